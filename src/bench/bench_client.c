@@ -0,0 +1,184 @@
+/**
+ * @file bench_client.c
+ * @brief Microbenchmark of request throughput on a single client connection.
+ *
+ * A responder thread stands in for the server at the other end of a socketpair and
+ * answers every `@<id> <command>` frame with `@<id> OK`, so only the client side and
+ * the kernel are measured. Requests are sent the way client_utils.c does, one at a time
+ * waiting for each answer, then through the async client library: waiting on a future
+ * per request, and pipelined with callbacks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "socket_utils.h"
+#include "async_client.h"
+#include "bench_utils.h"
+
+#define OPS 200000
+#define RESPONDER_BUFFER (1024 * 1024)
+
+static const char request[] = "list_files Dev";
+
+/**
+ * @brief Answers every frame received on a socket until it is closed.
+ */
+static void *responder_main(void *arg)
+{
+    int fd = *(int *)arg;
+    char *in = malloc(RESPONDER_BUFFER);
+    char *out = malloc(RESPONDER_BUFFER);
+    size_t in_length = 0;
+
+    while (1)
+    {
+        ssize_t count = read(fd, in + in_length, RESPONDER_BUFFER - in_length);
+        if (count <= 0)
+        {
+            break;
+        }
+        in_length += count;
+
+        // One write answers every complete frame of the read
+        size_t offset = 0, out_length = 0;
+        while (in_length - offset >= FRAME_HEADER_SIZE)
+        {
+            int32_t size;
+            memcpy(&size, in + offset, sizeof(size));
+            if (in_length - offset < FRAME_HEADER_SIZE + (size_t)size)
+            {
+                break;
+            }
+            const char *frame = in + offset + FRAME_HEADER_SIZE;
+            size_t tag = strcspn(frame, " ") + 1;
+            int32_t reply_size = tag + 3;
+            memcpy(out + out_length, &reply_size, sizeof(reply_size));
+            memcpy(out + out_length + FRAME_HEADER_SIZE, frame, tag);
+            memcpy(out + out_length + FRAME_HEADER_SIZE + tag, "OK\n", 3);
+            out_length += FRAME_HEADER_SIZE + reply_size;
+            offset += FRAME_HEADER_SIZE + size;
+        }
+        memmove(in, in + offset, in_length - offset);
+        in_length -= offset;
+
+        for (size_t written = 0; written < out_length;)
+        {
+            ssize_t sent = write(fd, out + written, out_length - written);
+            if (sent <= 0)
+            {
+                bench_fail("bench_client: responder write failed");
+            }
+            written += sent;
+        }
+    }
+    free(in);
+    free(out);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * @brief Opens a socketpair with a responder thread at the far end.
+ */
+static int open_responder(pthread_t *thread)
+{
+    static int far_end;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        bench_fail("bench_client: socketpair failed");
+    }
+    far_end = pair[1];
+    pthread_create(thread, NULL, responder_main, &far_end);
+    return pair[0];
+}
+
+static void bench_lockstep(void)
+{
+    pthread_t thread;
+    int fd = open_responder(&thread);
+    char tagged[64];
+    int length = snprintf(tagged, sizeof(tagged), "@1 %s", request);
+    char buffer[64];
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < OPS; i++)
+    {
+        send_message(fd, tagged, length, 0);
+        receive_message(fd, buffer, sizeof(buffer), 0);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_report("client", "request_reply", "lockstep", OPS, elapsed, 0);
+
+    close(fd);
+    pthread_join(thread, NULL);
+}
+
+static void bench_future(void)
+{
+    pthread_t thread;
+    struct async_client *client = async_client_open(open_responder(&thread), NULL, NULL);
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < OPS / 10; i++)
+    {
+        struct async_future *future = async_client_request(client, request, sizeof(request) - 1);
+        if (future == NULL || async_future_wait(future, -1, NULL) == NULL)
+        {
+            bench_fail("bench_client: request %d failed", i);
+        }
+        async_future_free(future);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_report("client", "request_reply", "async_future_wait", OPS / 10, elapsed, 0);
+
+    async_client_close(client);
+    pthread_join(thread, NULL);
+}
+
+static void count_reply(void *arg, const char *reply, size_t length)
+{
+    if (reply == NULL || length != 3)
+    {
+        bench_fail("bench_client: wrong answer");
+    }
+    (*(uint64_t *)arg)++;
+}
+
+static void bench_pipelined(void)
+{
+    pthread_t thread;
+    struct async_client *client = async_client_open(open_responder(&thread), NULL, NULL);
+    uint64_t answered = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < OPS; i++)
+    {
+        if (async_client_send(client, request, sizeof(request) - 1, count_reply, &answered) == 0)
+        {
+            bench_fail("bench_client: request %d failed", i);
+        }
+    }
+    async_client_drain(client);
+    uint64_t elapsed = bench_now_ns() - start;
+    if (answered != OPS)
+    {
+        bench_fail("bench_client: %llu answers for %d requests", (unsigned long long)answered, OPS);
+    }
+    bench_report("client", "request_reply", "async_pipelined", OPS, elapsed, 0);
+
+    async_client_close(client);
+    pthread_join(thread, NULL);
+}
+
+int main(void)
+{
+    bench_lockstep();
+    bench_future();
+    bench_pipelined();
+    return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * @file bench_command.c
+ * @brief Microbenchmark of command tokenizing on realistic chat traffic.
+ *
+ * Compares the sscanf/strcmp parsing the server used to do with the in-place tokenizer
+ * for each instruction set available on the machine, and measures message body
+ * validation throughput. It first checks that view_to_long() refuses numbers past the
+ * range of a long.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "command.h"
+#include "bench_utils.h"
+
+#define CORPUS_FRAMES 4096
+#define CORPUS_ROUNDS 200
+#define VALIDATE_SIZE (64 * 1024)
+#define VALIDATE_ROUNDS 2000
+
+static const char *user_names[] = {"Louis", "Nicolas", "Julien", "Fabien", "alice_42", "bob", "charlotte", "dmitri"};
+static const char *group_names[] = {"Dev", "Mix", "general", "random", "ops-oncall"};
+static const char *words[] = {"hello", "the", "build", "is", "green", "again", "déjà", "vu", "👍", "merging",
+                              "now", "can", "you", "review", "my", "PR", "?", "lunch", "at", "noon"};
+
+struct frame
+{
+    char *data;
+    size_t length;
+};
+
+static struct frame corpus[CORPUS_FRAMES];
+static size_t corpus_bytes = 0;
+
+#define PICK(array) array[bench_random() % (sizeof(array) / sizeof(array[0]))]
+
+/**
+ * @brief Appends random words to a buffer until it reaches roughly `target` bytes.
+ */
+static size_t append_text(char *buffer, size_t length, size_t target)
+{
+    while (length < target)
+    {
+        length += sprintf(buffer + length, "%s ", PICK(words));
+    }
+    buffer[--length] = '\0';
+    return length;
+}
+
+/**
+ * @brief Builds a mix of frames resembling the traffic of a busy server.
+ *
+ * Mostly short chat lines, some pasted paragraphs, and a sprinkling of the other
+ * commands.
+ */
+static void build_corpus(void)
+{
+    char buffer[8192];
+
+    for (int i = 0; i < CORPUS_FRAMES; i++)
+    {
+        int kind = bench_random() % 100;
+        size_t length;
+
+        if (kind < 75)
+        {
+            size_t text = bench_random() % 10 == 0 ? 200 + bench_random() % 2000 : 10 + bench_random() % 80;
+            length = sprintf(buffer, "message %s %s 1 ", PICK(group_names), PICK(user_names));
+            length = append_text(buffer, length, length + text);
+        }
+        else if (kind < 85)
+        {
+            length = sprintf(buffer, "join_group %s %s", PICK(user_names), PICK(group_names));
+        }
+        else if (kind < 90)
+        {
+            length = sprintf(buffer, "login %s secret%d", PICK(user_names), (int)(bench_random() % 1000));
+        }
+        else if (kind < 95)
+        {
+            length = sprintf(buffer, "list_files %s", PICK(group_names));
+        }
+        else if (kind < 98)
+        {
+            length = sprintf(buffer, "download_file %s report-%d.pdf", PICK(group_names), (int)(bench_random() % 100));
+        }
+        else
+        {
+            length = sprintf(buffer, "list_groups");
+        }
+
+        corpus[i].data = malloc(length + 1);
+        memcpy(corpus[i].data, buffer, length + 1);
+        corpus[i].length = length;
+        corpus_bytes += length;
+    }
+}
+
+/**
+ * @brief The parsing done by handle_client() before the in-place tokenizer.
+ */
+static int legacy_parse(const char *buffer)
+{
+    char command[50], arg1[50], arg2[50];
+    static char arg3[8192];
+    int arg4;
+
+    if (sscanf(buffer, "%49s %49s %49s %d %[^\n]", command, arg1, arg2, &arg4, arg3) < 1)
+        return -1;
+    if (strcmp(command, "login") == 0)
+        return COMMAND_LOGIN;
+    else if (strcmp(command, "create_user") == 0)
+        return COMMAND_CREATE_USER;
+    else if (strcmp(command, "list_groups") == 0)
+        return COMMAND_LIST_GROUPS;
+    else if (strcmp(command, "join_group") == 0)
+        return COMMAND_JOIN_GROUP;
+    else if (strcmp(command, "message") == 0)
+        return COMMAND_MESSAGE;
+    else if (strcmp(command, "upload_file") == 0)
+        return COMMAND_UPLOAD_FILE;
+    else if (strcmp(command, "list_files") == 0)
+        return COMMAND_LIST_FILES;
+    else if (strcmp(command, "download_file") == 0)
+        return COMMAND_DOWNLOAD_FILE;
+    return COMMAND_UNKNOWN;
+}
+
+static void bench_legacy(void)
+{
+    uint64_t checksum = 0;
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < CORPUS_ROUNDS; round++)
+    {
+        for (int i = 0; i < CORPUS_FRAMES; i++)
+        {
+            checksum += legacy_parse(corpus[i].data);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_consume(checksum);
+    bench_report("command", "parse_frame", "sscanf", (uint64_t)CORPUS_ROUNDS * CORPUS_FRAMES, elapsed,
+                 (uint64_t)CORPUS_ROUNDS * corpus_bytes);
+}
+
+/**
+ * @brief Times the in-place tokenizer, optionally validating message bodies.
+ *
+ * @return A checksum of the results, used to check every ISA agrees.
+ */
+static uint64_t bench_views(const char *name, int validate)
+{
+    uint64_t checksum = 0, fields = 0;
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < CORPUS_ROUNDS; round++)
+    {
+        for (int i = 0; i < CORPUS_FRAMES; i++)
+        {
+            struct command cmd;
+            if (command_parse(corpus[i].data, corpus[i].length, &cmd) < 0)
+                continue;
+            checksum += cmd.id * 31 + cmd.argc;
+            fields += 1 + cmd.argc;
+            if (validate && cmd.id == COMMAND_MESSAGE)
+            {
+                checksum += view_is_printable_utf8(command_tail(&cmd, 3));
+            }
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_consume(checksum);
+
+    bench_report("command", name, command_isa_name(), (uint64_t)CORPUS_ROUNDS * CORPUS_FRAMES, elapsed,
+                 (uint64_t)CORPUS_ROUNDS * corpus_bytes);
+    if (!validate)
+    {
+        char field_name[64];
+        snprintf(field_name, sizeof(field_name), "%s_per_field", name);
+        bench_report("command", field_name, command_isa_name(), fields, elapsed, 0);
+    }
+    return checksum;
+}
+
+static void bench_validate(void)
+{
+    char *text = malloc(VALIDATE_SIZE + 64);
+    size_t length = append_text(text, 0, VALIDATE_SIZE);
+    struct str_view view = {text, length};
+    uint64_t valid = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < VALIDATE_ROUNDS; round++)
+    {
+        valid += view_is_printable_utf8(view);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_consume(valid);
+    bench_report("command", "validate_utf8_64k", command_isa_name(), VALIDATE_ROUNDS, elapsed,
+                 (uint64_t)VALIDATE_ROUNDS * length);
+    free(text);
+}
+
+/**
+ * @brief Checks the parsing of numbers at the edges of the range of a long.
+ */
+static void check_view_to_long(void)
+{
+    static const struct
+    {
+        const char *text;
+        int status;
+        long value;
+    } cases[] = {
+        {"0", 0, 0},
+        {"65536", 0, 65536},
+        {"-42", 0, -42},
+        {"9223372036854775807", 0, LONG_MAX},
+        {"-9223372036854775807", 0, -LONG_MAX},
+        {"9223372036854775808", -1, 0},
+        {"99999999999999999999999999", -1, 0},
+        {"-99999999999999999999999999", -1, 0},
+        {"12a", -1, 0},
+        {"-", -1, 0},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        long value = 0;
+        int status = view_to_long(view_from_cstr(cases[i].text), &value);
+        if (status != cases[i].status || (status == 0 && value != cases[i].value))
+        {
+            bench_fail("bench_command: view_to_long(\"%s\") gave %d, %ld", cases[i].text, status, value);
+        }
+    }
+}
+
+int main(void)
+{
+    check_view_to_long();
+    build_corpus();
+    bench_legacy();
+
+    uint64_t reference = 0;
+    for (int isa = COMMAND_ISA_SCALAR; isa <= COMMAND_ISA_AVX2; isa++)
+    {
+        if (command_select_isa(isa) < 0)
+            continue;
+
+        bench_views("parse_frame", 0);
+        uint64_t checksum = bench_views("parse_and_validate", 1);
+        bench_validate();
+
+        if (reference == 0)
+            reference = checksum;
+        else if (checksum != reference)
+        {
+            fprintf(stderr, "bench_command: %s results differ from scalar\n", command_isa_name());
+            return EXIT_FAILURE;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,184 @@
+/**
+ * @file bench_framing.c
+ * @brief Microbenchmark of message framing over a socketpair.
+ *
+ * Measures a frame going through the kernel and back for each way the code sends and
+ * receives frames: the blocking send_message()/receive_message() pair used by the
+ * clients, the scatter-gather send_message_parts() with the pooled receive_frame(),
+ * and the non-blocking frame reader of the server event loop. Small frames are also
+ * measured pipelined, the way a busy connection sees them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "socket_utils.h"
+#include "pool.h"
+#include "bench_utils.h"
+
+#define PIPELINE_DEPTH 64
+#define BYTES_PER_RUN (256 * 1024 * 1024)
+#define MIN_OPS 2000
+#define MAX_OPS 200000
+
+static const size_t frame_sizes[] = {16, 256, 4096, 65536};
+
+static int pair[2];
+static char *payload;
+static char *receive_buffer;
+
+static uint64_t ops_for_size(size_t size)
+{
+    uint64_t ops = BYTES_PER_RUN / (size + FRAME_HEADER_SIZE);
+    if (ops < MIN_OPS)
+        return MIN_OPS;
+    return ops > MAX_OPS ? MAX_OPS : ops;
+}
+
+static void bench_send_receive(size_t size)
+{
+    uint64_t ops = ops_for_size(size);
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        send_message(pair[0], payload, size, 0);
+        receive_message(pair[1], receive_buffer, size + 1, 0);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%zu", size);
+    bench_report("framing", "send_receive_message", variant, ops, elapsed, ops * size);
+}
+
+static void bench_parts_receive_frame(size_t size)
+{
+    uint64_t ops = ops_for_size(size);
+    struct iovec parts[3] = {
+        {"Louis", 5},
+        {": ", 2},
+        {payload, size > 7 ? size - 7 : 0},
+    };
+
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        size_t length;
+        send_message_parts(pair[0], parts, 3);
+        char *frame = receive_frame(pair[1], FRAME_MAX_SIZE, &length);
+        if (frame == NULL || length != parts[0].iov_len + parts[1].iov_len + parts[2].iov_len)
+        {
+            bench_fail("bench_framing: receive_frame returned a wrong frame");
+        }
+        pool_free(frame);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%zu", size);
+    bench_report("framing", "send_parts_receive_frame", variant, ops, elapsed, ops * size);
+}
+
+/**
+ * @brief Receives `count` frames with the non-blocking reader of the server.
+ */
+static uint64_t read_frames(struct frame_reader *reader, int count)
+{
+    uint64_t bytes = 0;
+    while (count > 0)
+    {
+        int status = frame_reader_poll(pair[1], reader);
+        if (status == FRAME_READY)
+        {
+            bytes += reader->size;
+            frame_reader_release(reader);
+            count--;
+        }
+        else if (status != FRAME_PENDING)
+        {
+            bench_fail("bench_framing: frame_reader_poll failed (%d)", status);
+        }
+    }
+    return bytes;
+}
+
+static void bench_frame_reader(size_t size)
+{
+    uint64_t ops = ops_for_size(size);
+    struct frame_reader reader;
+    frame_reader_init(&reader, FRAME_MAX_SIZE);
+
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        send_message(pair[0], payload, size, 0);
+        bench_consume(read_frames(&reader, 1));
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%zu", size);
+    bench_report("framing", "frame_reader_poll", variant, ops, elapsed, ops * size);
+}
+
+/**
+ * @brief Sends frames in batches before reading them back, as a pipelining client would.
+ */
+static void bench_pipelined(size_t size)
+{
+    uint64_t batches = ops_for_size(size) / PIPELINE_DEPTH;
+    struct frame_reader reader;
+    frame_reader_init(&reader, FRAME_MAX_SIZE);
+
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < batches; i++)
+    {
+        for (int j = 0; j < PIPELINE_DEPTH; j++)
+        {
+            send_message(pair[0], payload, size, 0);
+        }
+        bench_consume(read_frames(&reader, PIPELINE_DEPTH));
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%zu", size);
+    bench_report("framing", "pipelined_frame_reader", variant, batches * PIPELINE_DEPTH, elapsed,
+                 batches * PIPELINE_DEPTH * size);
+}
+
+int main(void)
+{
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+
+    // Room for the largest frame plus a pipelined batch of small ones in flight
+    int buffer_size = 4 * 1024 * 1024;
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(pair[1], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+    payload = malloc(frame_sizes[3]);
+    receive_buffer = malloc(frame_sizes[3] + 1);
+    for (size_t i = 0; i < frame_sizes[3]; i++)
+    {
+        payload[i] = 'a' + bench_random() % 26;
+    }
+
+    for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++)
+    {
+        bench_send_receive(frame_sizes[i]);
+        bench_parts_receive_frame(frame_sizes[i]);
+        bench_frame_reader(frame_sizes[i]);
+        if (frame_sizes[i] <= 4096)
+        {
+            bench_pipelined(frame_sizes[i]);
+        }
+    }
+    return 0;
+}
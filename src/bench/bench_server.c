@@ -0,0 +1,1120 @@
+/**
+ * @file bench_server.c
+ * @brief Microbenchmark of the server request handlers.
+ *
+ * Drives the real handlers in-process, with clients and the other server replaced by
+ * socketpairs:
+ * - handle_client() reading, parsing and dispatching each kind of command, including
+ *   the commands replicated to a peer server;
+ * - handle_message() fanning a message out to groups of growing size;
+ * - messages queued for a member logged in nowhere, and their delivery on login;
+ * - handle_list_groups() and handle_list_files() building their replies;
+ * - the message archive indexing a group's history, and searches of it against a scan
+ *   of the whole log;
+ * - handle_download_file() serving small files picked with a Zipf distribution, with
+ *   and without the file cache;
+ * - parse_file() loading large user databases.
+ *
+ * Before measuring, it checks that an async client that negotiated `max_frame` gets a
+ * frame larger than FRAME_DEFAULT_MAX_SIZE through the server, that messages holding
+ * newlines survive `batch` frames and mailboxes forwarded by a peer, and before its
+ * last measures, that a search forwarded to a peer is answered when the link is lost.
+ *
+ * Everything runs in a scratch directory, and the logging of the handlers is silenced
+ * so that only the results are printed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "database.h"
+#include "server_utils.h"
+#include "socket_utils.h"
+#include "connection.h"
+#include "config.h"
+#include "pool.h"
+#include "command.h"
+#include "peer.h"
+#include "metrics.h"
+#include "archive.h"
+#include "mailbox.h"
+#include "routing.h"
+#include "async_client.h"
+#include "bench_utils.h"
+
+#define DISPATCH_BATCH 128
+#define DISPATCH_ROUNDS 200
+#define FAN_OUT_BATCH 64
+#define FAN_OUT_ROUNDS 100
+#define LIST_BATCH 16
+#define LIST_ROUNDS 200
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+#define ZIPF_FILES 1000
+#define ZIPF_FILE_SIZE (16 * 1024)
+#define ZIPF_DOWNLOADS 20000
+#define MAILBOX_ROUNDS 20
+#define ARCHIVE_CHUNK 8192
+#define SEARCH_ROUNDS 200
+#define LARGE_FRAME_SIZE (256 * 1024)
+#define CHECK_TIMEOUT_MS 5000
+#define CHECK_EVENTS 8
+
+static char scratch_dir[] = "/tmp/bench_server.XXXXXX";
+static int peer_server_end; /**< End of the link to the peer handled by the server functions */
+static int peer_end;        /**< End of the link played by the peer thread, which only reads it */
+
+/**
+ * @brief Creates a connected socketpair with large buffers.
+ *
+ * @param server_end Receives the end handled by the server functions.
+ * @param client_end Receives the end played by the benchmark.
+ */
+static void open_pair(int *server_end, int *client_end)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        bench_fail("bench_server: socketpair failed");
+    }
+    int size = SOCKET_BUFFER_SIZE;
+    for (int i = 0; i < 2; i++)
+    {
+        setsockopt(pair[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        setsockopt(pair[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    *server_end = pair[0];
+    *client_end = pair[1];
+}
+
+/**
+ * @brief Throws away everything waiting on a socket.
+ */
+static void drain(int fd)
+{
+    char buffer[64 * 1024];
+    while (recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0)
+    {
+    }
+}
+
+/**
+ * @brief Plays a peer server: reads and drops every replicated command.
+ */
+static void *peer_main(void *arg)
+{
+    int fd = *(int *)arg;
+    size_t length;
+    char *frame;
+    while ((frame = receive_frame(fd, FRAME_MAX_SIZE, &length)) != NULL)
+    {
+        pool_free(frame);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Links the server to a thread playing a peer server.
+ */
+static void start_peer(void)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        bench_fail("bench_server: socketpair failed");
+    }
+
+    peer_server_end = pair[0];
+    peer_end = pair[1];
+    node_id = 1;
+    struct peer *peer;
+    if (connection_open(peer_server_end) == NULL || peer_add(2, "bench", 0) < 0 ||
+        (peer = peer_attach(peer_server_end, 2)) == NULL)
+    {
+        bench_fail("bench_server: peer link failed");
+    }
+    // The drained end never answers with its own peer_sync
+    peer_sync(peer, 1, 0, 0);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, peer_main, &peer_end);
+    pthread_detach(thread);
+}
+
+/**
+ * @struct served_client
+ * @brief A client connection handled on a thread of its own.
+ */
+struct served_client
+{
+    int fd;
+    int stop;
+};
+
+/**
+ * @brief Plays the event loop for one client: dispatches its frames until told to stop.
+ */
+static void *serve_main(void *arg)
+{
+    struct served_client *served = arg;
+    struct pollfd pfd = {.fd = served->fd, .events = POLLIN};
+    while (!__atomic_load_n(&served->stop, __ATOMIC_ACQUIRE))
+    {
+        if (poll(&pfd, 1, 10) > 0)
+        {
+            handle_client(served->fd);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sends a chat line larger than FRAME_DEFAULT_MAX_SIZE with an async client.
+ *
+ * The line must be refused before the client negotiates `max_frame`, and reach the other
+ * member of the group whole after.
+ */
+static void check_large_frame(void)
+{
+    char members[MAX_GROUP_MEMBERS][50] = {"Big", "Reader"};
+    add_user("Big", 'M', 30, "bbbbbb");
+    add_user("Reader", 'F', 30, "rrrrrr");
+    add_group("Large", members, 2);
+
+    int server_end, client_end, reader_end, reader_client;
+    open_pair(&server_end, &client_end);
+    open_pair(&reader_end, &reader_client);
+    if (connection_open(server_end) == NULL)
+    {
+        bench_fail("bench_server: connection_open failed");
+    }
+    add_client("Big", server_end);
+    add_client("Reader", reader_end);
+
+    struct served_client served = {.fd = server_end, .stop = 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_main, &served);
+    struct async_client *client = async_client_open(client_end, NULL, NULL);
+    if (client == NULL)
+    {
+        bench_fail("bench_server: async_client_open failed");
+    }
+
+    static const char prefix[] = "message Large Big 1 ";
+    size_t length = sizeof(prefix) - 1 + LARGE_FRAME_SIZE;
+    char *command = malloc(length);
+    if (command == NULL)
+    {
+        bench_fail("bench_server: out of memory");
+    }
+    memcpy(command, prefix, sizeof(prefix) - 1);
+    memset(command + sizeof(prefix) - 1, 'x', LARGE_FRAME_SIZE);
+
+    if (async_client_send(client, command, length, NULL, NULL) != 0)
+    {
+        bench_fail("bench_server: a %d-byte frame was sent before max_frame", LARGE_FRAME_SIZE);
+    }
+    if (async_client_max_frame(client, FRAME_MAX_SIZE) != FRAME_MAX_SIZE)
+    {
+        bench_fail("bench_server: max_frame %d not granted", FRAME_MAX_SIZE);
+    }
+    struct async_future *future = async_client_request(client, command, length);
+    if (future == NULL || async_future_wait(future, CHECK_TIMEOUT_MS, NULL) == NULL)
+    {
+        bench_fail("bench_server: the %d-byte frame was not answered", LARGE_FRAME_SIZE);
+    }
+    async_future_free(future);
+
+    size_t received;
+    char *line = receive_frame(reader_client, FRAME_MAX_SIZE, &received);
+    if (line == NULL || received != 5 + LARGE_FRAME_SIZE || memcmp(line, "Big: ", 5) != 0 ||
+        line[received - 1] != 'x')
+    {
+        bench_fail("bench_server: the %d-byte line was not delivered whole", LARGE_FRAME_SIZE);
+    }
+    pool_free(line);
+    free(command);
+
+    __atomic_store_n(&served.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    async_client_close(client);
+    remove_client(server_end);
+    remove_client(reader_end);
+    connection_close(server_end);
+    close(server_end);
+    close(reader_end);
+    close(reader_client);
+}
+
+/**
+ * @struct received_events
+ * @brief Chat lines pushed to an async client, as its event callback saw them.
+ */
+struct received_events
+{
+    char lines[CHECK_EVENTS][64];
+    int count;
+};
+
+static void collect_event(void *arg, const char *event, size_t length)
+{
+    struct received_events *events = arg;
+    int index = __atomic_load_n(&events->count, __ATOMIC_ACQUIRE);
+    if (event != NULL && index < CHECK_EVENTS) // NULL tells the connection closed
+    {
+        snprintf(events->lines[index], sizeof(events->lines[index]), "%.*s", (int)length, event);
+        __atomic_store_n(&events->count, index + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Sends messages holding newlines to a member that fell behind.
+ *
+ * The first line goes out in a frame of its own and the next ones in a `batch` frame,
+ * and each must reach the async client as one event, newlines included.
+ */
+static void check_batched_lines(void)
+{
+    static const char *messages[] = {"first\nline", "second\nline", "third"};
+    static const char *expected[] = {"Writer: first\nline", "Writer: second\nline", "Writer: third"};
+    char members[MAX_GROUP_MEMBERS][50] = {"Writer", "Slow"};
+    add_user("Writer", 'M', 30, "wwwwww");
+    add_user("Slow", 'F', 30, "ssssss");
+    add_group("Lines", members, 2);
+
+    int writer_end, writer_client, slow_end, slow_client;
+    open_pair(&writer_end, &writer_client);
+    open_pair(&slow_end, &slow_client);
+    if (connection_open(slow_end) == NULL)
+    {
+        bench_fail("bench_server: connection_open failed");
+    }
+    add_client("Writer", writer_end);
+    add_client("Slow", slow_end);
+
+    server_config.chat_batch_bytes = 8192;
+    for (int i = 0; i < 3; i++)
+    {
+        handle_message(writer_end, view_from_cstr("Lines"), view_from_cstr("Writer"), view_from_cstr(messages[i]), 1);
+    }
+    connection_flush_chat();
+
+    struct received_events events = {.count = 0};
+    struct async_client *client = async_client_open(slow_client, collect_event, &events);
+    if (client == NULL)
+    {
+        bench_fail("bench_server: async_client_open failed");
+    }
+    for (int waited = 0; __atomic_load_n(&events.count, __ATOMIC_ACQUIRE) < 3 && waited < CHECK_TIMEOUT_MS; waited++)
+    {
+        usleep(1000);
+    }
+    async_client_close(client);
+    if (events.count != 3)
+    {
+        bench_fail("bench_server: %d chat lines received for 3 messages", events.count);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (strcmp(events.lines[i], expected[i]) != 0)
+        {
+            bench_fail("bench_server: chat line %d is \"%s\"", i, events.lines[i]);
+        }
+    }
+
+    remove_client(writer_end);
+    remove_client(slow_end);
+    connection_close(slow_end);
+    close(writer_end);
+    close(writer_client);
+    close(slow_end);
+}
+
+/**
+ * @brief Forwards a mailbox holding multi-line messages from the peer, then logs its user in.
+ *
+ * The user is logged in nowhere, so the mailbox is stored again, and the login must
+ * deliver each message whole in one `batch` frame. The length of the first line, 10,
+ * starts with a newline byte and the last line ends with one, which reading the lines
+ * as a command argument would have lost.
+ */
+static void check_forwarded_mailbox(void)
+{
+    static const char *lines[] = {"Far: 1\ntwo", "Far: three\n\nfour", "Far: five\n"};
+    char members[MAX_GROUP_MEMBERS][50] = {"Far", "Remote"};
+    add_user("Remote", 'F', 30, "eeeeee");
+    add_group("Mailed", members, 2);
+
+    char frame[256];
+    size_t length = snprintf(frame, sizeof(frame), "mailbox Remote\n");
+    for (int i = 0; i < 3; i++)
+    {
+        int32_t size = strlen(lines[i]);
+        memcpy(frame + length, &size, sizeof(size));
+        memcpy(frame + length + sizeof(size), lines[i], size);
+        length += sizeof(size) + size;
+    }
+    send_message(peer_end, frame, length, 0);
+    handle_client(peer_server_end);
+
+    int remote_end, remote_client;
+    open_pair(&remote_end, &remote_client);
+    handle_login(remote_end, view_from_cstr("Remote"), view_from_cstr("eeeeee"));
+    size_t received;
+    char *batch = receive_frame(remote_client, FRAME_MAX_SIZE, &received);
+    size_t header = sizeof(FRAME_BATCH_HEADER) - 1;
+    if (batch == NULL || received < header || memcmp(batch, FRAME_BATCH_HEADER, header) != 0)
+    {
+        bench_fail("bench_server: the forwarded mailbox was not delivered on login");
+    }
+    const char *cursor = batch + header;
+    const char *line;
+    size_t line_length;
+    int count = 0;
+    while ((line = batch_next_line(&cursor, batch + received, &line_length)) != NULL)
+    {
+        if (count >= 3 || line_length != strlen(lines[count]) || memcmp(line, lines[count], line_length) != 0)
+        {
+            bench_fail("bench_server: forwarded message %d is \"%.*s\"", count, (int)line_length, line);
+        }
+        count++;
+    }
+    if (count != 3 || cursor != batch + received)
+    {
+        bench_fail("bench_server: %d forwarded messages delivered of 3", count);
+    }
+    pool_free(batch);
+
+    remove_client(remote_end);
+    close(remote_end);
+    close(remote_client);
+}
+
+/**
+ * @brief Reads a frame and fails unless it is the expected answer.
+ */
+static void expect_answer(int fd, const char *expected)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, CHECK_TIMEOUT_MS) != 1)
+    {
+        bench_fail("bench_server: no answer instead of \"%s\"", expected);
+    }
+    size_t length;
+    char *answer = receive_frame(fd, FRAME_MAX_SIZE, &length);
+    if (answer == NULL || length != strlen(expected) || memcmp(answer, expected, length) != 0)
+    {
+        bench_fail("bench_server: \"%.*s\" answered instead of \"%s\"", answer != NULL ? (int)length : 0,
+                   answer != NULL ? answer : "", expected);
+    }
+    pool_free(answer);
+}
+
+/**
+ * @brief Searches a group owned by the peer, as a stranger and as a member, then loses the peer.
+ *
+ * The stranger is refused. The search of the member is forwarded to the peer, which never
+ * answers, and must be answered as finding nothing once the link goes down. The stranger
+ * then joins the group: forwarded to the peer as well, the change must be applied here
+ * and answered once the link goes down. A mailbox
+ * forwarded to the peer, which never acknowledges it, must be delivered here afterwards.
+ * The server has no peer afterwards.
+ */
+static void check_search_owner_lost(void)
+{
+    // Groups are spread over this server and the peer, as server_loop() would set up
+    routing_init();
+    group_count = 0;
+    char group[32];
+    int tries = 0;
+    do
+    {
+        snprintf(group, sizeof(group), "Far%d", tries++);
+    } while (routing_owner(view_from_cstr(group)) != 2 && tries < 1000);
+    char members[MAX_GROUP_MEMBERS][50] = {"Seeker"};
+    add_user("Seeker", 'F', 30, "kkkkkk");
+    add_user("Stranger", 'M', 30, "tttttt");
+    add_group(group, members, 1);
+
+    int seeker_end, seeker_client, stranger_end, stranger_client;
+    open_pair(&seeker_end, &seeker_client);
+    open_pair(&stranger_end, &stranger_client);
+    if (connection_open(seeker_end) == NULL || connection_open(stranger_end) == NULL)
+    {
+        bench_fail("bench_server: connection_open failed");
+    }
+    handle_login(seeker_end, view_from_cstr("Seeker"), view_from_cstr("kkkkkk"));
+    handle_login(stranger_end, view_from_cstr("Stranger"), view_from_cstr("tttttt"));
+    expect_answer(seeker_client, "Login successful\n");
+    expect_answer(stranger_client, "Login successful\n");
+
+    char command[64];
+    int length = snprintf(command, sizeof(command), "@7 search %s hello", group);
+    send_message(stranger_client, command, length, 0);
+    handle_client(stranger_end);
+    expect_answer(stranger_client, "@7 Not a member of the group\n");
+
+    send_message(seeker_client, command, length, 0);
+    handle_client(seeker_end);
+    struct pollfd pfd = {.fd = seeker_client, .events = POLLIN};
+    if (routing_owner(view_from_cstr(group)) != 2 || poll(&pfd, 1, 0) != 0)
+    {
+        bench_fail("bench_server: the search of %s was not forwarded to its owner", group);
+    }
+
+    length = snprintf(command, sizeof(command), "@8 join_group Stranger %s", group);
+    send_message(stranger_client, command, length, 0);
+    handle_client(stranger_end);
+    pfd.fd = stranger_client;
+    if (poll(&pfd, 1, 0) != 0)
+    {
+        bench_fail("bench_server: joining %s was not forwarded to its owner", group);
+    }
+    static const char kept[] = "Seeker: kept for Away";
+    struct iovec line = {(char *)kept, sizeof(kept) - 1};
+    add_user("Away", 'M', 30, "aaaaaa");
+    mailbox_append("Away", &line, 1);
+    mailbox_forward("Away", 2);
+
+    shutdown(peer_end, SHUT_RDWR);
+    handle_client(peer_server_end);
+    expect_answer(seeker_client, "@7 No messages found\n");
+    expect_answer(stranger_client, "@8 Joined group successfully\n");
+    Group *joined = &groups[group_count - 1];
+    if (joined->member_count != 2 || strcmp(joined->members[1], "Stranger") != 0)
+    {
+        bench_fail("bench_server: joining %s was not applied once its owner was lost", group);
+    }
+
+    int away_end, away_client;
+    open_pair(&away_end, &away_client);
+    handle_login(away_end, view_from_cstr("Away"), view_from_cstr("aaaaaa"));
+    char expected[64];
+    int32_t kept_length = sizeof(kept) - 1;
+    size_t header = sizeof(FRAME_BATCH_HEADER) - 1;
+    memcpy(expected, FRAME_BATCH_HEADER, header);
+    memcpy(expected + header, &kept_length, sizeof(kept_length));
+    memcpy(expected + header + sizeof(kept_length), kept, kept_length);
+    size_t received;
+    char *batch = receive_frame(away_client, FRAME_MAX_SIZE, &received);
+    if (batch == NULL || received != header + sizeof(kept_length) + kept_length ||
+        memcmp(batch, expected, received) != 0)
+    {
+        bench_fail("bench_server: the mailbox forwarded to the lost peer was not delivered on login");
+    }
+    pool_free(batch);
+    remove_client(away_end);
+    close(away_end);
+    close(away_client);
+
+    for (int fd = seeker_end; fd >= 0; fd = fd == seeker_end ? stranger_end : -1)
+    {
+        remove_client(fd);
+        connection_close(fd);
+        close(fd);
+    }
+    close(seeker_client);
+    close(stranger_client);
+}
+
+static void bench_dispatch(const char *variant, const char *command)
+{
+    int server_end, client_end;
+    open_pair(&server_end, &client_end);
+    if (connection_open(server_end) == NULL)
+    {
+        bench_fail("bench_server: connection_open failed");
+    }
+
+    uint64_t elapsed = 0;
+    size_t length = strlen(command);
+    for (int round = 0; round < DISPATCH_ROUNDS; round++)
+    {
+        for (int i = 0; i < DISPATCH_BATCH; i++)
+        {
+            send_message(client_end, (char *)command, length, 0);
+        }
+
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < DISPATCH_BATCH; i++)
+        {
+            handle_client(server_end);
+        }
+        elapsed += bench_now_ns() - start;
+        drain(client_end);
+    }
+
+    uint64_t ops = (uint64_t)DISPATCH_ROUNDS * DISPATCH_BATCH;
+    bench_report("server", "handle_client", variant, ops, elapsed, ops * length);
+
+    connection_close(server_end);
+    close(server_end);
+    close(client_end);
+}
+
+/**
+ * @brief Posts bursts of messages to a group whose members read only between bursts.
+ *
+ * With `batch_bytes` set, a member still holding unread lines gets the rest of the
+ * burst coalesced into `batch` frames, flushed at the end of the burst as the event
+ * loop does at the end of a turn.
+ */
+static void bench_fan_out(int members, size_t batch_bytes)
+{
+    char group_name[32];
+    char member_names[MAX_GROUP_MEMBERS][50];
+    int server_ends[MAX_GROUP_MEMBERS], client_ends[MAX_GROUP_MEMBERS];
+    const char *suffix = batch_bytes > 0 ? "_batched" : "";
+
+    server_config.chat_batch_bytes = batch_bytes;
+    snprintf(group_name, sizeof(group_name), "fan%d%s", members, suffix);
+    for (int i = 0; i < members; i++)
+    {
+        snprintf(member_names[i], sizeof(member_names[i]), "member%d_%d%s", members, i, suffix);
+        open_pair(&server_ends[i], &client_ends[i]);
+        if (connection_open(server_ends[i]) == NULL)
+        {
+            bench_fail("bench_server: connection_open failed");
+        }
+        add_client(member_names[i], server_ends[i]);
+    }
+    add_group(group_name, member_names, members);
+
+    const char *text = "hello everyone, the build is green again, merging now";
+    struct str_view group = view_from_cstr(group_name);
+    struct str_view user = view_from_cstr(member_names[0]);
+    struct str_view message = view_from_cstr(text);
+
+    uint64_t elapsed = 0;
+    for (int round = 0; round < FAN_OUT_ROUNDS; round++)
+    {
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < FAN_OUT_BATCH; i++)
+        {
+            handle_message(server_ends[0], group, user, message, 1);
+        }
+        connection_flush_chat();
+        elapsed += bench_now_ns() - start;
+        for (int i = 1; i < members; i++)
+        {
+            drain(client_ends[i]);
+        }
+    }
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%d_members%s", members, suffix);
+    uint64_t ops = (uint64_t)FAN_OUT_ROUNDS * FAN_OUT_BATCH;
+    uint64_t deliveries = ops * (members - 1);
+    uint64_t delivered_bytes = deliveries * (user.len + 2 + message.len);
+    bench_report("server", "handle_message_fan_out", variant, ops, elapsed, delivered_bytes);
+    bench_report("server", "fan_out_per_delivery", variant, deliveries, elapsed, delivered_bytes);
+
+    for (int i = 0; i < members; i++)
+    {
+        remove_client(server_ends[i]);
+        connection_close(server_ends[i]);
+        close(server_ends[i]);
+        close(client_ends[i]);
+    }
+}
+
+/**
+ * @brief Queues messages for a member logged in nowhere, then logs it in.
+ *
+ * The login sends the whole mailbox as one frame; sending the same lines one frame each
+ * gives the cost it replaces.
+ */
+static void bench_mailbox(int messages)
+{
+    char members[MAX_GROUP_MEMBERS][50] = {"Sender", "Away"};
+    add_user("Away", 'F', 30, "aaaaaa");
+    add_group("Mail", members, 2);
+
+    int sender_end, sender_client;
+    open_pair(&sender_end, &sender_client);
+    add_client("Sender", sender_end);
+
+    const char *text = "hello everyone, the build is green again, merging now";
+    struct str_view group = view_from_cstr("Mail");
+    struct str_view user = view_from_cstr("Sender");
+    struct str_view message = view_from_cstr(text);
+    uint64_t bytes = (uint64_t)messages * (FRAME_HEADER_SIZE + user.len + 2 + message.len);
+
+    uint64_t queued = 0, delivered = 0;
+    for (int round = 0; round < MAILBOX_ROUNDS; round++)
+    {
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < messages; i++)
+        {
+            handle_message(sender_end, group, user, message, 1);
+        }
+        queued += bench_now_ns() - start;
+
+        int away_end, away_client;
+        open_pair(&away_end, &away_client);
+        start = bench_now_ns();
+        handle_login(away_end, view_from_cstr("Away"), view_from_cstr("aaaaaa"));
+        delivered += bench_now_ns() - start;
+        drain(away_client);
+        remove_client(away_end);
+        close(away_end);
+        close(away_client);
+    }
+
+    // The same lines sent as they would be without the batch frame
+    int away_end, away_client;
+    open_pair(&away_end, &away_client);
+    struct iovec line[3] = {
+        {(char *)user.ptr, user.len},
+        {": ", 2},
+        {(char *)message.ptr, message.len},
+    };
+    uint64_t one_by_one = 0;
+    for (int round = 0; round < MAILBOX_ROUNDS; round++)
+    {
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < messages; i++)
+        {
+            send_message_parts(away_end, line, 3);
+        }
+        one_by_one += bench_now_ns() - start;
+        drain(away_client);
+    }
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%d_messages", messages);
+    bench_report("server", "mailbox_queue", variant, (uint64_t)MAILBOX_ROUNDS * messages, queued, bytes * MAILBOX_ROUNDS);
+    snprintf(variant, sizeof(variant), "batch_frame_%d", messages);
+    bench_report("server", "mailbox_login_delivery", variant, MAILBOX_ROUNDS, delivered, bytes * MAILBOX_ROUNDS);
+    snprintf(variant, sizeof(variant), "frame_per_message_%d", messages);
+    bench_report("server", "mailbox_login_delivery", variant, MAILBOX_ROUNDS, one_by_one, bytes * MAILBOX_ROUNDS);
+
+    remove_client(sender_end);
+    close(away_end);
+    close(away_client);
+    close(sender_end);
+    close(sender_client);
+}
+
+/**
+ * @brief Archives a group history, then searches it.
+ *
+ * One message in 100 is "flaky", always with "service7", so "flaky service3" matches
+ * nothing and walks every posting of the rarest term. The scan reads the whole log and
+ * looks for both words in each record, as a search would without the index.
+ */
+static void bench_archive(int messages)
+{
+    char name[32], path[64];
+    snprintf(name, sizeof(name), "history%d", messages);
+    snprintf(path, sizeof(path), ARCHIVE_DIR "/%s.log", name);
+    struct str_view group = view_from_cstr(name);
+    char text[128];
+    size_t bytes = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < messages; i++)
+    {
+        int length = snprintf(text, sizeof(text), "deploy %d of service%d finished, the tests are %s",
+                              i, i % 50, i % 100 == 7 ? "flaky" : "green");
+        struct iovec line[3] = {
+            {"Louis", 5},
+            {": ", 2},
+            {text, (size_t)length},
+        };
+        archive_post(group, line, 3);
+        bytes += 7 + length;
+        if (i % ARCHIVE_CHUNK == ARCHIVE_CHUNK - 1)
+        {
+            archive_sync();
+        }
+    }
+    archive_sync();
+    uint64_t indexed = bench_now_ns() - start;
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%d_messages", messages);
+    bench_report("server", "archive_index", variant, messages, indexed, bytes);
+
+    static const char *const queries[][2] = {
+        {"common_term", "green"},
+        {"rare_term", "flaky"},
+        {"two_terms", "green service7"},
+        {"no_match", "flaky service3"},
+    };
+    static char out[64 * 1024];
+    for (size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++)
+    {
+        struct str_view query = view_from_cstr(queries[q][1]);
+        size_t answered = 0;
+        start = bench_now_ns();
+        for (int round = 0; round < SEARCH_ROUNDS; round++)
+        {
+            answered += archive_search(group, query, out, sizeof(out));
+        }
+        uint64_t elapsed = bench_now_ns() - start;
+        snprintf(variant, sizeof(variant), "%s_%d", queries[q][0], messages);
+        bench_report("server", "archive_search", variant, SEARCH_ROUNDS, elapsed, answered);
+    }
+
+    // The same "no_match" query answered by reading the log
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        bench_fail("bench_server: archive log missing");
+    }
+    char *log = malloc(st.st_size);
+    if (log == NULL)
+    {
+        bench_fail("bench_server: out of memory");
+    }
+    int scans = SEARCH_ROUNDS / 10;
+    uint64_t found = 0;
+    start = bench_now_ns();
+    for (int round = 0; round < scans; round++)
+    {
+        if (pread(fd, log, st.st_size, 0) != st.st_size)
+        {
+            bench_fail("bench_server: short read of the archive log");
+        }
+        for (off_t at = 0; at + 4 <= st.st_size;)
+        {
+            uint32_t length;
+            memcpy(&length, log + at, 4);
+            const char *record = log + at + 4;
+            if (memmem(record, length, "flaky", 5) != NULL && memmem(record, length, "service3", 8) != NULL)
+            {
+                found++;
+            }
+            at += 4 + length;
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_consume(found);
+    snprintf(variant, sizeof(variant), "scan_log_%d", messages);
+    bench_report("server", "archive_search", variant, scans, elapsed, (uint64_t)scans * st.st_size);
+    free(log);
+    close(fd);
+}
+
+static void bench_list_groups(int count)
+{
+    group_count = 0;
+    char no_members[MAX_GROUP_MEMBERS][50];
+    for (int i = 0; i < count; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "group%03d", i);
+        add_group(name, no_members, 0);
+    }
+
+    int server_end, client_end;
+    open_pair(&server_end, &client_end);
+
+    uint64_t elapsed = 0;
+    for (int round = 0; round < LIST_ROUNDS; round++)
+    {
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < LIST_BATCH; i++)
+        {
+            handle_list_groups(server_end);
+        }
+        elapsed += bench_now_ns() - start;
+        drain(client_end);
+    }
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%d_groups", count);
+    bench_report("server", "handle_list_groups", variant, (uint64_t)LIST_ROUNDS * LIST_BATCH, elapsed, 0);
+    close(server_end);
+    close(client_end);
+}
+
+static void bench_list_files(int count)
+{
+    char group_name[32], path[256];
+    snprintf(group_name, sizeof(group_name), "files%d", count);
+    snprintf(path, sizeof(path), "./drive/%s", group_name);
+    mkdir(path, 0777);
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(path, sizeof(path), "./drive/%s/report-%04d.pdf", group_name, i);
+        close(open(path, O_CREAT | O_WRONLY, 0644));
+    }
+
+    int server_end, client_end;
+    open_pair(&server_end, &client_end);
+    struct str_view group = view_from_cstr(group_name);
+
+    uint64_t elapsed = 0;
+    for (int round = 0; round < LIST_ROUNDS; round++)
+    {
+        uint64_t start = bench_now_ns();
+        for (int i = 0; i < LIST_BATCH; i++)
+        {
+            handle_list_files(server_end, group);
+        }
+        elapsed += bench_now_ns() - start;
+        drain(client_end);
+    }
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%d_files", count);
+    bench_report("server", "handle_list_files", variant, (uint64_t)LIST_ROUNDS * LIST_BATCH, elapsed, 0);
+    close(server_end);
+    close(client_end);
+}
+
+/**
+ * @brief Plays a client downloading files: runs the handshake of each download and reads the data.
+ */
+static void *download_client_main(void *arg)
+{
+    int fd = *(int *)arg;
+    char *data = malloc(ZIPF_FILE_SIZE);
+    while (1)
+    {
+        uint64_t size;
+        if (send(fd, "SERVER_READY", 12, MSG_NOSIGNAL) != 12 || recv(fd, &size, sizeof(size), MSG_WAITALL) != sizeof(size))
+        {
+            break;
+        }
+        if (size > ZIPF_FILE_SIZE)
+        {
+            bench_fail("bench_server: download of %llu bytes", (unsigned long long)size);
+        }
+        send(fd, "SIZE_OK", 7, MSG_NOSIGNAL);
+        if (size > 0 && recv(fd, data, size, MSG_WAITALL) != (ssize_t)size)
+        {
+            break;
+        }
+    }
+    free(data);
+    return NULL;
+}
+
+/**
+ * @brief Picks `count` file indexes with a Zipf distribution of exponent 1: index k is
+ * chosen with a probability proportional to 1 / (k + 1).
+ */
+static void zipf_sequence(int *sequence, int count)
+{
+    static double cumulative[ZIPF_FILES];
+    double total = 0;
+    for (int k = 0; k < ZIPF_FILES; k++)
+    {
+        total += 1.0 / (k + 1);
+        cumulative[k] = total;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        double u = (bench_random() >> 11) * (1.0 / 9007199254740992.0) * total;
+        int low = 0, high = ZIPF_FILES - 1;
+        while (low < high)
+        {
+            int middle = (low + high) / 2;
+            if (cumulative[middle] < u)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        sequence[i] = low;
+    }
+}
+
+static void bench_download_zipf(const char *variant, size_t cache_bytes)
+{
+    static int sequence[ZIPF_DOWNLOADS];
+    char path[256];
+    if (mkdir("./drive/zipf", 0777) == 0)
+    {
+        char *data = calloc(1, ZIPF_FILE_SIZE);
+        for (int i = 0; i < ZIPF_FILES; i++)
+        {
+            snprintf(path, sizeof(path), "./drive/zipf/doc-%04d.bin", i);
+            int fd = open(path, O_CREAT | O_WRONLY, 0644);
+            if (fd < 0 || write(fd, data, ZIPF_FILE_SIZE) != ZIPF_FILE_SIZE)
+            {
+                bench_fail("bench_server: cannot write %s", path);
+            }
+            close(fd);
+        }
+        free(data);
+    }
+    zipf_sequence(sequence, ZIPF_DOWNLOADS);
+    server_config.file_cache_bytes = cache_bytes;
+
+    static int client_end;
+    int server_end;
+    open_pair(&server_end, &client_end);
+    pthread_t thread;
+    pthread_create(&thread, NULL, download_client_main, &client_end);
+
+    // The first quarter fills the cache, the rest is timed
+    struct str_view group = view_from_cstr("zipf");
+    int warm_up = ZIPF_DOWNLOADS / 4;
+    uint64_t hits = 0, start = 0;
+    for (int i = 0; i < ZIPF_DOWNLOADS; i++)
+    {
+        if (i == warm_up)
+        {
+            hits = metrics_total(METRIC_FILE_CACHE_HITS);
+            start = bench_now_ns();
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "doc-%04d.bin", sequence[i]);
+        handle_download_file(server_end, group, view_from_cstr(name));
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    hits = metrics_total(METRIC_FILE_CACHE_HITS) - hits;
+
+    shutdown(server_end, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(server_end);
+    close(client_end);
+
+    // Hits over downloads gives the hit rate of the cache
+    uint64_t ops = ZIPF_DOWNLOADS - warm_up;
+    bench_report("server", "download_file_zipf", variant, ops, elapsed, ops * ZIPF_FILE_SIZE);
+    bench_report("server", "download_file_zipf_cache_hits", variant, hits, elapsed, hits * ZIPF_FILE_SIZE);
+}
+
+/**
+ * @brief Writes a database of `users` users and one group per 16 of them.
+ *
+ * @return The size of the file in bytes.
+ */
+static size_t write_database(const char *filename, int users)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        bench_fail("bench_server: cannot write %s", filename);
+    }
+    for (int i = 0; i < users; i++)
+    {
+        fprintf(file, "user%05d %c %d password%05d\n", i, i % 2 ? 'F' : 'M', 18 + i % 60, i);
+    }
+    int groups = users / 16 < MAX_GROUPS ? users / 16 : MAX_GROUPS;
+    for (int i = 0; i < groups; i++)
+    {
+        fprintf(file, "group team%03d", i);
+        for (int j = 0; j < 8; j++)
+        {
+            fprintf(file, " user%05d", (i * 16 + j) % users);
+        }
+        fprintf(file, "\n");
+    }
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+static void bench_parse_file(int users, int rounds)
+{
+    char filename[64];
+    snprintf(filename, sizeof(filename), "data_%d.txt", users);
+    size_t size = write_database(filename, users);
+
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < rounds; round++)
+    {
+        user_count = 0;
+        group_count = 0;
+        parse_file(filename);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_consume(user_count + group_count);
+
+    char variant[32];
+    snprintf(variant, sizeof(variant), "%d_users", users);
+    bench_report("server", "parse_file", variant, rounds, elapsed, (uint64_t)rounds * size);
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int flag, struct FTW *ftw)
+{
+    (void)sb;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+int main(void)
+{
+    if (mkdtemp(scratch_dir) == NULL || chdir(scratch_dir) < 0 || mkdir("drive", 0777) < 0)
+    {
+        perror("bench_server: scratch directory");
+        return EXIT_FAILURE;
+    }
+
+    bench_silence();
+    start_peer();
+
+    // The benchmark sends far faster than any client is allowed to
+    server_config.conn_messages_per_sec = 1e12;
+    server_config.conn_bytes_per_sec = 1e15;
+
+    char dev_members[MAX_GROUP_MEMBERS][50] = {"Louis"};
+    add_user("Louis", 'M', 23, "llllll");
+    add_group("Dev", dev_members, 1);
+
+    check_large_frame();
+    check_batched_lines();
+    check_forwarded_mailbox();
+
+    bench_dispatch("list_groups", "list_groups");
+    bench_dispatch("max_frame", "max_frame 65536");
+    bench_dispatch("unknown", "frobnicate the widgets");
+    bench_dispatch("join_group_forwarded", "join_group Louis Dev");
+    bench_dispatch("message_forwarded", "message Dev Louis 1 hello everyone, the build is green again");
+
+    static const int fan_out_sizes[] = {2, 8, 32, MAX_GROUP_MEMBERS};
+    for (size_t i = 0; i < sizeof(fan_out_sizes) / sizeof(fan_out_sizes[0]); i++)
+    {
+        bench_fan_out(fan_out_sizes[i], 0);
+        bench_fan_out(fan_out_sizes[i], 8192);
+    }
+
+    bench_mailbox(10000);
+
+    archive_start();
+    bench_archive(10000);
+    bench_archive(200000);
+
+    static const int group_counts[] = {8, 64, MAX_GROUPS};
+    for (size_t i = 0; i < sizeof(group_counts) / sizeof(group_counts[0]); i++)
+    {
+        bench_list_groups(group_counts[i]);
+    }
+
+    static const int file_counts[] = {10, 100, 1000};
+    for (size_t i = 0; i < sizeof(file_counts) / sizeof(file_counts[0]); i++)
+    {
+        bench_list_files(file_counts[i]);
+    }
+
+    // 1000 files of 16 KiB: no cache, a cache of a quarter of them, and of all of them
+    bench_download_zipf("no_cache", 0);
+    bench_download_zipf("cache_4MiB", 4 * 1024 * 1024);
+    bench_download_zipf("cache_16MiB", 16 * 1024 * 1024);
+
+    // Loses the peer, and parse_file() replaces the users
+    check_search_owner_lost();
+
+    bench_parse_file(1000, 50);
+    bench_parse_file(MAX_USERS, 10);
+
+    if (chdir("/") == 0)
+    {
+        nftw(scratch_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file bench_utils.c
+ * @brief Timing and reporting helpers shared by the microbenchmarks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "bench_utils.h"
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ull;
+static volatile uint64_t sink;
+static FILE *report_stream = NULL; /**< Where results go (stdout unless silenced) */
+static FILE *error_stream = NULL;  /**< Where failures go (stderr unless silenced) */
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Prints one benchmark result as a JSON line.
+ */
+void bench_report(const char *suite, const char *name, const char *variant, uint64_t ops, uint64_t elapsed_ns, uint64_t bytes)
+{
+    double ns_per_op = ops > 0 ? (double)elapsed_ns / ops : 0.0;
+    double ops_per_sec = elapsed_ns > 0 ? ops * 1e9 / elapsed_ns : 0.0;
+    double mb_per_sec = elapsed_ns > 0 ? bytes * 1e3 / elapsed_ns : 0.0;
+
+    FILE *out = report_stream != NULL ? report_stream : stdout;
+    const char *revision = getenv("BENCH_REVISION");
+
+    fprintf(out, "{\"suite\":\"%s\",\"name\":\"%s\",\"variant\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,"
+            "\"ops_per_sec\":%.0f,\"mb_per_sec\":%.1f",
+            suite, name, variant, (unsigned long long)ops, ns_per_op, ops_per_sec, mb_per_sec);
+    if (revision != NULL && revision[0] != '\0')
+    {
+        fprintf(out, ",\"revision\":\"%s\"", revision);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+}
+
+/**
+ * @brief Returns a pseudo-random 64-bit number (xorshift, deterministic across runs).
+ */
+uint64_t bench_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+/**
+ * @brief Sends the output of the code under test to /dev/null.
+ */
+void bench_silence(void)
+{
+    fflush(stdout);
+    fflush(stderr);
+    report_stream = fdopen(dup(STDOUT_FILENO), "w");
+    error_stream = fdopen(dup(STDERR_FILENO), "w");
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+}
+
+/**
+ * @brief Prints an error message and exits with a failure status.
+ */
+void bench_fail(const char *format, ...)
+{
+    FILE *out = error_stream != NULL ? error_stream : stderr;
+    va_list args;
+    va_start(args, format);
+    vfprintf(out, format, args);
+    va_end(args);
+    fputc('\n', out);
+    fflush(out);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Prevents the compiler from optimising a computed value away.
+ */
+void bench_consume(uint64_t value)
+{
+    sink += value;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file bench_utils.h
+ * @brief Timing and reporting helpers shared by the microbenchmarks.
+ *
+ * Results are printed as one JSON object per line on stdout so that runs can be
+ * collected and compared across releases. When the BENCH_REVISION environment variable
+ * is set, every result is tagged with it.
+ */
+
+#ifndef BENCH_UTILS_H
+#define BENCH_UTILS_H
+
+#include <stdint.h>
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t bench_now_ns(void);
+
+/**
+ * @brief Prints one benchmark result as a JSON line.
+ *
+ * @param suite The benchmark program (e.g. "command").
+ * @param name The measured operation.
+ * @param variant The implementation or parameter being compared.
+ * @param ops The number of operations performed.
+ * @param elapsed_ns The total time spent, in nanoseconds.
+ * @param bytes The number of payload bytes processed (0 if not meaningful).
+ */
+void bench_report(const char *suite, const char *name, const char *variant, uint64_t ops, uint64_t elapsed_ns, uint64_t bytes);
+
+/**
+ * @brief Returns a pseudo-random 64-bit number (xorshift, deterministic across runs).
+ */
+uint64_t bench_random(void);
+
+/**
+ * @brief Sends the output of the code under test to /dev/null.
+ *
+ * Server functions log every request on stdout and stderr; after this call only the
+ * results of bench_report() and the messages of bench_fail() are printed.
+ */
+void bench_silence(void);
+
+/**
+ * @brief Prints an error message and exits with a failure status.
+ */
+void bench_fail(const char *format, ...);
+
+/**
+ * @brief Prevents the compiler from optimising a computed value away.
+ */
+void bench_consume(uint64_t value);
+
+#endif // BENCH_UTILS_H
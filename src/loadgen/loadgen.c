@@ -0,0 +1,1361 @@
+/**
+ * @file loadgen.c
+ * @brief Headless load generator for the messaging servers.
+ *
+ * Simulates many users speaking the client protocol at once: each user connects to one
+ * of the servers, logs in, joins a group and then chats at a configured rate while
+ * occasionally listing the files of its group. A separate thread uploads files to the
+ * servers and downloads them back from the other server. Users are spread over the
+ * servers so that most groups span both of them and exercise replication.
+ *
+ * Every chat message carries the time it was scheduled to be sent; the members of the
+ * group that receive it record the end-to-end latency. Messages are scheduled ahead of
+ * time rather than sent when the previous one completes, so a slow server shows up as
+ * latency instead of silently lowering the offered load.
+ *
+ * The users and groups must exist on the servers: `loadgen.exe -w data.txt` writes a
+ * data file matching the scenario, and run_loadgen.sh sets both servers up with it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "socket_utils.h"
+#include "histogram.h"
+
+#define LOADGEN_MAX_SERVERS 4
+#define LOADGEN_MAX_GROUPS 512                        /**< Matches MAX_GROUPS of the servers */
+#define LOADGEN_GROUP_SIZE 32                         /**< Users per group when the group count is not given */
+#define USER_INPUT_SIZE (12 * 1024)                   /**< Holds the largest reply (a BUFFER_SIZE file list) */
+#define USER_OUTPUT_SIZE (4 * 1024)                   /**< Frames waiting for the socket to drain */
+#define MAX_MESSAGE_SIZE 1024                         /**< Largest chat message body */
+#define CONNECTS_IN_FLIGHT 64                         /**< Connections opened at once by each worker */
+#define REQUEST_TIMEOUT_NS (5 * 1000000000ULL)        /**< Time after which a request is given up */
+#define SETUP_TIMEOUT_NS (60 * 1000000000ULL)         /**< Time allowed for every user to log in and join */
+#define DRAIN_NS (1000000000ULL)                      /**< Time spent collecting in-flight messages at the end */
+#define TRANSFER_TIMEOUT_SEC 10                       /**< Socket timeout of the file transfer thread */
+#define TRANSFER_MAX_FILES 4096                       /**< Uploaded files remembered for downloads */
+#define NS_PER_SEC 1000000000ULL
+
+/**
+ * @struct loadgen_options
+ * @brief Scenario settings taken from the command line.
+ */
+struct loadgen_options
+{
+    int users;                       /**< Number of simulated users */
+    int groups;                      /**< Number of groups the users are spread over */
+    int threads;                     /**< Number of worker threads driving the users */
+    double duration;                 /**< Seconds of measured chat */
+    double message_rate;             /**< Messages per second sent by each user */
+    int message_size;                /**< Bytes of each chat message body */
+    double list_rate;                /**< list_files requests per second sent by each user */
+    double transfer_rate;            /**< File uploads and downloads per second */
+    int file_size;                   /**< Bytes of each uploaded file */
+    int ports[LOADGEN_MAX_SERVERS];  /**< Ports of the servers on localhost */
+    int server_count;                /**< Number of servers */
+    int json;                        /**< Non-zero to print the summary as a JSON line */
+};
+
+static struct loadgen_options options = {
+    .users = 200,
+    .groups = 0,
+    .threads = 2,
+    .duration = 10,
+    .message_rate = 1,
+    .message_size = 64,
+    .list_rate = 0.1,
+    .transfer_rate = 2,
+    .file_size = 64 * 1024,
+    .ports = {8080, 8081},
+    .server_count = 2,
+    .json = 0,
+};
+
+enum loadgen_phase
+{
+    PHASE_SETUP, /**< Users are connecting, logging in and joining their group */
+    PHASE_RUN,   /**< Users are chatting; latencies are recorded */
+    PHASE_DRAIN, /**< Users stop sending and collect the messages still in flight */
+    PHASE_STOP,  /**< Workers exit */
+};
+
+static int phase = PHASE_SETUP;
+static int settled_users = 0;                   /**< Users that finished setting up, successfully or not */
+static int group_members[LOADGEN_MAX_GROUPS]; /**< Users currently in each group */
+
+enum user_state
+{
+    USER_IDLE,
+    USER_CONNECTING,
+    USER_LOGGING_IN,
+    USER_JOINING,
+    USER_READY,
+    USER_FAILED,
+};
+
+enum request_kind
+{
+    REQUEST_NONE,
+    REQUEST_LOGIN,
+    REQUEST_JOIN,
+    REQUEST_LIST_FILES,
+};
+
+/**
+ * @struct user
+ * @brief One simulated client connection.
+ */
+struct user
+{
+    int index;
+    int fd;
+    int server;
+    int group;
+    int member;                 /**< Non-zero once the user is in its group */
+    enum user_state state;
+    enum request_kind request;  /**< Request waiting for a reply (one at a time, like the real client) */
+    uint64_t request_ns;        /**< When the pending request was sent */
+    uint64_t next_message_ns;   /**< When the next chat message is due */
+    uint64_t next_list_ns;      /**< When the next list_files request is due */
+    uint64_t sequence;
+    uint32_t epoll_events;      /**< Events currently registered for the socket */
+    char name[16];
+    size_t in_length;
+    size_t out_length;
+    char in[USER_INPUT_SIZE];
+    char out[USER_OUTPUT_SIZE];
+};
+
+/**
+ * @struct loadgen_stats
+ * @brief Counters and latencies collected by a worker.
+ *
+ * Counters are updated atomically so that the main thread can print progress.
+ */
+struct loadgen_stats
+{
+    uint64_t connected;
+    uint64_t logged_in;
+    uint64_t joined;
+    uint64_t group_full;
+    uint64_t failed;
+    uint64_t disconnected;
+    uint64_t messages_sent;
+    uint64_t messages_skipped;     /**< Messages not sent because the socket was backed up */
+    uint64_t expected_deliveries;  /**< Messages times the other members of the group */
+    uint64_t deliveries;
+    uint64_t rejected;             /**< "Rate limit exceeded" replies */
+    uint64_t timeouts;
+    uint64_t unexpected;           /**< Frames that matched no request */
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    struct histogram message_latency;
+    struct histogram login_latency;
+    struct histogram join_latency;
+    struct histogram list_latency;
+};
+
+#define STAT_ADD(stats, field, n) __atomic_add_fetch(&(stats)->field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(stats, field) __atomic_load_n(&(stats)->field, __ATOMIC_RELAXED)
+
+/**
+ * @struct worker
+ * @brief A thread driving a share of the users with its own epoll set.
+ */
+struct worker
+{
+    pthread_t thread;
+    int epoll_fd;
+    struct user **users;
+    int user_count;
+    int next_connect;      /**< Next user to connect */
+    int connecting;        /**< Connections in progress */
+    int chatting;          /**< Non-zero once the chat timers are armed */
+    struct user **heap;    /**< Chatting users ordered by their next due action */
+    int heap_size;
+    uint64_t random;
+    uint64_t next_timeout_check_ns;
+    struct loadgen_stats stats;
+};
+
+/**
+ * @struct transfer_stats
+ * @brief Counters and latencies of the file transfer thread.
+ */
+struct transfer_stats
+{
+    uint64_t uploads;
+    uint64_t upload_errors;
+    uint64_t downloads;
+    uint64_t download_errors;
+    uint64_t bytes;
+    struct histogram upload_latency;
+    struct histogram download_latency;
+};
+
+static struct transfer_stats transfers;
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    struct timespec ts = {ns / NS_PER_SEC, ns % NS_PER_SEC};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Returns a pseudo-random number (xorshift).
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/**
+ * @brief Returns a jittered interval (uniform between half and one and a half periods).
+ *
+ * @param rate The number of events per second, or 0 for never.
+ */
+static uint64_t next_interval(uint64_t *random, double rate)
+{
+    if (rate <= 0)
+    {
+        return UINT64_MAX / 2;
+    }
+    double period = NS_PER_SEC / rate;
+    return (uint64_t)(period * (0.5 + (next_random(random) % 1000) / 1000.0));
+}
+
+static int load_phase(void)
+{
+    return __atomic_load_n(&phase, __ATOMIC_ACQUIRE);
+}
+
+/* ---------------------------------------------------------------------------------- */
+/* Timer heap                                                                          */
+/* ---------------------------------------------------------------------------------- */
+
+static uint64_t user_due(const struct user *user)
+{
+    return user->next_message_ns < user->next_list_ns ? user->next_message_ns : user->next_list_ns;
+}
+
+static void heap_push(struct worker *worker, struct user *user)
+{
+    int i = worker->heap_size++;
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (user_due(worker->heap[parent]) <= user_due(user))
+        {
+            break;
+        }
+        worker->heap[i] = worker->heap[parent];
+        i = parent;
+    }
+    worker->heap[i] = user;
+}
+
+static struct user *heap_pop(struct worker *worker)
+{
+    struct user *top = worker->heap[0];
+    struct user *last = worker->heap[--worker->heap_size];
+    int i = 0;
+    while (1)
+    {
+        int child = 2 * i + 1;
+        if (child >= worker->heap_size)
+        {
+            break;
+        }
+        if (child + 1 < worker->heap_size && user_due(worker->heap[child + 1]) < user_due(worker->heap[child]))
+        {
+            child++;
+        }
+        if (user_due(last) <= user_due(worker->heap[child]))
+        {
+            break;
+        }
+        worker->heap[i] = worker->heap[child];
+        i = child;
+    }
+    if (worker->heap_size > 0)
+    {
+        worker->heap[i] = last;
+    }
+    return top;
+}
+
+/* ---------------------------------------------------------------------------------- */
+/* User connections                                                                    */
+/* ---------------------------------------------------------------------------------- */
+
+static void user_watch(struct worker *worker, struct user *user, uint32_t events)
+{
+    if (events != user->epoll_events)
+    {
+        struct epoll_event event = {.events = events, .data.ptr = user};
+        epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, user->fd, &event);
+        user->epoll_events = events;
+    }
+}
+
+/**
+ * @brief Marks a user as settled once it is done setting up, successfully or not.
+ */
+static void user_settle(void)
+{
+    __atomic_add_fetch(&settled_users, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Closes the connection of a user after an error.
+ */
+static void user_fail(struct worker *worker, struct user *user)
+{
+    if (user->state == USER_FAILED)
+    {
+        return;
+    }
+    if (user->state == USER_READY)
+    {
+        STAT_ADD(&worker->stats, disconnected, 1);
+    }
+    else
+    {
+        STAT_ADD(&worker->stats, failed, 1);
+        user_settle();
+    }
+    if (user->state == USER_CONNECTING)
+    {
+        worker->connecting--;
+    }
+    if (user->member)
+    {
+        __atomic_sub_fetch(&group_members[user->group], 1, __ATOMIC_RELAXED);
+        user->member = 0;
+    }
+    close(user->fd);
+    user->fd = -1;
+    user->state = USER_FAILED;
+}
+
+/**
+ * @brief Writes as much of the output buffer as the socket accepts.
+ */
+static void user_flush(struct worker *worker, struct user *user)
+{
+    size_t written = 0;
+    while (written < user->out_length)
+    {
+        ssize_t n = send(user->fd, user->out + written, user->out_length - written, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            user_fail(worker, user);
+            return;
+        }
+        written += n;
+    }
+
+    STAT_ADD(&worker->stats, bytes_sent, written);
+    memmove(user->out, user->out + written, user->out_length - written);
+    user->out_length -= written;
+    user_watch(worker, user, user->out_length > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/**
+ * @brief Queues a frame on the connection of a user.
+ *
+ * @return 0 on success, -1 if the output buffer is full.
+ */
+static int user_send(struct worker *worker, struct user *user, const char *data, size_t length)
+{
+    if (user->out_length + FRAME_HEADER_SIZE + length > USER_OUTPUT_SIZE)
+    {
+        return -1;
+    }
+
+    int size = length;
+    memcpy(user->out + user->out_length, &size, FRAME_HEADER_SIZE);
+    memcpy(user->out + user->out_length + FRAME_HEADER_SIZE, data, length);
+    user->out_length += FRAME_HEADER_SIZE + length;
+    user_flush(worker, user);
+    return 0;
+}
+
+/**
+ * @brief Sends a request expecting one reply.
+ */
+static void user_request(struct worker *worker, struct user *user, enum request_kind kind, const char *command)
+{
+    if (user_send(worker, user, command, strlen(command)) == 0)
+    {
+        user->request = kind;
+        user->request_ns = now_ns();
+    }
+}
+
+/**
+ * @brief Starts connecting a user to its server.
+ */
+static void user_connect(struct worker *worker, struct user *user)
+{
+    user->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (user->fd < 0)
+    {
+        perror("socket");
+        user->state = USER_CONNECTING;
+        worker->connecting++;
+        user_fail(worker, user);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(user->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(options.ports[user->server]);
+
+    user->state = USER_CONNECTING;
+    worker->connecting++;
+    if (connect(user->fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS)
+    {
+        user_fail(worker, user);
+        return;
+    }
+
+    struct epoll_event event = {.events = EPOLLOUT, .data.ptr = user};
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, user->fd, &event);
+    user->epoll_events = EPOLLOUT;
+}
+
+/**
+ * @brief Completes a non-blocking connect and sends the login request.
+ */
+static void user_connected(struct worker *worker, struct user *user)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(user->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+    {
+        user_fail(worker, user);
+        return;
+    }
+
+    worker->connecting--;
+    STAT_ADD(&worker->stats, connected, 1);
+    user->state = USER_LOGGING_IN;
+    user_watch(worker, user, EPOLLIN);
+
+    char command[64];
+    snprintf(command, sizeof(command), "login %s pw%d", user->name, user->index);
+    user_request(worker, user, REQUEST_LOGIN, command);
+}
+
+/**
+ * @brief Records a chat message delivered to a user.
+ *
+ * Deliveries look like "<sender>: <sequence> <scheduled time> <padding>".
+ */
+static void handle_delivery(struct worker *worker, const char *body, size_t length, uint64_t now)
+{
+    char header[64];
+    size_t n = length < sizeof(header) - 1 ? length : sizeof(header) - 1;
+    memcpy(header, body, n);
+    header[n] = '\0';
+
+    char *cursor = strstr(header, ": ");
+    if (cursor == NULL)
+    {
+        STAT_ADD(&worker->stats, unexpected, 1);
+        return;
+    }
+    strtoull(cursor + 2, &cursor, 10);
+    uint64_t scheduled = strtoull(cursor, NULL, 10);
+
+    STAT_ADD(&worker->stats, deliveries, 1);
+    if (scheduled > 0 && scheduled <= now && load_phase() != PHASE_SETUP)
+    {
+        histogram_record(&worker->stats.message_latency, now - scheduled);
+    }
+}
+
+/**
+ * @brief Records each chat message of a `batch` frame, sent to a user that fell behind.
+ */
+static void handle_batch(struct worker *worker, const char *frame, size_t length, uint64_t now)
+{
+    const char *cursor = frame + sizeof(FRAME_BATCH_HEADER) - 1;
+    const char *line;
+    size_t line_length;
+    while ((line = batch_next_line(&cursor, frame + length, &line_length)) != NULL)
+    {
+        handle_delivery(worker, line, line_length, now);
+    }
+}
+
+static int reply_is(const char *frame, size_t length, const char *expected)
+{
+    size_t expected_length = strlen(expected);
+    return length >= expected_length && memcmp(frame, expected, expected_length) == 0;
+}
+
+/**
+ * @brief Handles a reply to the pending request of a user.
+ */
+static void handle_reply(struct worker *worker, struct user *user, const char *frame, size_t length, uint64_t now)
+{
+    if (reply_is(frame, length, "Rate limit exceeded"))
+    {
+        STAT_ADD(&worker->stats, rejected, 1);
+        return;
+    }
+
+    enum request_kind request = user->request;
+    uint64_t latency = now - user->request_ns;
+    user->request = REQUEST_NONE;
+
+    switch (request)
+    {
+    case REQUEST_LOGIN:
+        if (!reply_is(frame, length, "Login successful"))
+        {
+            user_fail(worker, user);
+            return;
+        }
+        STAT_ADD(&worker->stats, logged_in, 1);
+        histogram_record(&worker->stats.login_latency, latency);
+        user->state = USER_JOINING;
+
+        char command[64];
+        snprintf(command, sizeof(command), "join_group %s lg%d", user->name, user->group);
+        user_request(worker, user, REQUEST_JOIN, command);
+        break;
+
+    case REQUEST_JOIN:
+        histogram_record(&worker->stats.join_latency, latency);
+        if (reply_is(frame, length, "Joined group successfully") || reply_is(frame, length, "Already in the group"))
+        {
+            STAT_ADD(&worker->stats, joined, 1);
+            __atomic_add_fetch(&group_members[user->group], 1, __ATOMIC_RELAXED);
+            user->member = 1;
+        }
+        else if (reply_is(frame, length, "Group is full"))
+        {
+            STAT_ADD(&worker->stats, group_full, 1);
+        }
+        else
+        {
+            user_fail(worker, user);
+            return;
+        }
+        user->state = USER_READY;
+        user_settle();
+        break;
+
+    case REQUEST_LIST_FILES:
+        histogram_record(&worker->stats.list_latency, latency);
+        break;
+
+    default:
+        STAT_ADD(&worker->stats, unexpected, 1);
+        break;
+    }
+}
+
+/**
+ * @brief Reads everything available on the connection of a user and handles each frame.
+ */
+static void user_read(struct worker *worker, struct user *user)
+{
+    while (user->state != USER_FAILED)
+    {
+        ssize_t n = recv(user->fd, user->in + user->in_length, USER_INPUT_SIZE - user->in_length, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            user_fail(worker, user);
+            return;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        user->in_length += n;
+        STAT_ADD(&worker->stats, bytes_received, n);
+
+        uint64_t now = now_ns();
+        size_t offset = 0;
+        while (user->in_length - offset >= FRAME_HEADER_SIZE)
+        {
+            int size;
+            memcpy(&size, user->in + offset, FRAME_HEADER_SIZE);
+            if (size < 0 || size > USER_INPUT_SIZE - FRAME_HEADER_SIZE)
+            {
+                user_fail(worker, user);
+                return;
+            }
+            if (user->in_length - offset < FRAME_HEADER_SIZE + (size_t)size)
+            {
+                break;
+            }
+
+            const char *frame = user->in + offset + FRAME_HEADER_SIZE;
+            if (size > 3 && memcmp(frame, "lgu", 3) == 0 && memchr(frame, ':', size < 24 ? size : 24) != NULL)
+            {
+                handle_delivery(worker, frame, size, now);
+            }
+            else if (reply_is(frame, size, FRAME_BATCH_HEADER))
+            {
+                handle_batch(worker, frame, size, now);
+            }
+            else if (user->request != REQUEST_NONE || reply_is(frame, size, "Rate limit exceeded"))
+            {
+                handle_reply(worker, user, frame, size, now);
+            }
+            else
+            {
+                STAT_ADD(&worker->stats, unexpected, 1);
+            }
+            offset += FRAME_HEADER_SIZE + size;
+
+            if (user->state == USER_FAILED)
+            {
+                return;
+            }
+        }
+
+        memmove(user->in, user->in + offset, user->in_length - offset);
+        user->in_length -= offset;
+    }
+}
+
+/**
+ * @brief Sends the chat message and list_files request of a user that are due.
+ */
+static void user_act(struct worker *worker, struct user *user, uint64_t now)
+{
+    if (user->next_message_ns <= now)
+    {
+        char message[MAX_MESSAGE_SIZE + 128];
+        int length = snprintf(message, sizeof(message), "message lg%d %s 1 %llu %llu ", user->group, user->name,
+                              (unsigned long long)user->sequence++, (unsigned long long)user->next_message_ns);
+        int header_length = length;
+        while (length - header_length < options.message_size)
+        {
+            message[length++] = 'x';
+        }
+
+        if (user_send(worker, user, message, length) == 0)
+        {
+            int members = __atomic_load_n(&group_members[user->group], __ATOMIC_RELAXED);
+            STAT_ADD(&worker->stats, messages_sent, 1);
+            STAT_ADD(&worker->stats, expected_deliveries, members > 1 ? members - 1 : 0);
+        }
+        else
+        {
+            STAT_ADD(&worker->stats, messages_skipped, 1);
+        }
+        user->next_message_ns += next_interval(&worker->random, options.message_rate);
+    }
+
+    if (user->next_list_ns <= now && user->state == USER_READY)
+    {
+        if (user->request == REQUEST_NONE)
+        {
+            char command[64];
+            snprintf(command, sizeof(command), "list_files lg%d", user->group);
+            user_request(worker, user, REQUEST_LIST_FILES, command);
+        }
+        user->next_list_ns += next_interval(&worker->random, options.list_rate);
+    }
+}
+
+/**
+ * @brief Arms the chat timers of every user of a worker that joined its group.
+ */
+static void worker_start_chat(struct worker *worker)
+{
+    uint64_t now = now_ns();
+    for (int i = 0; i < worker->user_count; i++)
+    {
+        struct user *user = worker->users[i];
+        if (user->state == USER_READY && user->member)
+        {
+            // Spread the first messages over a whole period
+            user->next_message_ns = now + next_interval(&worker->random, options.message_rate) / 2;
+            user->next_list_ns = now + next_interval(&worker->random, options.list_rate);
+            heap_push(worker, user);
+        }
+    }
+    worker->chatting = 1;
+}
+
+/**
+ * @brief Gives up requests that have been waiting for too long.
+ */
+static void worker_check_timeouts(struct worker *worker, uint64_t now)
+{
+    for (int i = 0; i < worker->user_count; i++)
+    {
+        struct user *user = worker->users[i];
+        if (user->request != REQUEST_NONE && now - user->request_ns > REQUEST_TIMEOUT_NS)
+        {
+            STAT_ADD(&worker->stats, timeouts, 1);
+            if (user->state == USER_LOGGING_IN || user->state == USER_JOINING)
+            {
+                user_fail(worker, user);
+            }
+            user->request = REQUEST_NONE;
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct epoll_event events[256];
+
+    while (load_phase() != PHASE_STOP)
+    {
+        while (worker->connecting < CONNECTS_IN_FLIGHT && worker->next_connect < worker->user_count)
+        {
+            user_connect(worker, worker->users[worker->next_connect++]);
+        }
+
+        int current = load_phase();
+        uint64_t now = now_ns();
+        if (current == PHASE_RUN && !worker->chatting)
+        {
+            worker_start_chat(worker);
+        }
+
+        int timeout = 10;
+        if (current == PHASE_RUN)
+        {
+            while (worker->heap_size > 0 && user_due(worker->heap[0]) <= now)
+            {
+                struct user *user = heap_pop(worker);
+                if (user->state != USER_READY)
+                {
+                    continue;
+                }
+                user_act(worker, user, now);
+                heap_push(worker, user);
+            }
+            if (worker->heap_size > 0)
+            {
+                uint64_t wait = (user_due(worker->heap[0]) - now + 999999) / 1000000;
+                timeout = wait < 10 ? wait : 10;
+            }
+        }
+
+        if (now >= worker->next_timeout_check_ns)
+        {
+            worker_check_timeouts(worker, now);
+            worker->next_timeout_check_ns = now + NS_PER_SEC / 10;
+        }
+
+        int count = epoll_wait(worker->epoll_fd, events, 256, timeout);
+        for (int i = 0; i < count; i++)
+        {
+            struct user *user = events[i].data.ptr;
+            if (user->state == USER_FAILED)
+            {
+                continue;
+            }
+            if (user->state == USER_CONNECTING)
+            {
+                user_connected(worker, user);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                user_read(worker, user);
+            }
+            if (user->state != USER_FAILED && (events[i].events & EPOLLOUT))
+            {
+                user_flush(worker, user);
+            }
+        }
+    }
+
+    for (int i = 0; i < worker->user_count; i++)
+    {
+        if (worker->users[i]->fd >= 0)
+        {
+            close(worker->users[i]->fd);
+        }
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------- */
+/* File transfers                                                                      */
+/* ---------------------------------------------------------------------------------- */
+
+static int recv_exact(int fd, void *data, size_t length)
+{
+    size_t received = 0;
+    while (received < length)
+    {
+        ssize_t n = recv(fd, (char *)data + received, length - received, 0);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Opens a blocking connection used for a single file transfer.
+ */
+static int transfer_connect(int server)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct timeval timeout = {TRANSFER_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(options.ports[server]);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Uploads a file with the upload_file handshake of the client.
+ *
+ * The server does not acknowledge the end of an upload, so the latency covers the
+ * handshake and handing every byte to the kernel.
+ */
+static int transfer_upload(int server, int group, int file, const char *data)
+{
+    int fd = transfer_connect(server);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    char command[64];
+    snprintf(command, sizeof(command), "upload_file lg%d lgf%d", group, file);
+    send_message(fd, command, strlen(command), 0);
+
+    char reply[12];
+    uint64_t size = options.file_size;
+    int status = -1;
+    if (recv_exact(fd, reply, 12) == 0 && memcmp(reply, "SERVER_READY", 12) == 0 &&
+        send(fd, &size, sizeof(size), MSG_NOSIGNAL) == sizeof(size) &&
+        recv_exact(fd, reply, 7) == 0 && memcmp(reply, "SIZE_OK", 7) == 0)
+    {
+        size_t sent = 0;
+        while (sent < size)
+        {
+            ssize_t n = send(fd, data + sent, size - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+        status = sent == size ? 0 : -1;
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * @brief Downloads a file with the download_file handshake of the client.
+ */
+static int transfer_download(int server, int group, int file, char *data)
+{
+    int fd = transfer_connect(server);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    char command[64];
+    snprintf(command, sizeof(command), "download_file lg%d lgf%d", group, file);
+    send_message(fd, command, strlen(command), 0);
+    send(fd, "SERVER_READY", 12, MSG_NOSIGNAL);
+
+    // A missing file is answered with a plain "Error opening file" instead of the size
+    uint64_t size;
+    int status = -1;
+    if (recv_exact(fd, &size, sizeof(size)) == 0 && memcmp(&size, "Error op", sizeof(size)) != 0 &&
+        size == (uint64_t)options.file_size && send(fd, "SIZE_OK", 7, MSG_NOSIGNAL) == 7 &&
+        recv_exact(fd, data, size) == 0)
+    {
+        status = 0;
+    }
+    close(fd);
+    return status;
+}
+
+/**
+ * @brief Uploads files to the servers and downloads them back from the other server.
+ */
+static void *transfer_main(void *arg)
+{
+    (void)arg;
+    char *upload_data = malloc(options.file_size);
+    char *download_data = malloc(options.file_size);
+    static uint64_t uploaded_at[TRANSFER_MAX_FILES];
+    uint64_t random = 0x2545f4914f6cdd1dULL;
+    int uploaded = 0;
+
+    histogram_init(&transfers.upload_latency);
+    histogram_init(&transfers.download_latency);
+    for (int i = 0; i < options.file_size; i++)
+    {
+        upload_data[i] = next_random(&random);
+    }
+
+    uint64_t next = 0;
+    uint64_t round = 0;
+    int groups = options.groups;
+    while (load_phase() < PHASE_DRAIN)
+    {
+        if (load_phase() == PHASE_SETUP)
+        {
+            sleep_ns(NS_PER_SEC / 100);
+            continue;
+        }
+
+        uint64_t now = now_ns();
+        if (next == 0)
+        {
+            next = now;
+        }
+        if (next > now)
+        {
+            sleep_ns(next - now);
+        }
+        next += NS_PER_SEC / options.transfer_rate;
+
+        // Download a file old enough to have been replicated, otherwise upload a new one
+        int file = uploaded > 0 ? next_random(&random) % uploaded : -1;
+        if (round++ % 2 == 1 && file >= 0 && now_ns() - uploaded_at[file] > NS_PER_SEC)
+        {
+            int server = (file + 1) % options.server_count;
+            uint64_t start = now_ns();
+            if (transfer_download(server, file % groups, file, download_data) == 0)
+            {
+                histogram_record(&transfers.download_latency, now_ns() - start);
+                transfers.downloads++;
+                transfers.bytes += options.file_size;
+            }
+            else
+            {
+                transfers.download_errors++;
+            }
+        }
+        else if (uploaded < TRANSFER_MAX_FILES)
+        {
+            int server = uploaded % options.server_count;
+            uint64_t start = now_ns();
+            if (transfer_upload(server, uploaded % groups, uploaded, upload_data) == 0)
+            {
+                histogram_record(&transfers.upload_latency, now_ns() - start);
+                uploaded_at[uploaded++] = now_ns();
+                transfers.uploads++;
+                transfers.bytes += options.file_size;
+            }
+            else
+            {
+                transfers.upload_errors++;
+            }
+        }
+    }
+
+    free(upload_data);
+    free(download_data);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------------- */
+/* Reporting                                                                           */
+/* ---------------------------------------------------------------------------------- */
+
+static void merge_stats(struct loadgen_stats *into, const struct loadgen_stats *from)
+{
+    into->connected += from->connected;
+    into->logged_in += from->logged_in;
+    into->joined += from->joined;
+    into->group_full += from->group_full;
+    into->failed += from->failed;
+    into->disconnected += from->disconnected;
+    into->messages_sent += from->messages_sent;
+    into->messages_skipped += from->messages_skipped;
+    into->expected_deliveries += from->expected_deliveries;
+    into->deliveries += from->deliveries;
+    into->rejected += from->rejected;
+    into->timeouts += from->timeouts;
+    into->unexpected += from->unexpected;
+    into->bytes_sent += from->bytes_sent;
+    into->bytes_received += from->bytes_received;
+    histogram_merge(&into->message_latency, &from->message_latency);
+    histogram_merge(&into->login_latency, &from->login_latency);
+    histogram_merge(&into->join_latency, &from->join_latency);
+    histogram_merge(&into->list_latency, &from->list_latency);
+}
+
+static void print_latency(const char *name, const struct histogram *histogram)
+{
+    if (histogram->count == 0)
+    {
+        printf("  %-12s no samples\n", name);
+        return;
+    }
+    printf("  %-12s n=%-9llu p50 %9.1f us  p99 %9.1f us  p999 %9.1f us  max %9.1f us\n", name,
+           (unsigned long long)histogram->count, histogram_percentile(histogram, 50) / 1e3,
+           histogram_percentile(histogram, 99) / 1e3, histogram_percentile(histogram, 99.9) / 1e3,
+           histogram->max / 1e3);
+}
+
+static void json_latency(const char *name, const struct histogram *histogram)
+{
+    printf(",\"%s\":{\"count\":%llu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}", name,
+           (unsigned long long)histogram->count, histogram_percentile(histogram, 50) / 1e3,
+           histogram_percentile(histogram, 99) / 1e3, histogram_percentile(histogram, 99.9) / 1e3,
+           histogram->count ? histogram->max / 1e3 : 0);
+}
+
+static void print_report(const struct loadgen_stats *total, double elapsed)
+{
+    double delivery_ratio = total->expected_deliveries ? 100.0 * total->deliveries / total->expected_deliveries : 0;
+
+    if (options.json)
+    {
+        printf("{\"tool\":\"loadgen\",\"users\":%d,\"groups\":%d,\"servers\":%d,\"duration_s\":%.2f,"
+               "\"connected\":%llu,\"joined\":%llu,\"failed\":%llu,\"disconnected\":%llu,"
+               "\"messages_sent\":%llu,\"messages_per_sec\":%.1f,\"messages_skipped\":%llu,"
+               "\"expected_deliveries\":%llu,\"deliveries\":%llu,\"deliveries_per_sec\":%.1f,\"delivery_ratio\":%.4f,"
+               "\"rejected\":%llu,\"timeouts\":%llu,\"unexpected\":%llu,"
+               "\"uploads\":%llu,\"upload_errors\":%llu,\"downloads\":%llu,\"download_errors\":%llu",
+               options.users, options.groups, options.server_count, elapsed,
+               (unsigned long long)total->connected, (unsigned long long)total->joined,
+               (unsigned long long)total->failed, (unsigned long long)total->disconnected,
+               (unsigned long long)total->messages_sent, total->messages_sent / elapsed,
+               (unsigned long long)total->messages_skipped, (unsigned long long)total->expected_deliveries,
+               (unsigned long long)total->deliveries, total->deliveries / elapsed, delivery_ratio / 100,
+               (unsigned long long)total->rejected, (unsigned long long)total->timeouts,
+               (unsigned long long)total->unexpected, (unsigned long long)transfers.uploads,
+               (unsigned long long)transfers.upload_errors, (unsigned long long)transfers.downloads,
+               (unsigned long long)transfers.download_errors);
+        json_latency("message_latency", &total->message_latency);
+        json_latency("login_latency", &total->login_latency);
+        json_latency("join_latency", &total->join_latency);
+        json_latency("list_files_latency", &total->list_latency);
+        json_latency("upload_latency", &transfers.upload_latency);
+        json_latency("download_latency", &transfers.download_latency);
+        printf("}\n");
+        return;
+    }
+
+    printf("\nLoad generator report\n----------------------------------------------\n");
+    printf("Users: %d on %d server(s), %d groups, %.1f s measured\n", options.users, options.server_count,
+           options.groups, elapsed);
+    printf("Setup: %llu connected, %llu logged in, %llu joined, %llu group full, %llu failed\n",
+           (unsigned long long)total->connected, (unsigned long long)total->logged_in,
+           (unsigned long long)total->joined, (unsigned long long)total->group_full,
+           (unsigned long long)total->failed);
+    printf("Chat: %llu messages sent (%.1f/s), %llu skipped on backpressure\n",
+           (unsigned long long)total->messages_sent, total->messages_sent / elapsed,
+           (unsigned long long)total->messages_skipped);
+    printf("Deliveries: %llu of %llu expected (%.2f%%), %.1f/s\n", (unsigned long long)total->deliveries,
+           (unsigned long long)total->expected_deliveries, delivery_ratio, total->deliveries / elapsed);
+    printf("Traffic: %.2f MB sent, %.2f MB received\n", total->bytes_sent / 1e6, total->bytes_received / 1e6);
+    printf("Errors: %llu rate limited, %llu timeouts, %llu unexpected frames, %llu disconnected\n",
+           (unsigned long long)total->rejected, (unsigned long long)total->timeouts,
+           (unsigned long long)total->unexpected, (unsigned long long)total->disconnected);
+    printf("Files: %llu uploads (%llu failed), %llu downloads (%llu failed), %.2f MB/s\n",
+           (unsigned long long)transfers.uploads, (unsigned long long)transfers.upload_errors,
+           (unsigned long long)transfers.downloads, (unsigned long long)transfers.download_errors,
+           transfers.bytes / 1e6 / elapsed);
+    printf("Latency:\n");
+    print_latency("message", &total->message_latency);
+    print_latency("login", &total->login_latency);
+    print_latency("join_group", &total->join_latency);
+    print_latency("list_files", &total->list_latency);
+    print_latency("upload", &transfers.upload_latency);
+    print_latency("download", &transfers.download_latency);
+}
+
+/* ---------------------------------------------------------------------------------- */
+/* Setup                                                                               */
+/* ---------------------------------------------------------------------------------- */
+
+/**
+ * @brief Writes a server data file holding the users and groups of the scenario.
+ */
+static int write_data_file(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        perror("fopen");
+        return -1;
+    }
+    for (int i = 0; i < options.users; i++)
+    {
+        fprintf(file, "lgu%d M 30 pw%d\n", i, i);
+    }
+    for (int i = 0; i < options.groups; i++)
+    {
+        fprintf(file, "group lg%d\n", i);
+    }
+    fclose(file);
+    return 0;
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -u users       simulated users (default %d)\n"
+            "  -g groups      groups the users are spread over (default: one per %d users)\n"
+            "  -t threads     worker threads (default %d)\n"
+            "  -d seconds     measured duration (default %.0f)\n"
+            "  -r rate        messages per second per user (default %.1f)\n"
+            "  -s bytes       message size (default %d, at most %d)\n"
+            "  -l rate        list_files per second per user (default %.2f)\n"
+            "  -f rate        file uploads and downloads per second (default %.1f, 0 to disable)\n"
+            "  -F bytes       uploaded file size (default %d)\n"
+            "  -p ports       comma-separated server ports on localhost (default 8080,8081)\n"
+            "  -j             print the summary as a JSON line\n"
+            "  -w file        write the server data file of the scenario and exit\n",
+            program, options.users, LOADGEN_GROUP_SIZE, options.threads, options.duration, options.message_rate,
+            options.message_size, MAX_MESSAGE_SIZE, options.list_rate, options.transfer_rate, options.file_size);
+}
+
+static int parse_ports(char *list)
+{
+    options.server_count = 0;
+    for (char *port = strtok(list, ","); port != NULL; port = strtok(NULL, ","))
+    {
+        if (options.server_count == LOADGEN_MAX_SERVERS)
+        {
+            return -1;
+        }
+        options.ports[options.server_count++] = atoi(port);
+    }
+    return options.server_count > 0 ? 0 : -1;
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *data_file = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "u:g:t:d:r:s:l:f:F:p:jw:h")) != -1)
+    {
+        switch (option)
+        {
+        case 'u': options.users = atoi(optarg); break;
+        case 'g': options.groups = atoi(optarg); break;
+        case 't': options.threads = atoi(optarg); break;
+        case 'd': options.duration = atof(optarg); break;
+        case 'r': options.message_rate = atof(optarg); break;
+        case 's': options.message_size = atoi(optarg); break;
+        case 'l': options.list_rate = atof(optarg); break;
+        case 'f': options.transfer_rate = atof(optarg); break;
+        case 'F': options.file_size = atoi(optarg); break;
+        case 'j': options.json = 1; break;
+        case 'w': data_file = optarg; break;
+        case 'p':
+            if (parse_ports(optarg) < 0)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (options.groups <= 0)
+    {
+        options.groups = (options.users + LOADGEN_GROUP_SIZE - 1) / LOADGEN_GROUP_SIZE;
+    }
+    if (options.users <= 0 || options.threads <= 0 || options.duration <= 0 || options.groups > LOADGEN_MAX_GROUPS ||
+        options.message_size < 0 || options.message_size > MAX_MESSAGE_SIZE || options.file_size <= 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (data_file != NULL)
+    {
+        return write_data_file(data_file) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    raise_fd_limit();
+
+    struct user *users = calloc(options.users, sizeof(struct user));
+    struct worker *workers = calloc(options.threads, sizeof(struct worker));
+    if (users == NULL || workers == NULL)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    for (int t = 0; t < options.threads; t++)
+    {
+        struct worker *worker = &workers[t];
+        worker->epoll_fd = epoll_create1(0);
+        worker->users = calloc(options.users / options.threads + 1, sizeof(struct user *));
+        worker->heap = calloc(options.users / options.threads + 1, sizeof(struct user *));
+        worker->random = 0x9e3779b97f4a7c15ULL * (t + 1);
+        histogram_init(&worker->stats.message_latency);
+        histogram_init(&worker->stats.login_latency);
+        histogram_init(&worker->stats.join_latency);
+        histogram_init(&worker->stats.list_latency);
+    }
+    for (int i = 0; i < options.users; i++)
+    {
+        struct user *user = &users[i];
+        user->index = i;
+        user->fd = -1;
+        user->server = i % options.server_count;
+        user->group = i % options.groups;
+        snprintf(user->name, sizeof(user->name), "lgu%d", i);
+
+        struct worker *worker = &workers[i % options.threads];
+        worker->users[worker->user_count++] = user;
+    }
+
+    uint64_t start = now_ns();
+    for (int t = 0; t < options.threads; t++)
+    {
+        pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]);
+    }
+    pthread_t transfer_thread;
+    if (options.transfer_rate > 0)
+    {
+        pthread_create(&transfer_thread, NULL, transfer_main, NULL);
+    }
+
+    // Wait for every user to be logged in and in its group before measuring
+    while (__atomic_load_n(&settled_users, __ATOMIC_ACQUIRE) < options.users && now_ns() - start < SETUP_TIMEOUT_NS)
+    {
+        sleep_ns(NS_PER_SEC / 100);
+    }
+    fprintf(stderr, "loadgen: %d/%d users set up in %.2f s\n", __atomic_load_n(&settled_users, __ATOMIC_RELAXED),
+            options.users, (now_ns() - start) / 1e9);
+
+    __atomic_store_n(&phase, PHASE_RUN, __ATOMIC_RELEASE);
+    uint64_t run_start = now_ns();
+    uint64_t run_end = run_start + (uint64_t)(options.duration * NS_PER_SEC);
+    uint64_t last_sent = 0, last_delivered = 0;
+
+    for (int second = 1; now_ns() < run_end; second++)
+    {
+        uint64_t tick = run_start + second * NS_PER_SEC;
+        uint64_t now = now_ns();
+        if (tick > run_end)
+        {
+            tick = run_end;
+        }
+        if (tick > now)
+        {
+            sleep_ns(tick - now);
+        }
+
+        uint64_t sent = 0, delivered = 0;
+        for (int t = 0; t < options.threads; t++)
+        {
+            sent += STAT_GET(&workers[t].stats, messages_sent);
+            delivered += STAT_GET(&workers[t].stats, deliveries);
+        }
+        fprintf(stderr, "loadgen: %3ds %8llu msg/s %9llu deliveries/s\n", second,
+                (unsigned long long)(sent - last_sent), (unsigned long long)(delivered - last_delivered));
+        last_sent = sent;
+        last_delivered = delivered;
+    }
+    double elapsed = (now_ns() - run_start) / 1e9;
+
+    __atomic_store_n(&phase, PHASE_DRAIN, __ATOMIC_RELEASE);
+    sleep_ns(DRAIN_NS);
+    __atomic_store_n(&phase, PHASE_STOP, __ATOMIC_RELEASE);
+
+    struct loadgen_stats total = {0};
+    histogram_init(&total.message_latency);
+    histogram_init(&total.login_latency);
+    histogram_init(&total.join_latency);
+    histogram_init(&total.list_latency);
+    for (int t = 0; t < options.threads; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        merge_stats(&total, &workers[t].stats);
+    }
+    if (options.transfer_rate > 0)
+    {
+        pthread_join(transfer_thread, NULL);
+    }
+
+    print_report(&total, elapsed);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Cuts the link between the two servers under load and measures how long it takes to heal.
+#
+# Both servers are started as in run_loadgen.sh, with a short heartbeat, and the load
+# generator runs against them. After WARMUP seconds server2 is frozen with SIGSTOP for
+# OUTAGE seconds: server sees the link go silent, drops it after the heartbeat timeout
+# and dials again with backoff. Once server2 resumes, the script waits for server to log
+# the link as restored, which happens after the commands server2 missed are replayed,
+# and prints the time it took. Arguments are passed on to loadgen.exe and default to
+# "-u 200 -d 12"; WARMUP, OUTAGE, HEARTBEAT_MS and TIMEOUT_MS can be set in the environment.
+
+cd "$(dirname "$0")" || exit 1
+RUN=run
+WARMUP=${WARMUP:-3}
+OUTAGE=${OUTAGE:-3}
+HEARTBEAT_MS=${HEARTBEAT_MS:-200}
+TIMEOUT_MS=${TIMEOUT_MS:-1000}
+[ $# -eq 0 ] && set -- -u 200 -d 12
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+restored() { grep -c "Link to node 2 restored" $RUN/server/server.log; }
+
+rm -rf $RUN
+mkdir -p $RUN/server/drive $RUN/server2/drive
+./loadgen.exe -w $RUN/server/data.txt "$@" || exit 1
+cp $RUN/server/data.txt $RUN/server2/data.txt
+cp ../region1/server/server.exe ../region1/server/server.conf $RUN/server/
+cp ../region2/server2/server2.exe ../region2/server2/server.conf $RUN/server2/
+for conf in $RUN/server/server.conf $RUN/server2/server.conf; do
+    printf 'peer_heartbeat_ms %s\npeer_timeout_ms %s\n' "$HEARTBEAT_MS" "$TIMEOUT_MS" >> $conf
+done
+
+(cd $RUN/server2 && exec ./server2.exe > server2.log 2>&1) &
+SERVER2=$!
+sleep 0.5
+(cd $RUN/server && exec ./server.exe > server.log 2>&1) &
+SERVER1=$!
+trap 'kill -CONT $SERVER2 2>/dev/null; kill $SERVER1 $SERVER2 2>/dev/null' EXIT INT TERM
+sleep 0.5
+
+./loadgen.exe "$@" &
+LOADGEN=$!
+
+sleep "$WARMUP"
+BEFORE=$(restored)
+echo "link_failure: freezing server2 for ${OUTAGE}s (heartbeat ${HEARTBEAT_MS} ms, timeout ${TIMEOUT_MS} ms)"
+kill -STOP $SERVER2
+sleep "$OUTAGE"
+kill -CONT $SERVER2
+RESUMED=$(now_ms)
+
+while [ "$(restored)" -le "$BEFORE" ]; do
+    if [ $(($(now_ms) - RESUMED)) -gt 30000 ]; then
+        echo "link_failure: link not restored 30 s after server2 resumed"
+        wait $LOADGEN
+        exit 1
+    fi
+    sleep 0.01
+done
+echo "link_failure: link restored $(($(now_ms) - RESUMED)) ms after server2 resumed"
+grep "Link to node 2 restored" $RUN/server/server.log | tail -n 1
+
+wait $LOADGEN
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs the load generator against both servers on localhost.
+#
+# The servers are started from a scratch copy under loadgen/run/ with a data file
+# holding the users and groups of the scenario, so the region directories are left
+# untouched. Arguments are passed on to loadgen.exe (see loadgen.exe -h).
+
+cd "$(dirname "$0")" || exit 1
+RUN=run
+
+rm -rf $RUN
+mkdir -p $RUN/server/drive $RUN/server2/drive
+./loadgen.exe -w $RUN/server/data.txt "$@" || exit 1
+cp $RUN/server/data.txt $RUN/server2/data.txt
+cp ../region1/server/server.exe ../region1/server/server.conf $RUN/server/
+cp ../region2/server2/server2.exe ../region2/server2/server.conf $RUN/server2/
+
+(cd $RUN/server2 && exec ./server2.exe > server2.log 2>&1) &
+SERVER2=$!
+sleep 0.5
+(cd $RUN/server && exec ./server.exe > server.log 2>&1) &
+SERVER1=$!
+trap 'kill $SERVER1 $SERVER2 2>/dev/null' EXIT INT TERM
+sleep 0.5
+
+./loadgen.exe "$@"
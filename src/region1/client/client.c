@@ -27,6 +27,8 @@ int main(int argc, char *argv[])
     const char *server_ip = SERVER_IP;
     int server_port = PORT;
 
+    client_configure(argc, argv, server_ip, server_port);
+
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1)
     {
@@ -51,6 +53,7 @@ int main(int argc, char *argv[])
         close(sockfd);
         exit(EXIT_FAILURE);
     }
+    negotiate_max_frame(sockfd);
 
     char command[BUFFER_SIZE];
 
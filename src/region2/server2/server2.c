@@ -39,28 +39,45 @@
 #include <sys/stat.h>
 #include "database.h"
 #include "server_utils.h"
+#include "connection.h"
+#include "pool.h"
+#include "config.h"
+#include "peer.h"
 
-#define PORT 8081
+#define PORT 8081 /**< Client port unless the configuration sets one */
 
 
 /**
  * @brief Main entry point for the server application.
  *
  * Initializes the server, sets up socket connections, and handles incoming client requests
- * using a polling mechanism. The server also communicates with a secondary server to manage
- * load balancing and synchronization.
+ * using a polling mechanism. The links to the other servers of the cluster, listed in the
+ * configuration file, are maintained by the event loop.
  *
+ * @param argc The number of arguments.
+ * @param argv The arguments: an optional configuration file, CONFIG_FILE by default.
  * @return int Returns 0 on successful execution, or exits with an error code.
  */
-int main()
+int main(int argc, char *argv[])
 {
 
     parse_file("data.txt");
+    config_load(argc > 1 ? argv[1] : CONFIG_FILE);
+
+    // A server dialing its peers without a secret would be refused by all of them
+    if (peer_count > 0 && peer_secret[0] == '\0')
+    {
+        fprintf(stderr, "peer_secret is not set, generate one with `openssl rand -hex 16` and set it on every server\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Warm the pools up so that serving clients does not allocate
+    pool_reserve(sizeof(struct connection), MAX_CLIENTS);
+    pool_reserve(BUFFER_SIZE, 256);
     print_data();
 
-    int server_fd, new_socket;
+    int server_fd;
     struct sockaddr_in address;
-    int addrlen = sizeof(address);
 
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
@@ -68,9 +85,13 @@ int main()
         exit(EXIT_FAILURE);
     }
 
+    // Allow restarting while connections of the previous run are in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    address.sin_port = htons(server_config.port > 0 ? server_config.port : PORT);
 
     if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
     {
@@ -79,69 +100,14 @@ int main()
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) < 0)
+    if (listen(server_fd, SOMAXCONN) < 0)
     {
         perror("listen");
         close(server_fd);
         exit(EXIT_FAILURE);
     }
 
-    struct pollfd fds[MAX_CLIENTS];
-    int nfds = 1;
-
-    fds[0].fd = server_fd;
-    fds[0].events = POLLIN;
-
-    for (int i = 1; i < MAX_CLIENTS; i++)
-    {
-        fds[i].fd = -1;
-    }
-
-    while (1)
-    {
-        int activity = poll(fds, nfds, -1);
-
-        if (activity < 0)
-        {
-            perror("poll error");
-            break;
-        }
-
-        if (fds[0].revents & POLLIN)
-        {
-            if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
-            {
-                perror("accept");
-                continue;
-            }
-
-            printf("New connection, socket fd is %d, ip is : %s, port : %d\n",
-                   new_socket, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-
-            for (int i = 1; i < MAX_CLIENTS; i++)
-            {
-                if (fds[i].fd == -1)
-                {
-                    fds[i].fd = new_socket;
-                    fds[i].events = POLLIN;
-                    if (i >= nfds)
-                    {
-                        nfds = i + 1;
-                    }
-                    break;
-                }
-            }
-        }
-
-        for (int i = 1; i < nfds; i++)
-        {
-            if (fds[i].fd != -1 && fds[i].revents & POLLIN)
-            {
-                handle_client(fds[i].fd);
-                print_data();
-            }
-        }
-    }
+    server_loop(server_fd);
 
     close(server_fd);
 
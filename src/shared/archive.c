@@ -0,0 +1,953 @@
+/**
+ * @file archive.c
+ * @brief Message archives of the groups, their indexing thread and the search.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "config.h"
+#include "database.h"
+#include "pool.h"
+#include "metrics.h"
+#include "log.h"
+
+#define ARCHIVE_PATH_SIZE 128             /**< Room for `archive/<group>.log` */
+#define ARCHIVE_WRITE_SIZE (64 * 1024)    /**< Bytes of records written to a file at once */
+#define ARCHIVE_LOAD_SIZE (1024 * 1024)   /**< Bytes read at once when indexing a file again */
+#define ARCHIVE_RECORD_HEADER 4           /**< Length before each line of a file */
+#define ARCHIVE_FIRST_SLOTS 1024          /**< Slots of the term table of a new archive, a power of two */
+#define ARCHIVE_WINDOW_SIZE (16 * 1024)   /**< Bytes of records read at once by a search */
+
+/**
+ * @struct posting_block
+ * @brief Skip entry of a block of a posting list.
+ */
+struct posting_block
+{
+    uint64_t first; /**< Number of the first message of the block, not stored in `data` */
+    size_t offset;  /**< Where the deltas of the block start in `data` */
+};
+
+/**
+ * @struct posting_list
+ * @brief Numbers of the messages of a group holding a term, in increasing order.
+ */
+struct posting_list
+{
+    char term[ARCHIVE_TERM_SIZE];
+    uint64_t hash;
+    uint64_t last;  /**< Number of the last message added */
+    uint64_t count; /**< Messages in the list */
+    uint8_t *data;  /**< Deltas from the previous number, 7 bits per byte, low bits first */
+    size_t length;
+    size_t capacity;
+    struct posting_block *blocks;
+    size_t block_count;
+    size_t block_capacity;
+};
+
+/**
+ * @struct archive
+ * @brief Archive of one group: its file and its index.
+ */
+struct archive
+{
+    char group[50];
+    int fd;                     /**< The file, open for appending */
+    uint64_t messages;          /**< Messages in the file, which is the number of the last one */
+    uint64_t size;              /**< Bytes of complete records in the file */
+    uint64_t *offsets;          /**< Offset of messages 1, 1 + ARCHIVE_OFFSET_STRIDE, ... */
+    size_t offset_capacity;
+    struct posting_list *lists; /**< One per term */
+    size_t list_count;
+    size_t list_capacity;
+    uint32_t *slots;            /**< Index + 1 of the list hashed to each slot, 0 if free */
+    size_t slot_count;
+};
+
+/**
+ * @struct archive_record
+ * @brief A line waiting in the queue, allocated from the pools.
+ */
+struct archive_record
+{
+    uint32_t group_length;
+    uint32_t line_length;
+    char data[]; /**< The group name, then the line */
+};
+
+static struct archive archives[MAX_GROUPS];
+static int archive_count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /**< Guards the published archives */
+
+// Single-producer, single-consumer ring: the event loop advances the head, the thread the tail
+static struct archive_record *queue[ARCHIVE_QUEUE_SIZE];
+static uint64_t queue_head = 0;
+static uint64_t queue_tail = 0;
+static int running = 0;
+
+static int is_term_byte(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+/**
+ * @brief Reads the next term of a text, lowercased and cut to ARCHIVE_TERM_SIZE - 1 bytes.
+ *
+ * @return The length of the term, 0 at the end of the text.
+ */
+static size_t next_term(const char **cursor, const char *end, char *term)
+{
+    const char *p = *cursor;
+    while (p < end && !is_term_byte(*p))
+    {
+        p++;
+    }
+    size_t length = 0;
+    while (p < end && is_term_byte(*p))
+    {
+        if (length < ARCHIVE_TERM_SIZE - 1)
+        {
+            term[length++] = *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p;
+        }
+        p++;
+    }
+    term[length] = '\0';
+    *cursor = p;
+    return length;
+}
+
+/**
+ * @brief Grows an array to hold at least `needed` items, doubling its capacity.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int reserve(void **items, size_t *capacity, size_t needed, size_t item_size, size_t first)
+{
+    if (needed <= *capacity)
+    {
+        return 0;
+    }
+    size_t grown = *capacity > 0 ? *capacity : first;
+    while (grown < needed)
+    {
+        grown *= 2;
+    }
+    void *resized = realloc(*items, grown * item_size);
+    if (resized == NULL)
+    {
+        return -1;
+    }
+    metrics_gauge_add(METRIC_ARCHIVE_INDEX_BYTES, (int64_t)((grown - *capacity) * item_size));
+    *items = resized;
+    *capacity = grown;
+    return 0;
+}
+
+/**
+ * @brief Doubles the term table of an archive and hashes its lists again.
+ */
+static int grow_slots(struct archive *archive)
+{
+    size_t slot_count = archive->slot_count > 0 ? archive->slot_count * 2 : ARCHIVE_FIRST_SLOTS;
+    uint32_t *slots = calloc(slot_count, sizeof(*slots));
+    if (slots == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < archive->list_count; i++)
+    {
+        uint64_t hash = archive->lists[i].hash;
+        size_t j = 0;
+        while (slots[(hash + j) & (slot_count - 1)] != 0)
+        {
+            j++;
+        }
+        slots[(hash + j) & (slot_count - 1)] = i + 1;
+    }
+    metrics_gauge_add(METRIC_ARCHIVE_INDEX_BYTES, (int64_t)((slot_count - archive->slot_count) * sizeof(*slots)));
+    free(archive->slots);
+    archive->slots = slots;
+    archive->slot_count = slot_count;
+    return 0;
+}
+
+/**
+ * @brief Finds the posting list of a term, creating it if asked to.
+ *
+ * @return The list, or NULL if the term has none (or memory ran out).
+ */
+static struct posting_list *find_list(struct archive *archive, const char *term, size_t length, int create)
+{
+    if (create && (archive->list_count + 1) * 2 > archive->slot_count && grow_slots(archive) < 0)
+    {
+        return NULL;
+    }
+    if (archive->slot_count == 0)
+    {
+        return NULL;
+    }
+
+    struct str_view view = {term, length};
+    uint64_t hash = view_hash(view);
+    for (size_t i = 0;; i++)
+    {
+        uint32_t *slot = &archive->slots[(hash + i) & (archive->slot_count - 1)];
+        if (*slot != 0 && strcmp(archive->lists[*slot - 1].term, term) == 0)
+        {
+            return &archive->lists[*slot - 1];
+        }
+        if (*slot != 0)
+        {
+            continue;
+        }
+        if (!create || reserve((void **)&archive->lists, &archive->list_capacity, archive->list_count + 1,
+                               sizeof(*archive->lists), 256) < 0)
+        {
+            return NULL;
+        }
+        struct posting_list *list = &archive->lists[archive->list_count++];
+        memset(list, 0, sizeof(*list));
+        memcpy(list->term, term, length + 1);
+        list->hash = hash;
+        *slot = archive->list_count;
+        return list;
+    }
+}
+
+/**
+ * @brief Adds the number of a message to a posting list, once per message.
+ */
+static void add_posting(struct posting_list *list, uint64_t number)
+{
+    if (list->count > 0 && list->last == number)
+    {
+        return;
+    }
+    if (list->count % ARCHIVE_BLOCK_POSTINGS == 0)
+    {
+        if (reserve((void **)&list->blocks, &list->block_capacity, list->block_count + 1, sizeof(*list->blocks), 1) < 0)
+        {
+            return;
+        }
+        list->blocks[list->block_count].first = number;
+        list->blocks[list->block_count].offset = list->length;
+        list->block_count++;
+    }
+    else
+    {
+        if (reserve((void **)&list->data, &list->capacity, list->length + 10, 1, 16) < 0)
+        {
+            return;
+        }
+        uint64_t delta = number - list->last;
+        while (delta >= 0x80)
+        {
+            list->data[list->length++] = (uint8_t)(delta | 0x80);
+            delta >>= 7;
+        }
+        list->data[list->length++] = (uint8_t)delta;
+    }
+    list->last = number;
+    list->count++;
+}
+
+/**
+ * @brief Decodes a block of a posting list.
+ *
+ * @return The number of message numbers written to `numbers`.
+ */
+static int decode_block(const struct posting_list *list, size_t block, uint64_t *numbers)
+{
+    size_t position = list->blocks[block].offset;
+    size_t end = block + 1 < list->block_count ? list->blocks[block + 1].offset : list->length;
+    uint64_t number = list->blocks[block].first;
+    int count = 0;
+    numbers[count++] = number;
+    while (position < end)
+    {
+        uint64_t delta = 0;
+        int shift = 0;
+        uint8_t byte;
+        do
+        {
+            byte = list->data[position++];
+            delta |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        number += delta;
+        numbers[count++] = number;
+    }
+    return count;
+}
+
+/**
+ * @brief Numbers the next message of an archive and indexes its terms.
+ *
+ * @param line The chat line of the message.
+ * @param length Its length.
+ */
+static void index_message(struct archive *archive, const char *line, size_t length)
+{
+    uint64_t number = ++archive->messages;
+    if ((number - 1) % ARCHIVE_OFFSET_STRIDE == 0)
+    {
+        size_t index = (number - 1) / ARCHIVE_OFFSET_STRIDE;
+        if (reserve((void **)&archive->offsets, &archive->offset_capacity, index + 1, sizeof(*archive->offsets), 64) == 0)
+        {
+            archive->offsets[index] = archive->size;
+        }
+    }
+    archive->size += ARCHIVE_RECORD_HEADER + length;
+
+    const char *cursor = line;
+    const char *end = line + length;
+    char term[ARCHIVE_TERM_SIZE];
+    size_t term_length;
+    while ((term_length = next_term(&cursor, end, term)) > 0)
+    {
+        struct posting_list *list = find_list(archive, term, term_length, 1);
+        if (list != NULL)
+        {
+            add_posting(list, number);
+        }
+    }
+}
+
+/**
+ * @brief Writes the path of the file of a group.
+ *
+ * @return The path, or NULL if the group name cannot be used as a file name.
+ */
+static const char *make_path(char *path, const char *group)
+{
+    if (group[0] == '.' || group[0] == '\0' || strchr(group, '/') != NULL)
+    {
+        return NULL;
+    }
+    snprintf(path, ARCHIVE_PATH_SIZE, "%s/%s.log", ARCHIVE_DIR, group);
+    return path;
+}
+
+/**
+ * @brief Indexes the records of the file of an archive not yet published.
+ *
+ * A record cut by a crash is removed, so the next ones are appended after the last whole one.
+ */
+static void load(struct archive *archive)
+{
+    size_t capacity = ARCHIVE_LOAD_SIZE;
+    char *buffer = malloc(capacity);
+    size_t buffered = 0;
+    uint64_t offset = 0;
+    ssize_t count;
+    while (buffer != NULL && (count = pread(archive->fd, buffer + buffered, capacity - buffered, offset)) > 0)
+    {
+        offset += count;
+        buffered += count;
+
+        size_t position = 0;
+        uint32_t length = 0;
+        while (buffered - position >= ARCHIVE_RECORD_HEADER)
+        {
+            memcpy(&length, buffer + position, sizeof(length));
+            if (buffered - position - ARCHIVE_RECORD_HEADER < length)
+            {
+                break;
+            }
+            index_message(archive, buffer + position + ARCHIVE_RECORD_HEADER, length);
+            position += ARCHIVE_RECORD_HEADER + length;
+        }
+        memmove(buffer, buffer + position, buffered - position);
+        buffered -= position;
+
+        // A record larger than the buffer
+        if (buffered == capacity)
+        {
+            char *grown = realloc(buffer, ARCHIVE_RECORD_HEADER + (size_t)length);
+            if (grown == NULL)
+            {
+                break;
+            }
+            buffer = grown;
+            capacity = ARCHIVE_RECORD_HEADER + (size_t)length;
+        }
+    }
+    free(buffer);
+
+    struct stat file_stat;
+    if (fstat(archive->fd, &file_stat) == 0 && (uint64_t)file_stat.st_size > archive->size)
+    {
+        log_warn("Archive of %s ends with an incomplete message, removed", archive->group);
+        if (ftruncate(archive->fd, archive->size) < 0)
+        {
+            log_errno("ftruncate");
+        }
+    }
+}
+
+/**
+ * @brief Finds the archive of a group among the published ones.
+ */
+static struct archive *find_archive(struct str_view group)
+{
+    for (int i = 0; i < archive_count; i++)
+    {
+        if (view_equals(group, archives[i].group))
+        {
+            return &archives[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the archive of a group, opening and indexing its file if needed.
+ *
+ * Called by the indexing thread only, the one adding archives.
+ */
+static struct archive *get_archive(struct str_view group)
+{
+    pthread_mutex_lock(&lock);
+    struct archive *archive = find_archive(group);
+    pthread_mutex_unlock(&lock);
+    if (archive != NULL)
+    {
+        return archive;
+    }
+
+    char path[ARCHIVE_PATH_SIZE];
+    archive = &archives[archive_count];
+    if (archive_count == MAX_GROUPS || group.len >= sizeof(archive->group))
+    {
+        return NULL;
+    }
+    memset(archive, 0, sizeof(*archive));
+    view_copy(archive->group, sizeof(archive->group), group);
+    if (make_path(path, archive->group) == NULL)
+    {
+        return NULL;
+    }
+    if (mkdir(ARCHIVE_DIR, 0777) < 0 && errno != EEXIST)
+    {
+        log_errno(ARCHIVE_DIR);
+        return NULL;
+    }
+    archive->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (archive->fd < 0)
+    {
+        log_errno(path);
+        return NULL;
+    }
+
+    // Searches only see the archive once its file is indexed
+    uint64_t start = metrics_now_ns();
+    load(archive);
+    if (archive->messages > 0)
+    {
+        log_info("Indexed %llu archived messages of %s in %llu ms", (unsigned long long)archive->messages,
+                 archive->group, (unsigned long long)((metrics_now_ns() - start) / 1000000));
+    }
+    pthread_mutex_lock(&lock);
+    archive_count++;
+    pthread_mutex_unlock(&lock);
+    return archive;
+}
+
+static int count_records(const char *data, size_t length)
+{
+    int count = 0;
+    for (size_t position = 0; position < length; count++)
+    {
+        uint32_t line_length;
+        memcpy(&line_length, data + position, sizeof(line_length));
+        position += ARCHIVE_RECORD_HEADER + line_length;
+    }
+    return count;
+}
+
+/**
+ * @brief Appends records to the file of an archive, then indexes them.
+ *
+ * @param data Records, each a 4-byte length followed by the line.
+ * @param length Bytes of the records.
+ */
+static void append(struct archive *archive, const char *data, size_t length)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t count = write(archive->fd, data + written, length - written);
+        if (count < 0)
+        {
+            log_errno(archive->group);
+            // A partly written record would shift every later one
+            if (ftruncate(archive->fd, archive->size) < 0)
+            {
+                log_errno("ftruncate");
+            }
+            metrics_add(METRIC_ARCHIVE_DROPPED, count_records(data, length));
+            return;
+        }
+        written += count;
+    }
+
+    // One message at a time, so that a search waits for one message to be indexed at most
+    int indexed = 0;
+    for (size_t position = 0; position < length; indexed++)
+    {
+        uint32_t line_length;
+        memcpy(&line_length, data + position, sizeof(line_length));
+        pthread_mutex_lock(&lock);
+        index_message(archive, data + position + ARCHIVE_RECORD_HEADER, line_length);
+        pthread_mutex_unlock(&lock);
+        position += ARCHIVE_RECORD_HEADER + line_length;
+    }
+    metrics_add(METRIC_ARCHIVE_MESSAGES, indexed);
+}
+
+/**
+ * @brief Archives the queued lines, writing those of the same group together.
+ *
+ * @return The number of lines taken from the queue.
+ */
+static int drain(char *buffer)
+{
+    uint64_t head = __atomic_load_n(&queue_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = queue_tail;
+    struct archive *pending = NULL;
+    size_t buffered = 0;
+    int taken = 0;
+
+    for (; tail != head; tail++, taken++)
+    {
+        struct archive_record *record = queue[tail & (ARCHIVE_QUEUE_SIZE - 1)];
+        struct str_view group = {record->data, record->group_length};
+        size_t size = ARCHIVE_RECORD_HEADER + record->line_length;
+
+        if (pending != NULL && (!view_equals(group, pending->group) || buffered + size > ARCHIVE_WRITE_SIZE))
+        {
+            append(pending, buffer, buffered);
+            pending = NULL;
+            buffered = 0;
+        }
+        struct archive *archive = pending != NULL ? pending : get_archive(group);
+        if (archive == NULL)
+        {
+            metrics_add(METRIC_ARCHIVE_DROPPED, 1);
+        }
+        else if (size > ARCHIVE_WRITE_SIZE)
+        {
+            // A line too long for the buffer is written on its own
+            char *large = malloc(size);
+            if (large != NULL)
+            {
+                memcpy(large, &record->line_length, ARCHIVE_RECORD_HEADER);
+                memcpy(large + ARCHIVE_RECORD_HEADER, record->data + record->group_length, record->line_length);
+                append(archive, large, size);
+                free(large);
+            }
+        }
+        else
+        {
+            memcpy(buffer + buffered, &record->line_length, ARCHIVE_RECORD_HEADER);
+            memcpy(buffer + buffered + ARCHIVE_RECORD_HEADER, record->data + record->group_length, record->line_length);
+            buffered += size;
+            pending = archive;
+        }
+        pool_free(record);
+    }
+    if (pending != NULL)
+    {
+        append(pending, buffer, buffered);
+    }
+    __atomic_store_n(&queue_tail, tail, __ATOMIC_RELEASE);
+    return taken;
+}
+
+/**
+ * @brief Indexes the archives left by an earlier run.
+ */
+static void load_all(void)
+{
+    DIR *dir = opendir(ARCHIVE_DIR);
+    if (dir == NULL)
+    {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        if (entry->d_name[0] != '.' && length > 4 && strcmp(entry->d_name + length - 4, ".log") == 0)
+        {
+            struct str_view group = {entry->d_name, length - 4};
+            get_archive(group);
+        }
+    }
+    closedir(dir);
+}
+
+static void *archive_main(void *arg)
+{
+    (void)arg;
+    char *buffer = malloc(ARCHIVE_WRITE_SIZE);
+    if (buffer == NULL)
+    {
+        log_error("Out of memory for the message archive");
+        return NULL;
+    }
+    load_all();
+
+    struct timespec pause = {0, ARCHIVE_IDLE_MS * 1000000L};
+    while (1)
+    {
+        if (drain(buffer) == 0)
+        {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the indexing thread, which first indexes the archives left by an earlier run.
+ */
+void archive_start(void)
+{
+    pthread_t thread;
+    if (running || !server_config.message_archive)
+    {
+        return;
+    }
+    if (pthread_create(&thread, NULL, archive_main, NULL) != 0)
+    {
+        log_error("Cannot start the message archive thread");
+        return;
+    }
+    pthread_detach(thread);
+    running = 1;
+}
+
+/**
+ * @brief Queues a delivered chat line for the archive of its group.
+ */
+void archive_post(struct str_view group, const struct iovec *parts, int count)
+{
+    uint64_t head = queue_head;
+    if (!running)
+    {
+        return;
+    }
+    size_t line_length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        line_length += parts[i].iov_len;
+    }
+    struct archive_record *record;
+    if (head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) == ARCHIVE_QUEUE_SIZE ||
+        (record = pool_alloc(sizeof(*record) + group.len + line_length)) == NULL)
+    {
+        metrics_add(METRIC_ARCHIVE_DROPPED, 1);
+        return;
+    }
+
+    record->group_length = group.len;
+    record->line_length = line_length;
+    memcpy(record->data, group.ptr, group.len);
+    char *line = record->data + group.len;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(line, parts[i].iov_base, parts[i].iov_len);
+        line += parts[i].iov_len;
+    }
+    queue[head & (ARCHIVE_QUEUE_SIZE - 1)] = record;
+    __atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Waits until every queued line has been archived and indexed.
+ */
+void archive_sync(void)
+{
+    struct timespec pause = {0, 1000000L};
+    while (running && __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) != queue_head)
+    {
+        nanosleep(&pause, NULL);
+    }
+}
+
+/**
+ * @struct cursor
+ * @brief The block of a posting list decoded last during a search.
+ */
+struct cursor
+{
+    const struct posting_list *list;
+    size_t block;
+    int count; /**< Numbers in `numbers`, 0 before the first block is decoded */
+    uint64_t numbers[ARCHIVE_BLOCK_POSTINGS];
+};
+
+/**
+ * @brief Checks whether a posting list holds a message, decoding the block that would.
+ */
+static int cursor_contains(struct cursor *cursor, uint64_t number)
+{
+    const struct posting_list *list = cursor->list;
+    if (number < list->blocks[0].first || number > list->last)
+    {
+        return 0;
+    }
+    // The numbers tried go down, so the block decoded last is usually the right one
+    size_t block = cursor->block;
+    if (cursor->count == 0 || list->blocks[block].first > number ||
+        (block + 1 < list->block_count && list->blocks[block + 1].first <= number))
+    {
+        size_t low = 0;
+        size_t high = list->block_count;
+        while (high - low > 1)
+        {
+            size_t middle = low + (high - low) / 2;
+            if (list->blocks[middle].first <= number)
+                low = middle;
+            else
+                high = middle;
+        }
+        cursor->block = low;
+        cursor->count = decode_block(list, low, cursor->numbers);
+    }
+
+    int low = 0;
+    int high = cursor->count - 1;
+    while (low <= high)
+    {
+        int middle = (low + high) / 2;
+        if (cursor->numbers[middle] == number)
+            return 1;
+        if (cursor->numbers[middle] < number)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    return 0;
+}
+
+/**
+ * @struct hit
+ * @brief A message found by a search, and where its stride of records lies in the file.
+ *
+ * Taken under the lock, so that the file is read without it.
+ */
+struct hit
+{
+    uint64_t number; /**< Number of the message */
+    uint64_t offset; /**< Offset of the first record of its stride */
+    uint64_t end;    /**< Offset past the last record of its stride written when it was found */
+};
+
+/**
+ * @struct window
+ * @brief Records of an archive file read during a search, one stride of messages at most.
+ */
+struct window
+{
+    char data[ARCHIVE_WINDOW_SIZE];
+    uint64_t start;  /**< Offset in the file of `data` */
+    size_t length;   /**< Bytes read into `data`, 0 if none */
+};
+
+/**
+ * @brief Reads the line of a message from the file of its archive.
+ *
+ * The records from the offset kept for its stride are read at once into the window,
+ * which the next messages found, usually close by, read from again.
+ *
+ * @return The length of the line, cut to `size`, or -1 on error.
+ */
+static ssize_t read_message(int fd, struct window *window, const struct hit *hit, char *line, size_t size)
+{
+    uint64_t offset = hit->offset;
+    uint64_t end = hit->end;
+    for (uint64_t skip = (hit->number - 1) % ARCHIVE_OFFSET_STRIDE;; skip--)
+    {
+        if (offset < window->start || offset + ARCHIVE_RECORD_HEADER > window->start + window->length)
+        {
+            size_t wanted = end - offset < ARCHIVE_WINDOW_SIZE ? end - offset : ARCHIVE_WINDOW_SIZE;
+            ssize_t count = pread(fd, window->data, wanted, offset);
+            if (count < ARCHIVE_RECORD_HEADER)
+            {
+                window->length = 0;
+                return -1;
+            }
+            window->start = offset;
+            window->length = count;
+        }
+        const char *record = window->data + (offset - window->start);
+        uint32_t length;
+        memcpy(&length, record, sizeof(length));
+        if (skip == 0)
+        {
+            size_t wanted = length < size ? length : size;
+            if (offset + ARCHIVE_RECORD_HEADER + wanted <= window->start + window->length)
+            {
+                memcpy(line, record + ARCHIVE_RECORD_HEADER, wanted);
+                return wanted;
+            }
+            return pread(fd, line, wanted, offset + ARCHIVE_RECORD_HEADER);
+        }
+        offset += ARCHIVE_RECORD_HEADER + length;
+    }
+}
+
+/**
+ * @brief Finds the numbers of the most recent messages holding every term of a query.
+ *
+ * @return The number of messages written to `found`, newest first, with only their numbers set.
+ */
+static int match(struct archive *archive, struct str_view query, struct hit *found, int limit)
+{
+    struct cursor cursors[ARCHIVE_QUERY_TERMS];
+    int term_count = 0;
+    const char *cursor = query.ptr;
+    const char *end = query.ptr + query.len;
+    char term[ARCHIVE_TERM_SIZE];
+    size_t term_length;
+    while (term_count < ARCHIVE_QUERY_TERMS && (term_length = next_term(&cursor, end, term)) > 0)
+    {
+        const struct posting_list *list = find_list(archive, term, term_length, 0);
+        if (list == NULL)
+        {
+            return 0;
+        }
+        int known = 0;
+        for (int i = 0; i < term_count; i++)
+        {
+            known |= cursors[i].list == list;
+        }
+        if (!known)
+        {
+            cursors[term_count].list = list;
+            cursors[term_count].count = 0;
+            term_count++;
+        }
+    }
+    if (term_count == 0)
+    {
+        return 0;
+    }
+
+    // The rarest term drives the walk; the others are probed
+    for (int i = 1; i < term_count; i++)
+    {
+        if (cursors[i].list->count < cursors[0].list->count)
+        {
+            const struct posting_list *rarest = cursors[i].list;
+            cursors[i].list = cursors[0].list;
+            cursors[0].list = rarest;
+        }
+    }
+
+    int count = 0;
+    struct cursor *driver = &cursors[0];
+    for (size_t block = driver->list->block_count; block-- > 0 && count < limit;)
+    {
+        driver->count = decode_block(driver->list, block, driver->numbers);
+        for (int i = driver->count - 1; i >= 0 && count < limit; i--)
+        {
+            int probed = 1;
+            while (probed < term_count && cursor_contains(&cursors[probed], driver->numbers[i]))
+            {
+                probed++;
+            }
+            if (probed == term_count)
+            {
+                found[count++].number = driver->numbers[i];
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Finds the most recent messages of a group holding every term of a query.
+ */
+size_t archive_search(struct str_view group, struct str_view query, char *out, size_t size)
+{
+    static const char none[] = "No messages found\n";
+    static const char header[] = "Search results:\n";
+    int limit = server_config.search_results;
+    struct hit *found = limit > 0 ? malloc(limit * sizeof(*found)) : NULL;
+    struct window *window = malloc(sizeof(*window));
+    if (found == NULL || window == NULL || size < sizeof(none))
+    {
+        free(found);
+        free(window);
+        return 0;
+    }
+    window->start = 0;
+    window->length = 0;
+
+    // Only the index is walked under the lock; the lines are read from the file after it
+    pthread_mutex_lock(&lock);
+    struct archive *archive = find_archive(group);
+    int count = archive != NULL ? match(archive, query, found, limit) : 0;
+    int fd = archive != NULL ? archive->fd : -1;
+    for (int i = 0; i < count; i++)
+    {
+        size_t stride = (found[i].number - 1) / ARCHIVE_OFFSET_STRIDE;
+        found[i].offset = archive->offsets[stride];
+        found[i].end = (stride + 1) * ARCHIVE_OFFSET_STRIDE < archive->messages ? archive->offsets[stride + 1]
+                                                                                : archive->size;
+    }
+    pthread_mutex_unlock(&lock);
+
+    size_t length = 0;
+    if (count > 0 && size > sizeof(header))
+    {
+        memcpy(out, header, sizeof(header) - 1);
+        length = sizeof(header) - 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        // `#<number> ` then the line, which must end before the buffer does
+        char *start = out + length;
+        int prefix = snprintf(start, size - length, "#%llu ", (unsigned long long)found[i].number);
+        if (prefix < 0 || length + prefix + 2 > size)
+        {
+            break;
+        }
+        ssize_t read = read_message(fd, window, &found[i], start + prefix, size - length - prefix - 1);
+        if (read < 0)
+        {
+            continue;
+        }
+        for (ssize_t j = 0; j < read; j++)
+        {
+            if (start[prefix + j] == '\n')
+            {
+                start[prefix + j] = ' ';
+            }
+        }
+        length += prefix + read;
+        out[length++] = '\n';
+    }
+    free(found);
+    free(window);
+
+    if (length == 0)
+    {
+        memcpy(out, none, sizeof(none) - 1);
+        length = sizeof(none) - 1;
+    }
+    return length;
+}
@@ -0,0 +1,80 @@
+/**
+ * @file archive.h
+ * @brief Archive of the chat messages of each group and its full-text index.
+ *
+ * The owner of a group keeps every message posted to it, wherever it was posted, in
+ * `archive/<group>.log` in its working directory: one record per message, a 4-byte
+ * length followed by the chat line `<user>: <message>`. A message is numbered by its
+ * position in the file, from 1.
+ *
+ * The event loop only copies a message into a queue once it has been delivered; a
+ * background thread appends it to the file and adds it to an inverted index kept in
+ * memory, so archiving never delays the delivery. Each term of a group (a run of
+ * letters and digits, lowercased, or of non-ASCII UTF-8) maps to the numbers of the
+ * messages holding it, as deltas in variable-length bytes. The list is cut into blocks
+ * of ARCHIVE_BLOCK_POSTINGS numbers, each with a skip entry giving its first number
+ * and where it starts, so a query
+ *
+ *     search <group> <term> [<term> ...]
+ *
+ * walks the rarest of its terms from the newest message back, and checks the other
+ * terms by a binary search of their skip entries, decoding one block of each. It
+ * answers the most recent messages holding every term, at most `search_results`, in
+ * the time of a few blocks whatever the size of the archive. The files are indexed
+ * again by the thread when the server starts.
+ *
+ * The index is shared by the event loop and the thread under one lock, held by the
+ * thread only while it adds the postings of one message, and by a search only while
+ * it walks the posting lists; the lines found are read from the file after it.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "command.h"
+
+#define ARCHIVE_DIR "archive"        /**< Directory of the archives of the groups */
+#define ARCHIVE_BLOCK_POSTINGS 128   /**< Numbers of messages per block of a posting list */
+#define ARCHIVE_OFFSET_STRIDE 64     /**< Messages between two file offsets kept in memory */
+#define ARCHIVE_QUEUE_SIZE 65536     /**< Messages waiting for the indexing thread, a power of two */
+#define ARCHIVE_IDLE_MS 5            /**< Pause of the indexing thread when the queue is empty */
+#define ARCHIVE_TERM_SIZE 32         /**< Room for a term; longer words are cut */
+#define ARCHIVE_QUERY_TERMS 8        /**< Most terms of a query */
+
+/**
+ * @brief Starts the indexing thread, which first indexes the archives left by an earlier run.
+ */
+void archive_start(void);
+
+/**
+ * @brief Queues a delivered chat line for the archive of its group.
+ *
+ * The line is dropped, and counted, if the queue is full or the thread is not running.
+ *
+ * @param group The group.
+ * @param parts The pieces of the line `<user>: <message>`.
+ * @param count The number of pieces.
+ */
+void archive_post(struct str_view group, const struct iovec *parts, int count);
+
+/**
+ * @brief Waits until every queued line has been archived and indexed.
+ */
+void archive_sync(void);
+
+/**
+ * @brief Finds the most recent messages of a group holding every term of a query.
+ *
+ * @param group The group.
+ * @param query The terms, separated by spaces or punctuation.
+ * @param out Receives the answer: `Search results:` then `#<number> <user>: <message>`
+ *            per message, newest first, or `No messages found`.
+ * @param size The size of `out`.
+ * @return The length of the answer.
+ */
+size_t archive_search(struct str_view group, struct str_view query, char *out, size_t size);
+
+#endif // ARCHIVE_H
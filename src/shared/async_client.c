@@ -0,0 +1,588 @@
+/**
+ * @file async_client.c
+ * @brief I/O thread, request table and futures of the pipelined client library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "async_client.h"
+#include "socket_utils.h"
+
+#define ASYNC_READ_SIZE 65536 /**< Bytes read from the socket at once */
+#define ASYNC_TAG_SIZE 24     /**< Room for `@<id> ` */
+#define ASYNC_NEGOTIATE_MS 5000 /**< Longest wait for the answer to `max_frame` */
+
+/**
+ * @struct async_request
+ * @brief A request in flight, in the slot of its id.
+ */
+struct async_request
+{
+    uint64_t id; /**< 0 if the slot is free */
+    async_reply_fn on_reply;
+    void *arg;
+};
+
+/**
+ * @struct async_buffer
+ * @brief Growable byte buffer.
+ */
+struct async_buffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+struct async_client
+{
+    int fd;
+    int wake[2];        /**< Pipe waking the I/O thread up when requests are queued or on close */
+    pthread_t thread;
+    async_event_fn on_event;
+    void *event_arg;
+
+    pthread_mutex_t lock; /**< Protects the fields below */
+    pthread_cond_t changed; /**< Signalled when a request completes or the connection is lost */
+    struct async_buffer queued; /**< Frames waiting for the I/O thread */
+    struct async_request requests[ASYNC_CLIENT_MAX_PENDING];
+    uint64_t next_id;
+    int in_flight;
+    size_t max_frame; /**< Largest frame the server accepts from the client */
+    int closed;   /**< The connection is lost, no more requests are accepted */
+    int stopping; /**< async_client_close() was called */
+};
+
+struct async_future
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int done;
+    int refs; /**< The caller and the pending request */
+    char *reply;
+    size_t length;
+};
+
+static int buffer_reserve(struct async_buffer *buffer, size_t extra)
+{
+    if (buffer->length + extra <= buffer->capacity)
+    {
+        return 0;
+    }
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->length + extra)
+    {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL)
+    {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Fails every request in flight, once the connection is lost or closed.
+ */
+static void fail_requests(struct async_client *client)
+{
+    struct async_request failed[ASYNC_CLIENT_MAX_PENDING];
+    int count = 0;
+
+    pthread_mutex_lock(&client->lock);
+    int was_closed = client->closed;
+    client->closed = 1;
+    for (int i = 0; i < ASYNC_CLIENT_MAX_PENDING; i++)
+    {
+        if (client->requests[i].id != 0)
+        {
+            failed[count++] = client->requests[i];
+            client->requests[i].id = 0;
+        }
+    }
+    client->in_flight = 0;
+    pthread_cond_broadcast(&client->changed);
+    pthread_mutex_unlock(&client->lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (failed[i].on_reply != NULL)
+        {
+            failed[i].on_reply(failed[i].arg, NULL, 0);
+        }
+    }
+    if (!was_closed && client->on_event != NULL)
+    {
+        client->on_event(client->event_arg, NULL, 0);
+    }
+}
+
+/**
+ * @brief Hands a frame to the callback of its request, or to the event callback.
+ */
+static void deliver(struct async_client *client, char *frame, size_t length)
+{
+    // `@<id> <answer>` completes a request; anything else is pushed by the server
+    size_t i = 1;
+    uint64_t id = 0;
+    if (length > 1 && frame[0] == '@')
+    {
+        while (i < length && frame[i] >= '0' && frame[i] <= '9')
+        {
+            id = id * 10 + (frame[i++] - '0');
+        }
+    }
+    if (id == 0 || (i < length && frame[i] != ' '))
+    {
+        if (client->on_event == NULL)
+        {
+            return;
+        }
+        size_t header = sizeof(FRAME_BATCH_HEADER) - 1;
+        if (length < header || memcmp(frame, FRAME_BATCH_HEADER, header) != 0)
+        {
+            client->on_event(client->event_arg, frame, length);
+            return;
+        }
+        // Each line of a batch is an event of its own, terminated like a frame
+        const char *cursor = frame + header;
+        const char *line;
+        size_t line_length;
+        while ((line = batch_next_line(&cursor, frame + length, &line_length)) != NULL)
+        {
+            char *line_end = (char *)line + line_length;
+            char saved = *line_end;
+            *line_end = '\0';
+            client->on_event(client->event_arg, line, line_length);
+            *line_end = saved;
+        }
+        return;
+    }
+    if (i < length)
+    {
+        i++;
+    }
+
+    pthread_mutex_lock(&client->lock);
+    struct async_request *slot = &client->requests[id & (ASYNC_CLIENT_MAX_PENDING - 1)];
+    struct async_request request = *slot;
+    if (slot->id == id)
+    {
+        slot->id = 0;
+        client->in_flight--;
+        pthread_cond_broadcast(&client->changed);
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    if (request.id == id && request.on_reply != NULL)
+    {
+        request.on_reply(request.arg, frame + i, length - i);
+    }
+}
+
+/**
+ * @brief Splits the bytes read into frames and delivers the complete ones.
+ *
+ * @return 0, or -1 if the server sent a frame larger than FRAME_MAX_SIZE.
+ */
+static int deliver_frames(struct async_client *client, struct async_buffer *in)
+{
+    size_t offset = 0;
+    while (in->length - offset >= FRAME_HEADER_SIZE)
+    {
+        int32_t size;
+        memcpy(&size, in->data + offset, sizeof(size));
+        if (size < 0 || size > FRAME_MAX_SIZE)
+        {
+            return -1;
+        }
+        if (in->length - offset < FRAME_HEADER_SIZE + (size_t)size)
+        {
+            break;
+        }
+
+        // Answers are NUL-terminated for the callbacks, over the first byte of the next frame
+        char *frame = in->data + offset + FRAME_HEADER_SIZE;
+        char saved = frame[size];
+        frame[size] = '\0';
+        deliver(client, frame, size);
+        frame[size] = saved;
+        offset += FRAME_HEADER_SIZE + size;
+    }
+
+    memmove(in->data, in->data + offset, in->length - offset);
+    in->length -= offset;
+    return 0;
+}
+
+static void *io_main(void *arg)
+{
+    struct async_client *client = arg;
+    struct async_buffer in = {0};
+    struct async_buffer out = {0};
+    size_t written = 0;
+
+    while (1)
+    {
+        // Take the queued frames once the previous batch is written
+        pthread_mutex_lock(&client->lock);
+        int stopping = client->stopping;
+        if (written == out.length && client->queued.length > 0)
+        {
+            struct async_buffer swap = out;
+            out = client->queued;
+            client->queued = swap;
+            client->queued.length = 0;
+            written = 0;
+        }
+        pthread_mutex_unlock(&client->lock);
+        if (stopping)
+        {
+            break;
+        }
+
+        struct pollfd fds[2] = {
+            {.fd = client->fd, .events = POLLIN | (written < out.length ? POLLOUT : 0)},
+            {.fd = client->wake[0], .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(client->wake[0], drain, sizeof(drain)) == sizeof(drain))
+            {
+            }
+        }
+
+        if (fds[0].revents & POLLOUT)
+        {
+            ssize_t count = send(client->fd, out.data + written, out.length - written, MSG_NOSIGNAL);
+            if (count < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                break;
+            }
+            written += count > 0 ? count : 0;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            if (buffer_reserve(&in, ASYNC_READ_SIZE + 1) < 0)
+            {
+                break;
+            }
+            ssize_t count = recv(client->fd, in.data + in.length, ASYNC_READ_SIZE, 0);
+            if (count == 0 || (count < 0 && errno != EAGAIN && errno != EINTR))
+            {
+                break;
+            }
+            in.length += count > 0 ? count : 0;
+            if (deliver_frames(client, &in) < 0)
+            {
+                break;
+            }
+        }
+    }
+
+    free(in.data);
+    free(out.data);
+    fail_requests(client);
+    return NULL;
+}
+
+/**
+ * @brief Takes over a connected socket and starts the I/O thread.
+ */
+struct async_client *async_client_open(int fd, async_event_fn on_event, void *event_arg)
+{
+    struct async_client *client = calloc(1, sizeof(*client));
+    if (client == NULL)
+    {
+        return NULL;
+    }
+    if (pipe(client->wake) < 0)
+    {
+        free(client);
+        return NULL;
+    }
+    fcntl(client->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(client->wake[1], F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    client->fd = fd;
+    client->on_event = on_event;
+    client->event_arg = event_arg;
+    client->next_id = 1;
+    client->max_frame = FRAME_DEFAULT_MAX_SIZE;
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->changed, NULL);
+    if (pthread_create(&client->thread, NULL, io_main, client) != 0)
+    {
+        close(client->wake[0]);
+        close(client->wake[1]);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+/**
+ * @brief Connects to a server, starts the I/O thread and negotiates the frame size.
+ */
+struct async_client *async_client_connect(const char *host, int port, async_event_fn on_event, void *event_arg)
+{
+    char service[16];
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *address;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &address) != 0)
+    {
+        return NULL;
+    }
+
+    int fd = socket(address->ai_family, address->ai_socktype, 0);
+    if (fd < 0 || connect(fd, address->ai_addr, address->ai_addrlen) < 0)
+    {
+        freeaddrinfo(address);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    freeaddrinfo(address);
+
+    // Requests are batched by the I/O thread already
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    struct async_client *client = async_client_open(fd, on_event, event_arg);
+    if (client == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    // A server refusing keeps the default limit, which requests are still checked against
+    async_client_max_frame(client, FRAME_MAX_SIZE);
+    return client;
+}
+
+/**
+ * @brief Sends a request, its answer going to a callback.
+ */
+uint64_t async_client_send(struct async_client *client, const char *command, size_t length, async_reply_fn on_reply,
+                           void *arg)
+{
+    pthread_mutex_lock(&client->lock);
+    struct async_request *slot = &client->requests[client->next_id & (ASYNC_CLIENT_MAX_PENDING - 1)];
+    while (!client->closed && slot->id != 0)
+    {
+        pthread_cond_wait(&client->changed, &client->lock);
+    }
+
+    char tag[ASYNC_TAG_SIZE];
+    int tag_length = snprintf(tag, sizeof(tag), "@%llu ", (unsigned long long)client->next_id);
+    int32_t size = tag_length + length;
+    if (client->closed || length > client->max_frame - tag_length ||
+        buffer_reserve(&client->queued, FRAME_HEADER_SIZE + size) < 0)
+    {
+        pthread_mutex_unlock(&client->lock);
+        return 0;
+    }
+
+    uint64_t id = client->next_id++;
+    slot->id = id;
+    slot->on_reply = on_reply;
+    slot->arg = arg;
+    client->in_flight++;
+
+    // The I/O thread only needs waking up for the first frame of a batch
+    int wake = client->queued.length == 0;
+    char *p = client->queued.data + client->queued.length;
+    memcpy(p, &size, FRAME_HEADER_SIZE);
+    memcpy(p + FRAME_HEADER_SIZE, tag, tag_length);
+    memcpy(p + FRAME_HEADER_SIZE + tag_length, command, length);
+    client->queued.length += FRAME_HEADER_SIZE + size;
+    pthread_mutex_unlock(&client->lock);
+
+    if (wake)
+    {
+        (void)!write(client->wake[1], "", 1);
+    }
+    return id;
+}
+
+/**
+ * @brief Asks the server to accept frames of up to `size` bytes from this client.
+ */
+size_t async_client_max_frame(struct async_client *client, size_t size)
+{
+    char command[32];
+    int length = snprintf(command, sizeof(command), "max_frame %zu", size);
+    struct async_future *future = async_client_request(client, command, length);
+    if (future == NULL)
+    {
+        return 0;
+    }
+
+    // The answer is `max_frame <granted bytes>`
+    const char *reply = async_future_wait(future, ASYNC_NEGOTIATE_MS, NULL);
+    unsigned long long granted = 0;
+    if (reply != NULL && sscanf(reply, "max_frame %llu", &granted) == 1 && granted > 0)
+    {
+        pthread_mutex_lock(&client->lock);
+        client->max_frame = granted;
+        pthread_mutex_unlock(&client->lock);
+    }
+    async_future_free(future);
+    return granted;
+}
+
+static void future_release(struct async_future *future)
+{
+    pthread_mutex_lock(&future->lock);
+    int refs = --future->refs;
+    pthread_mutex_unlock(&future->lock);
+    if (refs == 0)
+    {
+        pthread_mutex_destroy(&future->lock);
+        pthread_cond_destroy(&future->done_cond);
+        free(future->reply);
+        free(future);
+    }
+}
+
+static void complete_future(void *arg, const char *reply, size_t length)
+{
+    struct async_future *future = arg;
+    pthread_mutex_lock(&future->lock);
+    if (reply != NULL && (future->reply = malloc(length + 1)) != NULL)
+    {
+        memcpy(future->reply, reply, length);
+        future->reply[length] = '\0';
+        future->length = length;
+    }
+    future->done = 1;
+    pthread_cond_broadcast(&future->done_cond);
+    pthread_mutex_unlock(&future->lock);
+    future_release(future);
+}
+
+/**
+ * @brief Sends a request, its answer going to a future.
+ */
+struct async_future *async_client_request(struct async_client *client, const char *command, size_t length)
+{
+    struct async_future *future = calloc(1, sizeof(*future));
+    if (future == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->done_cond, NULL);
+    future->refs = 2;
+    if (async_client_send(client, command, length, complete_future, future) == 0)
+    {
+        future->refs = 1;
+        future_release(future);
+        return NULL;
+    }
+    return future;
+}
+
+/**
+ * @brief Waits for the answer of a request.
+ */
+const char *async_future_wait(struct async_future *future, int timeout_ms, size_t *length)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&future->lock);
+    while (!future->done)
+    {
+        if (timeout_ms < 0)
+        {
+            pthread_cond_wait(&future->done_cond, &future->lock);
+        }
+        else if (pthread_cond_timedwait(&future->done_cond, &future->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    const char *reply = future->reply;
+    if (length != NULL)
+    {
+        *length = future->length;
+    }
+    pthread_mutex_unlock(&future->lock);
+    return reply;
+}
+
+/**
+ * @brief Releases a future, answered or not.
+ */
+void async_future_free(struct async_future *future)
+{
+    if (future != NULL)
+    {
+        future_release(future);
+    }
+}
+
+/**
+ * @brief Waits until every request sent so far is answered.
+ */
+void async_client_drain(struct async_client *client)
+{
+    pthread_mutex_lock(&client->lock);
+    while (!client->closed && client->in_flight > 0)
+    {
+        pthread_cond_wait(&client->changed, &client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+/**
+ * @brief Stops the I/O thread, fails the requests in flight and closes the socket.
+ */
+void async_client_close(struct async_client *client)
+{
+    pthread_mutex_lock(&client->lock);
+    client->stopping = 1;
+    pthread_mutex_unlock(&client->lock);
+    (void)!write(client->wake[1], "", 1);
+    pthread_join(client->thread, NULL);
+
+    close(client->fd);
+    close(client->wake[0]);
+    close(client->wake[1]);
+    pthread_mutex_destroy(&client->lock);
+    pthread_cond_destroy(&client->changed);
+    free(client->queued.data);
+    free(client);
+}
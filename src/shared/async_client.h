@@ -0,0 +1,129 @@
+/**
+ * @file async_client.h
+ * @brief Pipelined client library for bots and integrations.
+ *
+ * A background thread owns the socket: it writes the queued requests in batches and
+ * reads every frame the server sends. Each request is sent as `@<id> <command>`; the
+ * server answers it behind the same tag, and tagged requests without an answer of their
+ * own (a chat message, leaving a group) get an empty one, so every request completes.
+ * Frames without a tag are pushed events, chat lines from other members.
+ *
+ * Many requests can be in flight at once, up to ASYNC_CLIENT_MAX_PENDING, and their
+ * answers may come back out of order (membership changes are answered by the server
+ * owning the group). A request completes through a callback, run on the I/O thread,
+ * or through a future the caller waits on.
+ *
+ * async_client_connect() raises the frame size the server accepts from the client to
+ * FRAME_MAX_SIZE; until a larger size is granted, requests longer than
+ * FRAME_DEFAULT_MAX_SIZE are refused.
+ *
+ * File transfers use a raw handshake that cannot be pipelined and are not supported.
+ * The rate limits of the server (ratelimit_* in server.conf) apply as for any client.
+ */
+
+#ifndef ASYNC_CLIENT_H
+#define ASYNC_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASYNC_CLIENT_MAX_PENDING 4096 /**< Requests in flight per connection, a power of two */
+
+/**
+ * @brief Called with the answer of a request, or with NULL if the connection was lost.
+ *
+ * Runs on the I/O thread, and the answer is only valid during the call.
+ */
+typedef void (*async_reply_fn)(void *arg, const char *reply, size_t length);
+
+/**
+ * @brief Called with each pushed event, or with NULL once the connection is lost.
+ *
+ * Runs on the I/O thread, and the event is only valid during the call.
+ */
+typedef void (*async_event_fn)(void *arg, const char *event, size_t length);
+
+struct async_client;
+struct async_future;
+
+/**
+ * @brief Connects to a server, starts the I/O thread and negotiates the frame size.
+ *
+ * @param host The address of the server.
+ * @param port Its client port.
+ * @param on_event Called with the pushed events, may be NULL.
+ * @param event_arg Passed to `on_event`.
+ * @return The client, or NULL if the server cannot be reached.
+ */
+struct async_client *async_client_connect(const char *host, int port, async_event_fn on_event, void *event_arg);
+
+/**
+ * @brief Takes over a connected socket and starts the I/O thread.
+ *
+ * @param fd The socket, closed by async_client_close().
+ * @param on_event Called with the pushed events, may be NULL.
+ * @param event_arg Passed to `on_event`.
+ * @return The client, or NULL if it cannot be allocated.
+ */
+struct async_client *async_client_open(int fd, async_event_fn on_event, void *event_arg);
+
+/**
+ * @brief Asks the server to accept frames of up to `size` bytes from this client.
+ *
+ * Waits for the answer of the server.
+ *
+ * @param client The client.
+ * @param size The frame size wanted, in bytes.
+ * @return The size granted, or 0 if the server refused or the connection is lost.
+ */
+size_t async_client_max_frame(struct async_client *client, size_t size);
+
+/**
+ * @brief Sends a request, its answer going to a callback.
+ *
+ * Waits while ASYNC_CLIENT_MAX_PENDING requests are in flight.
+ *
+ * @param client The client.
+ * @param command The command, as typed in the interactive client.
+ * @param length Its length.
+ * @param on_reply Called with the answer, may be NULL.
+ * @param arg Passed to `on_reply`.
+ * @return The request id, or 0 if the connection is lost or the request is longer than
+ *         the frames the server accepts.
+ */
+uint64_t async_client_send(struct async_client *client, const char *command, size_t length, async_reply_fn on_reply,
+                           void *arg);
+
+/**
+ * @brief Sends a request, its answer going to a future.
+ *
+ * @return The future, to be released with async_future_free(), or NULL if the connection is lost.
+ */
+struct async_future *async_client_request(struct async_client *client, const char *command, size_t length);
+
+/**
+ * @brief Waits for the answer of a request.
+ *
+ * @param future The future.
+ * @param timeout_ms The longest wait, negative to wait forever.
+ * @param length Receives the length of the answer, may be NULL.
+ * @return The answer, NUL-terminated and owned by the future, or NULL on timeout or if the connection was lost.
+ */
+const char *async_future_wait(struct async_future *future, int timeout_ms, size_t *length);
+
+/**
+ * @brief Releases a future, answered or not.
+ */
+void async_future_free(struct async_future *future);
+
+/**
+ * @brief Waits until every request sent so far is answered.
+ */
+void async_client_drain(struct async_client *client);
+
+/**
+ * @brief Stops the I/O thread, fails the requests in flight and closes the socket.
+ */
+void async_client_close(struct async_client *client);
+
+#endif // ASYNC_CLIENT_H
@@ -0,0 +1,164 @@
+/**
+ * @file checksum.c
+ * @brief Implementation of the XXH64 file checksum.
+ */
+
+#include <string.h>
+#include "checksum.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t round64(uint64_t lane, uint64_t input)
+{
+    lane += input * PRIME2;
+    lane = rotate_left(lane, 31);
+    return lane * PRIME1;
+}
+
+static inline uint64_t merge_lane(uint64_t hash, uint64_t lane)
+{
+    hash ^= round64(0, lane);
+    return hash * PRIME1 + PRIME4;
+}
+
+/**
+ * @brief Starts a checksum.
+ */
+void checksum_init(struct checksum *checksum)
+{
+    memset(checksum, 0, sizeof(*checksum));
+    checksum->lanes[0] = PRIME1 + PRIME2;
+    checksum->lanes[1] = PRIME2;
+    checksum->lanes[2] = 0;
+    checksum->lanes[3] = -PRIME1;
+}
+
+/**
+ * @brief Feeds bytes to a checksum.
+ *
+ * Whole 32-byte stripes are consumed straight from the input; only the bytes around them
+ * go through the tail buffer.
+ */
+void checksum_update(struct checksum *checksum, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + length;
+    checksum->total += length;
+
+    if (checksum->tail_length + length < sizeof(checksum->tail))
+    {
+        memcpy(checksum->tail + checksum->tail_length, p, length);
+        checksum->tail_length += length;
+        return;
+    }
+
+    uint64_t *lanes = checksum->lanes;
+    if (checksum->tail_length > 0)
+    {
+        size_t fill = sizeof(checksum->tail) - checksum->tail_length;
+        memcpy(checksum->tail + checksum->tail_length, p, fill);
+        p += fill;
+        for (int i = 0; i < 4; i++)
+        {
+            lanes[i] = round64(lanes[i], read64(checksum->tail + 8 * i));
+        }
+        checksum->tail_length = 0;
+    }
+
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+    while (end - p >= 32)
+    {
+        v1 = round64(v1, read64(p));
+        v2 = round64(v2, read64(p + 8));
+        v3 = round64(v3, read64(p + 16));
+        v4 = round64(v4, read64(p + 24));
+        p += 32;
+    }
+    lanes[0] = v1, lanes[1] = v2, lanes[2] = v3, lanes[3] = v4;
+
+    checksum->tail_length = end - p;
+    memcpy(checksum->tail, p, checksum->tail_length);
+}
+
+/**
+ * @brief Returns the checksum of the bytes fed so far; more can be fed afterwards.
+ */
+uint64_t checksum_final(const struct checksum *checksum)
+{
+    const uint64_t *lanes = checksum->lanes;
+    uint64_t hash;
+    if (checksum->total >= 32)
+    {
+        hash = rotate_left(lanes[0], 1) + rotate_left(lanes[1], 7) + rotate_left(lanes[2], 12) +
+               rotate_left(lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+        {
+            hash = merge_lane(hash, lanes[i]);
+        }
+    }
+    else
+    {
+        hash = PRIME5;
+    }
+    hash += checksum->total;
+
+    const unsigned char *p = checksum->tail;
+    const unsigned char *end = p + checksum->tail_length;
+    for (; end - p >= 8; p += 8)
+    {
+        hash ^= round64(0, read64(p));
+        hash = rotate_left(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (end - p >= 4)
+    {
+        hash ^= (uint64_t)read32(p) * PRIME1;
+        hash = rotate_left(hash, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        hash ^= *p * PRIME5;
+        hash = rotate_left(hash, 11) * PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * @brief Returns the checksum of a buffer.
+ */
+uint64_t checksum_of(const void *data, size_t length)
+{
+    struct checksum checksum;
+    checksum_init(&checksum);
+    checksum_update(&checksum, data, length);
+    return checksum_final(&checksum);
+}
@@ -0,0 +1,48 @@
+/**
+ * @file checksum.h
+ * @brief Streaming 64-bit checksum of file contents.
+ *
+ * The checksum is XXH64 with a seed of 0, so it can be checked with the xxhsum tool. It
+ * consumes 32 bytes per step, several gigabytes per second, and data can be fed in pieces
+ * of any size as it is read or received. It detects corruption, not tampering.
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @struct checksum
+ * @brief State of a checksum being computed.
+ */
+struct checksum
+{
+    uint64_t lanes[4];      /**< Accumulators of the four 8-byte lanes of a stripe */
+    uint64_t total;         /**< Number of bytes fed so far */
+    unsigned char tail[32]; /**< Bytes fed that do not yet fill a stripe */
+    size_t tail_length;     /**< Number of bytes in `tail` */
+};
+
+/**
+ * @brief Starts a checksum.
+ */
+void checksum_init(struct checksum *checksum);
+
+/**
+ * @brief Feeds bytes to a checksum.
+ */
+void checksum_update(struct checksum *checksum, const void *data, size_t length);
+
+/**
+ * @brief Returns the checksum of the bytes fed so far; more can be fed afterwards.
+ */
+uint64_t checksum_final(const struct checksum *checksum);
+
+/**
+ * @brief Returns the checksum of a buffer.
+ */
+uint64_t checksum_of(const void *data, size_t length);
+
+#endif // CHECKSUM_H
@@ -5,6 +5,9 @@
  * Detailed description of the file's purpose and contents.
  */
 
+#define _GNU_SOURCE // splice() and F_SETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -15,8 +18,15 @@
 #include <libgen.h>
 #include <poll.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include "client_utils.h"
 #include "socket_utils.h"
+#include "pool.h"
+#include "command.h"
+#include "metrics.h"
+#include "checksum.h"
 
 #define BUFFER_SIZE 8192
 
@@ -24,6 +34,90 @@ char current_user[50] = ""; /**< Currently logged-in user's name */
 int is_in_group = 0;        /**< Flag indicating if the user is in a group */
 char group_name[50] = "";   /**< Name of the group the user is currently in */
 
+struct server_address download_servers[DOWNLOAD_MAX_SERVERS]; /**< Servers files are downloaded from */
+int download_server_count = 0;                                /**< Number of entries in download_servers */
+int download_connections = DOWNLOAD_CONNECTIONS;              /**< Connections a download is spread over */
+size_t max_frame_size = FRAME_DEFAULT_MAX_SIZE;               /**< Largest frame the server accepts from this client */
+
+/**
+ * @brief Prints a frame pushed by the server: a chat line, or the lines of a `batch` frame.
+ *
+ * @param frame The frame, NUL-terminated.
+ * @param length The length of the frame.
+ */
+static void print_pushed(const char *frame, size_t length)
+{
+    size_t header = sizeof(FRAME_BATCH_HEADER) - 1;
+    if (length >= header && memcmp(frame, FRAME_BATCH_HEADER, header) == 0)
+    {
+        // Chat lines sent together, such as the messages received while logged out
+        const char *cursor = frame + header;
+        const char *line;
+        size_t line_length;
+        while ((line = batch_next_line(&cursor, frame + length, &line_length)) != NULL)
+        {
+            printf("%.*s\n", (int)line_length, line);
+        }
+        return;
+    }
+    printf("%s\n", frame);
+}
+
+/**
+ * @brief Sends a request and waits for its answer, printing the chat lines pushed meanwhile.
+ *
+ * The request is tagged, so its answer cannot be taken for a pushed frame.
+ *
+ * @param sockfd The socket descriptor for the connection.
+ * @param command The command string to send.
+ * @param answer Receives the answer, without its tag, NUL-terminated.
+ * @param size The size of `answer`.
+ */
+static void request(int sockfd, const char *command, char *answer, size_t size)
+{
+    char tagged[BUFFER_SIZE + 4];
+    int length = snprintf(tagged, sizeof(tagged), "@1 %s", command);
+    send_message(sockfd, tagged, length, 0);
+
+    answer[0] = '\0';
+    char *frame;
+    size_t frame_length;
+    while ((frame = receive_frame(sockfd, FRAME_MAX_SIZE, &frame_length)) != NULL)
+    {
+        if (strncmp(frame, "@1 ", 3) == 0)
+        {
+            snprintf(answer, size, "%s", frame + 3);
+            pool_free(frame);
+            return;
+        }
+        print_pushed(frame, frame_length);
+        pool_free(frame);
+    }
+    printf("Server disconnected or error occurred.\n");
+}
+
+/**
+ * @brief Asks the server to accept frames of up to FRAME_MAX_SIZE from this client.
+ *
+ * Servers accept frames of FRAME_DEFAULT_MAX_SIZE until asked for more; the size granted
+ * bounds the chat lines the client sends.
+ *
+ * @param sockfd The socket descriptor for the connection.
+ */
+void negotiate_max_frame(int sockfd)
+{
+    char command[32];
+    char answer[64];
+    snprintf(command, sizeof(command), "max_frame %d", FRAME_MAX_SIZE);
+    request(sockfd, command, answer, sizeof(answer));
+
+    unsigned long granted;
+    if (sscanf(answer, "max_frame %lu", &granted) == 1)
+    {
+        max_frame_size = granted;
+    }
+}
+
 /**
  * @brief Send a command to the server and receive a response.
  *
@@ -32,11 +126,8 @@ char group_name[50] = "";   /**< Name of the group the user is currently in */
  */
 void send_command(int sockfd, char *command)
 {
-    send_message(sockfd, command, strlen(command), 0);
-
     char buffer[BUFFER_SIZE];
-
-    receive_message(sockfd, buffer, sizeof(buffer) - 1, 0);
+    request(sockfd, command, buffer, sizeof(buffer));
     printf("Server response: %s\n", buffer);
 }
 
@@ -48,11 +139,9 @@ void send_command(int sockfd, char *command)
  */
 void handle_login_command(int sockfd, char *command)
 {
-    send_message(sockfd, command, strlen(command), 0);
-
-    // Wait for server response
+    // Messages received while logged out arrive before the answer
     char buffer[BUFFER_SIZE];
-    receive_message(sockfd, buffer, sizeof(buffer) - 1, 0);
+    request(sockfd, command, buffer, sizeof(buffer));
     printf("Server response: %s\n", buffer);
     if (strncmp(buffer, "Login successful", 16) == 0)
     {
@@ -61,9 +150,238 @@ void handle_login_command(int sockfd, char *command)
     }
 }
 
+#define TRANSFER_CHUNK (1024 * 1024)        /**< Most bytes moved by one system call of a file transfer */
+#define PROGRESS_INTERVAL_NS 250000000ULL /**< Shortest time between two progress reports */
+
+/**
+ * @brief Progress of a file transfer, reported at most every PROGRESS_INTERVAL_NS.
+ */
+struct progress
+{
+    uint64_t total; /**< Size of the file */
+    uint64_t start; /**< When the transfer started */
+    uint64_t last;  /**< When progress was last reported */
+};
+
+static void progress_start(struct progress *progress, uint64_t total)
+{
+    progress->total = total;
+    progress->start = metrics_now_ns();
+    progress->last = progress->start;
+}
+
+/**
+ * @brief Reports the progress of a transfer, if the last report is old enough or it is complete.
+ *
+ * The report overwrites the previous one on the same line, and the complete one ends it.
+ */
+static void progress_update(struct progress *progress, uint64_t done)
+{
+    uint64_t now = metrics_now_ns();
+    if (done < progress->total && now - progress->last < PROGRESS_INTERVAL_NS)
+    {
+        return;
+    }
+    progress->last = now;
+
+    double seconds = (now - progress->start) / 1e9;
+    printf("\rProgress: %lu/%lu bytes (%.0f%%, %.1f MB/s)%s", done, progress->total,
+           progress->total ? 100.0 * done / progress->total : 100.0, seconds > 0 ? done / seconds / 1e6 : 0.0,
+           done == progress->total ? "\n" : "");
+    fflush(stdout);
+}
+
+/**
+ * @brief Sends a mapped file, for the systems where sendfile() cannot write to a socket.
+ *
+ * @return The number of bytes sent.
+ */
+static uint64_t send_mapped_file(int sockfd, int fd, uint64_t file_size, struct progress *progress)
+{
+    if (file_size == 0)
+    {
+        return 0;
+    }
+    char *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return 0;
+    }
+    madvise(data, file_size, MADV_SEQUENTIAL);
+
+    uint64_t total_bytes_sent = 0;
+    while (total_bytes_sent < file_size)
+    {
+        size_t chunk = file_size - total_bytes_sent < TRANSFER_CHUNK ? file_size - total_bytes_sent : TRANSFER_CHUNK;
+        ssize_t sent = send(sockfd, data + total_bytes_sent, chunk, 0);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            perror("send");
+            break;
+        }
+        total_bytes_sent += sent;
+        progress_update(progress, total_bytes_sent);
+    }
+    munmap(data, file_size);
+    return total_bytes_sent;
+}
+
+/**
+ * @brief Sends the contents of a file with sendfile(), so they never pass through the client.
+ *
+ * @return The number of bytes sent.
+ */
+static uint64_t send_file_data(int sockfd, int fd, uint64_t file_size, struct progress *progress)
+{
+    off_t offset = 0;
+    while ((uint64_t)offset < file_size)
+    {
+        size_t chunk = file_size - offset < TRANSFER_CHUNK ? file_size - offset : TRANSFER_CHUNK;
+        ssize_t sent = sendfile(sockfd, fd, &offset, chunk);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent < 0 && offset == 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            return send_mapped_file(sockfd, fd, file_size, progress);
+        }
+        if (sent <= 0)
+        {
+            perror("sendfile");
+            break;
+        }
+        progress_update(progress, offset);
+    }
+    return offset;
+}
+
+/**
+ * @brief Receives file data into a large buffer, for the systems where splice() cannot read a socket.
+ *
+ * @return The number of bytes received.
+ */
+static uint64_t receive_buffered(int sockfd, int fd, uint64_t file_size, struct progress *progress)
+{
+    uint64_t received = 0;
+    char *buffer = malloc(TRANSFER_CHUNK);
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        return received;
+    }
+    while (received < file_size)
+    {
+        size_t chunk = file_size - received < TRANSFER_CHUNK ? file_size - received : TRANSFER_CHUNK;
+        ssize_t bytes_received = recv(sockfd, buffer, chunk, 0);
+        if (bytes_received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_received <= 0)
+        {
+            perror("recv (file data)");
+            break;
+        }
+        ssize_t written = 0;
+        while (written < bytes_received)
+        {
+            ssize_t count = write(fd, buffer + written, bytes_received - written);
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (count <= 0)
+            {
+                break;
+            }
+            written += count;
+        }
+        if (written < bytes_received)
+        {
+            perror("write");
+            break;
+        }
+        received += bytes_received;
+        progress_update(progress, received);
+    }
+    free(buffer);
+    return received;
+}
+
+/**
+ * @brief Receives the contents of a file, moved from the socket to the file through a pipe with splice().
+ *
+ * @return The number of bytes received.
+ */
+static uint64_t receive_file_data(int sockfd, int fd, uint64_t file_size, struct progress *progress)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds) < 0)
+    {
+        return receive_buffered(sockfd, fd, file_size, progress);
+    }
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, TRANSFER_CHUNK); // Best effort, larger than pipe-max-size is refused
+
+    uint64_t received = 0;
+    while (received < file_size)
+    {
+        size_t chunk = file_size - received < TRANSFER_CHUNK ? file_size - received : TRANSFER_CHUNK;
+        ssize_t in = splice(sockfd, NULL, pipe_fds[1], NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (in < 0 && received == 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            return receive_buffered(sockfd, fd, file_size, progress);
+        }
+        if (in <= 0)
+        {
+            perror("splice (file data)");
+            break;
+        }
+
+        ssize_t left = in;
+        while (left > 0)
+        {
+            ssize_t out = splice(pipe_fds[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (out <= 0)
+            {
+                break;
+            }
+            left -= out;
+        }
+        if (left > 0)
+        {
+            perror("splice (file write)");
+            break;
+        }
+        received += in;
+        progress_update(progress, received);
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return received;
+}
+
 /**
  * @brief Upload a file to the server under a specific group.
  *
+ * The file is sent with sendfile(), or from a memory mapping where that is not supported,
+ * so its contents are never copied through the client.
+ *
  * @param sockfd The socket descriptor for the connection.
  * @param group_name The name of the group to upload the file to.
  * @param file_path The path to the file to upload.
@@ -72,10 +390,17 @@ void upload_file(int sockfd, char *group_name, char *file_path)
 {
 
     printf("uploading file to server ...\n");
-    FILE *file = fopen(file_path, "rb");
-    if (file == NULL)
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("open");
+        return;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
     {
-        perror("fopen");
+        printf("%s is not a regular file\n", file_path);
+        close(fd);
         return;
     }
 
@@ -95,31 +420,29 @@ void upload_file(int sockfd, char *group_name, char *file_path)
         if (strncmp(server_ready, "SERVER_READY", 12) != 0)
         {
             printf("Server is not ready for file upload. Aborting upload.\n");
-            fclose(file);
+            close(fd);
             return;
         }
     }
     else if (nbytes == 0)
     {
         printf("Server closed the connection\n");
-        fclose(file);
+        close(fd);
         exit(EXIT_FAILURE);
     }
     else
     {
         perror("recv");
-        fclose(file);
+        close(fd);
         return;
     }
 
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    uint64_t file_size = file_stat.st_size;
 
     if (send(sockfd, &file_size, sizeof(file_size), 0) == -1)
     {
         perror("send");
-        fclose(file);
+        close(fd);
         return;
     }
 
@@ -131,48 +454,493 @@ void upload_file(int sockfd, char *group_name, char *file_path)
         if (strncmp(size_ok, "SIZE_OK", 7) != 0)
         {
             printf("Server did not acknowledge file size. Aborting upload.\n");
-            fclose(file);
+            close(fd);
             return;
         }
     }
     else if (nbytes == 0)
     {
         printf("Server closed the connection\n");
-        fclose(file);
+        close(fd);
         exit(EXIT_FAILURE);
     }
     else
     {
         perror("recv");
-        fclose(file);
+        close(fd);
         return;
     }
 
     printf("Uploading file %s to group %s...\n", file_name, group_name);
 
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    struct progress progress;
+    progress_start(&progress, file_size);
+    uint64_t total_bytes_sent = send_file_data(sockfd, fd, file_size, &progress);
+    close(fd);
+
+    if (total_bytes_sent == file_size)
+    {
+        printf("File uploaded successfully\n");
+    }
+    else
+    {
+        printf("\nFile upload incomplete. Sent %lu of %lu bytes.\n", total_bytes_sent, file_size);
+    }
+}
+
+/**
+ * @brief Reads the download options of the command line.
+ *
+ * `-j <connections>` sets the number of connections a download is spread over (1 keeps
+ * the single-stream download) and each `-m <host>:<port>` adds a mirror, another server
+ * holding copies of the files, that ranges are also fetched from.
+ *
+ * @param argc The number of arguments.
+ * @param argv The arguments.
+ * @param server_ip The address of the server the client is connected to.
+ * @param server_port Its port.
+ */
+void client_configure(int argc, char *argv[], const char *server_ip, int server_port)
+{
+    snprintf(download_servers[0].host, sizeof(download_servers[0].host), "%s", server_ip);
+    download_servers[0].port = server_port;
+    download_server_count = 1;
+
+    for (int i = 1; i + 1 < argc; i += 2)
     {
-        if (send(sockfd, buffer, bytes_read, 0) == -1)
+        if (strcmp(argv[i], "-j") == 0)
+        {
+            download_connections = atoi(argv[i + 1]);
+            if (download_connections < 1 || download_connections > DOWNLOAD_MAX_CONNECTIONS)
+            {
+                printf("-j: between 1 and %d connections, using %d\n", DOWNLOAD_MAX_CONNECTIONS, DOWNLOAD_CONNECTIONS);
+                download_connections = DOWNLOAD_CONNECTIONS;
+            }
+        }
+        else if (strcmp(argv[i], "-m") == 0 && download_server_count < DOWNLOAD_MAX_SERVERS)
+        {
+            struct server_address *mirror = &download_servers[download_server_count];
+            char *colon = strrchr(argv[i + 1], ':');
+            if (colon == NULL || colon - argv[i + 1] >= (int)sizeof(mirror->host))
+            {
+                printf("-m: expected <host>:<port>, got %s\n", argv[i + 1]);
+                continue;
+            }
+            memcpy(mirror->host, argv[i + 1], colon - argv[i + 1]);
+            mirror->host[colon - argv[i + 1]] = '\0';
+            mirror->port = atoi(colon + 1);
+            download_server_count++;
+        }
+        else
+        {
+            printf("Ignoring option %s\n", argv[i]);
+        }
+    }
+}
+
+/**
+ * @brief Opens a connection to a server.
+ *
+ * @return The socket, or -1 if the server cannot be reached.
+ */
+static int connect_to_server(const struct server_address *server)
+{
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(server->port);
+    if (inet_pton(AF_INET, server->host, &server_addr.sin_addr) <= 0)
+    {
+        return -1;
+    }
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0)
+    {
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+enum range_state
+{
+    RANGE_PENDING = 0, /**< Waiting for a connection to fetch it */
+    RANGE_ACTIVE,      /**< Being fetched */
+    RANGE_DONE         /**< Written and verified */
+};
+
+/**
+ * @struct range_download
+ * @brief A file being downloaded as DOWNLOAD_RANGE_SIZE ranges over several connections.
+ */
+struct range_download
+{
+    const char *group_name;     /**< Group of the file */
+    const char *file_name;      /**< Name of the file */
+    int fd;                     /**< The file being written */
+    uint64_t file_size;         /**< Size of the file */
+    uint32_t range_count;       /**< Number of ranges of the file */
+    unsigned char *state;       /**< range_state of each range */
+    unsigned char *attempts;    /**< Times each range was tried */
+    uint32_t ranges_done;       /**< Number of ranges written and verified */
+    uint32_t ranges_failed;     /**< Number of ranges given up after DOWNLOAD_RANGE_ATTEMPTS */
+    uint64_t bytes_done;        /**< Bytes written so far, for the progress report */
+    struct progress progress;   /**< Progress of the whole file */
+    pthread_mutex_t lock;       /**< Protects everything below `range_count` */
+    pthread_cond_t changed;     /**< Signalled when a range is done or given back */
+};
+
+/**
+ * @struct range_worker
+ * @brief A connection fetching ranges of a download, on its own thread.
+ */
+struct range_worker
+{
+    struct range_download *download; /**< The download */
+    const struct server_address *server; /**< The server the connection goes to */
+    int sockfd;                      /**< The connection, or -1 until the worker opens it */
+    pthread_t thread;                /**< The thread running the worker */
+};
+
+/**
+ * @brief Takes the next range to fetch, waiting while the ranges left are being fetched elsewhere.
+ *
+ * @return The index of the range, or -1 once there is nothing left to fetch.
+ */
+static int take_range(struct range_download *download)
+{
+    pthread_mutex_lock(&download->lock);
+    int index = -1;
+    while (download->ranges_done + download->ranges_failed < download->range_count)
+    {
+        int active = 0;
+        for (uint32_t i = 0; i < download->range_count && index < 0; i++)
+        {
+            if (download->state[i] == RANGE_PENDING)
+            {
+                index = i;
+            }
+            active |= download->state[i] == RANGE_ACTIVE;
+        }
+        if (index >= 0)
+        {
+            download->state[index] = RANGE_ACTIVE;
+            download->attempts[index]++;
+            break;
+        }
+        if (!active)
         {
-            perror("send");
             break;
         }
+        // A range in flight may yet fail and come back
+        pthread_cond_wait(&download->changed, &download->lock);
     }
+    pthread_mutex_unlock(&download->lock);
+    return index;
+}
 
-    if (ferror(file))
+/**
+ * @brief Records the outcome of a range: done, or given back to be fetched again.
+ */
+static void finish_range(struct range_download *download, int index, int done)
+{
+    pthread_mutex_lock(&download->lock);
+    if (done)
+    {
+        download->state[index] = RANGE_DONE;
+        download->ranges_done++;
+    }
+    else if (download->attempts[index] >= DOWNLOAD_RANGE_ATTEMPTS)
     {
-        perror("fread");
+        download->state[index] = RANGE_DONE;
+        download->ranges_failed++;
+        printf("\nRange %d of %s failed %d times, giving up\n", index, download->file_name, DOWNLOAD_RANGE_ATTEMPTS);
     }
+    else
+    {
+        download->state[index] = RANGE_PENDING;
+    }
+    pthread_cond_broadcast(&download->changed);
+    pthread_mutex_unlock(&download->lock);
+}
+
+/**
+ * @brief Asks a server for a range of a file and reads the header of its answer.
+ *
+ * @return 0 if the range follows, -1 if the server cannot send it.
+ */
+static int request_range(int sockfd, const struct server_address *server, const struct range_download *download,
+                         uint64_t offset, uint64_t length, uint64_t *file_size)
+{
+    char request[BUFFER_SIZE];
+    int request_length = snprintf(request, sizeof(request), "download_range %s %s %lu %lu", download->group_name,
+                                  download->file_name, offset, length);
+    send_message(sockfd, request, request_length, 0);
 
-    fclose(file);
-    printf("File uploaded successfully\n");
+    size_t header_length;
+    char *header = receive_frame(sockfd, BUFFER_SIZE, &header_length);
+    if (header == NULL)
+    {
+        printf("\n%s:%d closed the connection\n", server->host, server->port);
+        return -1;
+    }
+    unsigned long got_offset, got_length, got_size;
+    int parsed = sscanf(header, "RANGE %lu %lu %lu", &got_offset, &got_length, &got_size);
+    if (parsed != 3 || got_offset != offset || got_length != length)
+    {
+        printf("\n%s:%d: %s", server->host, server->port, header);
+        pool_free(header);
+        return -1;
+    }
+    pool_free(header);
+    *file_size = got_size;
+    return 0;
+}
+
+/**
+ * @brief Reads the trailer of a range and checks its data against the checksum it announces.
+ *
+ * @return 0 if the data matches, 1 if not, -1 if the connection failed.
+ */
+static int verify_range(int sockfd, const struct checksum *checksum)
+{
+    size_t trailer_length;
+    char *trailer = receive_frame(sockfd, BUFFER_SIZE, &trailer_length);
+    if (trailer == NULL)
+    {
+        return -1;
+    }
+    unsigned long long expected;
+    int parsed = sscanf(trailer, "RANGE_END %llx", &expected);
+    pool_free(trailer);
+    if (parsed != 1)
+    {
+        return -1;
+    }
+    return expected == checksum_final(checksum) ? 0 : 1;
+}
+
+/**
+ * @brief Fetches one range of a file and writes it in place.
+ *
+ * @return 0 if the range was written and verified, 1 if it failed verification, -1 if the
+ *         connection can no longer be used.
+ */
+static int fetch_range(struct range_worker *worker, int index, char *buffer)
+{
+    struct range_download *download = worker->download;
+    uint64_t offset = (uint64_t)index * DOWNLOAD_RANGE_SIZE;
+    uint64_t length = download->file_size - offset < DOWNLOAD_RANGE_SIZE ? download->file_size - offset
+                                                                         : DOWNLOAD_RANGE_SIZE;
+    uint64_t file_size;
+    if (request_range(worker->sockfd, worker->server, download, offset, length, &file_size) < 0)
+    {
+        return -1;
+    }
+    if (file_size != download->file_size)
+    {
+        printf("\n%s:%d has another version of %s\n", worker->server->host, worker->server->port,
+               download->file_name);
+        return -1;
+    }
+
+    struct checksum checksum;
+    checksum_init(&checksum);
+    uint64_t received = 0;
+    int status = 0;
+    while (received < length && status == 0)
+    {
+        size_t chunk = length - received < TRANSFER_CHUNK ? length - received : TRANSFER_CHUNK;
+        ssize_t bytes_received = recv(worker->sockfd, buffer, chunk, 0);
+        if (bytes_received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_received <= 0)
+        {
+            status = -1;
+            break;
+        }
+        checksum_update(&checksum, buffer, bytes_received);
+        for (ssize_t written = 0; written < bytes_received;)
+        {
+            ssize_t count = pwrite(download->fd, buffer + written, bytes_received - written, offset + received + written);
+            if (count <= 0)
+            {
+                perror("pwrite");
+                status = -1;
+                break;
+            }
+            written += count;
+        }
+        received += bytes_received;
+
+        pthread_mutex_lock(&download->lock);
+        download->bytes_done += bytes_received;
+        if (download->bytes_done < download->file_size)
+        {
+            progress_update(&download->progress, download->bytes_done);
+        }
+        pthread_mutex_unlock(&download->lock);
+    }
+
+    if (status == 0)
+    {
+        status = verify_range(worker->sockfd, &checksum);
+    }
+    if (status != 0)
+    {
+        // Whatever was counted for this range will be fetched again
+        pthread_mutex_lock(&download->lock);
+        download->bytes_done -= received;
+        pthread_mutex_unlock(&download->lock);
+    }
+    if (status > 0)
+    {
+        printf("\nRange %d from %s:%d failed verification\n", index, worker->server->host, worker->server->port);
+    }
+    return status;
+}
+
+/**
+ * @brief Fetches ranges over one connection until none is left or the connection fails.
+ */
+static void *range_worker_main(void *arg)
+{
+    struct range_worker *worker = arg;
+    if (worker->sockfd < 0)
+    {
+        worker->sockfd = connect_to_server(worker->server);
+    }
+    char *buffer = malloc(TRANSFER_CHUNK);
+
+    int index;
+    while (worker->sockfd >= 0 && buffer != NULL && (index = take_range(worker->download)) >= 0)
+    {
+        int status = fetch_range(worker, index, buffer);
+        finish_range(worker->download, index, status == 0);
+        if (status < 0)
+        {
+            break;
+        }
+    }
+
+    free(buffer);
+    if (worker->sockfd >= 0)
+    {
+        close(worker->sockfd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Downloads a file as ranges fetched in parallel, from the server and its mirrors.
+ *
+ * A first request for an empty range, to the first server that has the file, gives its
+ * size. The file is then split into DOWNLOAD_RANGE_SIZE ranges, shared out between up to
+ * `download_connections` connections opened to the servers in turn. Each range is checked
+ * against the checksum its server computed and written in place with pwrite(), and a
+ * range that fails is fetched again on another connection.
+ *
+ * @return 0 if the whole file was downloaded, -1 otherwise.
+ */
+static int download_ranges(const char *group_name, const char *file_name, int fd)
+{
+    struct range_download download;
+    memset(&download, 0, sizeof(download));
+    download.group_name = group_name;
+    download.file_name = file_name;
+    download.fd = fd;
+
+    // Find a server with the file and learn its size
+    int first = -1, probe_fd = -1;
+    for (int i = 0; i < download_server_count && first < 0; i++)
+    {
+        probe_fd = connect_to_server(&download_servers[i]);
+        if (probe_fd < 0)
+        {
+            continue;
+        }
+        struct checksum empty;
+        checksum_init(&empty);
+        if (request_range(probe_fd, &download_servers[i], &download, 0, 0, &download.file_size) == 0 &&
+            verify_range(probe_fd, &empty) == 0)
+        {
+            first = i;
+        }
+        else
+        {
+            close(probe_fd);
+        }
+    }
+    if (first < 0)
+    {
+        printf("No server could send %s\n", file_name);
+        return -1;
+    }
+
+    download.range_count = (download.file_size + DOWNLOAD_RANGE_SIZE - 1) / DOWNLOAD_RANGE_SIZE;
+    int worker_count = download.range_count < (uint32_t)download_connections ? (int)download.range_count
+                                                                           : download_connections;
+    printf("File size received: %lu, %u ranges over %d connections\n", download.file_size, download.range_count,
+           worker_count);
+    if (ftruncate(fd, download.file_size) < 0)
+    {
+        perror("ftruncate");
+        close(probe_fd);
+        return -1;
+    }
+
+    download.state = calloc(download.range_count + 1, 1);
+    download.attempts = calloc(download.range_count + 1, 1);
+    struct range_worker *workers = calloc(worker_count + 1, sizeof(*workers));
+    pthread_mutex_init(&download.lock, NULL);
+    pthread_cond_init(&download.changed, NULL);
+    progress_start(&download.progress, download.file_size);
+
+    // The first connection is the one that found the file, the others go to the servers in turn
+    for (int i = 0; i < worker_count; i++)
+    {
+        workers[i].download = &download;
+        workers[i].server = &download_servers[(first + i) % download_server_count];
+        workers[i].sockfd = i == 0 ? probe_fd : -1;
+        pthread_create(&workers[i].thread, NULL, range_worker_main, &workers[i]);
+    }
+    if (worker_count == 0)
+    {
+        close(probe_fd);
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    int complete = download.ranges_done == download.range_count;
+    if (complete)
+    {
+        progress_update(&download.progress, download.file_size);
+    }
+    pthread_cond_destroy(&download.changed);
+    pthread_mutex_destroy(&download.lock);
+    free(workers);
+    free(download.attempts);
+    free(download.state);
+    return complete ? 0 : -1;
 }
 
 /**
  * @brief Download a file from the server.
  *
+ * With several connections or mirrors configured, the file is fetched as verified
+ * ranges in parallel over new connections (see download_ranges()). Otherwise it is
+ * streamed over the connection of the session, moved from the socket to the file with
+ * splice(), or through a large buffer where that is not supported.
+ *
  * @param sockfd The socket descriptor for the connection.
  * @param group_name The name of the group from which to download the file.
  * @param file_name The name of the file to download.
@@ -181,6 +949,28 @@ void download_file(int sockfd, char *group_name, char *file_name)
 {
     printf("Downloading file %s from group %s...\n", file_name, group_name);
 
+    if (download_connections > 1 || download_server_count > 1)
+    {
+        char file_path[BUFFER_SIZE];
+        snprintf(file_path, sizeof(file_path), "./downloads/%s", file_name);
+        int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            perror("open");
+            return;
+        }
+        if (download_ranges(group_name, file_name, fd) == 0)
+        {
+            printf("File downloaded successfully: %s\n", file_name);
+        }
+        else
+        {
+            printf("File download incomplete: %s\n", file_name);
+        }
+        close(fd);
+        return;
+    }
+
     char download_command[BUFFER_SIZE];
     snprintf(download_command, sizeof(download_command), "download_file %s %s", group_name, file_name);
     send_message(sockfd, download_command, strlen(download_command), 0);
@@ -190,10 +980,10 @@ void download_file(int sockfd, char *group_name, char *file_name)
     snprintf(file_path, sizeof(file_path), "./downloads/%s", file_name);
 
     // Ouvrir le fichier pour écriture
-    FILE *file = fopen(file_path, "wb");
-    if (file == NULL)
+    int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
     {
-        perror("fopen");
+        perror("open");
         return;
     }
 
@@ -203,10 +993,10 @@ void download_file(int sockfd, char *group_name, char *file_name)
 
     // Receive the file size from the client
     uint64_t file_size;
-    if (recv(sockfd, &file_size, sizeof(file_size), 0) <= 0)
+    if (recv(sockfd, &file_size, sizeof(file_size), MSG_WAITALL) != sizeof(file_size))
     {
         perror("recv (file size)");
-        fclose(file);
+        close(fd);
         return;
     }
     printf("File size received: %lu\n", file_size);
@@ -214,28 +1004,9 @@ void download_file(int sockfd, char *group_name, char *file_name)
     // Notify the client that the file size is received and OK
     send(sockfd, "SIZE_OK", 7, 0);
 
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    uint64_t total_bytes_received = 0;
-    while (total_bytes_received < file_size)
-    {
-        bytes_received = recv(sockfd, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0)
-        {
-            perror("recv (file data)");
-            break;
-        }
-
-        size_t bytes_written = fwrite(buffer, 1, bytes_received, file);
-        if (bytes_written != bytes_received)
-        {
-            perror("fwrite");
-            break;
-        }
-
-        total_bytes_received += bytes_received;
-        printf("Progress: %ld/%ld bytes downloaded\n", total_bytes_received, file_size);
-    }
+    struct progress progress;
+    progress_start(&progress, file_size);
+    uint64_t total_bytes_received = receive_file_data(sockfd, fd, file_size, &progress);
 
     if (total_bytes_received == file_size)
     {
@@ -243,20 +1014,23 @@ void download_file(int sockfd, char *group_name, char *file_name)
     }
     else
     {
-        printf("File download incomplete. Received %ld of %ld bytes.\n", total_bytes_received, file_size);
+        printf("\nFile download incomplete. Received %lu of %lu bytes.\n", total_bytes_received, file_size);
     }
 
-    fclose(file);
+    close(fd);
 }
 
 /**
  * @brief Handle the group chat functionality, allowing message sending and file operations.
  *
  * @param sockfd The socket descriptor for the connection.
- * @param command The command string representing the user's action.
  */
-void handle_chat(int sockfd, char *command)
+void handle_chat(int sockfd)
 {
+    // Chat lines are read whole: they may be as long as the frames the server accepts
+    char *line = NULL;
+    size_t line_capacity = 0;
+
     printf("\n\n\nyou are now in : %s\n", group_name);
 
     printf("--------------------\nAvailable commands:\n");
@@ -264,6 +1038,7 @@ void handle_chat(int sockfd, char *command)
     printf("upload_file <file path> to upload a file to group\n");
     printf("download_file <file name> to download file from group\n");
     printf("list_files to list available files in group\n");
+    printf("search <words> to find past messages of the group\n");
     printf("--------------------\n");
 
     struct pollfd fds[2];
@@ -283,17 +1058,42 @@ void handle_chat(int sockfd, char *command)
 
         if (fds[0].revents & POLLIN)
         {
-            char buffer[BUFFER_SIZE];
-            receive_message(sockfd, buffer, sizeof(buffer) - 1, 0);
-            printf("%s\n", buffer);
+            size_t length;
+            char *buffer = receive_frame(sockfd, FRAME_MAX_SIZE, &length);
+            if (buffer == NULL)
+            {
+                printf("Server disconnected or error occurred.\n");
+                exit(EXIT_FAILURE);
+            }
+            // Answers to the tagged list_files come back as "@1 <files>", chat lines untagged
+            if (buffer[0] == '@' && strchr(buffer, ' ') != NULL)
+            {
+                printf("%s\n", strchr(buffer, ' ') + 1);
+            }
+            else
+            {
+                print_pushed(buffer, length);
+            }
+            pool_free(buffer);
         }
 
         if (fds[1].revents & POLLIN)
         {
-            fgets(command, BUFFER_SIZE, stdin);
-            command[strcspn(command, "\n")] = '\0';
+            if (getline(&line, &line_capacity, stdin) < 0)
+            {
+                exit(EXIT_SUCCESS);
+            }
+            char *command = line;
+            size_t length = strcspn(command, "\n");
+            command[length] = '\0';
+
+            struct command cmd;
+            if (command_parse(command, length, &cmd) < 0)
+            {
+                continue;
+            }
 
-            if (strncmp(command, "exit", 4) == 0)
+            if (cmd.id == COMMAND_EXIT)
             {
                 char exit_command[BUFFER_SIZE];
                 snprintf(exit_command, sizeof(exit_command), "message %s %s %d %s", group_name, current_user, 0, command);
@@ -301,39 +1101,60 @@ void handle_chat(int sockfd, char *command)
                 printf("Leaving group %s...\n", group_name);
                 break;
             }
-            else if (strncmp(command, "upload_file", 11) == 0)
+            else if (cmd.id == COMMAND_UPLOAD_FILE)
             {
                 char file_path[BUFFER_SIZE];
-                sscanf(command + 12, "%s", file_path);
+                view_copy(file_path, sizeof(file_path), command_arg(&cmd, 0));
 
                 upload_file(sockfd, group_name, file_path);
             }
-            else if (strncmp(command, "download_file", 13) == 0)
+            else if (cmd.id == COMMAND_DOWNLOAD_FILE)
             {
                 char file_name[BUFFER_SIZE];
-                sscanf(command + 14, "%s", file_name);
+                view_copy(file_name, sizeof(file_name), command_arg(&cmd, 0));
 
                 download_file(sockfd, group_name, file_name);
             }
-            else if (strncmp(command, "list_files", 10) == 0)
+            else if (cmd.id == COMMAND_LIST_FILES)
             {
+                // The list arrives with the chat lines, tagged so it cannot be taken for one
                 char list_files_command[BUFFER_SIZE];
-                snprintf(list_files_command, sizeof(list_files_command), "list_files %s", group_name);
+                snprintf(list_files_command, sizeof(list_files_command), "@1 list_files %s", group_name);
                 send_message(sockfd, list_files_command, strlen(list_files_command), 0);
-
-                char buffer[BUFFER_SIZE];
-                receive_message(sockfd, buffer, sizeof(buffer) - 1, 0);
-                printf("%s\n", buffer);
+            }
+            else if (cmd.id == COMMAND_SEARCH)
+            {
+                char search_command[BUFFER_SIZE];
+                snprintf(search_command, sizeof(search_command), "@1 search %s %.*s", group_name,
+                         (int)command_tail(&cmd, 0).len, command_tail(&cmd, 0).ptr);
+                send_message(sockfd, search_command, strlen(search_command), 0);
+            }
+            else if (!view_is_printable_utf8(view_from_cstr(command)))
+            {
+                printf("Message contains invalid characters, not sent.\n");
             }
             else
             {
-                char message_command[BUFFER_SIZE];
-                snprintf(message_command, sizeof(message_command), "message %s %s %d %s", group_name, current_user, 1, command);
-
-                send_message(sockfd, message_command, strlen(message_command), 0);
+                size_t size = length + sizeof(group_name) + sizeof(current_user) + 16;
+                char *message_command = malloc(size);
+                if (message_command == NULL)
+                {
+                    continue;
+                }
+                int message_length = snprintf(message_command, size, "message %s %s %d %s", group_name, current_user, 1, command);
+                if ((size_t)message_length > max_frame_size)
+                {
+                    printf("Message too long, not sent.\n");
+                }
+                else
+                {
+                    send_message(sockfd, message_command, message_length, 0);
+                }
+                free(message_command);
             }
         }
     }
+    free(line);
 }
 
 /**
@@ -354,15 +1175,12 @@ void handle_join_command(int sockfd, char *command)
         char join_command[BUFFER_SIZE];
         snprintf(join_command, sizeof(join_command), "join_group %s %s", current_user, command + 11);
 
-        send_message(sockfd, join_command, strlen(join_command), 0);
-
         char buffer[BUFFER_SIZE];
-
-        receive_message(sockfd, buffer, sizeof(buffer) - 1, 0);
+        request(sockfd, join_command, buffer, sizeof(buffer));
         if (strncmp(buffer, "Joined group successfully", 25) == 0)
         {
             sscanf(command, "join_group %s", group_name);
-            handle_chat(sockfd, command);
+            handle_chat(sockfd);
         }
     }
 }
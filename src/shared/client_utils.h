@@ -20,15 +20,39 @@
 
 #define BUFFER_SIZE 8192
 
+#define DOWNLOAD_MAX_SERVERS 4                /**< The server and its mirrors a download can use */
+#define DOWNLOAD_CONNECTIONS 4                /**< Default number of connections a download is spread over */
+#define DOWNLOAD_MAX_CONNECTIONS 16           /**< Most connections a download can be spread over */
+#define DOWNLOAD_RANGE_SIZE (8 * 1024 * 1024) /**< Bytes fetched by one range request */
+#define DOWNLOAD_RANGE_ATTEMPTS 3             /**< Times a range is tried before the download fails */
+
+/**
+ * @struct server_address
+ * @brief Where a server accepts clients.
+ */
+struct server_address
+{
+    char host[64]; /**< IPv4 address */
+    int port;      /**< Client port */
+};
+
 extern char current_user[50]; /**< Currently logged-in user's name */
 extern int is_in_group;       /**< Flag indicating if the user is in a group */
 extern char group_name[50];   /**< Name of the group the user is currently in */
 
+extern struct server_address download_servers[DOWNLOAD_MAX_SERVERS]; /**< Servers files are downloaded from */
+extern int download_server_count;                                     /**< Number of entries in download_servers */
+extern int download_connections;                                      /**< Connections a download is spread over */
+extern size_t max_frame_size;                                         /**< Largest frame the server accepts from this client */
+
+void client_configure(int argc, char *argv[], const char *server_ip, int server_port);
+
+void negotiate_max_frame(int sockfd);
 void send_command(int sockfd, char *command);
 void handle_login_command(int sockfd, char *command);
 void upload_file(int sockfd, char *group_name, char *file_path);
 void download_file(int sockfd, char *group_name, char *file_name);
-void handle_chat(int sockfd, char *command);
+void handle_chat(int sockfd);
 void handle_join_command(int sockfd, char *command);
 void menu(int sockfd, char *command);
 
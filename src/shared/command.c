@@ -0,0 +1,617 @@
+/**
+ * @file command.c
+ * @brief Implementation of the in-place command tokenizer.
+ *
+ * The two scanning primitives, classifying a 64-byte block into a separator bitmask and
+ * skipping printable ASCII, come in scalar, SSE2 and AVX2 flavours. The flavour is
+ * resolved once, on first use, from the features reported by the CPU. Token boundaries
+ * are then extracted from the bitmask with a few bit operations per field.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "command.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMMAND_HAVE_X86 1
+#endif
+
+/**
+ * @struct command_scanner
+ * @brief Scanning primitives of one instruction set.
+ */
+struct command_scanner
+{
+    const char *name;
+    /** Returns a mask with bit i set if block[i] is a separator; 64 bytes must be readable */
+    uint64_t (*separator_mask)(const char *block);
+    /** Returns the first byte in [p, end) that is not printable ASCII, newline or tab, or end */
+    const char *(*skip_ascii)(const char *p, const char *end);
+};
+
+/**
+ * @brief Returns non-zero for the characters separating command fields.
+ */
+static int is_separator(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+/**
+ * @brief Returns non-zero for bytes allowed as-is in a message body.
+ */
+static int is_plain_ascii(unsigned char c)
+{
+    return (c >= 0x20 && c < 0x7f) || c == '\n' || c == '\t';
+}
+
+static uint64_t separator_mask_scalar(const char *block)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        mask |= (uint64_t)is_separator(block[i]) << i;
+    }
+    return mask;
+}
+
+static const char *skip_ascii_scalar(const char *p, const char *end)
+{
+    while (p < end && is_plain_ascii((unsigned char)*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+#ifdef COMMAND_HAVE_X86
+__attribute__((target("sse2"))) static uint64_t separator_mask_sse2(const char *block)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i carriage = _mm_set1_epi8('\r');
+    uint64_t mask = 0;
+
+    for (int i = 0; i < 64; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(block + i));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, newline)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, carriage)));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(hit) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("sse2"))) static const char *skip_ascii_sse2(const char *p, const char *end)
+{
+    // Signed compare: bytes >= 0x80 are negative, so "< 0x20" also catches them
+    const __m128i low = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i tab = _mm_set1_epi8('\t');
+
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, low), _mm_cmpeq_epi8(v, del));
+        __m128i allowed = _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, tab));
+        int mask = _mm_movemask_epi8(_mm_andnot_si128(allowed, bad));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return skip_ascii_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static uint64_t separator_mask_avx2(const char *block)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i carriage = _mm256_set1_epi8('\r');
+
+    __m256i lo = _mm256_loadu_si256((const __m256i *)block);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(block + 32));
+    __m256i hit_lo = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(lo, space), _mm256_cmpeq_epi8(lo, newline)),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(lo, tab), _mm256_cmpeq_epi8(lo, carriage)));
+    __m256i hit_hi = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(hi, space), _mm256_cmpeq_epi8(hi, newline)),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(hi, tab), _mm256_cmpeq_epi8(hi, carriage)));
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(hit_lo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(hit_hi) << 32;
+}
+
+__attribute__((target("avx2"))) static const char *skip_ascii_avx2(const char *p, const char *end)
+{
+    const __m256i low = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i tab = _mm256_set1_epi8('\t');
+
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        // AVX2 only has "greater than": bad when 0x20 > byte (signed), or byte == 0x7f
+        __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(low, v), _mm256_cmpeq_epi8(v, del));
+        __m256i allowed = _mm256_or_si256(_mm256_cmpeq_epi8(v, newline), _mm256_cmpeq_epi8(v, tab));
+        unsigned mask = _mm256_movemask_epi8(_mm256_andnot_si256(allowed, bad));
+        if (mask != 0)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return skip_ascii_sse2(p, end);
+}
+#endif
+
+static const struct command_scanner scanners[] = {
+    [COMMAND_ISA_SCALAR] = {"scalar", separator_mask_scalar, skip_ascii_scalar},
+#ifdef COMMAND_HAVE_X86
+    [COMMAND_ISA_SSE2] = {"sse2", separator_mask_sse2, skip_ascii_sse2},
+    [COMMAND_ISA_AVX2] = {"avx2", separator_mask_avx2, skip_ascii_avx2},
+#endif
+};
+
+static const struct command_scanner *scanner = NULL;
+
+/**
+ * @brief Returns non-zero if the CPU supports an instruction set.
+ */
+static int isa_supported(enum command_isa isa)
+{
+    switch (isa)
+    {
+    case COMMAND_ISA_SCALAR:
+        return 1;
+#ifdef COMMAND_HAVE_X86
+    case COMMAND_ISA_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case COMMAND_ISA_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Returns the scanner in use, picking the best supported one on first call.
+ */
+static const struct command_scanner *get_scanner(void)
+{
+    if (scanner == NULL)
+    {
+        enum command_isa isa = COMMAND_ISA_AVX2;
+        while (!isa_supported(isa))
+        {
+            isa--;
+        }
+        scanner = &scanners[isa];
+    }
+    return scanner;
+}
+
+/**
+ * @brief Forces the instruction set used by the tokenizer.
+ *
+ * @param isa The instruction set to use.
+ * @return 0 on success, -1 if the CPU does not support it.
+ */
+int command_select_isa(enum command_isa isa)
+{
+    if (!isa_supported(isa))
+    {
+        return -1;
+    }
+    scanner = &scanners[isa];
+    return 0;
+}
+
+/**
+ * @brief Returns the name of the instruction set in use.
+ */
+const char *command_isa_name(void)
+{
+    return get_scanner()->name;
+}
+
+/**
+ * @brief Maps a command keyword to its identifier.
+ *
+ * Dispatches on the keyword length first, so at most three comparisons are made.
+ *
+ * @param name The keyword.
+ * @return The identifier, or COMMAND_UNKNOWN.
+ */
+enum command_id command_classify(struct str_view name)
+{
+#define KEYWORD(text, id)                                     \
+    if (memcmp(name.ptr, text, sizeof(text) - 1) == 0)        \
+    {                                                         \
+        return id;                                            \
+    }
+
+    switch (name.len)
+    {
+    case 4:
+        KEYWORD("exit", COMMAND_EXIT);
+        break;
+    case 5:
+        KEYWORD("login", COMMAND_LOGIN);
+        break;
+    case 6:
+        KEYWORD("search", COMMAND_SEARCH);
+        break;
+    case 7:
+        KEYWORD("message", COMMAND_MESSAGE);
+        KEYWORD("mailbox", COMMAND_MAILBOX);
+        break;
+    case 8:
+        KEYWORD("interest", COMMAND_INTEREST);
+        KEYWORD("presence", COMMAND_PRESENCE);
+        KEYWORD("peer_ack", COMMAND_PEER_ACK);
+        KEYWORD("file_end", COMMAND_FILE_END);
+        break;
+    case 9:
+        KEYWORD("max_frame", COMMAND_MAX_FRAME);
+        KEYWORD("peer_sync", COMMAND_PEER_SYNC);
+        KEYWORD("file_meta", COMMAND_FILE_META);
+        break;
+    case 10:
+        KEYWORD("join_group", COMMAND_JOIN_GROUP);
+        KEYWORD("list_files", COMMAND_LIST_FILES);
+        KEYWORD("peer_hello", COMMAND_PEER_HELLO);
+        KEYWORD("peer_reply", COMMAND_PEER_REPLY);
+        KEYWORD("file_begin", COMMAND_FILE_BEGIN);
+        KEYWORD("file_chunk", COMMAND_FILE_CHUNK);
+        break;
+    case 11:
+        KEYWORD("create_user", COMMAND_CREATE_USER);
+        KEYWORD("list_groups", COMMAND_LIST_GROUPS);
+        KEYWORD("upload_file", COMMAND_UPLOAD_FILE);
+        KEYWORD("mailbox_ack", COMMAND_MAILBOX_ACK);
+        break;
+    case 12:
+        KEYWORD("peer_request", COMMAND_PEER_REQUEST);
+        break;
+    case 13:
+        KEYWORD("download_file", COMMAND_DOWNLOAD_FILE);
+        break;
+    case 14:
+        KEYWORD("download_range", COMMAND_DOWNLOAD_RANGE);
+        break;
+    }
+    return COMMAND_UNKNOWN;
+
+#undef KEYWORD
+}
+
+/**
+ * @brief Returns the keyword of a command identifier ("unknown" for COMMAND_UNKNOWN).
+ */
+const char *command_id_name(enum command_id id)
+{
+    static const char *const names[COMMAND_COUNT] = {
+        [COMMAND_UNKNOWN] = "unknown",
+        [COMMAND_LOGIN] = "login",
+        [COMMAND_CREATE_USER] = "create_user",
+        [COMMAND_LIST_GROUPS] = "list_groups",
+        [COMMAND_JOIN_GROUP] = "join_group",
+        [COMMAND_MESSAGE] = "message",
+        [COMMAND_UPLOAD_FILE] = "upload_file",
+        [COMMAND_DOWNLOAD_FILE] = "download_file",
+        [COMMAND_DOWNLOAD_RANGE] = "download_range",
+        [COMMAND_LIST_FILES] = "list_files",
+        [COMMAND_SEARCH] = "search",
+        [COMMAND_FILE_BEGIN] = "file_begin",
+        [COMMAND_FILE_CHUNK] = "file_chunk",
+        [COMMAND_FILE_END] = "file_end",
+        [COMMAND_FILE_META] = "file_meta",
+        [COMMAND_MAX_FRAME] = "max_frame",
+        [COMMAND_EXIT] = "exit",
+        [COMMAND_PEER_HELLO] = "peer_hello",
+        [COMMAND_PEER_REQUEST] = "peer_request",
+        [COMMAND_PEER_REPLY] = "peer_reply",
+        [COMMAND_INTEREST] = "interest",
+        [COMMAND_PRESENCE] = "presence",
+        [COMMAND_MAILBOX] = "mailbox",
+        [COMMAND_PEER_SYNC] = "peer_sync",
+        [COMMAND_PEER_ACK] = "peer_ack",
+        [COMMAND_MAILBOX_ACK] = "mailbox_ack",
+    };
+    return id >= 0 && id < COMMAND_COUNT ? names[id] : names[COMMAND_UNKNOWN];
+}
+
+/**
+ * @brief Decodes one non-ASCII UTF-8 sequence and checks it is a printable code point.
+ *
+ * @return The length of the sequence, or 0 if it is invalid, a C1 control, a surrogate
+ *         or an overlong encoding.
+ */
+static int utf8_sequence_length(const unsigned char *p, const unsigned char *end)
+{
+    unsigned char c = p[0];
+    int length;
+    unsigned char low = 0x80, high = 0xbf;
+
+    if (c >= 0xc2 && c <= 0xdf)
+    {
+        length = 2;
+        if (c == 0xc2)
+        {
+            low = 0xa0; // U+0080 to U+009F are C1 controls
+        }
+    }
+    else if (c >= 0xe0 && c <= 0xef)
+    {
+        length = 3;
+        if (c == 0xe0)
+            low = 0xa0;
+        else if (c == 0xed)
+            high = 0x9f;
+    }
+    else if (c >= 0xf0 && c <= 0xf4)
+    {
+        length = 4;
+        if (c == 0xf0)
+            low = 0x90;
+        else if (c == 0xf4)
+            high = 0x8f;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (end - p < length || p[1] < low || p[1] > high)
+    {
+        return 0;
+    }
+    for (int i = 2; i < length; i++)
+    {
+        if ((p[i] & 0xc0) != 0x80)
+        {
+            return 0;
+        }
+    }
+    return length;
+}
+
+/**
+ * @brief Checks that a message body is valid UTF-8 without control characters.
+ *
+ * @param text The text to check.
+ * @return Non-zero if the text is valid.
+ */
+int view_is_printable_utf8(struct str_view text)
+{
+    const struct command_scanner *scan = get_scanner();
+    const char *p = text.ptr;
+    const char *end = text.ptr + text.len;
+
+    while ((p = scan->skip_ascii(p, end)) < end)
+    {
+        int length = utf8_sequence_length((const unsigned char *)p, (const unsigned char *)end);
+        if (length == 0)
+        {
+            return 0;
+        }
+        p += length;
+    }
+    return 1;
+}
+
+/**
+ * @brief Records the token [start, stop) as the next field of a command.
+ *
+ * @return Non-zero once every field slot is filled.
+ */
+static int add_field(struct command *cmd, const char *start, const char *stop)
+{
+    struct str_view token = {start, (size_t)(stop - start)};
+    if (cmd->name.len == 0)
+    {
+        cmd->name = token;
+        return 0;
+    }
+    cmd->args[cmd->argc++] = token;
+    return cmd->argc == COMMAND_MAX_ARGS;
+}
+
+/**
+ * @brief Splits a frame into a command name and up to COMMAND_MAX_ARGS arguments.
+ *
+ * The frame is classified 64 bytes at a time into a separator bitmask. Token starts
+ * are the non-separator bits whose predecessor is a separator, token ends the
+ * separator bits whose predecessor is not; both are walked in order with
+ * count-trailing-zeros. The short tail of the frame is copied into a padded block so
+ * the vector code never reads past the buffer.
+ *
+ * @param frame The frame payload.
+ * @param length The length of the payload.
+ * @param cmd The command filled by the call.
+ * @return 0 on success, -1 if the frame holds no command name.
+ */
+int command_parse(const char *frame, size_t length, struct command *cmd)
+{
+    const struct command_scanner *scan = get_scanner();
+    const char *end = frame + length;
+    const char *token = NULL;
+    uint64_t in_token = 0; // 1 if the byte before the block belongs to a token
+
+    cmd->id = COMMAND_UNKNOWN;
+    cmd->argc = 0;
+    cmd->end = end;
+    cmd->name.ptr = end;
+    cmd->name.len = 0;
+
+    for (const char *block = frame; block < end; block += 64)
+    {
+        uint64_t separators;
+        size_t available = end - block;
+        if (available >= 64)
+        {
+            separators = scan->separator_mask(block);
+        }
+        else
+        {
+            char padded[64] = {0};
+            memcpy(padded, block, available);
+            separators = scan->separator_mask(padded) | (~0ull << available);
+        }
+
+        uint64_t shifted = ~separators << 1 | in_token;
+        uint64_t boundaries = (~separators & ~shifted) | (separators & shifted);
+        in_token = ~separators >> 63;
+
+        while (boundaries != 0)
+        {
+            const char *position = block + __builtin_ctzll(boundaries);
+            boundaries &= boundaries - 1;
+            if (token == NULL)
+            {
+                token = position;
+            }
+            else
+            {
+                if (add_field(cmd, token, position))
+                {
+                    goto done;
+                }
+                token = NULL;
+            }
+        }
+    }
+    if (token != NULL)
+    {
+        add_field(cmd, token, end);
+    }
+
+done:
+    if (cmd->name.len == 0)
+    {
+        return -1;
+    }
+    cmd->id = command_classify(cmd->name);
+    return 0;
+}
+
+/**
+ * @brief Returns an argument, or an empty view if it is missing.
+ */
+struct str_view command_arg(const struct command *cmd, int index)
+{
+    if (index < cmd->argc)
+    {
+        return cmd->args[index];
+    }
+    struct str_view empty = {cmd->end, 0};
+    return empty;
+}
+
+/**
+ * @brief Returns the text from an argument to the end of the frame.
+ */
+struct str_view command_tail(const struct command *cmd, int index)
+{
+    struct str_view tail = command_arg(cmd, index);
+    if (tail.len == 0)
+    {
+        return tail;
+    }
+
+    tail.len = cmd->end - tail.ptr;
+    if (tail.len > 0 && tail.ptr[tail.len - 1] == '\n')
+    {
+        tail.len--;
+    }
+    return tail;
+}
+
+/**
+ * @brief Builds a view on a NUL-terminated string.
+ */
+struct str_view view_from_cstr(const char *s)
+{
+    struct str_view view = {s, strlen(s)};
+    return view;
+}
+
+/**
+ * @brief Compares a view with a NUL-terminated string.
+ */
+int view_equals(struct str_view view, const char *s)
+{
+    return strnlen(s, view.len + 1) == view.len && memcmp(view.ptr, s, view.len) == 0;
+}
+
+/**
+ * @brief Copies a view into a fixed-size, NUL-terminated buffer.
+ */
+void view_copy(char *dest, size_t size, struct str_view view)
+{
+    size_t length = view.len < size - 1 ? view.len : size - 1;
+    memcpy(dest, view.ptr, length);
+    dest[length] = '\0';
+}
+
+/**
+ * @brief Parses a decimal integer held in a view.
+ */
+int view_to_long(struct str_view view, long *value)
+{
+    size_t i = 0;
+    int negative = 0;
+    long result = 0;
+
+    if (view.len > 0 && view.ptr[0] == '-')
+    {
+        negative = 1;
+        i = 1;
+    }
+    if (i == view.len)
+    {
+        return -1;
+    }
+    for (; i < view.len; i++)
+    {
+        if (view.ptr[i] < '0' || view.ptr[i] > '9')
+        {
+            return -1;
+        }
+        // The digits come from clients: refuse a value past LONG_MAX rather than overflow
+        int digit = view.ptr[i] - '0';
+        if (result > (LONG_MAX - digit) / 10)
+        {
+            return -1;
+        }
+        result = result * 10 + digit;
+    }
+
+    *value = negative ? -result : result;
+    return 0;
+}
+
+/**
+ * @brief Hashes the characters of a view.
+ */
+uint64_t view_hash(struct str_view view)
+{
+    // FNV-1a, then a 64-bit finalizer so that close names land far apart
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < view.len; i++)
+    {
+        hash ^= (unsigned char)view.ptr[i];
+        hash *= 0x100000001b3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
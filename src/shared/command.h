@@ -0,0 +1,203 @@
+/**
+ * @file command.h
+ * @brief In-place tokenizer for text commands.
+ *
+ * Commands are split directly in the receive buffer into (pointer, length) views. No
+ * field is copied or NUL-terminated, so handlers can work on the frame as received.
+ * Separator search and text validation use SSE2 or AVX2 when the CPU supports them,
+ * selected at runtime, with a portable scalar fallback.
+ */
+
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMMAND_MAX_ARGS 4 /**< Number of arguments split after the command name */
+
+/**
+ * @enum command_id
+ * @brief Keywords understood by the servers and the interactive client.
+ */
+enum command_id
+{
+    COMMAND_UNKNOWN = 0,
+    COMMAND_LOGIN,
+    COMMAND_CREATE_USER,
+    COMMAND_LIST_GROUPS,
+    COMMAND_JOIN_GROUP,
+    COMMAND_MESSAGE,
+    COMMAND_UPLOAD_FILE,
+    COMMAND_DOWNLOAD_FILE,
+    COMMAND_DOWNLOAD_RANGE,
+    COMMAND_LIST_FILES,
+    COMMAND_SEARCH,
+    COMMAND_FILE_BEGIN,
+    COMMAND_FILE_CHUNK,
+    COMMAND_FILE_END,
+    COMMAND_FILE_META,
+    COMMAND_MAX_FRAME,
+    COMMAND_EXIT,
+    COMMAND_PEER_HELLO,
+    COMMAND_PEER_REQUEST,
+    COMMAND_PEER_REPLY,
+    COMMAND_INTEREST,
+    COMMAND_PRESENCE,
+    COMMAND_MAILBOX,
+    COMMAND_PEER_SYNC,
+    COMMAND_PEER_ACK,
+    COMMAND_MAILBOX_ACK,
+    COMMAND_COUNT /**< Number of identifiers, not a command */
+};
+
+/**
+ * @enum command_isa
+ * @brief Instruction sets the tokenizer can use.
+ */
+enum command_isa
+{
+    COMMAND_ISA_SCALAR = 0, /**< Portable byte-at-a-time code */
+    COMMAND_ISA_SSE2,       /**< 16 bytes per step */
+    COMMAND_ISA_AVX2        /**< 32 bytes per step */
+};
+
+/**
+ * @struct str_view
+ * @brief A non-owning view on a run of characters.
+ */
+struct str_view
+{
+    const char *ptr; /**< First character of the view */
+    size_t len;      /**< Number of characters in the view */
+};
+
+/**
+ * @struct command
+ * @brief A command split into its name and leading arguments.
+ */
+struct command
+{
+    enum command_id id;                     /**< The classified keyword */
+    struct str_view name;                   /**< The command keyword */
+    struct str_view args[COMMAND_MAX_ARGS]; /**< The whitespace-separated arguments */
+    int argc;                               /**< The number of arguments found */
+    const char *end;                        /**< One past the last character of the frame */
+};
+
+/**
+ * @brief Splits a frame into a command name and up to COMMAND_MAX_ARGS arguments.
+ *
+ * Parsing stops after the last argument slot, so long message bodies are not scanned.
+ * The keyword is classified into cmd->id.
+ *
+ * @param frame The frame payload.
+ * @param length The length of the payload.
+ * @param cmd The command filled by the call.
+ * @return 0 on success, -1 if the frame holds no command name.
+ */
+int command_parse(const char *frame, size_t length, struct command *cmd);
+
+/**
+ * @brief Maps a command keyword to its identifier.
+ *
+ * @param name The keyword.
+ * @return The identifier, or COMMAND_UNKNOWN.
+ */
+enum command_id command_classify(struct str_view name);
+
+/**
+ * @brief Returns the keyword of a command identifier ("unknown" for COMMAND_UNKNOWN).
+ */
+const char *command_id_name(enum command_id id);
+
+/**
+ * @brief Checks that a message body is valid UTF-8 without control characters.
+ *
+ * Newlines and tabs are accepted so that pasted text keeps its layout. Runs of
+ * printable ASCII are checked 16 or 32 bytes at a time.
+ *
+ * @param text The text to check.
+ * @return Non-zero if the text is valid.
+ */
+int view_is_printable_utf8(struct str_view text);
+
+/**
+ * @brief Forces the instruction set used by the tokenizer.
+ *
+ * By default the best instruction set supported by the CPU is picked on first use.
+ *
+ * @param isa The instruction set to use.
+ * @return 0 on success, -1 if the CPU does not support it.
+ */
+int command_select_isa(enum command_isa isa);
+
+/**
+ * @brief Returns the name of the instruction set in use ("scalar", "sse2" or "avx2").
+ */
+const char *command_isa_name(void);
+
+/**
+ * @brief Returns an argument, or an empty view if it is missing.
+ *
+ * @param cmd The parsed command.
+ * @param index The index of the argument.
+ * @return The argument view.
+ */
+struct str_view command_arg(const struct command *cmd, int index);
+
+/**
+ * @brief Returns the text from an argument to the end of the frame.
+ *
+ * Inner whitespace is preserved and a trailing newline is dropped. This is how free
+ * text such as a message body or a password is passed to handlers.
+ *
+ * @param cmd The parsed command.
+ * @param index The index of the first argument of the text.
+ * @return The text view, empty if the argument is missing.
+ */
+struct str_view command_tail(const struct command *cmd, int index);
+
+/**
+ * @brief Builds a view on a NUL-terminated string.
+ */
+struct str_view view_from_cstr(const char *s);
+
+/**
+ * @brief Compares a view with a NUL-terminated string.
+ *
+ * @return Non-zero if both hold the same characters.
+ */
+int view_equals(struct str_view view, const char *s);
+
+/**
+ * @brief Copies a view into a fixed-size, NUL-terminated buffer.
+ *
+ * The copy is truncated to fit the buffer.
+ *
+ * @param dest The destination buffer.
+ * @param size The size of the destination buffer.
+ * @param view The view to copy.
+ */
+void view_copy(char *dest, size_t size, struct str_view view);
+
+/**
+ * @brief Parses a decimal integer held in a view.
+ *
+ * @param view The view.
+ * @param value Set to the parsed value on success.
+ * @return 0 on success, -1 if the view is not a valid integer or does not fit in a long.
+ */
+int view_to_long(struct str_view view, long *value);
+
+/**
+ * @brief Hashes the characters of a view.
+ *
+ * The hash is the same on every server, so it can be used to place keys across them.
+ *
+ * @param view The view.
+ * @return A 64-bit hash.
+ */
+uint64_t view_hash(struct str_view view);
+
+#endif // COMMAND_H
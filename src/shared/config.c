@@ -0,0 +1,175 @@
+/**
+ * @file config.c
+ * @brief Parsing of the server configuration file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "log.h"
+#include "peer.h"
+#include "replica.h"
+
+#define CONFIG_LINE_LENGTH 256
+
+struct server_config server_config = {
+    .conn_messages_per_sec = 50,
+    .conn_bytes_per_sec = 4 * 1024 * 1024,
+    .user_messages_per_sec = 100,
+    .user_bytes_per_sec = 8 * 1024 * 1024,
+    .burst_seconds = 2,
+    .ratelimit_mode = RATELIMIT_DELAY,
+    .metrics_port = 0,
+    .tracing = 0,
+    .port = 0,
+    .file_cache_bytes = 64 * 1024 * 1024,
+    .file_cache_max_file_bytes = 1024 * 1024,
+    .mailbox_memory_bytes = 16 * 1024 * 1024,
+    .mailbox_max_bytes = 4 * 1024 * 1024,
+    .chat_batch_bytes = 8192,
+    .message_archive = 1,
+    .search_results = 20,
+};
+
+/**
+ * @brief Applies one `key value` pair to the settings.
+ *
+ * @return 0 on success, -1 if the key or the value is not recognised.
+ */
+static int config_set(const char *key, const char *value)
+{
+    if (strcmp(key, "ratelimit_messages_per_sec") == 0)
+        server_config.conn_messages_per_sec = atof(value);
+    else if (strcmp(key, "ratelimit_bytes_per_sec") == 0)
+        server_config.conn_bytes_per_sec = atof(value);
+    else if (strcmp(key, "ratelimit_user_messages_per_sec") == 0)
+        server_config.user_messages_per_sec = atof(value);
+    else if (strcmp(key, "ratelimit_user_bytes_per_sec") == 0)
+        server_config.user_bytes_per_sec = atof(value);
+    else if (strcmp(key, "ratelimit_burst_seconds") == 0)
+        server_config.burst_seconds = atof(value);
+    else if (strcmp(key, "ratelimit_mode") == 0)
+    {
+        if (strcmp(value, "delay") == 0)
+            server_config.ratelimit_mode = RATELIMIT_DELAY;
+        else if (strcmp(value, "reject") == 0)
+            server_config.ratelimit_mode = RATELIMIT_REJECT;
+        else
+            return -1;
+    }
+    else if (strcmp(key, "metrics_port") == 0)
+        server_config.metrics_port = atoi(value);
+    else if (strcmp(key, "tracing") == 0)
+    {
+        if (strcmp(value, "on") == 0)
+            server_config.tracing = 1;
+        else if (strcmp(value, "off") == 0)
+            server_config.tracing = 0;
+        else
+            return -1;
+    }
+    else if (strcmp(key, "file_cache_bytes") == 0)
+        server_config.file_cache_bytes = strtoull(value, NULL, 10);
+    else if (strcmp(key, "file_cache_max_file_bytes") == 0)
+        server_config.file_cache_max_file_bytes = strtoull(value, NULL, 10);
+    else if (strcmp(key, "mailbox_memory_bytes") == 0)
+        server_config.mailbox_memory_bytes = strtoull(value, NULL, 10);
+    else if (strcmp(key, "mailbox_max_bytes") == 0)
+        server_config.mailbox_max_bytes = strtoull(value, NULL, 10);
+    else if (strcmp(key, "chat_batch_bytes") == 0)
+        server_config.chat_batch_bytes = strtoull(value, NULL, 10);
+    else if (strcmp(key, "message_archive") == 0)
+        server_config.message_archive = atoi(value);
+    else if (strcmp(key, "search_results") == 0)
+        server_config.search_results = atoi(value);
+    else if (strcmp(key, "port") == 0)
+        server_config.port = atoi(value);
+    else if (strcmp(key, "node_id") == 0)
+        node_id = atoi(value);
+    else if (strcmp(key, "peer_heartbeat_ms") == 0)
+        peer_heartbeat_ms = atoi(value);
+    else if (strcmp(key, "peer_timeout_ms") == 0)
+        peer_timeout_ms = atoi(value);
+    else if (strcmp(key, "peer_backoff_max_ms") == 0)
+        peer_backoff_max_ms = atoi(value);
+    else if (strcmp(key, "peer_secret") == 0)
+    {
+        if (sscanf(value, "%127s", peer_secret) != 1)
+            return -1;
+    }
+    else if (strcmp(key, "peer") == 0)
+    {
+        int id, port;
+        char host[PEER_HOST_SIZE];
+        if (sscanf(value, "%d %63s %d", &id, host, &port) != 3 || peer_add(id, host, port) < 0)
+            return -1;
+    }
+    else if (strcmp(key, "replication") == 0)
+    {
+        if (strcmp(value, "eager") == 0)
+            replica_default_mode = REPLICA_EAGER;
+        else if (strcmp(value, "lazy") == 0)
+            replica_default_mode = REPLICA_LAZY;
+        else
+            return -1;
+    }
+    else if (strcmp(key, "replication_group") == 0)
+    {
+        char group[64], mode[8];
+        if (sscanf(value, "%63s %7s", group, mode) != 2)
+            return -1;
+        if (strcmp(mode, "eager") == 0)
+            return replica_set_policy(group, REPLICA_EAGER);
+        else if (strcmp(mode, "lazy") == 0)
+            return replica_set_policy(group, REPLICA_LAZY);
+        else
+            return -1;
+    }
+    else if (strcmp(key, "log_level") == 0)
+    {
+        int level = log_level_from_name(value);
+        if (level < 0)
+            return -1;
+        log_level = level;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Loads settings from a configuration file.
+ *
+ * @param filename The file to read.
+ * @return 0 on success, -1 if the file could not be opened (defaults are kept).
+ */
+int config_load(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        printf("No %s found, using default settings\n", filename);
+        return -1;
+    }
+
+    char line[CONFIG_LINE_LENGTH];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        char key[64], value[CONFIG_LINE_LENGTH];
+        line_number++;
+
+        if (line[0] == '#' || sscanf(line, "%63s %255[^\n]", key, value) != 2)
+        {
+            continue;
+        }
+        if (config_set(key, value) < 0)
+        {
+            fprintf(stderr, "%s:%d: invalid setting '%s'\n", filename, line_number, key);
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
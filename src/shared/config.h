@@ -0,0 +1,62 @@
+/**
+ * @file config.h
+ * @brief Server settings loaded from a configuration file.
+ *
+ * The file is read from the working directory of the server, next to `data.txt`,
+ * unless another path is given on the command line. Each line holds a key and a value
+ * separated by spaces; lines starting with `#` are comments. Missing keys keep their
+ * default value.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+#define CONFIG_FILE "server.conf" /**< Default configuration file name */
+
+/**
+ * @enum ratelimit_mode
+ * @brief What happens to a frame received while its sender is over its rate.
+ */
+enum ratelimit_mode
+{
+    RATELIMIT_DELAY = 0, /**< The frame is held and the socket is not read until tokens are available */
+    RATELIMIT_REJECT     /**< The frame is dropped and the client is told it was rate limited */
+};
+
+/**
+ * @struct server_config
+ * @brief Settings of a server.
+ */
+struct server_config
+{
+    double conn_messages_per_sec; /**< Frames per second allowed per connection (0 disables) */
+    double conn_bytes_per_sec;    /**< Bytes per second allowed per connection (0 disables) */
+    double user_messages_per_sec; /**< Frames per second allowed per logged-in user (0 disables) */
+    double user_bytes_per_sec;    /**< Bytes per second allowed per logged-in user (0 disables) */
+    double burst_seconds;         /**< Bucket capacity, in seconds worth of rate */
+    enum ratelimit_mode ratelimit_mode;
+    int metrics_port; /**< Loopback port serving the Prometheus metrics (0 disables) */
+    int tracing;      /**< Non-zero to record request spans, served as /trace on the metrics port */
+    int port;         /**< Client port, also dialed by the peers (0 keeps the built-in port) */
+    size_t file_cache_bytes;          /**< Memory for the files cached by the downloads (0 disables) */
+    size_t file_cache_max_file_bytes; /**< Largest file kept in the cache */
+    size_t mailbox_memory_bytes;      /**< Memory for the messages of offline users, beyond which mailboxes go to disk */
+    size_t mailbox_max_bytes;         /**< Most bytes of messages kept for one user */
+    size_t chat_batch_bytes;          /**< Largest batch of chat lines sent to a client that fell behind (0 disables) */
+    int message_archive;              /**< Non-zero to archive and index the messages of the groups owned here */
+    int search_results;               /**< Most messages in the answer to a search */
+};
+
+extern struct server_config server_config; /**< Settings in effect */
+
+/**
+ * @brief Loads settings from a configuration file.
+ *
+ * @param filename The file to read.
+ * @return 0 on success, -1 if the file could not be opened (defaults are kept).
+ */
+int config_load(const char *filename);
+
+#endif // CONFIG_H
@@ -0,0 +1,210 @@
+/**
+ * @file connection.c
+ * @brief Table of per-socket connection state, indexed by file descriptor.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "connection.h"
+#include "pool.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+
+static struct connection *connections[MAX_CONNECTIONS];
+static int open_connections = 0;
+static int batched[MAX_CONNECTIONS]; /**< Sockets with a chat batch started during this turn */
+static int batched_count = 0;
+static uint64_t last_session = 0; /**< Session number given to the last connection opened */
+
+/**
+ * @brief Creates the connection object of a newly accepted socket.
+ *
+ * @param fd The socket file descriptor.
+ * @return The connection, or NULL if fd is out of range or memory is exhausted.
+ */
+struct connection *connection_open(int fd)
+{
+    if (fd < 0 || fd >= MAX_CONNECTIONS)
+    {
+        log_warn("Connection fd %d out of range", fd);
+        return NULL;
+    }
+    if (connections[fd] != NULL)
+    {
+        return connections[fd];
+    }
+
+    struct connection *conn = pool_alloc(sizeof(struct connection));
+    if (conn == NULL)
+    {
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->session = ++last_session;
+    frame_reader_init(&conn->rx, FRAME_DEFAULT_MAX_SIZE);
+    ratelimit_init(&conn->limit, server_config.conn_messages_per_sec, server_config.conn_bytes_per_sec,
+                   server_config.burst_seconds);
+    conn->user_index = -1;
+    conn->throttled_until = 0;
+    conn->peer_index = -1;
+    conn->batch = NULL;
+
+    connections[fd] = conn;
+    open_connections++;
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    metrics_gauge_add(METRIC_CONNECTIONS_OPEN, 1);
+    return conn;
+}
+
+/**
+ * @brief Looks up the connection object of a socket.
+ *
+ * @param fd The socket file descriptor.
+ * @return The connection, or NULL if the socket is not tracked.
+ */
+struct connection *connection_get(int fd)
+{
+    if (fd < 0 || fd >= MAX_CONNECTIONS)
+    {
+        return NULL;
+    }
+    return connections[fd];
+}
+
+/**
+ * @brief Releases the connection object of a socket and its buffers.
+ *
+ * @param fd The socket file descriptor.
+ */
+void connection_close(int fd)
+{
+    struct connection *conn = connection_get(fd);
+    if (conn == NULL)
+    {
+        return;
+    }
+    frame_reader_release(&conn->rx);
+    pool_free(conn->batch);
+    pool_free(conn);
+    connections[fd] = NULL;
+    open_connections--;
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    metrics_gauge_add(METRIC_CONNECTIONS_OPEN, -1);
+}
+
+/**
+ * @brief Returns the bytes a socket holds that the kernel has not sent yet, or -1.
+ *
+ * On TCP, bytes sent and only waiting for their acknowledgment do not count: they are
+ * left behind by delayed acknowledgments to a client that keeps up. Other sockets
+ * count every byte the other end has not read.
+ */
+static int unsent_bytes(int fd)
+{
+    int queued = 0;
+    if (ioctl(fd, SIOCOUTQNSD, &queued) < 0 && ioctl(fd, SIOCOUTQ, &queued) < 0)
+    {
+        return -1;
+    }
+    return queued;
+}
+
+/**
+ * @brief Writes the chat lines gathered for a client and empties its batch.
+ *
+ * A single line goes out in a frame of its own, as it would have without the batch.
+ */
+static void send_batch(struct connection *conn)
+{
+    size_t header = sizeof(FRAME_BATCH_HEADER) - 1;
+    if (conn->batch_lines == 1)
+    {
+        send_message(conn->fd, conn->batch + header + FRAME_HEADER_SIZE, conn->batch_length - header - FRAME_HEADER_SIZE, 0);
+    }
+    else if (conn->batch_lines > 1)
+    {
+        send_message(conn->fd, conn->batch, conn->batch_length, 0);
+        metrics_add(METRIC_CHAT_BATCHES, 1);
+        metrics_add(METRIC_CHAT_COALESCED, conn->batch_lines);
+    }
+    conn->batch_length = header;
+    conn->batch_lines = 0;
+}
+
+/**
+ * @brief Sends a chat line to a client, or adds it to a batch if the client is behind.
+ */
+int connection_send_chat(int fd, const struct iovec *parts, int count)
+{
+    struct connection *conn = connection_get(fd);
+    size_t header = sizeof(FRAME_BATCH_HEADER) - 1;
+    size_t length = FRAME_HEADER_SIZE;
+    for (int i = 0; i < count; i++)
+    {
+        length += parts[i].iov_len;
+    }
+    if (conn == NULL || length > server_config.chat_batch_bytes)
+    {
+        return send_message_parts(fd, parts, count);
+    }
+
+    if (conn->batch == NULL)
+    {
+        // Nothing waits in the socket: the line goes out at once
+        if (batched_count == MAX_CONNECTIONS || unsent_bytes(fd) <= 0 ||
+            (conn->batch = pool_alloc(header + server_config.chat_batch_bytes)) == NULL)
+        {
+            return send_message_parts(fd, parts, count);
+        }
+        memcpy(conn->batch, FRAME_BATCH_HEADER, header);
+        conn->batch_length = header;
+        conn->batch_lines = 0;
+        batched[batched_count++] = fd;
+    }
+    else if (conn->batch_length + length > header + server_config.chat_batch_bytes)
+    {
+        send_batch(conn);
+    }
+
+    // Each line behind its length, as a message may hold newlines
+    int32_t size = length - FRAME_HEADER_SIZE;
+    memcpy(conn->batch + conn->batch_length, &size, sizeof(size));
+    conn->batch_length += sizeof(size);
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(conn->batch + conn->batch_length, parts[i].iov_base, parts[i].iov_len);
+        conn->batch_length += parts[i].iov_len;
+    }
+    conn->batch_lines++;
+    return 0;
+}
+
+/**
+ * @brief Sends the chat batches gathered during this turn of the event loop.
+ */
+void connection_flush_chat(void)
+{
+    for (int i = 0; i < batched_count; i++)
+    {
+        // A socket closed and reused during the turn has no batch of its own yet
+        struct connection *conn = connection_get(batched[i]);
+        if (conn != NULL && conn->batch != NULL)
+        {
+            send_batch(conn);
+            pool_free(conn->batch);
+            conn->batch = NULL;
+        }
+    }
+    batched_count = 0;
+}
+
+/**
+ * @brief Returns the number of open connection objects.
+ */
+int connection_count(void)
+{
+    return open_connections;
+}
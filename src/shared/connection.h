@@ -0,0 +1,92 @@
+/**
+ * @file connection.h
+ * @brief Per-socket connection state kept by the servers.
+ *
+ * Every accepted socket gets a connection object allocated from the slab pools. The
+ * object owns the frame reader of that socket, which receives each frame into a pooled
+ * buffer sized for it, so handlers no longer need large buffers on their own stack.
+ *
+ * Chat lines for a client whose socket still holds data the kernel could not send
+ * are not written one frame each: they are gathered in a batch, a `batch` line
+ * followed by the chat lines, each behind its length (see batch_next_line()), sent at
+ * the end of the turn of the event loop or once it reaches `chat_batch_bytes`. Under
+ * load a turn fans out many messages to the same clients, so a client falling behind
+ * gets fewer, larger frames and the server makes fewer system calls for it, while a
+ * client keeping up still gets each line in its own frame at once.
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "socket_utils.h"
+#include "ratelimit.h"
+
+#define MAX_CONNECTIONS 8192 /**< Highest file descriptor number tracked by the connection table */
+
+/**
+ * @struct connection
+ * @brief State attached to one connected socket.
+ */
+struct connection
+{
+    int fd;                    /**< The socket file descriptor */
+    uint64_t session;          /**< Number of the connection, never reused while the server runs */
+    struct frame_reader rx;    /**< Reader assembling the incoming frame */
+    struct rate_limiter limit; /**< Frame and byte buckets of the connection */
+    int user_index;            /**< Index of the logged-in user in `users`, or -1 */
+    uint64_t throttled_until;  /**< Time at which a held frame may be dispatched, or 0 */
+    uint64_t received_at;      /**< Time the pending frame was read, only kept while tracing */
+    int peer_index;            /**< Index of the server in `peers` if this is a peer link, or -1 */
+    char *batch;               /**< Chat lines waiting for the end of the turn, behind FRAME_BATCH_HEADER, or NULL */
+    size_t batch_length;       /**< Bytes used in `batch`, header included */
+    int batch_lines;           /**< Chat lines in `batch` */
+};
+
+/**
+ * @brief Creates the connection object of a newly accepted socket.
+ *
+ * @param fd The socket file descriptor.
+ * @return The connection, or NULL if fd is out of range or memory is exhausted.
+ */
+struct connection *connection_open(int fd);
+
+/**
+ * @brief Looks up the connection object of a socket.
+ *
+ * @param fd The socket file descriptor.
+ * @return The connection, or NULL if the socket is not tracked.
+ */
+struct connection *connection_get(int fd);
+
+/**
+ * @brief Releases the connection object of a socket and its buffers.
+ *
+ * The socket itself is not closed.
+ *
+ * @param fd The socket file descriptor.
+ */
+void connection_close(int fd);
+
+/**
+ * @brief Sends a chat line to a client, or adds it to a batch if the client is behind.
+ *
+ * @param fd The socket of the client.
+ * @param parts The pieces of the line, without a newline.
+ * @param count The number of pieces.
+ * @return 0 on success, -1 if the line could not be sent.
+ */
+int connection_send_chat(int fd, const struct iovec *parts, int count);
+
+/**
+ * @brief Sends the chat batches gathered during this turn of the event loop.
+ */
+void connection_flush_chat(void);
+
+/**
+ * @brief Returns the number of open connection objects.
+ */
+int connection_count(void);
+
+#endif // CONNECTION_H
@@ -15,11 +15,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#define MAX_USERS 100        /**< Maximum number of users in the system */
-#define MAX_GROUPS 50        /**< Maximum number of groups in the system */
-#define MAX_GROUP_MEMBERS 10 /**< Maximum number of members in a group */
+#define MAX_USERS 8192       /**< Maximum number of users in the system */
+#define MAX_GROUPS 512       /**< Maximum number of groups in the system */
+#define MAX_GROUP_MEMBERS 64 /**< Maximum number of members in a group */
 #define MAX_LINE_LENGTH 256  /**< Maximum length of a line in the input file */
-#define MAX_CLIENTS 100      /**< Maximum number of clients that can connect to the server */
+#define MAX_CLIENTS 4096     /**< Maximum number of clients that can connect to the server */
 
 
 /**
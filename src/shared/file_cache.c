@@ -0,0 +1,185 @@
+/**
+ * @file file_cache.c
+ * @brief Hash table and LRU list of the cached files.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "file_cache.h"
+#include "config.h"
+#include "metrics.h"
+#include "log.h"
+
+#define FILE_CACHE_KEY_SIZE 256 /**< Room for `<group>/<file>` */
+
+static struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+static struct file_cache_entry *newest = NULL;
+static struct file_cache_entry *oldest = NULL;
+static size_t cached_bytes = 0;
+
+/**
+ * @brief Writes the key of a file, `<group>/<file>`.
+ *
+ * @return The key, or a view of length 0 if it does not fit.
+ */
+static struct str_view make_key(char *key, struct str_view group, struct str_view file)
+{
+    int length = snprintf(key, FILE_CACHE_KEY_SIZE, "%.*s/%.*s", (int)group.len, group.ptr, (int)file.len, file.ptr);
+    return (struct str_view){key, length < FILE_CACHE_KEY_SIZE ? (size_t)length : 0};
+}
+
+/**
+ * @brief Returns the link pointing at the entry of a key: a bucket or the chain of an entry.
+ */
+static struct file_cache_entry **find_link(struct str_view key, uint64_t hash)
+{
+    struct file_cache_entry **link = &buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+    while (*link != NULL &&
+           ((*link)->hash != hash || (*link)->key_length != key.len || memcmp((*link)->key, key.ptr, key.len) != 0))
+    {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+static void unlink_lru(struct file_cache_entry *entry)
+{
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        oldest = entry->newer;
+}
+
+static void push_newest(struct file_cache_entry *entry)
+{
+    entry->newer = NULL;
+    entry->older = newest;
+    if (newest != NULL)
+        newest->newer = entry;
+    else
+        oldest = entry;
+    newest = entry;
+}
+
+/**
+ * @brief Removes an entry from the table and the list, and frees it.
+ */
+static void drop(struct file_cache_entry **link)
+{
+    struct file_cache_entry *entry = *link;
+    *link = entry->chain;
+    unlink_lru(entry);
+    cached_bytes -= entry->size;
+    metrics_gauge_add(METRIC_FILE_CACHE_BYTES, -(int64_t)entry->size);
+    free(entry->data);
+    free(entry);
+}
+
+/**
+ * @brief Finds a cached file and marks it as the most recently used.
+ */
+const struct file_cache_entry *file_cache_get(struct str_view group, struct str_view file)
+{
+    char buffer[FILE_CACHE_KEY_SIZE];
+    struct str_view key = make_key(buffer, group, file);
+    struct file_cache_entry *entry = key.len > 0 ? *find_link(key, view_hash(key)) : NULL;
+    if (entry == NULL)
+    {
+        metrics_add(METRIC_FILE_CACHE_MISSES, 1);
+        return NULL;
+    }
+
+    metrics_add(METRIC_FILE_CACHE_HITS, 1);
+    if (entry != newest)
+    {
+        unlink_lru(entry);
+        push_newest(entry);
+    }
+    return entry;
+}
+
+/**
+ * @brief Loads a file into the cache if it is small enough, evicting older files to make room.
+ */
+const struct file_cache_entry *file_cache_load(struct str_view group, struct str_view file, int fd, size_t size)
+{
+    if (size > server_config.file_cache_max_file_bytes || size > server_config.file_cache_bytes)
+    {
+        return NULL;
+    }
+    char buffer[FILE_CACHE_KEY_SIZE];
+    struct str_view key = make_key(buffer, group, file);
+    if (key.len == 0)
+    {
+        return NULL;
+    }
+
+    struct file_cache_entry *entry = malloc(sizeof(*entry) + key.len);
+    char *data = malloc(size > 0 ? size : 1);
+    size_t loaded = 0;
+    while (entry != NULL && data != NULL && loaded < size)
+    {
+        ssize_t count = pread(fd, data + loaded, size - loaded, loaded);
+        if (count <= 0)
+        {
+            break;
+        }
+        loaded += count;
+    }
+    if (entry == NULL || data == NULL || loaded < size)
+    {
+        free(entry);
+        free(data);
+        return NULL;
+    }
+
+    uint64_t hash = view_hash(key);
+    struct file_cache_entry **link = find_link(key, hash);
+    if (*link != NULL)
+    {
+        drop(link);
+    }
+    while (cached_bytes + size > server_config.file_cache_bytes)
+    {
+        metrics_add(METRIC_FILE_CACHE_EVICTIONS, 1);
+        log_debug("Evicting %.*s from the file cache", (int)oldest->key_length, oldest->key);
+        drop(find_link((struct str_view){oldest->key, oldest->key_length}, oldest->hash));
+    }
+
+    entry->hash = hash;
+    entry->data = data;
+    entry->size = size;
+    entry->key_length = key.len;
+    memcpy(entry->key, key.ptr, key.len);
+    link = find_link(key, hash); // Evictions may have unlinked the entry the link pointed from
+    entry->chain = NULL;
+    *link = entry;
+    push_newest(entry);
+    cached_bytes += size;
+    metrics_gauge_add(METRIC_FILE_CACHE_BYTES, size);
+    return entry;
+}
+
+/**
+ * @brief Drops a file from the cache, if it is there.
+ */
+void file_cache_invalidate(struct str_view group, struct str_view file)
+{
+    char buffer[FILE_CACHE_KEY_SIZE];
+    struct str_view key = make_key(buffer, group, file);
+    if (key.len == 0)
+    {
+        return;
+    }
+    struct file_cache_entry **link = find_link(key, view_hash(key));
+    if (*link != NULL)
+    {
+        drop(link);
+    }
+}
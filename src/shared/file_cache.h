@@ -0,0 +1,65 @@
+/**
+ * @file file_cache.h
+ * @brief In-memory LRU cache of small files served by the downloads.
+ *
+ * Files of at most `file_cache_max_file_bytes` are kept whole in memory after their
+ * first download, keyed by group and file name, so popular attachments are sent
+ * without opening or reading them again. The cache holds at most `file_cache_bytes`
+ * of file data (0 disables it); the least recently downloaded files are dropped first
+ * to make room. Every change of a file on this server, an upload, a replica received
+ * from a peer or a copy replaced by a lazy announcement, drops its entry.
+ *
+ * The cache belongs to the event loop thread and is not locked.
+ */
+
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "command.h"
+
+#define FILE_CACHE_BUCKETS 4096 /**< Chains of the hash table, a power of two */
+
+/**
+ * @struct file_cache_entry
+ * @brief A cached file.
+ */
+struct file_cache_entry
+{
+    struct file_cache_entry *chain;   /**< Next entry of the same bucket */
+    struct file_cache_entry *newer;   /**< Neighbour towards the most recently used entry */
+    struct file_cache_entry *older;   /**< Neighbour towards the least recently used entry */
+    uint64_t hash;                    /**< view_hash() of the key */
+    char *data;                       /**< Contents of the file */
+    size_t size;                      /**< Size of the file */
+    size_t key_length;                /**< Length of `key` */
+    char key[];                       /**< `<group>/<file>` */
+};
+
+/**
+ * @brief Finds a cached file and marks it as the most recently used.
+ *
+ * @param group The group of the file.
+ * @param file The name of the file.
+ * @return The entry, valid until the next call that changes the cache, or NULL.
+ */
+const struct file_cache_entry *file_cache_get(struct str_view group, struct str_view file);
+
+/**
+ * @brief Loads a file into the cache if it is small enough, evicting older files to make room.
+ *
+ * @param group The group of the file.
+ * @param file The name of the file.
+ * @param fd The open file, read with pread() so its offset is left unchanged.
+ * @param size The size of the file.
+ * @return The entry, or NULL if the file is not cached.
+ */
+const struct file_cache_entry *file_cache_load(struct str_view group, struct str_view file, int fd, size_t size);
+
+/**
+ * @brief Drops a file from the cache, if it is there.
+ */
+void file_cache_invalidate(struct str_view group, struct str_view file);
+
+#endif // FILE_CACHE_H
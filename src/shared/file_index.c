@@ -0,0 +1,510 @@
+/**
+ * @file file_index.c
+ * @brief Loading, lookup, journaling and compaction of the group file indexes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "file_index.h"
+#include "checksum.h"
+#include "database.h"
+#include "metrics.h"
+#include "log.h"
+
+#define FILE_INDEX_PATH_SIZE 512 /**< Room for the path of an index */
+#define FILE_INDEX_LINE_SIZE 1280 /**< Room for a record, every character of its names escaped */
+#define FILE_INDEX_SLACK 64       /**< Records past twice the entries an index holds before it is compacted */
+
+/**
+ * @struct group_index
+ * @brief The loaded index of a group.
+ */
+struct group_index
+{
+    char group[64];
+    struct file_index_entry *entries; /**< Sorted by name */
+    int count;
+    int capacity;
+    int records; /**< Lines of the file, entries and changes appended since it was last written whole */
+};
+
+static struct group_index indexes[MAX_GROUPS];
+static int index_count = 0;
+
+/**
+ * @brief Counts the files of other servers in msgapp_replication_saved_bytes.
+ */
+static void count_remote(const struct file_index_entry *entry, int sign)
+{
+    if (entry->node != 0)
+    {
+        metrics_gauge_add(METRIC_REPLICATION_SAVED_BYTES, sign * (int64_t)entry->size);
+    }
+}
+
+/**
+ * @brief Returns the position of a name in a group: its entry, or where it would be inserted.
+ */
+static int search(const struct group_index *index, struct str_view name, int *found)
+{
+    int low = 0, high = index->count;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        int order = strncmp(index->entries[middle].name, name.ptr, name.len);
+        if (order == 0 && index->entries[middle].name[name.len] != '\0')
+        {
+            order = 1;
+        }
+        if (order == 0)
+        {
+            *found = 1;
+            return middle;
+        }
+        if (order < 0)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    *found = 0;
+    return low;
+}
+
+/**
+ * @brief Inserts or replaces an entry in memory.
+ */
+static int insert(struct group_index *index, const struct file_index_entry *entry)
+{
+    int found;
+    int position = search(index, view_from_cstr(entry->name), &found);
+    if (found)
+    {
+        count_remote(&index->entries[position], -1);
+        index->entries[position] = *entry;
+        count_remote(entry, 1);
+        return 0;
+    }
+
+    if (index->count == index->capacity)
+    {
+        int capacity = index->capacity > 0 ? index->capacity * 2 : 16;
+        struct file_index_entry *entries = realloc(index->entries, capacity * sizeof(*entries));
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    memmove(&index->entries[position + 1], &index->entries[position],
+            (index->count - position) * sizeof(*index->entries));
+    index->entries[position] = *entry;
+    index->count++;
+    count_remote(entry, 1);
+    return 0;
+}
+
+/**
+ * @brief Removes an entry in memory.
+ */
+static void remove_at(struct group_index *index, int position)
+{
+    count_remote(&index->entries[position], -1);
+    memmove(&index->entries[position], &index->entries[position + 1],
+            (index->count - position - 1) * sizeof(*index->entries));
+    index->count--;
+}
+
+/**
+ * @brief Hashes a file of the drive.
+ */
+static int hash_file(const char *path, uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    static char buffer[256 * 1024];
+    struct checksum checksum;
+    checksum_init(&checksum);
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        checksum_update(&checksum, buffer, count);
+    }
+    close(fd);
+    *hash = checksum_final(&checksum);
+    return count < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Builds the index of a group from the files in its directory.
+ *
+ * Stubs left by lazy replication before the index existed, `.<file>.remote` holding
+ * `<node> <size> <hash>`, become entries of remote files and are removed.
+ */
+static void scan(struct group_index *index, DIR *dir)
+{
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char path[FILE_INDEX_PATH_SIZE];
+        snprintf(path, sizeof(path), "./drive/%s/%s", index->group, entry->d_name);
+        size_t length = strlen(entry->d_name);
+        struct file_index_entry file = {.version = 1, .uploader = "-"};
+        struct stat file_stat;
+
+        if (entry->d_name[0] == '.' && length > 8 && strcmp(entry->d_name + length - 7, ".remote") == 0)
+        {
+            FILE *stub = fopen(path, "r");
+            unsigned long long hash;
+            if (stub != NULL && fscanf(stub, "%d %lu %llx", &file.node, &file.size, &hash) == 3 && file.node != 0)
+            {
+                snprintf(file.name, sizeof(file.name), "%.*s", (int)length - 8, entry->d_name + 1);
+                file.hash = hash;
+                insert(index, &file);
+            }
+            if (stub != NULL)
+            {
+                fclose(stub);
+            }
+            unlink(path);
+        }
+        else if (entry->d_name[0] != '.' && length < sizeof(file.name) && stat(path, &file_stat) == 0 &&
+                 S_ISREG(file_stat.st_mode) && hash_file(path, &file.hash) == 0)
+        {
+            memcpy(file.name, entry->d_name, length + 1);
+            file.size = file_stat.st_size;
+            file.mtime = file_stat.st_mtime;
+            insert(index, &file);
+        }
+    }
+}
+
+/**
+ * @brief Writes a name with its backslashes, spaces and line breaks escaped, so it is one field.
+ *
+ * @return The length written, or -1 if the buffer is too small.
+ */
+static int escape(char *out, size_t size, const char *text)
+{
+    size_t length = 0;
+    for (; *text != '\0'; text++)
+    {
+        const char *code = strchr("\\ \n\r\t", *text);
+        if (length + 3 > size)
+        {
+            return -1;
+        }
+        if (code != NULL)
+        {
+            out[length++] = '\\';
+            out[length++] = "\\snrt"[code - "\\ \n\r\t"];
+        }
+        else
+        {
+            out[length++] = *text;
+        }
+    }
+    out[length] = '\0';
+    return length;
+}
+
+/**
+ * @brief Decodes a field written by escape().
+ *
+ * A backslash before any other character is kept as is, as indexes from older releases wrote names raw.
+ *
+ * @return 0, or -1 if the field is empty or does not fit.
+ */
+static int unescape(char *out, size_t size, const char *field, size_t field_length)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < field_length; i++)
+    {
+        char c = field[i];
+        const char *code = c == '\\' && i + 1 < field_length ? strchr("\\snrt", field[i + 1]) : NULL;
+        if (code != NULL && *code != '\0')
+        {
+            c = "\\ \n\r\t"[code - "\\snrt"];
+            i++;
+        }
+        if (length + 1 >= size)
+        {
+            return -1;
+        }
+        out[length++] = c;
+    }
+    out[length] = '\0';
+    return length > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Formats the line of an entry, ending with a newline.
+ *
+ * @return The length of the line, or -1 if it does not fit.
+ */
+static int format_entry(char *line, size_t size, const struct file_index_entry *entry)
+{
+    char uploader[2 * FILE_INDEX_USER_SIZE], name[2 * FILE_INDEX_NAME_SIZE];
+    if (escape(uploader, sizeof(uploader), entry->uploader) < 0 || escape(name, sizeof(name), entry->name) < 0)
+    {
+        return -1;
+    }
+    int length = snprintf(line, size, "%u %lu %lld %016llx %d %s %s\n", entry->version, entry->size,
+                          (long long)entry->mtime, (unsigned long long)entry->hash, entry->node, uploader, name);
+    return length < (int)size ? length : -1;
+}
+
+/**
+ * @brief Applies a line of an index file: an entry, or `- <name>` for a removed file.
+ *
+ * @return 0, or -1 if the line cannot be read.
+ */
+static int apply_line(struct group_index *index, char *line, size_t length)
+{
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+    {
+        line[--length] = '\0';
+    }
+    if (line[0] == '-' && line[1] == ' ')
+    {
+        char name[FILE_INDEX_NAME_SIZE];
+        int found;
+        if (unescape(name, sizeof(name), line + 2, length - 2) < 0)
+        {
+            return -1;
+        }
+        int position = search(index, view_from_cstr(name), &found);
+        if (found)
+        {
+            remove_at(index, position);
+        }
+        return 0;
+    }
+
+    struct file_index_entry entry;
+    long long mtime;
+    unsigned long long hash;
+    int fields_end = 0;
+    if (sscanf(line, "%u %lu %lld %llx %d %n", &entry.version, &entry.size, &mtime, &hash, &entry.node,
+               &fields_end) != 5 || fields_end == 0)
+    {
+        return -1;
+    }
+    char *uploader = line + fields_end;
+    char *name = strchr(uploader, ' ');
+    if (name == NULL || unescape(entry.uploader, sizeof(entry.uploader), uploader, name - uploader) < 0 ||
+        unescape(entry.name, sizeof(entry.name), name + 1, line + length - name - 1) < 0)
+    {
+        return -1;
+    }
+    entry.mtime = mtime;
+    entry.hash = hash;
+    return insert(index, &entry);
+}
+
+/**
+ * @brief Writes the index of a group to a temporary file and renames it into place.
+ */
+static int save(struct group_index *index)
+{
+    char path[FILE_INDEX_PATH_SIZE], temp_path[FILE_INDEX_PATH_SIZE];
+    snprintf(path, sizeof(path), "./drive/%s/.index", index->group);
+    snprintf(temp_path, sizeof(temp_path), "./drive/%s/.index.tmp", index->group);
+    FILE *file = fopen(temp_path, "w");
+    if (file == NULL)
+    {
+        log_errno(temp_path);
+        return -1;
+    }
+    for (int i = 0; i < index->count; i++)
+    {
+        char line[FILE_INDEX_LINE_SIZE];
+        if (format_entry(line, sizeof(line), &index->entries[i]) > 0)
+        {
+            fputs(line, file);
+        }
+    }
+    int failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+    if (fclose(file) != 0 || failed || rename(temp_path, path) < 0)
+    {
+        log_errno(path);
+        unlink(temp_path);
+        return -1;
+    }
+    index->records = index->count;
+    return 0;
+}
+
+/**
+ * @brief Appends a record to the index file of a group, compacting the file once most of its lines are stale.
+ *
+ * Records are appended without fsync: a crash of the server loses nothing, and one of the machine
+ * at worst the last changes, while the event loop never waits for the disk.
+ */
+static int append(struct group_index *index, const char *line, int length)
+{
+    if (index->records + 1 > 2 * index->count + FILE_INDEX_SLACK)
+    {
+        return save(index);
+    }
+    char path[FILE_INDEX_PATH_SIZE];
+    snprintf(path, sizeof(path), "./drive/%s/.index", index->group);
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0 || length < 0 || write(fd, line, length) != length)
+    {
+        log_errno(path);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return save(index); // Rewritten whole, so a partial record does not remain
+    }
+    close(fd);
+    index->records++;
+    return 0;
+}
+
+/**
+ * @brief Returns the index of a group, loading or building it on first use.
+ *
+ * @return The index, or NULL if the group has no directory.
+ */
+static struct group_index *get_index(struct str_view group)
+{
+    for (int i = 0; i < index_count; i++)
+    {
+        if (view_equals(group, indexes[i].group))
+        {
+            return &indexes[i];
+        }
+    }
+    if (index_count == MAX_GROUPS || group.len >= sizeof(indexes[0].group) || memchr(group.ptr, '/', group.len) != NULL)
+    {
+        return NULL;
+    }
+
+    char folder[sizeof(indexes[0].group) + 8], path[FILE_INDEX_PATH_SIZE];
+    snprintf(folder, sizeof(folder), "./drive/%.*s", (int)group.len, group.ptr);
+    DIR *dir = opendir(folder);
+    if (dir == NULL)
+    {
+        return NULL;
+    }
+    struct group_index *index = &indexes[index_count++];
+    view_copy(index->group, sizeof(index->group), group);
+
+    snprintf(path, sizeof(path), "%s/.index", folder);
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
+    {
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t length;
+        int number = 0, damaged = 0;
+        while ((length = getline(&line, &size, file)) > 0)
+        {
+            number++;
+            if (line[length - 1] != '\n')
+            {
+                log_warn("%s:%d: incomplete last record dropped", path, number);
+                damaged = 1;
+            }
+            else if (apply_line(index, line, length) < 0)
+            {
+                log_warn("%s:%d: unreadable record skipped", path, number);
+                damaged = 1;
+            }
+        }
+        free(line);
+        fclose(file);
+        index->records = number;
+        if (damaged)
+        {
+            save(index); // Later records must not be appended to a broken line
+        }
+    }
+    else
+    {
+        scan(index, dir);
+        save(index);
+        log_info("Indexed %d files of group %s", index->count, index->group);
+    }
+    closedir(dir);
+    return index;
+}
+
+/**
+ * @brief Returns the files of a group, sorted by name.
+ */
+const struct file_index_entry *file_index_list(struct str_view group, int *count)
+{
+    struct group_index *index = get_index(group);
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    static const struct file_index_entry none;
+    *count = index->count;
+    return index->count > 0 ? index->entries : &none;
+}
+
+/**
+ * @brief Finds a file of a group.
+ */
+const struct file_index_entry *file_index_find(struct str_view group, struct str_view file)
+{
+    struct group_index *index = get_index(group);
+    int found;
+    int position = index != NULL ? search(index, file, &found) : 0;
+    return index != NULL && found ? &index->entries[position] : NULL;
+}
+
+/**
+ * @brief Adds or replaces the entry of a file and records the change in the index of its group.
+ */
+int file_index_put(struct str_view group, const struct file_index_entry *entry)
+{
+    struct group_index *index = get_index(group);
+    if (index == NULL || insert(index, entry) < 0)
+    {
+        return -1;
+    }
+    char line[FILE_INDEX_LINE_SIZE];
+    return append(index, line, format_entry(line, sizeof(line), entry));
+}
+
+/**
+ * @brief Removes the entry of a file, if it has one, and records the change in the index of its group.
+ */
+void file_index_remove(struct str_view group, struct str_view file)
+{
+    struct group_index *index = get_index(group);
+    int found;
+    int position = index != NULL ? search(index, file, &found) : 0;
+    if (index == NULL || !found)
+    {
+        return;
+    }
+    char line[FILE_INDEX_LINE_SIZE], name[2 * FILE_INDEX_NAME_SIZE];
+    int length = escape(name, sizeof(name), index->entries[position].name);
+    remove_at(index, position);
+    append(index, line, length < 0 ? -1 : snprintf(line, sizeof(line), "- %s\n", name));
+}
+
+/**
+ * @brief Returns the version the next upload of a file gets.
+ */
+uint32_t file_index_next_version(struct str_view group, struct str_view file)
+{
+    const struct file_index_entry *entry = file_index_find(group, file);
+    return entry != NULL ? entry->version + 1 : 1;
+}
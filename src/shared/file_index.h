@@ -0,0 +1,84 @@
+/**
+ * @file file_index.h
+ * @brief Persistent index of the files of each group.
+ *
+ * Every group directory holds a hidden `.index` file with one line per file:
+ *
+ *     <version> <size> <mtime> <hash> <node> <uploader> <name>
+ *
+ * where the hash is the XXH64 of the contents in hexadecimal, computed while the file
+ * is received, the version counts the uploads of the name, and the node is 0 for a
+ * file stored here or the node id of the server holding a file of a lazy group. The
+ * index of a group is loaded on first use and kept in memory, sorted by name, so
+ * listing and downloading files need no directory scan or stat. The uploader and name
+ * have their backslashes, spaces and line breaks escaped (`\\`, `\s`, `\n`, `\r`, `\t`),
+ * so each is a single field whatever it holds.
+ *
+ * Each change appends a line to the file, the new entry or `- <name>` for a removed
+ * file, and later lines win when it is loaded. Once most of its lines are stale the
+ * file is compacted: written whole under a temporary name, synced and renamed over the
+ * old one. A line that cannot be read is logged and skipped, and the file compacted.
+ *
+ * A group without an index, such as a drive from an older release, gets one built
+ * from its directory the first time it is used.
+ */
+
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <stdint.h>
+#include <time.h>
+#include "command.h"
+
+#define FILE_INDEX_NAME_SIZE 256 /**< Room for a file name */
+#define FILE_INDEX_USER_SIZE 50  /**< Room for the name of the uploader, as in `users` */
+
+/**
+ * @struct file_index_entry
+ * @brief What the server knows of a file of a group.
+ */
+struct file_index_entry
+{
+    char name[FILE_INDEX_NAME_SIZE];
+    uint64_t size;
+    time_t mtime;                        /**< When the copy of this server was completed */
+    char uploader[FILE_INDEX_USER_SIZE]; /**< User who uploaded the file, "-" if unknown */
+    uint64_t hash;                       /**< XXH64 of the contents */
+    uint32_t version;                    /**< 1 for the first upload of the name, then one more per upload */
+    int node;                            /**< 0 if the file is stored here, else the node id holding it */
+};
+
+/**
+ * @brief Returns the files of a group, sorted by name.
+ *
+ * @param group The group.
+ * @param count Receives the number of files.
+ * @return The entries, valid until the next change of the group, or NULL if the group has no directory.
+ */
+const struct file_index_entry *file_index_list(struct str_view group, int *count);
+
+/**
+ * @brief Finds a file of a group.
+ *
+ * @return The entry, valid until the next change of the group, or NULL.
+ */
+const struct file_index_entry *file_index_find(struct str_view group, struct str_view file);
+
+/**
+ * @brief Adds or replaces the entry of a file and records the change in the index of its group.
+ *
+ * @return 0 on success, -1 if the group has no directory or the index cannot be written.
+ */
+int file_index_put(struct str_view group, const struct file_index_entry *entry);
+
+/**
+ * @brief Removes the entry of a file, if it has one, and records the change in the index of its group.
+ */
+void file_index_remove(struct str_view group, struct str_view file);
+
+/**
+ * @brief Returns the version the next upload of a file gets.
+ */
+uint32_t file_index_next_version(struct str_view group, struct str_view file);
+
+#endif // FILE_INDEX_H
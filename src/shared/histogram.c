@@ -0,0 +1,129 @@
+/**
+ * @file histogram.c
+ * @brief Implementation of the log-linear latency histogram.
+ */
+
+#include <string.h>
+#include "histogram.h"
+
+#define HISTOGRAM_MAX_VALUE ((1ULL << HISTOGRAM_MAX_BITS) - 1)
+
+/**
+ * @brief Empties a histogram.
+ */
+void histogram_init(struct histogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+/**
+ * @brief Returns the index of the bucket counting a value.
+ *
+ * Values below HISTOGRAM_SUB_BUCKETS get a bucket each; above that, the position of the
+ * highest set bit selects the power of two and the next HISTOGRAM_SUB_BITS bits select
+ * the bucket inside it.
+ */
+int histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+    {
+        return value;
+    }
+    if (value > HISTOGRAM_MAX_VALUE)
+    {
+        value = HISTOGRAM_MAX_VALUE;
+    }
+
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    int sub_bucket = (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/**
+ * @brief Returns the largest value counted by a bucket.
+ */
+uint64_t histogram_bucket_limit(int bucket)
+{
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + (1ULL << shift) - 1;
+}
+
+/**
+ * @brief Records one value.
+ */
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value < histogram->min)
+    {
+        histogram->min = value;
+    }
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+/**
+ * @brief Adds the values of `from` to `into`.
+ */
+void histogram_merge(struct histogram *into, const struct histogram *from)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min)
+    {
+        into->min = from->min;
+    }
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+/**
+ * @brief Returns the value below which a given fraction of the recorded values fall.
+ *
+ * @param histogram The histogram.
+ * @param percentile The percentile, between 0 and 100 (e.g. 99.9).
+ * @return The upper bound of the bucket holding the percentile, or 0 if the histogram is empty.
+ */
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
@@ -0,0 +1,69 @@
+/**
+ * @file histogram.h
+ * @brief Log-linear histogram of latencies.
+ *
+ * Values are counted in buckets whose width grows with their magnitude: every power of
+ * two is split into HISTOGRAM_SUB_BUCKETS equal buckets, so any recorded value is known
+ * to within about 1.5% while the whole histogram stays a few kilobytes. Recording is a
+ * handful of instructions and never allocates. A histogram is not thread-safe; threads
+ * keep their own and merge them when reporting.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 6                              /**< log2 of the buckets per power of two */
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)   /**< Buckets per power of two */
+#define HISTOGRAM_MAX_BITS 40                             /**< Values of 2^40 and above are clamped (about 18 minutes in ns) */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * @struct histogram
+ * @brief Bucket counts and summary of a set of values.
+ */
+struct histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS]; /**< Number of values recorded in each bucket */
+    uint64_t count;                     /**< Number of values recorded */
+    uint64_t sum;                       /**< Sum of the values recorded */
+    uint64_t min;                       /**< Smallest value recorded */
+    uint64_t max;                       /**< Largest value recorded */
+};
+
+/**
+ * @brief Empties a histogram.
+ */
+void histogram_init(struct histogram *histogram);
+
+/**
+ * @brief Records one value.
+ */
+void histogram_record(struct histogram *histogram, uint64_t value);
+
+/**
+ * @brief Adds the values of `from` to `into`.
+ */
+void histogram_merge(struct histogram *into, const struct histogram *from);
+
+/**
+ * @brief Returns the value below which a given fraction of the recorded values fall.
+ *
+ * @param histogram The histogram.
+ * @param percentile The percentile, between 0 and 100 (e.g. 99.9).
+ * @return The upper bound of the bucket holding the percentile, or 0 if the histogram is empty.
+ */
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile);
+
+/**
+ * @brief Returns the index of the bucket counting a value.
+ */
+int histogram_bucket(uint64_t value);
+
+/**
+ * @brief Returns the largest value counted by a bucket.
+ */
+uint64_t histogram_bucket_limit(int bucket);
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,237 @@
+/**
+ * @file log.c
+ * @brief Per-thread log rings and the thread draining them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+/**
+ * @struct log_record
+ * @brief One formatted line waiting in a ring.
+ */
+struct log_record
+{
+    uint64_t time_ns; /**< Wall-clock time of the call */
+    uint32_t level;
+    char text[LOG_TEXT_SIZE];
+};
+
+/**
+ * @struct log_ring
+ * @brief Single-producer, single-consumer ring of one thread.
+ *
+ * The owning thread advances `head` after filling a record and the drain thread
+ * advances `tail` after writing it out; both are free-running counters.
+ */
+struct log_ring
+{
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;  /**< Records lost because the ring was full */
+    uint64_t reported; /**< Value of `dropped` already reported */
+    int id;            /**< Registration order, printed to tell threads apart */
+    struct log_ring *next;
+    struct log_record records[LOG_RING_RECORDS];
+};
+
+enum log_level log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+
+static struct log_ring *rings = NULL;
+static int ring_count = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t drain_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *local_ring = NULL;
+
+/**
+ * @brief Writes out the pending records of every ring.
+ *
+ * @return The number of records written.
+ */
+static int drain(FILE *out)
+{
+    int written = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        for (; tail != head; tail++)
+        {
+            struct log_record *record = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+            time_t seconds = record->time_ns / 1000000000ull;
+            struct tm tm;
+            char stamp[32];
+            gmtime_r(&seconds, &tm);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+            fprintf(out, "%s.%06lluZ %-5s [t%d] %s\n", stamp,
+                    (unsigned long long)(record->time_ns % 1000000000ull / 1000),
+                    level_names[record->level], ring->id, record->text);
+            written++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported)
+        {
+            fprintf(out, "[t%d] %llu log lines dropped, the ring was full\n", ring->id,
+                    (unsigned long long)(dropped - ring->reported));
+            ring->reported = dropped;
+        }
+    }
+    if (written > 0)
+    {
+        fflush(out);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return written;
+}
+
+static void *drain_main(void *arg)
+{
+    (void)arg;
+    struct timespec pause = {0, LOG_DRAIN_INTERVAL_MS * 1000000L};
+    while (1)
+    {
+        if (drain(stdout) == 0)
+        {
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void start_drain_thread(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drain_main, NULL) == 0)
+    {
+        pthread_detach(thread);
+    }
+    atexit(log_flush);
+}
+
+/**
+ * @brief Returns the ring of the calling thread, creating it on first use.
+ */
+static struct log_ring *get_ring(void)
+{
+    if (local_ring != NULL)
+    {
+        return local_ring;
+    }
+
+    pthread_once(&drain_once, start_drain_thread);
+    struct log_ring *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    ring->id = ring_count++;
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rings_lock);
+    return local_ring = ring;
+}
+
+/**
+ * @brief Appends a line to the ring of the calling thread.
+ */
+void log_write(enum log_level level, const char *format, ...)
+{
+    struct log_ring *ring = get_ring();
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_RECORDS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_record *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    record->level = level;
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+
+    if (length >= (int)sizeof(record->text))
+    {
+        length = sizeof(record->text) - 1;
+    }
+    while (length > 0 && record->text[length - 1] == '\n')
+    {
+        record->text[--length] = '\0';
+    }
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Decides whether a sampled call site may log now.
+ */
+int log_sample(struct log_sampler *sampler, enum log_level level)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    if ((uint64_t)now.tv_sec != sampler->second)
+    {
+        if (sampler->suppressed > 0)
+        {
+            log_write(level, "%u similar lines suppressed in the last second", sampler->suppressed);
+        }
+        sampler->second = now.tv_sec;
+        sampler->emitted = 0;
+        sampler->suppressed = 0;
+    }
+
+    if (sampler->emitted < LOG_SAMPLE_PER_SEC)
+    {
+        sampler->emitted++;
+        return 1;
+    }
+    sampler->suppressed++;
+    return 0;
+}
+
+/**
+ * @brief Returns the level named `name`.
+ */
+int log_level_from_name(const char *name)
+{
+    static const char *names[] = {"debug", "info", "warn", "error", "off"};
+    for (int i = 0; i <= LOG_LEVEL_OFF; i++)
+    {
+        if (strcmp(name, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Writes out every record still in the rings.
+ */
+void log_flush(void)
+{
+    drain(stdout);
+}
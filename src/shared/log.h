@@ -0,0 +1,118 @@
+/**
+ * @file log.h
+ * @brief Leveled logger writing to per-thread rings drained by a background thread.
+ *
+ * A log call formats its line into a fixed-size record of the ring owned by the
+ * calling thread and returns without any I/O or lock; a background thread writes the
+ * records to stdout. When a ring is full the record is dropped and counted instead of
+ * stalling the event loop.
+ *
+ * The level test is done by the macros, so a disabled log line costs one comparison
+ * and its arguments are never evaluated.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#define LOG_TEXT_SIZE 244       /**< Bytes of text per record, which makes records 256 bytes */
+#define LOG_RING_RECORDS 1024   /**< Records per thread ring, a power of two */
+#define LOG_SAMPLE_PER_SEC 20   /**< Lines per second let through by each sampled call site */
+#define LOG_DRAIN_INTERVAL_MS 5 /**< Pause of the drain thread when every ring is empty */
+
+/**
+ * @enum log_level
+ * @brief Severity of a log line, in increasing order.
+ */
+enum log_level
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF /**< Only as a threshold: disables every line */
+};
+
+/**
+ * @struct log_sampler
+ * @brief State of one sampled call site in one thread.
+ */
+struct log_sampler
+{
+    uint64_t second;     /**< Second the counters refer to */
+    unsigned emitted;    /**< Lines let through during that second */
+    unsigned suppressed; /**< Lines dropped during that second */
+};
+
+extern enum log_level log_level; /**< Lines below this level are discarded */
+
+/** Non-zero if lines of `level` are kept */
+#define LOG_ENABLED(level) ((level) >= log_level)
+
+/** Logs a printf-style line at `level` */
+#define log_at(level, ...)                  \
+    do                                      \
+    {                                       \
+        if (LOG_ENABLED(level))             \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/** Logs `what` followed by the description of errno, like perror() */
+#define log_errno(what) log_at(LOG_LEVEL_ERROR, "%s: %s", (what), strerror(errno))
+
+/**
+ * Logs a line at `level`, keeping at most LOG_SAMPLE_PER_SEC lines per second from
+ * this call site in this thread. The number of dropped lines is reported once the
+ * second is over.
+ */
+#define log_sampled(level, ...)                                          \
+    do                                                                   \
+    {                                                                    \
+        static __thread struct log_sampler log_site_sampler;            \
+        if (LOG_ENABLED(level) && log_sample(&log_site_sampler, (level))) \
+            log_write((level), __VA_ARGS__);                             \
+    } while (0)
+
+/**
+ * @brief Appends a line to the ring of the calling thread.
+ *
+ * Callers go through the macros, which test the level first. A trailing newline in
+ * the format is dropped since every record is written as one line.
+ *
+ * @param level The severity of the line.
+ * @param format A printf format string, followed by its arguments.
+ */
+void log_write(enum log_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Decides whether a sampled call site may log now.
+ *
+ * @param sampler The state of the call site.
+ * @param level The level used to report suppressed lines.
+ * @return Non-zero if the line should be written.
+ */
+int log_sample(struct log_sampler *sampler, enum log_level level);
+
+/**
+ * @brief Returns the level named `name` ("debug", "info", "warn", "error" or "off").
+ *
+ * @return The level, or -1 if the name is not recognised.
+ */
+int log_level_from_name(const char *name);
+
+/**
+ * @brief Writes out every record still in the rings.
+ *
+ * Called at exit so that the last lines of a failing process are not lost.
+ */
+void log_flush(void);
+
+#endif // LOG_H
@@ -0,0 +1,525 @@
+/**
+ * @file mailbox.c
+ * @brief Mailboxes of the offline users, their spill files and their delivery.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "mailbox.h"
+#include "config.h"
+#include "database.h"
+#include "socket_utils.h"
+#include "peer.h"
+#include "presence.h"
+#include "metrics.h"
+#include "log.h"
+
+#define MAILBOX_PATH_SIZE 128   /**< Room for `mailbox/<user>` */
+#define MAILBOX_HEADER_ROOM 128 /**< Room for the header of a frame carrying a mailbox */
+#define MAILBOX_MAX_FORWARDS 64 /**< Mailboxes sent to peers and not yet acknowledged */
+
+/**
+ * @struct forward
+ * @brief A mailbox sent to a peer, kept until the peer acknowledges it with `mailbox_ack`.
+ */
+struct forward
+{
+    int peer_index;      /**< Index in `peers` of the server it was sent to */
+    struct mailbox *box; /**< The mailbox it was taken from */
+    char *data;          /**< The chat lines sent, each behind its length */
+    size_t length;       /**< Bytes in `data` */
+};
+
+static struct mailbox mailboxes[MAX_USERS];
+static int mailbox_count = 0;
+static int slots[MAILBOX_TABLE_SIZE]; /**< Index + 1 of the mailbox hashed to each slot, 0 if free */
+static size_t memory_bytes = 0;       /**< Bytes of chat lines held in memory by all the mailboxes */
+static struct forward forwards[MAILBOX_MAX_FORWARDS]; /**< Oldest first */
+static int forward_count = 0;
+
+/**
+ * @brief Returns the slot of a user name: its mailbox, or the free slot where it goes.
+ */
+static int *find_slot(struct str_view username)
+{
+    uint64_t hash = view_hash(username);
+    for (size_t i = 0; i < MAILBOX_TABLE_SIZE; i++)
+    {
+        int *slot = &slots[(hash + i) & (MAILBOX_TABLE_SIZE - 1)];
+        if (*slot == 0 || view_equals(username, mailboxes[*slot - 1].username))
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Writes the path of the spill file of a mailbox.
+ *
+ * @return The path, or NULL if the user name cannot be used as a file name.
+ */
+static const char *make_path(char *path, const struct mailbox *box)
+{
+    if (box->username[0] == '.' || strchr(box->username, '/') != NULL)
+    {
+        return NULL;
+    }
+    snprintf(path, MAILBOX_PATH_SIZE, "%s/%s", MAILBOX_DIR, box->username);
+    return path;
+}
+
+/**
+ * @brief Finds the mailbox of a user, creating it if needed.
+ *
+ * A new mailbox picks up the spill file left by an earlier run of the server.
+ */
+static struct mailbox *get_mailbox(struct str_view username)
+{
+    int *slot = find_slot(username);
+    if (slot == NULL || username.len >= sizeof(mailboxes[0].username))
+    {
+        return NULL;
+    }
+    if (*slot != 0)
+    {
+        return &mailboxes[*slot - 1];
+    }
+    if (mailbox_count == MAX_USERS)
+    {
+        return NULL;
+    }
+
+    struct mailbox *box = &mailboxes[mailbox_count++];
+    memset(box, 0, sizeof(*box));
+    view_copy(box->username, sizeof(box->username), username);
+    *slot = mailbox_count;
+
+    char path[MAILBOX_PATH_SIZE];
+    struct stat file_stat;
+    if (make_path(path, box) != NULL && stat(path, &file_stat) == 0)
+    {
+        box->spilled = file_stat.st_size;
+    }
+    return box;
+}
+
+/**
+ * @brief Returns the most bytes a mailbox may hold: the setting, capped to what one frame carries.
+ */
+static uint64_t max_bytes(void)
+{
+    uint64_t limit = server_config.mailbox_max_bytes;
+    return limit < FRAME_MAX_SIZE - MAILBOX_HEADER_ROOM ? limit : FRAME_MAX_SIZE - MAILBOX_HEADER_ROOM;
+}
+
+/**
+ * @brief Counts the chat lines of a mailbox, each behind its length as in a `batch` frame.
+ */
+static size_t count_lines(const char *data, size_t length)
+{
+    size_t count = 0, line_length;
+    const char *cursor = data;
+    while (batch_next_line(&cursor, data + length, &line_length) != NULL)
+    {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Frees the lines a mailbox holds in memory.
+ */
+static void release(struct mailbox *box)
+{
+    memory_bytes -= box->length;
+    metrics_gauge_add(METRIC_MAILBOX_BYTES, -(int64_t)box->length);
+    free(box->data);
+    box->data = NULL;
+    box->length = 0;
+    box->capacity = 0;
+}
+
+/**
+ * @brief Appends the lines a mailbox holds in memory to its spill file, and frees them.
+ */
+static void spill(struct mailbox *box)
+{
+    char path[MAILBOX_PATH_SIZE];
+    if (make_path(path, box) == NULL)
+    {
+        return;
+    }
+    if (mkdir(MAILBOX_DIR, 0777) < 0 && errno != EEXIST)
+    {
+        log_errno(MAILBOX_DIR);
+        return;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0)
+    {
+        log_errno(path);
+        return;
+    }
+
+    size_t written = 0;
+    while (written < box->length)
+    {
+        ssize_t count = write(fd, box->data + written, box->length - written);
+        if (count < 0)
+        {
+            log_errno(path);
+            // Whatever reached the file is not kept twice
+            memmove(box->data, box->data + written, box->length - written);
+            box->spilled += written;
+            memory_bytes -= written;
+            metrics_gauge_add(METRIC_MAILBOX_BYTES, -(int64_t)written);
+            box->length -= written;
+            close(fd);
+            return;
+        }
+        written += count;
+    }
+    close(fd);
+    box->spilled += written;
+    metrics_add(METRIC_MAILBOX_SPILLED_BYTES, written);
+    release(box);
+}
+
+/**
+ * @brief Adds chat lines to a mailbox, spilling it to disk if the mailboxes use too much memory.
+ *
+ * @return 0 on success, -1 if the mailbox is full or out of memory.
+ */
+static int store(struct mailbox *box, const struct iovec *parts, int count)
+{
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        length += parts[i].iov_len;
+    }
+    if (box->spilled + box->length + length > max_bytes())
+    {
+        return -1;
+    }
+
+    if (box->length + length > box->capacity)
+    {
+        size_t capacity = box->capacity > 0 ? box->capacity : 256;
+        while (capacity < box->length + length)
+        {
+            capacity *= 2;
+        }
+        char *data = realloc(box->data, capacity);
+        if (data == NULL)
+        {
+            return -1;
+        }
+        box->data = data;
+        box->capacity = capacity;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(box->data + box->length, parts[i].iov_base, parts[i].iov_len);
+        box->length += parts[i].iov_len;
+    }
+    memory_bytes += length;
+    metrics_gauge_add(METRIC_MAILBOX_BYTES, length);
+
+    if (memory_bytes > server_config.mailbox_memory_bytes)
+    {
+        spill(box);
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues a chat line for a user.
+ */
+void mailbox_append(const char *username, const struct iovec *parts, int count)
+{
+    struct mailbox *box = get_mailbox(view_from_cstr(username));
+    struct iovec line[FRAME_MAX_PARTS];
+    if (box == NULL || count >= FRAME_MAX_PARTS)
+    {
+        metrics_add(METRIC_MAILBOX_DROPPED, 1);
+        return;
+    }
+    int32_t length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        length += parts[i].iov_len;
+    }
+    line[0].iov_base = &length;
+    line[0].iov_len = sizeof(length);
+    memcpy(&line[1], parts, count * sizeof(*parts));
+
+    if (store(box, line, count + 1) < 0)
+    {
+        metrics_add(METRIC_MAILBOX_DROPPED, 1);
+        log_sampled(LOG_LEVEL_WARN, "Mailbox of %s full, message dropped", username);
+        return;
+    }
+    metrics_add(METRIC_MAILBOX_QUEUED, 1);
+}
+
+/**
+ * @brief Takes the lines out of a mailbox, the spilled ones first, and empties it.
+ *
+ * @param box The mailbox.
+ * @param length Receives the number of bytes taken.
+ * @return The lines, to be freed by the caller, or NULL if the mailbox is empty or memory ran out.
+ */
+static char *take_lines(struct mailbox *box, size_t *length)
+{
+    *length = 0;
+    if (box->spilled + box->length == 0)
+    {
+        return NULL;
+    }
+    if (box->spilled == 0)
+    {
+        // Nothing on disk: the buffer of the mailbox is handed over as it is
+        char *data = box->data;
+        *length = box->length;
+        memory_bytes -= box->length;
+        metrics_gauge_add(METRIC_MAILBOX_BYTES, -(int64_t)box->length);
+        box->data = NULL;
+        box->length = 0;
+        box->capacity = 0;
+        return data;
+    }
+
+    // The older lines are on disk: read them back in front of the ones in memory
+    size_t size = box->spilled < max_bytes() ? box->spilled : max_bytes();
+    char *data = malloc(size + box->length);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+    char path[MAILBOX_PATH_SIZE];
+    int file = make_path(path, box) != NULL ? open(path, O_RDONLY) : -1;
+    if (file >= 0)
+    {
+        ssize_t count;
+        while (*length < size && (count = read(file, data + *length, size - *length)) > 0)
+        {
+            *length += count;
+        }
+        close(file);
+        unlink(path);
+    }
+    memcpy(data + *length, box->data, box->length);
+    *length += box->length;
+    box->spilled = 0;
+    release(box);
+    return data;
+}
+
+/**
+ * @brief Puts lines taken by take_lines() back in front of a mailbox, before the lines queued since.
+ */
+static void restore(struct mailbox *box, const char *data, size_t length)
+{
+    size_t newer_length;
+    char *newer = take_lines(box, &newer_length);
+    struct iovec parts[2] = {
+        {(char *)data, length},
+        {newer, newer_length},
+    };
+    if (store(box, parts, 2) < 0)
+    {
+        size_t count = count_lines(data, length) + count_lines(newer, newer_length);
+        metrics_add(METRIC_MAILBOX_DROPPED, count);
+        log_sampled(LOG_LEVEL_WARN, "Mailbox of %s full, %zu returned messages dropped", box->username, count);
+    }
+    free(newer);
+}
+
+/**
+ * @brief Sends the messages waiting for a user as one `batch` frame, and empties the mailbox.
+ */
+int mailbox_deliver(const char *username, int fd)
+{
+    struct mailbox *box = get_mailbox(view_from_cstr(username));
+    size_t length;
+    char *data = box != NULL ? take_lines(box, &length) : NULL;
+    if (data == NULL)
+    {
+        return 0;
+    }
+
+    struct iovec parts[2] = {
+        {FRAME_BATCH_HEADER, sizeof(FRAME_BATCH_HEADER) - 1},
+        {data, length},
+    };
+    int delivered = count_lines(data, length);
+    if (send_message_parts(fd, parts, 2) < 0)
+    {
+        restore(box, data, length);
+        delivered = 0;
+    }
+    free(data);
+    if (delivered <= 0)
+    {
+        return 0;
+    }
+    metrics_add(METRIC_MAILBOX_DELIVERED, delivered);
+    log_sampled(LOG_LEVEL_DEBUG, "Delivered %d queued messages to %s", delivered, username);
+    return delivered;
+}
+
+/**
+ * @brief Sends the messages waiting for a user to the server the user logged in on.
+ */
+void mailbox_forward(const char *username, int node)
+{
+    struct mailbox *box = get_mailbox(view_from_cstr(username));
+    if (box == NULL || box->spilled + box->length == 0)
+    {
+        return;
+    }
+    if (forward_count == MAILBOX_MAX_FORWARDS)
+    {
+        log_sampled(LOG_LEVEL_WARN, "Too many mailboxes waiting for an acknowledgement, the one of %s stays here",
+                    username);
+        return;
+    }
+    for (int i = 0; i < peer_count; i++)
+    {
+        struct peer *peer = &peers[i];
+        if (peer->id != node || peer->state != PEER_CONNECTED)
+        {
+            continue;
+        }
+
+        struct forward *forward = &forwards[forward_count];
+        forward->data = take_lines(box, &forward->length);
+        if (forward->data == NULL)
+        {
+            return;
+        }
+        char header[MAILBOX_HEADER_ROOM];
+        int length = snprintf(header, sizeof(header), "mailbox %s\n", username);
+        struct iovec parts[2] = {
+            {header, length},
+            {forward->data, forward->length},
+        };
+        if (send_message_parts(peer->fd, parts, 2) < 0)
+        {
+            // Part of the frame may have gone out, which leaves the link out of step
+            log_warn("Cannot write to node %d, dropping the link", peer->id);
+            shutdown(peer->fd, SHUT_RDWR);
+            peer->state = PEER_SYNCING;
+            restore(box, forward->data, forward->length);
+            free(forward->data);
+            return;
+        }
+        forward->peer_index = i;
+        forward->box = box;
+        forward_count++;
+        log_sampled(LOG_LEVEL_DEBUG, "Forwarded %zu queued messages of %s to node %d",
+                    count_lines(forward->data, forward->length), username, node);
+        return;
+    }
+}
+
+/**
+ * @brief Frees the oldest mailbox of a user sent to a peer, which acknowledged it.
+ */
+void mailbox_acknowledge(int peer_index, struct str_view username)
+{
+    for (int i = 0; i < forward_count; i++)
+    {
+        if (forwards[i].peer_index == peer_index && view_equals(username, forwards[i].box->username))
+        {
+            free(forwards[i].data);
+            memmove(&forwards[i], &forwards[i + 1], (forward_count - i - 1) * sizeof(forwards[0]));
+            forward_count--;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Puts the mailboxes sent to a peer and not acknowledged back, when its link is lost.
+ */
+void mailbox_forget(int peer_index)
+{
+    // Newest first, as each one goes back in front of its mailbox
+    for (int i = forward_count - 1; i >= 0; i--)
+    {
+        if (forwards[i].peer_index == peer_index)
+        {
+            restore(forwards[i].box, forwards[i].data, forwards[i].length);
+            free(forwards[i].data);
+            forwards[i].data = NULL;
+        }
+    }
+    int kept = 0;
+    for (int i = 0; i < forward_count; i++)
+    {
+        if (forwards[i].data != NULL)
+        {
+            forwards[kept++] = forwards[i];
+        }
+    }
+    forward_count = kept;
+}
+
+/**
+ * @brief Delivers the messages of a `mailbox` frame sent by a peer.
+ */
+void mailbox_receive(int peer_fd, struct str_view username, struct str_view lines)
+{
+    // Whatever becomes of the lines, this server answers for them from now on
+    char ack[MAILBOX_HEADER_ROOM];
+    struct iovec ack_part = {ack, snprintf(ack, sizeof(ack), "mailbox_ack %.*s", (int)username.len, username.ptr)};
+    if (ack_part.iov_len < sizeof(ack) && send_message_parts(peer_fd, &ack_part, 1) < 0)
+    {
+        shutdown(peer_fd, SHUT_RDWR);
+    }
+
+    // The lines are kept as they came, so they must be whole
+    size_t count = 0, length;
+    const char *cursor = lines.ptr;
+    while (batch_next_line(&cursor, lines.ptr + lines.len, &length) != NULL)
+    {
+        count++;
+    }
+    if (cursor != lines.ptr + lines.len)
+    {
+        log_warn("Malformed mailbox of %.*s received, dropped", (int)username.len, username.ptr);
+        return;
+    }
+    if (count == 0)
+    {
+        return;
+    }
+    struct iovec parts[2] = {
+        {FRAME_BATCH_HEADER, sizeof(FRAME_BATCH_HEADER) - 1},
+        {(char *)lines.ptr, lines.len},
+    };
+
+    int fd = presence_local_fd(username);
+    if (fd >= 0 && send_message_parts(fd, parts, 2) == 0)
+    {
+        metrics_add(METRIC_MAILBOX_DELIVERED, count);
+        return;
+    }
+
+    // The user logged out again: keep the messages for the next login
+    struct mailbox *box = get_mailbox(username);
+    if (box == NULL || store(box, &parts[1], 1) < 0)
+    {
+        metrics_add(METRIC_MAILBOX_DROPPED, count);
+        log_sampled(LOG_LEVEL_WARN, "Mailbox of %.*s full, %zu forwarded messages dropped", (int)username.len,
+                    username.ptr, count);
+    }
+}
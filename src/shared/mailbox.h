@@ -0,0 +1,110 @@
+/**
+ * @file mailbox.h
+ * @brief Chat messages kept for the group members who are logged in nowhere.
+ *
+ * A message sent to a group is queued for each member that the presence directory
+ * shows offline in the whole cluster, by the server the message was posted on. A
+ * mailbox holds the chat lines exactly as a `batch` frame carries them, each behind
+ * its length (see batch_next_line()), so it is sent without any reformatting: when its
+ * user logs in, the whole mailbox goes out as one frame, `batch` followed by the
+ * `<user>: <message>` lines, instead of one frame per message. When the user logs in
+ * on another server, the presence change gossiped by that server makes this one send
+ * it the mailbox over their link, `mailbox <user>` followed by the same lines, and
+ * that server delivers it and answers `mailbox_ack <user>`. Until then the lines are
+ * kept aside, and they go back in front of the mailbox if the link is lost first.
+ *
+ * Mailboxes live in memory up to `mailbox_memory_bytes` in total. Past that, the one
+ * that grew is appended to `mailbox/<user>` in the working directory of the server
+ * and freed, the file being delivered first, so the order of the messages is kept and
+ * a mailbox survives a restart once on disk. Each mailbox holds at most
+ * `mailbox_max_bytes`; messages beyond it are dropped (msgapp_mailbox_messages_total
+ * with event="dropped").
+ *
+ * Mailboxes belong to the event loop thread and are not locked.
+ */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "command.h"
+
+#define MAILBOX_DIR "mailbox"    /**< Directory of the mailboxes spilled to disk */
+#define MAILBOX_TABLE_SIZE 16384 /**< Slots of the hash table, a power of two over twice MAX_USERS */
+
+/**
+ * @struct mailbox
+ * @brief Messages waiting for a user.
+ */
+struct mailbox
+{
+    char username[50];
+    char *data;       /**< Chat lines kept in memory, each behind its length */
+    size_t length;    /**< Bytes used in `data` */
+    size_t capacity;  /**< Bytes allocated for `data` */
+    uint64_t spilled; /**< Bytes of older lines in the file of the mailbox */
+};
+
+/**
+ * @brief Queues a chat line for a user.
+ *
+ * @param username The user the line is for.
+ * @param parts The pieces of the line, without its newline.
+ * @param count The number of pieces.
+ */
+void mailbox_append(const char *username, const struct iovec *parts, int count);
+
+/**
+ * @brief Sends the messages waiting for a user as one `batch` frame, and empties the mailbox.
+ *
+ * Called before the login of the user is answered, so that a client waiting for the
+ * answer shows the messages first.
+ *
+ * @param username The user.
+ * @param fd The socket of a session of the user.
+ * @return The number of messages delivered.
+ */
+int mailbox_deliver(const char *username, int fd);
+
+/**
+ * @brief Sends the messages waiting for a user to the server the user logged in on.
+ *
+ * Called for each login gossiped by a peer. The mailbox is kept if the link is down,
+ * and a link on which the frame cannot be written whole is dropped.
+ *
+ * @param username The user.
+ * @param node The node id of the server.
+ */
+void mailbox_forward(const char *username, int node);
+
+/**
+ * @brief Delivers the messages of a `mailbox` frame sent by a peer, and acknowledges it.
+ *
+ * They are queued here again if the user is no longer logged in on this server.
+ *
+ * @param peer_fd The link the frame came on.
+ * @param username The user.
+ * @param lines The chat lines, each behind its length, as they follow the line of the user name.
+ */
+void mailbox_receive(int peer_fd, struct str_view username, struct str_view lines);
+
+/**
+ * @brief Frees the oldest mailbox of a user sent to a peer, once the peer sent `mailbox_ack`.
+ *
+ * @param peer_index The index in `peers` of the peer.
+ * @param username The user.
+ */
+void mailbox_acknowledge(int peer_index, struct str_view username);
+
+/**
+ * @brief Puts the mailboxes sent to a peer and not acknowledged back, when its link is lost.
+ *
+ * They are forwarded again when the peer gossips the login of their users anew.
+ *
+ * @param peer_index The index in `peers` of the peer.
+ */
+void mailbox_forget(int peer_index);
+
+#endif // MAILBOX_H
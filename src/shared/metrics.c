@@ -0,0 +1,590 @@
+/**
+ * @file metrics.c
+ * @brief Per-thread metric shards and their Prometheus exposition.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "metrics.h"
+#include "histogram.h"
+
+#define METRICS_REQUEST_SIZE 2048
+#define METRICS_MIN_FD 16 /**< Keeps the listener off the low fds used by clients and peer links */
+#define METRICS_MAX_ROUTES 4
+
+/**
+ * @struct metrics_shard
+ * @brief Metrics recorded by one thread.
+ *
+ * Only the owning thread writes a shard; the admin thread reads it concurrently with
+ * relaxed atomic loads, which is enough for monotonic values.
+ */
+struct metrics_shard
+{
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    struct histogram histograms[METRIC_HISTOGRAM_COUNT];
+    struct histogram commands[COMMAND_COUNT];
+    struct metrics_shard *next;
+};
+
+static struct metrics_shard *shards = NULL;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct metrics_shard *local_shard = NULL;
+static int64_t gauges[METRIC_GAUGE_COUNT];
+
+/**
+ * @struct metrics_route
+ * @brief Extra document served on the admin port.
+ */
+struct metrics_route
+{
+    const char *path;
+    const char *content_type;
+    void (*render)(FILE *out);
+};
+
+static struct metrics_route routes[METRICS_MAX_ROUTES];
+static int route_count = 0;
+
+/**
+ * @struct metric_info
+ * @brief Exposition name, labels and help text of a metric.
+ *
+ * Entries sharing a name form one family and are printed together.
+ */
+struct metric_info
+{
+    const char *name;
+    const char *labels;
+    const char *help;
+};
+
+static const struct metric_info counter_info[METRIC_COUNTER_COUNT] = {
+    [METRIC_CONNECTIONS_OPENED] = {"msgapp_connections_opened_total", "", "Connections accepted."},
+    [METRIC_CONNECTIONS_CLOSED] = {"msgapp_connections_closed_total", "", "Connections closed."},
+    [METRIC_FRAMES_RECEIVED] = {"msgapp_frames_received_total", "", "Frames received."},
+    [METRIC_BYTES_RECEIVED] = {"msgapp_received_bytes_total", "", "Bytes received in frames, headers included."},
+    [METRIC_FRAMES_SENT] = {"msgapp_frames_sent_total", "", "Frames sent."},
+    [METRIC_BYTES_SENT] = {"msgapp_sent_bytes_total", "", "Bytes sent in frames, headers included."},
+    [METRIC_FRAMES_TOO_LARGE] = {"msgapp_frames_dropped_total", "reason=\"too_large\"", "Frames dropped without being handled."},
+    [METRIC_FRAMES_INVALID] = {"msgapp_frames_dropped_total", "reason=\"invalid\"", NULL},
+    [METRIC_FRAMES_REJECTED] = {"msgapp_frames_dropped_total", "reason=\"rate_limited\"", NULL},
+    [METRIC_FRAMES_DELAYED] = {"msgapp_frames_delayed_total", "", "Frames held back by the rate limiter."},
+    [METRIC_PEER_FORWARDS] = {"msgapp_peer_forwards_total", "", "Commands written to a peer server, counted once per peer."},
+    [METRIC_PEER_FORWARDS_SKIPPED] = {"msgapp_peer_forwards_skipped_total", "", "Chat messages not sent to a linked peer with no member of the group logged in."},
+    [METRIC_PEER_RECONNECTS] = {"msgapp_peer_reconnects_total", "", "Links to a peer server restored after being lost."},
+    [METRIC_PEER_REPLAYED] = {"msgapp_peer_replayed_total", "", "Replicated commands sent again to a peer server after its link came back."},
+    [METRIC_UPLOADS] = {"msgapp_transfers_total", "direction=\"upload\"", "File transfers completed."},
+    [METRIC_DOWNLOADS] = {"msgapp_transfers_total", "direction=\"download\"", NULL},
+    [METRIC_DOWNLOAD_RANGES] = {"msgapp_transfers_total", "direction=\"download_range\"", NULL},
+    [METRIC_PULLS] = {"msgapp_transfers_total", "direction=\"pull_in\"", NULL},
+    [METRIC_UPLOAD_BYTES] = {"msgapp_transfer_bytes_total", "direction=\"upload\"", "Bytes of file data transferred."},
+    [METRIC_DOWNLOAD_BYTES] = {"msgapp_transfer_bytes_total", "direction=\"download\"", NULL},
+    [METRIC_REPLICATION_BYTES_SENT] = {"msgapp_transfer_bytes_total", "direction=\"replication_out\"", NULL},
+    [METRIC_REPLICATION_BYTES_RECEIVED] = {"msgapp_transfer_bytes_total", "direction=\"replication_in\"", NULL},
+    [METRIC_PULL_BYTES] = {"msgapp_transfer_bytes_total", "direction=\"pull_in\"", NULL},
+    [METRIC_FILE_CACHE_HITS] = {"msgapp_file_cache_lookups_total", "result=\"hit\"", "Downloads looked up in the file cache."},
+    [METRIC_FILE_CACHE_MISSES] = {"msgapp_file_cache_lookups_total", "result=\"miss\"", NULL},
+    [METRIC_FILE_CACHE_EVICTIONS] = {"msgapp_file_cache_evictions_total", "", "Files dropped from the file cache to make room for others."},
+    [METRIC_REPLICATION_SKIPPED] = {"msgapp_replication_skipped_total", "", "Files announced by a peer server that were not fetched because the copy here has the same checksum."},
+    [METRIC_REPLICATION_BYTES_DEFERRED] = {"msgapp_replication_deferred_bytes_total", "", "Bytes of uploads to lazy groups announced to peer servers instead of streamed, counted once per peer."},
+    [METRIC_MAILBOX_QUEUED] = {"msgapp_mailbox_messages_total", "event=\"queued\"", "Chat messages for group members logged in nowhere."},
+    [METRIC_MAILBOX_DELIVERED] = {"msgapp_mailbox_messages_total", "event=\"delivered\"", NULL},
+    [METRIC_MAILBOX_DROPPED] = {"msgapp_mailbox_messages_total", "event=\"dropped\"", NULL},
+    [METRIC_MAILBOX_SPILLED_BYTES] = {"msgapp_mailbox_spilled_bytes_total", "", "Bytes of mailboxes written to disk to stay within the memory budget."},
+    [METRIC_CHAT_BATCHES] = {"msgapp_chat_batches_total", "", "Frames carrying several chat lines to a client with data still waiting in its socket."},
+    [METRIC_CHAT_COALESCED] = {"msgapp_chat_coalesced_total", "", "Chat lines sent inside batch frames instead of frames of their own."},
+    [METRIC_ARCHIVE_MESSAGES] = {"msgapp_archive_messages_total", "event=\"indexed\"", "Chat messages of the groups owned by this server, archived for search."},
+    [METRIC_ARCHIVE_DROPPED] = {"msgapp_archive_messages_total", "event=\"dropped\"", NULL},
+};
+
+static const struct metric_info gauge_info[METRIC_GAUGE_COUNT] = {
+    [METRIC_CONNECTIONS_OPEN] = {"msgapp_connections_open", "", "Connections currently open."},
+    [METRIC_USERS_ONLINE] = {"msgapp_users_online", "", "Users currently logged in."},
+    [METRIC_REPLICATION_SAVED_BYTES] = {"msgapp_replication_saved_bytes", "", "Bytes of files stored on peer servers and not fetched by this one."},
+    [METRIC_FILE_CACHE_BYTES] = {"msgapp_file_cache_bytes", "", "Bytes of file data held in memory by the file cache."},
+    [METRIC_MAILBOX_BYTES] = {"msgapp_mailbox_bytes", "", "Bytes of chat messages for offline users held in memory."},
+    [METRIC_ARCHIVE_INDEX_BYTES] = {"msgapp_archive_index_bytes", "", "Bytes of memory allocated for the search index of the archived messages."},
+};
+
+static const struct metric_info histogram_info[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_REPLICATION_LAG] = {"msgapp_replication_lag_seconds", "", "Time to apply a command replicated by a peer server."},
+    [METRIC_UPLOAD_DURATION] = {"msgapp_transfer_duration_seconds", "direction=\"upload\"", "Duration of file transfers."},
+    [METRIC_DOWNLOAD_DURATION] = {"msgapp_transfer_duration_seconds", "direction=\"download\"", NULL},
+};
+
+/** Upper bounds of the exported histogram buckets, in nanoseconds */
+static const uint64_t bucket_bounds[] = {
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000,
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the shard of the calling thread, creating it on first use.
+ */
+static struct metrics_shard *get_shard(void)
+{
+    if (__builtin_expect(local_shard != NULL, 1))
+    {
+        return local_shard;
+    }
+
+    struct metrics_shard *shard = calloc(1, sizeof(*shard));
+    if (shard == NULL)
+    {
+        perror("metrics shard");
+        abort();
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        histogram_init(&shard->histograms[i]);
+    }
+    for (int i = 0; i < COMMAND_COUNT; i++)
+    {
+        histogram_init(&shard->commands[i]);
+    }
+
+    pthread_mutex_lock(&shards_lock);
+    shard->next = shards;
+    __atomic_store_n(&shards, shard, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shards_lock);
+    return local_shard = shard;
+}
+
+/**
+ * @brief Increments a value only written by the calling thread.
+ *
+ * A relaxed load and store instead of an atomic add: no lock prefix, yet readers on
+ * other threads never see a torn value.
+ */
+static inline void bump(uint64_t *slot, uint64_t value)
+{
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static void record(struct histogram *histogram, uint64_t ns)
+{
+    bump(&histogram->counts[histogram_bucket(ns)], 1);
+    bump(&histogram->count, 1);
+    bump(&histogram->sum, ns);
+    if (ns > histogram->max)
+    {
+        __atomic_store_n(&histogram->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Adds to a counter of the calling thread.
+ */
+void metrics_add(enum metric_counter counter, uint64_t value)
+{
+    bump(&get_shard()->counters[counter], value);
+}
+
+/**
+ * @brief Records a duration in a histogram of the calling thread.
+ */
+void metrics_observe(enum metric_histogram histogram, uint64_t ns)
+{
+    record(&get_shard()->histograms[histogram], ns);
+}
+
+/**
+ * @brief Records how long a command took from dispatch to its reply.
+ */
+void metrics_observe_command(enum command_id id, uint64_t ns)
+{
+    if (id >= 0 && id < COMMAND_COUNT)
+    {
+        record(&get_shard()->commands[id], ns);
+    }
+}
+
+/**
+ * @brief Adds to a gauge.
+ */
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta)
+{
+    __atomic_add_fetch(&gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Returns the sum of a counter over every thread.
+ */
+uint64_t metrics_total(enum metric_counter counter)
+{
+    uint64_t total = 0;
+    for (struct metrics_shard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next)
+    {
+        total += __atomic_load_n(&shard->counters[counter], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/**
+ * @brief Adds a histogram being written by another thread to a private copy.
+ */
+static void snapshot_add(struct histogram *into, const struct histogram *from)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    }
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max)
+    {
+        into->max = max;
+    }
+}
+
+static void print_header(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * @brief Prints the labels of a series, with an optional extra label.
+ */
+static void print_labels(FILE *out, const char *labels, const char *extra)
+{
+    int has_labels = labels != NULL && labels[0] != '\0';
+    if (!has_labels && extra == NULL)
+    {
+        return;
+    }
+    fprintf(out, "{%s%s%s}", has_labels ? labels : "", has_labels && extra != NULL ? "," : "", extra ? extra : "");
+}
+
+/**
+ * @brief Prints one histogram as Prometheus buckets, sum and count.
+ */
+static void print_histogram(FILE *out, const char *name, const char *labels, const struct histogram *histogram)
+{
+    char le[64];
+    uint64_t cumulative = 0;
+    int bucket = 0;
+
+    for (size_t i = 0; i < sizeof(bucket_bounds) / sizeof(bucket_bounds[0]); i++)
+    {
+        while (bucket < HISTOGRAM_BUCKETS && histogram_bucket_limit(bucket) <= bucket_bounds[i])
+        {
+            cumulative += histogram->counts[bucket++];
+        }
+        snprintf(le, sizeof(le), "le=\"%g\"", bucket_bounds[i] / 1e9);
+        fprintf(out, "%s_bucket", name);
+        print_labels(out, labels, le);
+        fprintf(out, " %llu\n", (unsigned long long)cumulative);
+    }
+    fprintf(out, "%s_bucket", name);
+    print_labels(out, labels, "le=\"+Inf\"");
+    fprintf(out, " %llu\n%s_sum", (unsigned long long)histogram->count, name);
+    print_labels(out, labels, NULL);
+    fprintf(out, " %.9f\n%s_count", histogram->sum / 1e9, name);
+    print_labels(out, labels, NULL);
+    fprintf(out, " %llu\n", (unsigned long long)histogram->count);
+}
+
+/**
+ * @brief Prints the exact quantiles of a histogram, which the coarse buckets lose.
+ */
+static void print_quantiles(FILE *out, const char *name, const char *labels, const struct histogram *histogram)
+{
+    char quantile[64];
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    {
+        snprintf(quantile, sizeof(quantile), "quantile=\"%g\"", quantiles[i]);
+        fprintf(out, "%s_quantile_seconds", name);
+        print_labels(out, labels, quantile);
+        fprintf(out, " %.9f\n", histogram_percentile(histogram, quantiles[i] * 100) / 1e9);
+    }
+}
+
+/**
+ * @brief Writes every metric in the Prometheus text exposition format.
+ */
+void metrics_render(FILE *out)
+{
+    struct metrics_shard *first = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+
+    // Counters, family by family
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        if (counter_info[i].help == NULL)
+        {
+            continue;
+        }
+        print_header(out, counter_info[i].name, "counter", counter_info[i].help);
+        for (int j = i; j < METRIC_COUNTER_COUNT; j++)
+        {
+            if (strcmp(counter_info[j].name, counter_info[i].name) != 0)
+            {
+                continue;
+            }
+            fprintf(out, "%s", counter_info[j].name);
+            print_labels(out, counter_info[j].labels, NULL);
+            fprintf(out, " %llu\n", (unsigned long long)metrics_total(j));
+        }
+    }
+
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        print_header(out, gauge_info[i].name, "gauge", gauge_info[i].help);
+        fprintf(out, "%s %lld\n", gauge_info[i].name, (long long)__atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+    }
+
+    // Histograms are summed over the shards into a private copy before printing
+    struct histogram *merged = malloc(sizeof(struct histogram));
+    if (merged == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        if (histogram_info[i].help != NULL)
+        {
+            print_header(out, histogram_info[i].name, "histogram", histogram_info[i].help);
+        }
+        histogram_init(merged);
+        for (struct metrics_shard *shard = first; shard != NULL; shard = shard->next)
+        {
+            snapshot_add(merged, &shard->histograms[i]);
+        }
+        print_histogram(out, histogram_info[i].name, histogram_info[i].labels, merged);
+    }
+
+    print_header(out, "msgapp_command_duration_seconds", "histogram", "Time from dispatching a client command to its reply.");
+    for (int id = 0; id < COMMAND_COUNT; id++)
+    {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_id_name(id));
+        histogram_init(merged);
+        for (struct metrics_shard *shard = first; shard != NULL; shard = shard->next)
+        {
+            snapshot_add(merged, &shard->commands[id]);
+        }
+        if (merged->count > 0)
+        {
+            print_histogram(out, "msgapp_command_duration_seconds", labels, merged);
+        }
+    }
+
+    print_header(out, "msgapp_command_duration_quantile_seconds", "gauge", "Quantiles of the command durations since startup.");
+    for (int id = 0; id < COMMAND_COUNT; id++)
+    {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_id_name(id));
+        histogram_init(merged);
+        for (struct metrics_shard *shard = first; shard != NULL; shard = shard->next)
+        {
+            snapshot_add(merged, &shard->commands[id]);
+        }
+        if (merged->count > 0)
+        {
+            print_quantiles(out, "msgapp_command_duration", labels, merged);
+        }
+    }
+
+    free(merged);
+}
+
+/**
+ * @brief Answers one HTTP request on the admin port.
+ */
+static void serve_request(int fd)
+{
+    char request[METRICS_REQUEST_SIZE];
+    size_t length = 0;
+    while (length < sizeof(request) - 1)
+    {
+        ssize_t n = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        length += n;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+        {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    char *body = NULL;
+    size_t body_length = 0;
+    FILE *out = open_memstream(&body, &body_length);
+    if (out == NULL)
+    {
+        return;
+    }
+
+    const char *status = "200 OK";
+    const char *content_type = "text/plain; version=0.0.4";
+    const struct metrics_route *route = NULL;
+    for (int i = 0; i < route_count; i++)
+    {
+        size_t path_length = strlen(routes[i].path);
+        if (strncmp(request, "GET ", 4) == 0 && strncmp(request + 4, routes[i].path, path_length) == 0 &&
+            request[4 + path_length] == ' ')
+        {
+            route = &routes[i];
+        }
+    }
+
+    if (route != NULL)
+    {
+        content_type = route->content_type;
+        route->render(out);
+    }
+    else if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0)
+    {
+        metrics_render(out);
+    }
+    else
+    {
+        status = "404 Not Found";
+        fprintf(out, "Only GET /metrics is served here\n");
+    }
+    fclose(out);
+
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                                 status, content_type, body_length);
+    send(fd, header, header_length, MSG_NOSIGNAL);
+    for (size_t sent = 0; sent < body_length;)
+    {
+        ssize_t n = send(fd, body + sent, body_length - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+        {
+            break;
+        }
+        sent += n;
+    }
+    free(body);
+}
+
+/**
+ * @brief Moves a socket to a descriptor of at least METRICS_MIN_FD.
+ */
+static int move_high(int fd)
+{
+    int high_fd = fcntl(fd, F_DUPFD_CLOEXEC, METRICS_MIN_FD);
+    if (high_fd < 0)
+    {
+        return fd;
+    }
+    close(fd);
+    return high_fd;
+}
+
+/**
+ * @brief Accepts scrapes until the process exits.
+ *
+ * The thread waits in poll() rather than in accept(): a blocked accept() already holds
+ * the lowest free descriptor, which the event loop would otherwise miss.
+ */
+static void *admin_main(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    while (1)
+    {
+        if (poll(&pfd, 1, -1) <= 0)
+        {
+            continue;
+        }
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            continue;
+        }
+        fd = move_high(fd);
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_request(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Serves another document on the admin port.
+ */
+int metrics_route(const char *path, const char *content_type, void (*render)(FILE *out))
+{
+    if (route_count == METRICS_MAX_ROUTES)
+    {
+        return -1;
+    }
+    routes[route_count++] = (struct metrics_route){path, content_type, render};
+    return 0;
+}
+
+/**
+ * @brief Serves the metrics over HTTP on a local port from a background thread.
+ *
+ * @param port The port to listen on.
+ * @return 0 on success, -1 if the port could not be opened.
+ */
+int metrics_serve(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("metrics socket");
+        return -1;
+    }
+
+    // Leave the low descriptors to the clients and peer links of the event loop
+    fd = move_high(fd);
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, 16) < 0)
+    {
+        perror("metrics bind");
+        close(fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_main, (void *)(intptr_t)fd) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("Metrics available on http://127.0.0.1:%d/metrics\n", port);
+    return 0;
+}
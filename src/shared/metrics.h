@@ -0,0 +1,149 @@
+/**
+ * @file metrics.h
+ * @brief Counters and latency histograms, exported in the Prometheus text format.
+ *
+ * Every thread updates its own shard of counters and histograms, so recording is a
+ * plain increment with no lock and no shared cache line. The admin endpoint sums the
+ * shards when it is scraped. Gauges change rarely and are kept globally.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "command.h"
+
+/**
+ * @enum metric_counter
+ * @brief Monotonic counters.
+ */
+enum metric_counter
+{
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_FRAMES_RECEIVED,
+    METRIC_BYTES_RECEIVED,
+    METRIC_FRAMES_SENT,
+    METRIC_BYTES_SENT,
+    METRIC_FRAMES_TOO_LARGE,
+    METRIC_FRAMES_INVALID,
+    METRIC_FRAMES_DELAYED,        /**< Frames held by the rate limiter */
+    METRIC_FRAMES_REJECTED,       /**< Frames dropped by the rate limiter */
+    METRIC_PEER_FORWARDS,         /**< Commands written to a peer server, once per peer */
+    METRIC_PEER_FORWARDS_SKIPPED, /**< Chat messages not sent to a linked peer without members of the group */
+    METRIC_PEER_RECONNECTS,       /**< Links to a peer restored after being lost */
+    METRIC_PEER_REPLAYED,         /**< Commands sent again to a peer from its replication log */
+    METRIC_UPLOADS,
+    METRIC_UPLOAD_BYTES,
+    METRIC_DOWNLOADS,
+    METRIC_DOWNLOAD_BYTES,
+    METRIC_DOWNLOAD_RANGES,       /**< Ranges of files sent for parallel downloads */
+    METRIC_REPLICATION_BYTES_SENT,
+    METRIC_REPLICATION_BYTES_RECEIVED,
+    METRIC_REPLICATION_BYTES_DEFERRED, /**< Bytes of lazy uploads announced to the peers instead of streamed */
+    METRIC_PULLS,                 /**< Files of lazy groups fetched from the server that has them */
+    METRIC_PULL_BYTES,
+    METRIC_REPLICATION_SKIPPED,   /**< Files announced by a peer whose copy here already had the same contents */
+    METRIC_FILE_CACHE_HITS,       /**< Downloads served from the file cache */
+    METRIC_FILE_CACHE_MISSES,     /**< Downloads of files not in the file cache */
+    METRIC_FILE_CACHE_EVICTIONS,  /**< Files dropped from the file cache to make room */
+    METRIC_MAILBOX_QUEUED,        /**< Chat messages kept for a member logged in nowhere */
+    METRIC_MAILBOX_DELIVERED,     /**< Queued chat messages sent to their user on login */
+    METRIC_MAILBOX_DROPPED,       /**< Chat messages not queued because the mailbox was full */
+    METRIC_MAILBOX_SPILLED_BYTES, /**< Bytes of mailboxes moved from memory to disk */
+    METRIC_CHAT_BATCHES,          /**< Frames carrying several chat lines to a client that fell behind */
+    METRIC_CHAT_COALESCED,        /**< Chat lines sent in those frames */
+    METRIC_ARCHIVE_MESSAGES,      /**< Chat messages written to the archive of their group and indexed */
+    METRIC_ARCHIVE_DROPPED,       /**< Chat messages left out of the archive */
+    METRIC_COUNTER_COUNT
+};
+
+/**
+ * @enum metric_gauge
+ * @brief Values that go up and down.
+ */
+enum metric_gauge
+{
+    METRIC_CONNECTIONS_OPEN,
+    METRIC_USERS_ONLINE,
+    METRIC_REPLICATION_SAVED_BYTES, /**< Bytes of files known from a peer and not fetched */
+    METRIC_FILE_CACHE_BYTES,        /**< Bytes of file data held by the file cache */
+    METRIC_MAILBOX_BYTES,           /**< Bytes of queued chat messages held in memory */
+    METRIC_ARCHIVE_INDEX_BYTES,     /**< Bytes allocated for the search index of the archives */
+    METRIC_GAUGE_COUNT
+};
+
+/**
+ * @enum metric_histogram
+ * @brief Latency distributions, in nanoseconds.
+ */
+enum metric_histogram
+{
+    METRIC_REPLICATION_LAG, /**< Time to apply a command replicated by a peer server */
+    METRIC_UPLOAD_DURATION,
+    METRIC_DOWNLOAD_DURATION,
+    METRIC_HISTOGRAM_COUNT
+};
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * @brief Adds to a counter of the calling thread.
+ */
+void metrics_add(enum metric_counter counter, uint64_t value);
+
+/**
+ * @brief Records a duration in a histogram of the calling thread.
+ */
+void metrics_observe(enum metric_histogram histogram, uint64_t ns);
+
+/**
+ * @brief Records how long a command took from dispatch to its reply.
+ */
+void metrics_observe_command(enum command_id id, uint64_t ns);
+
+/**
+ * @brief Adds to a gauge.
+ */
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta);
+
+/**
+ * @brief Returns the sum of a counter over every thread.
+ */
+uint64_t metrics_total(enum metric_counter counter);
+
+/**
+ * @brief Writes every metric in the Prometheus text exposition format.
+ *
+ * @param out The stream to write to.
+ */
+void metrics_render(FILE *out);
+
+/**
+ * @brief Serves another document on the admin port.
+ *
+ * Must be called before metrics_serve(). The render function runs on the admin thread.
+ *
+ * @param path The request path, such as "/trace".
+ * @param content_type The Content-Type of the answer.
+ * @param render Writes the document.
+ * @return 0 on success, -1 if too many routes are registered.
+ */
+int metrics_route(const char *path, const char *content_type, void (*render)(FILE *out));
+
+/**
+ * @brief Serves the metrics over HTTP on a local port from a background thread.
+ *
+ * `GET /metrics` returns metrics_render(). The port only listens on the loopback
+ * interface.
+ *
+ * @param port The port to listen on.
+ * @return 0 on success, -1 if the port could not be opened.
+ */
+int metrics_serve(int port);
+
+#endif // METRICS_H
@@ -0,0 +1,606 @@
+/**
+ * @file peer.c
+ * @brief Table of the other servers of the cluster and the links to them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "peer.h"
+#include "connection.h"
+#include "socket_utils.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "log.h"
+
+#define PEER_RECORD_HEADER (sizeof(uint32_t) + sizeof(uint64_t)) /**< Length and sequence number of a log record */
+#define PEER_PREFIX_SIZE 32 /**< Room for `replicate <seq> ` */
+
+struct peer peers[MAX_PEERS];
+int peer_count = 0;
+int node_id = 0;
+int peer_heartbeat_ms = 1000;
+int peer_timeout_ms = 5000;
+int peer_backoff_max_ms = 8000;
+char peer_secret[PEER_SECRET_SIZE] = "";
+
+/**
+ * @brief Returns the epoch of the sequence numbers of this server: the time it started.
+ */
+static uint64_t local_epoch(void)
+{
+    static uint64_t epoch = 0;
+    if (epoch == 0)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        epoch = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    }
+    return epoch;
+}
+
+/**
+ * @brief Sends a control frame on a link, shutting the link down if the write fails.
+ */
+static void send_control(struct peer *peer, const char *frame, size_t length)
+{
+    struct iovec part = {(char *)frame, length};
+    if (send_message_parts(peer->fd, &part, 1) < 0)
+    {
+        shutdown(peer->fd, SHUT_RDWR);
+    }
+}
+
+/**
+ * @brief Adds a server to the cluster.
+ */
+int peer_add(int id, const char *host, int port)
+{
+    if (peer_count == MAX_PEERS)
+    {
+        return -1;
+    }
+    for (int i = 0; i < peer_count; i++)
+    {
+        if (peers[i].id == id)
+        {
+            return -1;
+        }
+    }
+
+    struct peer *peer = &peers[peer_count++];
+    peer->id = id;
+    snprintf(peer->host, sizeof(peer->host), "%s", host);
+    peer->port = port;
+    peer->fd = -1;
+    peer->state = PEER_DISCONNECTED;
+    peer->next_attempt = 0;
+    peer->failed_attempts = 0;
+    peer->tx_seq = 0;
+    peer->rx_seq = 0;
+    peer->rx_epoch = 0;
+    peer->lost_at = 0;
+    memset(&peer->log, 0, sizeof(peer->log));
+    return 0;
+}
+
+/**
+ * @brief Returns the peer linked through a socket.
+ */
+struct peer *peer_by_fd(int fd)
+{
+    struct connection *conn = connection_get(fd);
+    if (conn == NULL || conn->peer_index < 0)
+    {
+        return NULL;
+    }
+    return &peers[conn->peer_index];
+}
+
+/**
+ * @brief Makes a connection the link to a peer and sends it `peer_sync`.
+ */
+struct peer *peer_attach(int fd, int id)
+{
+    struct connection *conn = connection_get(fd);
+    if (conn == NULL || id == node_id)
+    {
+        return NULL;
+    }
+
+    for (int i = 0; i < peer_count; i++)
+    {
+        struct peer *peer = &peers[i];
+        if (peer->id != id)
+        {
+            continue;
+        }
+
+        // A stalled peer makes writes fail after the heartbeat timeout instead of blocking forever
+        int nodelay = 1;
+        struct timeval timeout = {peer_timeout_ms / 1000, (peer_timeout_ms % 1000) * 1000};
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        conn->peer_index = i;
+        conn->rx.max_size = FRAME_MAX_SIZE;
+        peer->fd = fd;
+        peer->state = PEER_SYNCING;
+        peer->last_heard = ratelimit_now_ns();
+        peer->last_ack = peer->last_heard;
+        log_info("Linked to node %d (%s:%d) on fd %d", peer->id, peer->host, peer->port, fd);
+
+        char sync[96];
+        int length = snprintf(sync, sizeof(sync), "peer_sync %llx %llx %llu", (unsigned long long)local_epoch(),
+                              (unsigned long long)peer->rx_epoch, (unsigned long long)peer->rx_seq);
+        send_control(peer, sync, length);
+        return peer;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Compares a secret with `peer_secret`, in a time that does not depend on where they differ.
+ */
+static int secret_matches(const char *secret, size_t length)
+{
+    size_t expected = strlen(peer_secret);
+    unsigned char difference = length != expected;
+    for (size_t i = 0; i < length && i < expected; i++)
+    {
+        difference |= (unsigned char)(secret[i] ^ peer_secret[i]);
+    }
+    return expected > 0 && difference == 0;
+}
+
+/**
+ * @brief Makes an accepted connection announcing itself with `peer_hello` the link to a peer.
+ */
+struct peer *peer_accept(int fd, int id, const char *secret, size_t length)
+{
+    if (!secret_matches(secret, length))
+    {
+        log_warn("fd %d announced itself as node %d without the peer_secret of the cluster", fd, id);
+        return NULL;
+    }
+    for (int i = 0; i < peer_count; i++)
+    {
+        struct peer *peer = &peers[i];
+        if (peer->id != id)
+        {
+            continue;
+        }
+        // Only the smaller id of a pair dials, and a link that is up keeps its socket
+        if (id > node_id)
+        {
+            log_warn("fd %d announced itself as node %d, which this server dials", fd, id);
+            return NULL;
+        }
+        if (peer->state != PEER_DISCONNECTED)
+        {
+            log_warn("fd %d announced itself as node %d, already linked on fd %d", fd, id, peer->fd);
+            return NULL;
+        }
+        return peer_attach(fd, id);
+    }
+    log_warn("fd %d announced itself as node %d, which is not a peer of node %d", fd, id, node_id);
+    return NULL;
+}
+
+/**
+ * @brief Returns the wait before the next dial of a peer after `failures` failed ones.
+ */
+static uint64_t backoff(unsigned failures)
+{
+    uint64_t max = (uint64_t)peer_backoff_max_ms * 1000000ull;
+    uint64_t wait = PEER_BACKOFF_MIN_NS << (failures < 20 ? failures - 1 : 19);
+    return wait < max ? wait : max;
+}
+
+/**
+ * @brief Marks the link of a socket as lost, before the socket is closed.
+ */
+void peer_detach(int fd)
+{
+    struct peer *peer = peer_by_fd(fd);
+    if (peer == NULL || peer->fd != fd)
+    {
+        return;
+    }
+    uint64_t now = ratelimit_now_ns();
+    log_warn("Lost the link to node %d", peer->id);
+    peer->fd = -1;
+    peer->next_attempt = 0;
+    if (peer->state == PEER_SYNCING)
+    {
+        // A peer accepting links but never syncing is dialed again with the same backoff
+        peer->next_attempt = now + backoff(++peer->failed_attempts);
+    }
+    if (peer->lost_at == 0)
+    {
+        peer->lost_at = now;
+    }
+    peer->state = PEER_DISCONNECTED;
+}
+
+/**
+ * @brief Connects to a peer, waiting at most PEER_CONNECT_TIMEOUT_MS.
+ *
+ * @return The connected socket, or -1.
+ */
+static int dial(const struct peer *peer)
+{
+    char port[16];
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *address;
+    snprintf(port, sizeof(port), "%d", peer->port);
+    if (getaddrinfo(peer->host, port, &hints, &address) != 0)
+    {
+        return -1;
+    }
+
+    int fd = socket(address->ai_family, address->ai_socktype, 0);
+    if (fd < 0)
+    {
+        freeaddrinfo(address);
+        return -1;
+    }
+
+    // Connect without blocking so that an unreachable peer cannot stall the event loop
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int result = connect(fd, address->ai_addr, address->ai_addrlen);
+    freeaddrinfo(address);
+    if (result < 0 && errno == EINPROGRESS)
+    {
+        struct pollfd pending = {.fd = fd, .events = POLLOUT};
+        int error = ETIMEDOUT;
+        socklen_t length = sizeof(error);
+        if (poll(&pending, 1, PEER_CONNECT_TIMEOUT_MS) == 1)
+        {
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        }
+        errno = error;
+        result = error == 0 ? 0 : -1;
+    }
+    if (result < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, flags);
+    return fd;
+}
+
+/**
+ * @brief Dials the peers this server is responsible for that are not linked.
+ */
+int peer_maintain(uint64_t now, int *opened, int max)
+{
+    int count = 0;
+    for (int i = 0; i < peer_count && count < max; i++)
+    {
+        struct peer *peer = &peers[i];
+        if (peer->id <= node_id || peer->state != PEER_DISCONNECTED || now < peer->next_attempt)
+        {
+            continue;
+        }
+
+        int fd = dial(peer);
+        if (fd < 0 || connection_open(fd) == NULL)
+        {
+            // Only the first failure is worth a line, the peer is usually just not up yet
+            if (peer->failed_attempts++ == 0)
+            {
+                log_warn("Cannot reach node %d at %s:%d (%s), retrying", peer->id, peer->host, peer->port,
+                         strerror(errno));
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            peer->next_attempt = now + backoff(peer->failed_attempts);
+            continue;
+        }
+
+        char hello[32 + PEER_SECRET_SIZE];
+        int length = snprintf(hello, sizeof(hello), "peer_hello %d %s", node_id, peer_secret);
+        send_message(fd, hello, length, 0);
+        peer_attach(fd, peer->id);
+        opened[count++] = fd;
+    }
+    return count;
+}
+
+/**
+ * @brief Sends the heartbeats due and drops the links silent for too long.
+ */
+void peer_heartbeat(uint64_t now)
+{
+    uint64_t interval = (uint64_t)peer_heartbeat_ms * 1000000ull;
+    uint64_t timeout = (uint64_t)peer_timeout_ms * 1000000ull;
+    for (int i = 0; i < peer_count; i++)
+    {
+        struct peer *peer = &peers[i];
+        if (peer->state == PEER_DISCONNECTED)
+        {
+            continue;
+        }
+        if (peer->last_heard + timeout <= now)
+        {
+            log_warn("Nothing heard from node %d for %d ms, dropping the link", peer->id, peer_timeout_ms);
+            shutdown(peer->fd, SHUT_RDWR);
+            peer->last_heard = now; // Shut down once, the event loop reads the end of the socket
+            continue;
+        }
+        if (peer->last_ack + interval <= now)
+        {
+            char ack[48];
+            int length = snprintf(ack, sizeof(ack), "peer_ack %llu", (unsigned long long)peer->rx_seq);
+            peer->last_ack = now;
+            send_control(peer, ack, length);
+        }
+    }
+}
+
+/**
+ * @brief Returns the earliest time peer_maintain() or peer_heartbeat() has work.
+ */
+uint64_t peer_next_attempt(void)
+{
+    uint64_t earliest = UINT64_MAX;
+    uint64_t interval = (uint64_t)peer_heartbeat_ms * 1000000ull;
+    uint64_t timeout = (uint64_t)peer_timeout_ms * 1000000ull;
+    for (int i = 0; i < peer_count; i++)
+    {
+        const struct peer *peer = &peers[i];
+        uint64_t due = UINT64_MAX;
+        if (peer->state != PEER_DISCONNECTED)
+        {
+            due = peer->last_ack + interval;
+            if (peer->last_heard + timeout < due)
+            {
+                due = peer->last_heard + timeout;
+            }
+        }
+        else if (peer->id > node_id)
+        {
+            due = peer->next_attempt;
+        }
+        if (due < earliest)
+        {
+            earliest = due;
+        }
+    }
+    return earliest;
+}
+
+/**
+ * @brief Handles the `replicate <seq>` prefix of a frame received from a peer.
+ */
+int peer_receive(struct peer *peer, char **buffer, size_t *length)
+{
+    static const char keyword[] = "replicate ";
+    peer->last_heard = ratelimit_now_ns();
+    if (*length < sizeof(keyword) - 1 || memcmp(*buffer, keyword, sizeof(keyword) - 1) != 0)
+    {
+        return 0;
+    }
+
+    uint64_t seq = 0;
+    size_t i = sizeof(keyword) - 1;
+    while (i < *length && (*buffer)[i] >= '0' && (*buffer)[i] <= '9')
+    {
+        seq = seq * 10 + ((*buffer)[i++] - '0');
+    }
+    if (i < *length && (*buffer)[i] == ' ')
+    {
+        i++;
+    }
+    *buffer += i;
+    *length -= i;
+
+    // Commands sent before the link dropped may arrive again in the replay
+    if (seq <= peer->rx_seq)
+    {
+        return -1;
+    }
+    if (seq != peer->rx_seq + 1)
+    {
+        log_warn("Missed %llu commands from node %d", (unsigned long long)(seq - peer->rx_seq - 1), peer->id);
+    }
+    peer->rx_seq = seq;
+    return 0;
+}
+
+static uint32_t record_length(const struct peer_log *log, size_t offset)
+{
+    uint32_t length;
+    memcpy(&length, log->data + offset, sizeof(length));
+    return length;
+}
+
+static uint64_t record_seq(const struct peer_log *log, size_t offset)
+{
+    uint64_t seq;
+    memcpy(&seq, log->data + offset + sizeof(uint32_t), sizeof(seq));
+    return seq;
+}
+
+/**
+ * @brief Frees the log of a peer up to the sequence number it acknowledged.
+ */
+void peer_acknowledge(struct peer *peer, uint64_t seq)
+{
+    struct peer_log *log = &peer->log;
+    while (log->head < log->tail && record_seq(log, log->head) <= seq)
+    {
+        log->head += PEER_RECORD_HEADER + record_length(log, log->head);
+    }
+    if (log->head == log->tail)
+    {
+        log->head = log->tail = 0;
+    }
+    else
+    {
+        log->first_seq = record_seq(log, log->head);
+    }
+}
+
+/**
+ * @brief Appends a command to the log of a peer, dropping the oldest ones if it is full.
+ */
+static void log_append(struct peer *peer, uint64_t seq, const struct iovec *parts, int count)
+{
+    struct peer_log *log = &peer->log;
+    size_t size = 0;
+    for (int i = 0; i < count; i++)
+    {
+        size += parts[i].iov_len;
+    }
+    size_t needed = PEER_RECORD_HEADER + size;
+    if (needed > PEER_LOG_SIZE)
+    {
+        return;
+    }
+    if (log->data == NULL && (log->data = malloc(PEER_LOG_SIZE)) == NULL)
+    {
+        return;
+    }
+
+    if (log->tail + needed > PEER_LOG_SIZE)
+    {
+        // The live records move to the front. A peer too far behind first loses its oldest
+        // ones, down to half the log, so that the move costs at most a byte per byte logged
+        uint64_t dropped = 0;
+        while (log->head < log->tail && (log->tail - log->head) + needed > PEER_LOG_SIZE / 2)
+        {
+            log->head += PEER_RECORD_HEADER + record_length(log, log->head);
+            dropped++;
+        }
+        if (dropped > 0)
+        {
+            log_sampled(LOG_LEVEL_WARN, "Replication log of node %d full, %llu commands dropped", peer->id,
+                        (unsigned long long)dropped);
+        }
+        memmove(log->data, log->data + log->head, log->tail - log->head);
+        log->tail -= log->head;
+        log->head = 0;
+    }
+
+    log->first_seq = log->head == log->tail ? seq : record_seq(log, log->head);
+    uint32_t length = size;
+    memcpy(log->data + log->tail, &length, sizeof(length));
+    memcpy(log->data + log->tail + sizeof(length), &seq, sizeof(seq));
+    char *p = log->data + log->tail + PEER_RECORD_HEADER;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(p, parts[i].iov_base, parts[i].iov_len);
+        p += parts[i].iov_len;
+    }
+    log->tail += needed;
+}
+
+/**
+ * @brief Applies the `peer_sync` of a peer: replays the commands it missed.
+ */
+void peer_sync(struct peer *peer, uint64_t epoch, uint64_t seen_epoch, uint64_t seen_seq)
+{
+    if (epoch != peer->rx_epoch)
+    {
+        if (peer->rx_epoch != 0)
+        {
+            log_info("Node %d restarted, its commands are numbered again", peer->id);
+        }
+        peer->rx_epoch = epoch;
+        peer->rx_seq = 0;
+    }
+
+    struct peer_log *log = &peer->log;
+    uint64_t replayed = 0;
+    if (seen_epoch != local_epoch())
+    {
+        // The peer never heard of this run of the server: there is nothing it could catch up on
+        log->head = log->tail = 0;
+    }
+    else
+    {
+        peer_acknowledge(peer, seen_seq);
+        if (log->head < log->tail && log->first_seq > seen_seq + 1)
+        {
+            log_warn("Node %d missed %llu commands dropped from the replication log", peer->id,
+                     (unsigned long long)(log->first_seq - seen_seq - 1));
+        }
+        for (size_t offset = log->head; offset < log->tail; offset += PEER_RECORD_HEADER + record_length(log, offset))
+        {
+            struct iovec part = {log->data + offset + PEER_RECORD_HEADER, record_length(log, offset)};
+            if (send_message_parts(peer->fd, &part, 1) < 0)
+            {
+                shutdown(peer->fd, SHUT_RDWR);
+                return;
+            }
+            replayed++;
+        }
+    }
+
+    peer->state = PEER_CONNECTED;
+    peer->failed_attempts = 0;
+    metrics_add(METRIC_PEER_REPLAYED, replayed);
+    if (peer->lost_at != 0)
+    {
+        metrics_add(METRIC_PEER_RECONNECTS, 1);
+        log_info("Link to node %d restored %.1f ms after it was lost, %llu commands replayed", peer->id,
+                 (ratelimit_now_ns() - peer->lost_at) / 1e6, (unsigned long long)replayed);
+        peer->lost_at = 0;
+    }
+}
+
+/**
+ * @brief Sends a replicated command to a peer, or logs it for replay if the link is down.
+ */
+int peer_send(struct peer *peer, const struct iovec *parts, int count)
+{
+    if (peer->rx_epoch == 0 || count >= FRAME_MAX_PARTS)
+    {
+        return 0;
+    }
+
+    char prefix[PEER_PREFIX_SIZE];
+    struct iovec framed[FRAME_MAX_PARTS];
+    uint64_t seq = ++peer->tx_seq;
+    framed[0].iov_base = prefix;
+    framed[0].iov_len = snprintf(prefix, sizeof(prefix), "replicate %llu ", (unsigned long long)seq);
+    memcpy(&framed[1], parts, count * sizeof(*parts));
+
+    log_append(peer, seq, framed, count + 1);
+    if (peer->state == PEER_CONNECTED && send_message_parts(peer->fd, framed, count + 1) < 0)
+    {
+        // The command stays in the log and is replayed once the link is back
+        log_warn("Cannot write to node %d, dropping the link", peer->id);
+        shutdown(peer->fd, SHUT_RDWR);
+        peer->state = PEER_SYNCING;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends a replicated command to every peer.
+ */
+int peer_broadcast(const struct iovec *parts, int count)
+{
+    int sent = 0;
+    for (int i = 0; i < peer_count; i++)
+    {
+        sent += peer_send(&peers[i], parts, count);
+    }
+    return sent;
+}
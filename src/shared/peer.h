@@ -0,0 +1,224 @@
+/**
+ * @file peer.h
+ * @brief Links between the servers of a cluster.
+ *
+ * Every server has a node id and knows the other servers from its configuration file
+ * (`node_id` and one `peer <id> <host> <port>` line per other server). Each pair of
+ * servers shares a single connection: the server with the smaller id dials the client
+ * port of the other one and announces itself with `peer_hello <id> <secret>`, where the
+ * secret is the `peer_secret` shared by every server of the cluster. The other one
+ * refuses a wrong secret, an id it dials itself, and a peer whose link is already up,
+ * so a client cannot pass itself off as a server. A link that drops
+ * is dialed again by the same side, waiting twice as long after each failed attempt up
+ * to `peer_backoff_max_ms`.
+ *
+ * Replicated commands are written to the peers without waiting for an answer, each
+ * behind a sequence number of the link: `replicate <seq> <command>`. They are also kept
+ * in a replication log per peer until the peer acknowledges them, so that the commands
+ * sent while a link was down are replayed when it comes back:
+ *
+ *  - On linking, both sides send `peer_sync <epoch> <peer epoch> <seq>`: the epoch of
+ *    their own sequence numbers (the time they started) and the last sequence number
+ *    they applied from the other side, in the epoch they know it under. The other side
+ *    replays its log from there, then sends new commands. A peer that restarted has lost
+ *    its state with its epoch, and is not replayed anything.
+ *  - Every `peer_heartbeat_ms`, each side sends `peer_ack <seq>` with the last sequence
+ *    number it applied. It frees the log and doubles as a heartbeat: a link that carries
+ *    nothing for `peer_timeout_ms` is dropped and dialed again.
+ */
+
+#ifndef PEER_H
+#define PEER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define MAX_PEERS 16                    /**< Largest number of other servers in the cluster */
+#define PEER_HOST_SIZE 64               /**< Room for a host name or address */
+#define PEER_BACKOFF_MIN_NS 100000000ull /**< Wait after the first failed dial, doubled after each one */
+#define PEER_CONNECT_TIMEOUT_MS 500     /**< Longest time the event loop waits for a dial */
+#define PEER_LOG_SIZE (4 * 1024 * 1024) /**< Bytes of unacknowledged commands kept per peer */
+#define PEER_SECRET_SIZE 128            /**< Room for the secret of the cluster */
+
+/**
+ * @enum peer_state
+ * @brief State of the link to a peer.
+ */
+enum peer_state
+{
+    PEER_DISCONNECTED, /**< No link; dialed again at `next_attempt` if this server dials it */
+    PEER_SYNCING,      /**< Linked, waiting for the `peer_sync` of the peer; commands are only logged */
+    PEER_CONNECTED     /**< Linked and caught up, replicated commands are sent to `fd` */
+};
+
+/**
+ * @struct peer_log
+ * @brief Replicated commands not yet acknowledged by a peer, oldest first.
+ *
+ * Each record is a 4-byte length, an 8-byte sequence number and the frame payload,
+ * `replicate <seq>` prefix included, so that a replay is one send per record.
+ */
+struct peer_log
+{
+    char *data;          /**< PEER_LOG_SIZE bytes, allocated on first use */
+    size_t head;         /**< Offset of the oldest record */
+    size_t tail;         /**< Offset past the newest record */
+    uint64_t first_seq;  /**< Sequence number of the oldest record, if any */
+};
+
+/**
+ * @struct peer
+ * @brief Another server of the cluster.
+ */
+struct peer
+{
+    int id;                     /**< Node id of the server */
+    char host[PEER_HOST_SIZE];  /**< Address of the server */
+    int port;                   /**< Client port of the server */
+    int fd;                     /**< Socket of the link, or -1 */
+    enum peer_state state;
+    uint64_t next_attempt;      /**< Time of the next dial (ratelimit_now_ns() clock) */
+    unsigned failed_attempts;   /**< Dials failed since the link was last up */
+    uint64_t tx_seq;            /**< Sequence number of the last command sent or logged for the peer */
+    uint64_t rx_seq;            /**< Sequence number of the last command applied from the peer */
+    uint64_t rx_epoch;          /**< Epoch of the peer, 0 until its first `peer_sync` */
+    uint64_t last_heard;        /**< Time the last frame was received on the link */
+    uint64_t last_ack;          /**< Time the last `peer_ack` was sent on the link */
+    uint64_t lost_at;           /**< Time the link was last lost, 0 if never */
+    struct peer_log log;
+};
+
+extern struct peer peers[MAX_PEERS]; /**< The other servers, in configuration order */
+extern int peer_count;               /**< Number of entries in `peers` */
+extern int node_id;                  /**< Node id of this server */
+extern int peer_heartbeat_ms;        /**< Time between two `peer_ack` on a link */
+extern int peer_timeout_ms;          /**< Silence after which a link is dropped */
+extern int peer_backoff_max_ms;      /**< Longest wait between two dials of a peer */
+extern char peer_secret[PEER_SECRET_SIZE]; /**< Secret announced in `peer_hello`, empty refuses every link */
+
+/**
+ * @brief Adds a server to the cluster.
+ *
+ * @param id The node id of the server, unique in the cluster.
+ * @param host Its address.
+ * @param port Its client port.
+ * @return 0 on success, -1 if the table is full or the id is already known.
+ */
+int peer_add(int id, const char *host, int port);
+
+/**
+ * @brief Returns the peer linked through a socket.
+ *
+ * @param fd The socket file descriptor.
+ * @return The peer, or NULL if the socket is not a peer link.
+ */
+struct peer *peer_by_fd(int fd);
+
+/**
+ * @brief Makes a connection the link to a peer and sends it `peer_sync`.
+ *
+ * Called for the links this server dials, and by peer_accept() for the connections
+ * announcing themselves with `peer_hello`. The connection is allowed frames up to FRAME_MAX_SIZE,
+ * Nagle's algorithm is turned off on the socket, and a write blocking for longer than
+ * `peer_timeout_ms` fails instead of stalling the event loop.
+ *
+ * @param fd The socket, which must have a connection object.
+ * @param id The node id of the peer.
+ * @return The peer, or NULL if the id is not part of the cluster.
+ */
+struct peer *peer_attach(int fd, int id);
+
+/**
+ * @brief Makes an accepted connection announcing itself with `peer_hello` the link to a peer.
+ *
+ * @param fd The socket, which must have a connection object.
+ * @param id The node id announced.
+ * @param secret The secret announced.
+ * @param length Its length.
+ * @return The peer, or NULL if the secret is wrong, the id is not a peer dialing this
+ *         server, or its link is already up.
+ */
+struct peer *peer_accept(int fd, int id, const char *secret, size_t length);
+
+/**
+ * @brief Marks the link of a socket as lost, before the socket is closed.
+ *
+ * @param fd The socket file descriptor; nothing happens if it is not a peer link.
+ */
+void peer_detach(int fd);
+
+/**
+ * @brief Dials the peers this server is responsible for that are not linked.
+ *
+ * @param now The current time (ratelimit_now_ns()).
+ * @param opened Receives the sockets of the new links, to be polled by the caller.
+ * @param max Room in `opened`.
+ * @return The number of new links.
+ */
+int peer_maintain(uint64_t now, int *opened, int max);
+
+/**
+ * @brief Sends the heartbeats due and drops the links silent for too long.
+ *
+ * A dropped link is shut down, so the event loop reads its end and cleans it up as any
+ * other disconnection.
+ *
+ * @param now The current time (ratelimit_now_ns()).
+ */
+void peer_heartbeat(uint64_t now);
+
+/**
+ * @brief Returns the earliest time peer_maintain() or peer_heartbeat() has work, or UINT64_MAX if none.
+ */
+uint64_t peer_next_attempt(void);
+
+/**
+ * @brief Handles the `replicate <seq>` prefix of a frame received from a peer.
+ *
+ * Also records that the link is alive.
+ *
+ * @param peer The peer the frame comes from.
+ * @param buffer The frame, moved past the prefix.
+ * @param length Its length, updated.
+ * @return 0 if the frame is to be applied, -1 if it was already applied before a replay.
+ */
+int peer_receive(struct peer *peer, char **buffer, size_t *length);
+
+/**
+ * @brief Applies the `peer_sync` of a peer: replays the commands it missed.
+ *
+ * @param peer The peer.
+ * @param epoch The epoch of the peer.
+ * @param seen_epoch The epoch of this server as known by the peer.
+ * @param seen_seq The last sequence number the peer applied from this server.
+ */
+void peer_sync(struct peer *peer, uint64_t epoch, uint64_t seen_epoch, uint64_t seen_seq);
+
+/**
+ * @brief Frees the log of a peer up to the sequence number it acknowledged.
+ */
+void peer_acknowledge(struct peer *peer, uint64_t seq);
+
+/**
+ * @brief Sends a replicated command to a peer, or logs it for replay if the link is down.
+ *
+ * Nothing is logged for a peer that never linked: it has no state to catch up.
+ *
+ * @param peer The peer.
+ * @param parts The parts of the frame payload, as for send_message_parts().
+ * @param count The number of parts.
+ * @return 1 if the command was sent or logged, 0 otherwise.
+ */
+int peer_send(struct peer *peer, const struct iovec *parts, int count);
+
+/**
+ * @brief Sends a replicated command to every peer.
+ *
+ * @param parts The parts of the frame payload, as for send_message_parts().
+ * @param count The number of parts.
+ * @return The number of peers the frame was sent or logged for.
+ */
+int peer_broadcast(const struct iovec *parts, int count);
+
+#endif // PEER_H
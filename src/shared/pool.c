@@ -0,0 +1,468 @@
+/**
+ * @file pool.c
+ * @brief Implementation of the size-classed slab allocator.
+ *
+ * Every block is preceded by a small header recording its size class. Free blocks of a
+ * class are chained in a global depot protected by a mutex; each thread keeps its own
+ * lock-free cache in front of the depot and exchanges blocks with it in batches.
+ *
+ * The blocks in use are counted per thread, by the thread alone, and only summed when
+ * the statistics are read, so allocating and freeing touch no shared cache line. The
+ * high-water mark is updated from that sum when a cache refills from the depot, so it
+ * may miss a peak by less than a batch per thread.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define POOL_LARGE_CLASS POOL_CLASS_COUNT /**< Class index of blocks served by malloc */
+#define POOL_BATCH (POOL_CACHE_LIMIT / 2) /**< Blocks moved between a cache and the depot at once */
+
+/**
+ * @struct pool_block
+ * @brief Header placed in front of every block.
+ */
+struct pool_block
+{
+    union
+    {
+        struct pool_block *next; /**< Next free block while the block sits in a free list */
+        size_t large_size;       /**< Usable size of a malloc-backed block */
+    };
+    uint32_t class_index; /**< Size class of the block */
+    uint32_t magic;       /**< Guard value used to catch foreign pointers */
+};
+
+#define POOL_MAGIC 0x504f4f4cu
+#define POOL_HEADER_SIZE sizeof(struct pool_block)
+
+/**
+ * @struct pool_depot
+ * @brief Global free list and counters of one size class.
+ */
+struct pool_depot
+{
+    pthread_mutex_t lock;
+    struct pool_block *free_list;
+    size_t free_count;
+    size_t capacity;
+    size_t high_water; /**< Updated with atomics, outside the lock */
+};
+
+static struct pool_depot depots[POOL_CLASS_COUNT] = {
+    [0 ... POOL_CLASS_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER},
+};
+
+/**
+ * @struct pool_cache
+ * @brief Per-thread free lists sitting in front of the depots.
+ */
+struct pool_cache
+{
+    struct pool_block *head[POOL_CLASS_COUNT];
+    int count[POOL_CLASS_COUNT];
+    long allocated[POOL_CLASS_COUNT]; /**< Blocks allocated minus blocks freed by the thread, negative if it frees others' */
+    int registered;
+    struct pool_cache *prev_cache; /**< Neighbours in the list of registered caches */
+    struct pool_cache *next_cache;
+};
+
+static __thread struct pool_cache cache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/** Caches of the running threads, and the counts left by the threads that exited */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool_cache *registry = NULL;
+static long retired[POOL_CLASS_COUNT];
+
+/**
+ * @brief Returns the usable size of a size class.
+ */
+static size_t class_size(int class_index)
+{
+    return (size_t)POOL_MIN_BLOCK << class_index;
+}
+
+/**
+ * @brief Returns how many free blocks of a class a thread cache may hold.
+ *
+ * Blocks of a slab or larger are kept out of the caches as much as possible so that
+ * idle threads do not sit on megabytes of free memory.
+ */
+static int cache_limit(int class_index)
+{
+    return class_size(class_index) >= POOL_SLAB_SIZE ? 1 : POOL_CACHE_LIMIT;
+}
+
+/**
+ * @brief Returns the smallest size class able to hold `size` bytes, or POOL_LARGE_CLASS.
+ */
+static int class_for_size(size_t size)
+{
+    int class_index = 0;
+    while (class_index < POOL_CLASS_COUNT && class_size(class_index) < size)
+    {
+        class_index++;
+    }
+    return class_index;
+}
+
+/**
+ * @brief Carves a new slab for a class and pushes its blocks on the depot free list.
+ *
+ * Must be called with the depot lock held.
+ *
+ * @return 0 on success, -1 if the slab could not be allocated.
+ */
+static int depot_grow(int class_index)
+{
+    struct pool_depot *depot = &depots[class_index];
+    size_t stride = POOL_HEADER_SIZE + class_size(class_index);
+    size_t count = POOL_SLAB_SIZE / stride;
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    char *slab = malloc(stride * count);
+    if (slab == NULL)
+    {
+        perror("pool slab");
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct pool_block *block = (struct pool_block *)(slab + i * stride);
+        block->class_index = class_index;
+        block->magic = POOL_MAGIC;
+        block->next = depot->free_list;
+        depot->free_list = block;
+    }
+    depot->free_count += count;
+    depot->capacity += count;
+    return 0;
+}
+
+/**
+ * @brief Gives every block of a thread cache back to the depots.
+ */
+static void cache_flush_all(void *unused)
+{
+    (void)unused;
+    for (int c = 0; c < POOL_CLASS_COUNT; c++)
+    {
+        struct pool_depot *depot = &depots[c];
+        pthread_mutex_lock(&depot->lock);
+        while (cache.head[c] != NULL)
+        {
+            struct pool_block *block = cache.head[c];
+            cache.head[c] = block->next;
+            block->next = depot->free_list;
+            depot->free_list = block;
+            depot->free_count++;
+        }
+        cache.count[c] = 0;
+        pthread_mutex_unlock(&depot->lock);
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    for (int c = 0; c < POOL_CLASS_COUNT; c++)
+    {
+        retired[c] += cache.allocated[c];
+        cache.allocated[c] = 0;
+    }
+    if (cache.prev_cache != NULL)
+        cache.prev_cache->next_cache = cache.next_cache;
+    else
+        registry = cache.next_cache;
+    if (cache.next_cache != NULL)
+        cache.next_cache->prev_cache = cache.prev_cache;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static void cache_key_create(void)
+{
+    pthread_key_create(&cache_key, cache_flush_all);
+}
+
+/**
+ * @brief Makes sure the cache of the calling thread is flushed when the thread exits.
+ */
+static void cache_register(void)
+{
+    pthread_once(&cache_key_once, cache_key_create);
+    pthread_setspecific(cache_key, &cache);
+    cache.registered = 1;
+
+    pthread_mutex_lock(&registry_lock);
+    cache.prev_cache = NULL;
+    cache.next_cache = registry;
+    if (registry != NULL)
+    {
+        registry->prev_cache = &cache;
+    }
+    registry = &cache;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/**
+ * @brief Moves a batch of free blocks from the depot into the thread cache.
+ *
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+static int cache_refill(int class_index)
+{
+    struct pool_depot *depot = &depots[class_index];
+    int batch = class_size(class_index) >= POOL_SLAB_SIZE ? 1 : POOL_BATCH;
+
+    pthread_mutex_lock(&depot->lock);
+    if (depot->free_count == 0 && depot_grow(class_index) < 0)
+    {
+        pthread_mutex_unlock(&depot->lock);
+        return -1;
+    }
+    while (batch-- > 0 && depot->free_list != NULL)
+    {
+        struct pool_block *block = depot->free_list;
+        depot->free_list = block->next;
+        depot->free_count--;
+        block->next = cache.head[class_index];
+        cache.head[class_index] = block;
+        cache.count[class_index]++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+    return 0;
+}
+
+/**
+ * @brief Gives half of an overflowing thread cache back to the depot.
+ */
+static void cache_drain(int class_index)
+{
+    struct pool_depot *depot = &depots[class_index];
+
+    pthread_mutex_lock(&depot->lock);
+    while (cache.count[class_index] > cache_limit(class_index) / 2)
+    {
+        struct pool_block *block = cache.head[class_index];
+        cache.head[class_index] = block->next;
+        cache.count[class_index]--;
+        block->next = depot->free_list;
+        depot->free_list = block;
+        depot->free_count++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * @brief Updates the in-use counter of a class kept by the calling thread.
+ *
+ * Only this thread writes it, so a plain store is enough for the readers of pool_get_stats().
+ */
+static void account(int class_index, long delta)
+{
+    __atomic_store_n(&cache.allocated[class_index], cache.allocated[class_index] + delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sums the blocks of a class in use over every thread.
+ */
+static size_t count_in_use(int class_index)
+{
+    pthread_mutex_lock(&registry_lock);
+    long in_use = retired[class_index];
+    for (struct pool_cache *thread_cache = registry; thread_cache != NULL; thread_cache = thread_cache->next_cache)
+    {
+        in_use += __atomic_load_n(&thread_cache->allocated[class_index], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return in_use > 0 ? in_use : 0;
+}
+
+/**
+ * @brief Raises the high-water mark of a class to its current use, and returns that use.
+ */
+static size_t sample_high_water(int class_index)
+{
+    struct pool_depot *depot = &depots[class_index];
+    size_t in_use = count_in_use(class_index);
+    size_t high = __atomic_load_n(&depot->high_water, __ATOMIC_RELAXED);
+    while (in_use > high &&
+           !__atomic_compare_exchange_n(&depot->high_water, &high, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    return in_use;
+}
+
+/**
+ * @brief Allocates a block able to hold at least `size` bytes.
+ *
+ * @param size The number of bytes needed.
+ * @return A pointer to the block, or NULL if memory is exhausted.
+ */
+void *pool_alloc(size_t size)
+{
+    int class_index = class_for_size(size);
+
+    if (class_index == POOL_LARGE_CLASS)
+    {
+        struct pool_block *block = malloc(POOL_HEADER_SIZE + size);
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->large_size = size;
+        block->class_index = POOL_LARGE_CLASS;
+        block->magic = POOL_MAGIC;
+        return block + 1;
+    }
+
+    if (!cache.registered)
+    {
+        cache_register();
+    }
+    int refilled = cache.head[class_index] == NULL;
+    if (refilled && cache_refill(class_index) < 0)
+    {
+        return NULL;
+    }
+
+    struct pool_block *block = cache.head[class_index];
+    cache.head[class_index] = block->next;
+    cache.count[class_index]--;
+    account(class_index, 1);
+    if (refilled)
+    {
+        sample_high_water(class_index);
+    }
+    return block + 1;
+}
+
+/**
+ * @brief Returns a block obtained from pool_alloc() to its size class.
+ *
+ * @param ptr The block to release (NULL is ignored).
+ */
+void pool_free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    struct pool_block *block = (struct pool_block *)ptr - 1;
+    if (block->magic != POOL_MAGIC)
+    {
+        fprintf(stderr, "pool_free: invalid block %p\n", ptr);
+        return;
+    }
+
+    int class_index = block->class_index;
+    if (class_index == POOL_LARGE_CLASS)
+    {
+        free(block);
+        return;
+    }
+
+    if (!cache.registered)
+    {
+        cache_register();
+    }
+    block->next = cache.head[class_index];
+    cache.head[class_index] = block;
+    cache.count[class_index]++;
+    account(class_index, -1);
+
+    if (cache.count[class_index] > cache_limit(class_index))
+    {
+        cache_drain(class_index);
+    }
+}
+
+/**
+ * @brief Returns the usable size of a block obtained from pool_alloc().
+ *
+ * @param ptr The block.
+ * @return The number of bytes that can be used in the block.
+ */
+size_t pool_block_size(const void *ptr)
+{
+    const struct pool_block *block = (const struct pool_block *)ptr - 1;
+    if (block->class_index == POOL_LARGE_CLASS)
+    {
+        return block->large_size;
+    }
+    return class_size(block->class_index);
+}
+
+/**
+ * @brief Pre-allocates blocks so that the steady state does not carve new slabs.
+ *
+ * @param size The size of the blocks to reserve (rounded up to its class).
+ * @param count The number of free blocks to make available.
+ */
+void pool_reserve(size_t size, int count)
+{
+    int class_index = class_for_size(size);
+    if (class_index == POOL_LARGE_CLASS)
+    {
+        return;
+    }
+
+    struct pool_depot *depot = &depots[class_index];
+    pthread_mutex_lock(&depot->lock);
+    while (depot->free_count < (size_t)count)
+    {
+        if (depot_grow(class_index) < 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * @brief Copies the counters of every size class.
+ *
+ * @param stats Array of POOL_CLASS_COUNT entries filled by the call.
+ */
+void pool_get_stats(struct pool_class_stats stats[POOL_CLASS_COUNT])
+{
+    for (int c = 0; c < POOL_CLASS_COUNT; c++)
+    {
+        struct pool_depot *depot = &depots[c];
+        pthread_mutex_lock(&depot->lock);
+        stats[c].capacity = depot->capacity;
+        pthread_mutex_unlock(&depot->lock);
+        stats[c].block_size = class_size(c);
+        stats[c].in_use = sample_high_water(c);
+        stats[c].high_water = __atomic_load_n(&depot->high_water, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief Prints pool occupancy and high-water marks for each used size class.
+ *
+ * @param out The stream to print to.
+ */
+void pool_print_stats(FILE *out)
+{
+    struct pool_class_stats stats[POOL_CLASS_COUNT];
+    pool_get_stats(stats);
+
+    fprintf(out, "Pools:\n");
+    for (int c = 0; c < POOL_CLASS_COUNT; c++)
+    {
+        if (stats[c].capacity == 0)
+        {
+            continue;
+        }
+        fprintf(out, "Block size: %zu, In use: %zu/%zu, High water: %zu\n",
+                stats[c].block_size, stats[c].in_use, stats[c].capacity, stats[c].high_water);
+    }
+}
@@ -0,0 +1,83 @@
+/**
+ * @file pool.h
+ * @brief Size-classed slab allocator for connection state and message buffers.
+ *
+ * Blocks are carved out of large slabs and recycled through free lists, so once the
+ * server has warmed up the message path never calls malloc or free. Each thread keeps
+ * a small cache of free blocks per size class and only takes the global lock when its
+ * cache runs empty or overflows.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define POOL_CLASS_COUNT 19             /**< Number of size classes (64 B to 16 MB, doubling each step) */
+#define POOL_MIN_BLOCK 64               /**< Usable size of the smallest class */
+#define POOL_MAX_BLOCK (16 * 1024 * 1024) /**< Usable size of the largest class */
+#define POOL_SLAB_SIZE (256 * 1024)     /**< Minimum size of a slab carved into blocks */
+#define POOL_CACHE_LIMIT 64             /**< Maximum free blocks kept per class in a thread cache */
+
+/**
+ * @struct pool_class_stats
+ * @brief Occupancy counters of one size class.
+ */
+struct pool_class_stats
+{
+    size_t block_size; /**< Usable bytes per block */
+    size_t capacity;   /**< Blocks carved from slabs so far */
+    size_t in_use;     /**< Blocks currently handed out */
+    size_t high_water; /**< Highest in_use seen when a thread cache refilled or stats were read */
+};
+
+/**
+ * @brief Allocates a block able to hold at least `size` bytes.
+ *
+ * The block comes from the smallest size class that fits. Requests larger than
+ * POOL_MAX_BLOCK fall back to malloc and are still released with pool_free().
+ *
+ * @param size The number of bytes needed.
+ * @return A pointer to the block, or NULL if memory is exhausted.
+ */
+void *pool_alloc(size_t size);
+
+/**
+ * @brief Returns a block obtained from pool_alloc() to its size class.
+ *
+ * @param ptr The block to release (NULL is ignored).
+ */
+void pool_free(void *ptr);
+
+/**
+ * @brief Returns the usable size of a block obtained from pool_alloc().
+ *
+ * @param ptr The block.
+ * @return The number of bytes that can be used in the block.
+ */
+size_t pool_block_size(const void *ptr);
+
+/**
+ * @brief Pre-allocates blocks so that the steady state does not carve new slabs.
+ *
+ * @param size The size of the blocks to reserve (rounded up to its class).
+ * @param count The number of free blocks to make available.
+ */
+void pool_reserve(size_t size, int count);
+
+/**
+ * @brief Copies the counters of every size class.
+ *
+ * @param stats Array of POOL_CLASS_COUNT entries filled by the call.
+ */
+void pool_get_stats(struct pool_class_stats stats[POOL_CLASS_COUNT]);
+
+/**
+ * @brief Prints pool occupancy and high-water marks for each used size class.
+ *
+ * @param out The stream to print to.
+ */
+void pool_print_stats(FILE *out);
+
+#endif // POOL_H
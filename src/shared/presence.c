@@ -0,0 +1,381 @@
+/**
+ * @file presence.c
+ * @brief Presence entries, their hash table and the gossip of their changes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "presence.h"
+#include "database.h"
+#include "socket_utils.h"
+#include "log.h"
+
+#define PRESENCE_LINE_SIZE 128 /**< Room for one change line */
+
+static struct presence_entry entries[MAX_USERS];
+static int entry_count = 0;
+static int slots[PRESENCE_TABLE_SIZE]; /**< Index + 1 of the entry hashed to each slot, 0 if free */
+static uint64_t session_counter = 0;
+
+static const char delta_header[] = "presence\n";
+static char pending[PRESENCE_DELTA_SIZE];
+static size_t pending_length = 0;
+
+static uint64_t wall_clock_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * @brief Returns the slot of a user name: its entry, or the free slot where it goes.
+ */
+static int *find_slot(struct str_view username)
+{
+    uint64_t hash = view_hash(username);
+    for (size_t i = 0; i < PRESENCE_TABLE_SIZE; i++)
+    {
+        int *slot = &slots[(hash + i) & (PRESENCE_TABLE_SIZE - 1)];
+        if (*slot == 0 || view_equals(username, entries[*slot - 1].username))
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Finds the entry of a user.
+ */
+struct presence_entry *presence_find(struct str_view username)
+{
+    int *slot = find_slot(username);
+    return slot != NULL && *slot != 0 ? &entries[*slot - 1] : NULL;
+}
+
+/**
+ * @brief Finds the entry of a user, creating it if needed.
+ */
+static struct presence_entry *find_or_add(struct str_view username)
+{
+    int *slot = find_slot(username);
+    if (slot == NULL || username.len >= sizeof(entries[0].username))
+    {
+        return NULL;
+    }
+    if (*slot != 0)
+    {
+        return &entries[*slot - 1];
+    }
+    if (entry_count == MAX_USERS)
+    {
+        log_sampled(LOG_LEVEL_WARN, "Presence directory full, %.*s not tracked", (int)username.len, username.ptr);
+        return NULL;
+    }
+
+    struct presence_entry *entry = &entries[entry_count++];
+    memset(entry, 0, sizeof(*entry));
+    view_copy(entry->username, sizeof(entry->username), username);
+    entry->status = PRESENCE_OFFLINE;
+    entry->local_fd = -1;
+    *slot = entry_count;
+    return entry;
+}
+
+/**
+ * @brief Returns a socket of a user logged in on this server, or -1.
+ */
+int presence_local_fd(struct str_view username)
+{
+    struct presence_entry *entry = presence_find(username);
+    return entry != NULL ? entry->local_fd : -1;
+}
+
+/**
+ * @brief Returns the index in `sessions` of a node, or -1 if it is not part of the cluster.
+ */
+static int session_index(int node)
+{
+    if (node == node_id)
+    {
+        return 0;
+    }
+    for (int i = 0; i < peer_count; i++)
+    {
+        if (peers[i].id == node)
+        {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Sets the status of an entry from its sessions, forgotten ones not counting.
+ */
+static void update_status(struct presence_entry *entry)
+{
+    entry->status = PRESENCE_OFFLINE;
+    for (int i = 0; i <= peer_count; i++)
+    {
+        if (entry->sessions[i].id != 0 && !entry->sessions[i].forgotten)
+        {
+            entry->status = PRESENCE_ONLINE;
+        }
+    }
+}
+
+/**
+ * @brief Tells whether a user has no session on any node of the cluster.
+ */
+int presence_offline(struct str_view username)
+{
+    struct presence_entry *entry = presence_find(username);
+    if (entry == NULL)
+    {
+        return 1;
+    }
+    for (int i = 0; i <= peer_count; i++)
+    {
+        if (entry->sessions[i].id != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int format_change(char *line, size_t size, const struct presence_entry *entry, int node, uint64_t session,
+                         enum presence_status status, uint64_t stamp)
+{
+    return snprintf(line, size, "%s %d %llx %d %llx\n", entry->username, node, (unsigned long long)session, status,
+                    (unsigned long long)stamp);
+}
+
+/**
+ * @brief Adds a change of the session of this server to those sent at the next flush.
+ */
+static void queue_change(const struct presence_entry *entry, uint64_t session, enum presence_status status)
+{
+    if (pending_length + PRESENCE_LINE_SIZE > sizeof(pending))
+    {
+        presence_flush();
+    }
+    if (pending_length == 0)
+    {
+        memcpy(pending, delta_header, sizeof(delta_header) - 1);
+        pending_length = sizeof(delta_header) - 1;
+    }
+    pending_length += format_change(pending + pending_length, sizeof(pending) - pending_length, entry, node_id, session,
+                                    status, entry->sessions[0].stamp);
+}
+
+/**
+ * @brief Records a login on this server.
+ */
+void presence_login(const char *username, int fd)
+{
+    struct presence_entry *entry = find_or_add(view_from_cstr(username));
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->local_fd = fd;
+    if (entry->local_count++ > 0)
+    {
+        return;
+    }
+
+    struct presence_session *local = &entry->sessions[0];
+    local->id = ((uint64_t)node_id << 48) | ++session_counter;
+    local->stamp = wall_clock_ns();
+    local->forgotten = 0;
+    entry->status = PRESENCE_ONLINE;
+    queue_change(entry, local->id, PRESENCE_ONLINE);
+}
+
+/**
+ * @brief Records a logout on this server.
+ */
+int presence_logout(const char *username, int fd, int remaining_fd)
+{
+    struct presence_entry *entry = presence_find(view_from_cstr(username));
+    if (entry == NULL || entry->local_count == 0)
+    {
+        return 0;
+    }
+    if (entry->local_fd == fd)
+    {
+        entry->local_fd = remaining_fd;
+    }
+    if (--entry->local_count > 0)
+    {
+        return 0;
+    }
+
+    // Only the session of this server ends, those of the other nodes are theirs to end
+    struct presence_session *local = &entry->sessions[0];
+    uint64_t ended = local->id;
+    entry->local_fd = -1;
+    local->id = 0;
+    local->stamp = wall_clock_ns();
+    update_status(entry);
+    queue_change(entry, ended, PRESENCE_OFFLINE);
+    return presence_offline(view_from_cstr(username));
+}
+
+/**
+ * @brief Applies one change line gossiped by a peer.
+ *
+ * @return Non-zero if the entry changed.
+ */
+static int apply_change(const char *line, void (*on_online)(const char *username, int node))
+{
+    char username[50];
+    int node, status;
+    unsigned long long session, stamp;
+    if (sscanf(line, "%49s %d %llx %d %llx", username, &node, &session, &status, &stamp) != 5 || node == node_id)
+    {
+        return 0;
+    }
+    int index = session_index(node);
+    struct presence_entry *entry = index > 0 ? find_or_add(view_from_cstr(username)) : NULL;
+    if (entry == NULL)
+    {
+        return 0;
+    }
+    struct presence_session *known = &entry->sessions[index];
+
+    if (status == PRESENCE_OFFLINE)
+    {
+        // A logout only ends the session it belongs to
+        if (known->id != session)
+        {
+            return 0;
+        }
+        known->id = 0;
+        known->stamp = stamp;
+        known->forgotten = 0;
+        update_status(entry);
+        return 1;
+    }
+
+    if (stamp < known->stamp || (known->id == session && !known->forgotten))
+    {
+        return 0;
+    }
+    known->id = session;
+    known->stamp = stamp;
+    known->forgotten = 0;
+    entry->status = PRESENCE_ONLINE;
+    on_online(entry->username, node);
+    return 1;
+}
+
+/**
+ * @brief Applies the changes gossiped by a peer.
+ */
+int presence_apply(struct str_view deltas, void (*on_online)(const char *username, int node))
+{
+    int applied = 0;
+    const char *p = deltas.ptr;
+    const char *end = deltas.ptr + deltas.len;
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+        {
+            eol = end;
+        }
+
+        char line[PRESENCE_LINE_SIZE];
+        size_t length = eol - p;
+        if (length < sizeof(line))
+        {
+            memcpy(line, p, length);
+            line[length] = '\0';
+            applied += apply_change(line, on_online);
+        }
+        p = eol + 1;
+    }
+    return applied;
+}
+
+/**
+ * @brief Sends the changes gathered since the last call to every linked peer.
+ */
+void presence_flush(void)
+{
+    if (pending_length == 0)
+    {
+        return;
+    }
+    struct iovec part = {pending, pending_length};
+    peer_broadcast(&part, 1);
+    pending_length = 0;
+}
+
+/**
+ * @brief Sends the sessions of this server to a newly linked peer.
+ */
+void presence_announce(const struct peer *peer)
+{
+    int index = session_index(peer->id);
+    char frame[PRESENCE_DELTA_SIZE];
+    size_t length = 0;
+    for (int i = 0; i < entry_count; i++)
+    {
+        struct presence_entry *entry = &entries[i];
+        if (index > 0 && entry->sessions[index].forgotten)
+        {
+            entry->sessions[index].id = 0;
+            entry->sessions[index].forgotten = 0;
+            update_status(entry);
+        }
+
+        const struct presence_session *local = &entry->sessions[0];
+        if (entry->local_count == 0 || local->id == 0)
+        {
+            continue;
+        }
+        if (length + PRESENCE_LINE_SIZE > sizeof(frame))
+        {
+            send_message(peer->fd, frame, length, 0);
+            length = 0;
+        }
+        if (length == 0)
+        {
+            memcpy(frame, delta_header, sizeof(delta_header) - 1);
+            length = sizeof(delta_header) - 1;
+        }
+        length += format_change(frame + length, sizeof(frame) - length, entry, node_id, local->id, PRESENCE_ONLINE,
+                                local->stamp);
+    }
+    if (length > 0)
+    {
+        send_message(peer->fd, frame, length, 0);
+    }
+}
+
+/**
+ * @brief Marks as forgotten the sessions of a node whose link was lost.
+ */
+void presence_forget_node(int node)
+{
+    int index = session_index(node);
+    if (index <= 0)
+    {
+        return;
+    }
+    for (int i = 0; i < entry_count; i++)
+    {
+        // Forgotten rather than ended: the node announces its sessions again on relinking
+        if (entries[i].sessions[index].id != 0)
+        {
+            entries[i].sessions[index].forgotten = 1;
+            update_status(&entries[i]);
+        }
+    }
+}
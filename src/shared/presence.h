@@ -0,0 +1,135 @@
+/**
+ * @file presence.h
+ * @brief Cluster-wide directory of where each user is logged in.
+ *
+ * Every server keeps an entry per user with its session on each node of the cluster: a
+ * session id unique across the cluster and the time it changed. A session lasts from
+ * the first login of a user on a node to its last logout there; its id carries the node
+ * id in its high bits. A user is online while it has a session on any node. Entries are
+ * found through an open-addressing hash table on the user name, so lookups stay local
+ * and take constant time.
+ *
+ * Changes made on a server are gathered and sent to the peers as one frame per turn
+ * of the event loop:
+ *
+ *     presence
+ *     <user> <node> <session, hex> <status> <time, hex>
+ *     ...
+ *
+ * Each node only changes its own sessions. A logout only ends the session it belongs to,
+ * and a login older than the session known for its node is ignored, so changes replayed
+ * late cannot end or hide a newer session. A user logged in on two nodes stays online
+ * until both have logged it out.
+ */
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+#include "command.h"
+#include "peer.h"
+
+#define PRESENCE_TABLE_SIZE 16384 /**< Slots of the hash table, a power of two over twice MAX_USERS */
+#define PRESENCE_DELTA_SIZE 16384 /**< Bytes of pending changes that force a flush */
+
+/**
+ * @enum presence_status
+ * @brief Whether a user is logged in somewhere in the cluster.
+ */
+enum presence_status
+{
+    PRESENCE_OFFLINE = 0,
+    PRESENCE_ONLINE = 1
+};
+
+/**
+ * @struct presence_session
+ * @brief The session of a user on one node.
+ */
+struct presence_session
+{
+    uint64_t id;    /**< Id of the session, 0 if the user has none on the node */
+    uint64_t stamp; /**< Wall-clock time of its latest change, in nanoseconds */
+    int forgotten;  /**< The link to the node was lost while the session was up */
+};
+
+/**
+ * @struct presence_entry
+ * @brief What the cluster knows of a user, and its sessions on this server.
+ */
+struct presence_entry
+{
+    char username[50];
+    enum presence_status status;                     /**< Online while a session is up on any node */
+    struct presence_session sessions[MAX_PEERS + 1]; /**< This server first, then one per entry of `peers` */
+    int local_fd;                                    /**< A socket of the user on this server, or -1 */
+    int local_count;                                 /**< Sockets of the user logged in on this server */
+};
+
+/**
+ * @brief Finds the entry of a user.
+ *
+ * @param username The user name.
+ * @return The entry, or NULL if the user was never seen.
+ */
+struct presence_entry *presence_find(struct str_view username);
+
+/**
+ * @brief Tells whether a user has no session on any node of the cluster.
+ *
+ * A session forgotten with the link to its node is not over: the node catches up on the
+ * chat it missed when the link comes back.
+ */
+int presence_offline(struct str_view username);
+
+/**
+ * @brief Returns a socket of a user logged in on this server, or -1.
+ */
+int presence_local_fd(struct str_view username);
+
+/**
+ * @brief Records a login on this server.
+ *
+ * @param username The user name.
+ * @param fd The socket of the client.
+ */
+void presence_login(const char *username, int fd);
+
+/**
+ * @brief Records a logout on this server.
+ *
+ * @param username The user name.
+ * @param fd The socket that was closed.
+ * @param remaining_fd Another socket of the user still logged in here, or -1.
+ * @return Non-zero if the user now has no session on any node.
+ */
+int presence_logout(const char *username, int fd, int remaining_fd);
+
+/**
+ * @brief Applies the changes gossiped by a peer.
+ *
+ * @param deltas The lines following the `presence` keyword.
+ * @param on_online Called with the name and the node of each session that started.
+ * @return The number of changes applied.
+ */
+int presence_apply(struct str_view deltas, void (*on_online)(const char *username, int node));
+
+/**
+ * @brief Sends the changes gathered since the last call to every linked peer.
+ */
+void presence_flush(void);
+
+/**
+ * @brief Sends the sessions of this server to a newly linked peer.
+ *
+ * The sessions of the peer forgotten with its last link are dropped: it announces those
+ * still up in turn.
+ */
+void presence_announce(const struct peer *peer);
+
+/**
+ * @brief Marks as forgotten the sessions of a node whose link was lost.
+ */
+void presence_forget_node(int node);
+
+#endif // PRESENCE_H
@@ -0,0 +1,72 @@
+/**
+ * @file probes.h
+ * @brief Static probe points of the server request lifecycle.
+ *
+ * Built with `make SDT=1`, each probe becomes a systemtap/USDT marker from
+ * <sys/sdt.h> under the provider `msgapp`. It is a single nop until perf or bpftrace
+ * attaches to it, and its position does not depend on inlining. Without SDT the
+ * probes expand to nothing and their arguments are not evaluated.
+ *
+ * Listing and using them:
+ *
+ *     bpftrace -l 'usdt:./region1/server/server.exe:msgapp:*'
+ *     bpftrace -e 'usdt:./server.exe:msgapp:command_done { @[arg1] = hist(arg2); }'
+ *
+ * Command ids are the values of enum command_id, see command_id_name(). Trace ids are
+ * the correlation ids of trace.h and are 0 when tracing is off.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef ENABLE_SDT_PROBES
+
+#include <sys/sdt.h>
+
+/** A complete frame was read. arg0: fd, arg1: payload size in bytes */
+#define PROBE_FRAME_RECEIVE(fd, size) DTRACE_PROBE2(msgapp, frame_receive, fd, size)
+
+/** A frame was parsed and is about to be handled. arg0: fd, arg1: command id, arg2: trace id */
+#define PROBE_COMMAND_DISPATCH(fd, command, trace_id) DTRACE_PROBE3(msgapp, command_dispatch, fd, command, trace_id)
+
+/** A command was handled. arg0: fd, arg1: command id, arg2: nanoseconds since its dispatch */
+#define PROBE_COMMAND_DONE(fd, command, duration_ns) DTRACE_PROBE3(msgapp, command_done, fd, command, duration_ns)
+
+/** A message starts being delivered to a group. arg0: group name (char *), arg1: group members */
+#define PROBE_FAN_OUT_START(group, members) DTRACE_PROBE2(msgapp, fan_out_start, group, members)
+
+/** A message was delivered to a group. arg0: group name (char *), arg1: recipients sent the message */
+#define PROBE_FAN_OUT_END(group, delivered) DTRACE_PROBE2(msgapp, fan_out_end, group, delivered)
+
+/**
+ * A chunk of file data went through the server. arg0: fd, arg1: chunk size in bytes,
+ * arg2: bytes transferred so far, arg3: 0 for data received, 1 for data sent
+ */
+#define PROBE_TRANSFER_CHUNK(fd, size, total, sending) DTRACE_PROBE4(msgapp, transfer_chunk, fd, size, total, sending)
+
+/** A command is replicated to the peer servers. arg0: trace id, arg1: command id, arg2: frame size */
+#define PROBE_PEER_SEND(trace_id, command, size) DTRACE_PROBE3(msgapp, peer_send, trace_id, command, size)
+
+/** A replicated command was written to every linked peer. arg0: trace id, arg1: nanoseconds since the send */
+#define PROBE_PEER_ACK(trace_id, lag_ns) DTRACE_PROBE2(msgapp, peer_ack, trace_id, lag_ns)
+
+/** A command replicated by a peer server was applied. arg0: trace id, arg1: command id, arg2: nanoseconds taken */
+#define PROBE_PEER_APPLY(trace_id, command, duration_ns) DTRACE_PROBE3(msgapp, peer_apply, trace_id, command, duration_ns)
+
+#else
+
+// Compiled out; the dead branch only keeps the arguments used for the compiler
+
+#define PROBE_FRAME_RECEIVE(fd, size) do { if (0) { (void)(fd); (void)(size); } } while (0)
+#define PROBE_COMMAND_DISPATCH(fd, command, trace_id) do { if (0) { (void)(fd); (void)(command); (void)(trace_id); } } while (0)
+#define PROBE_COMMAND_DONE(fd, command, duration_ns) do { if (0) { (void)(fd); (void)(command); (void)(duration_ns); } } while (0)
+#define PROBE_FAN_OUT_START(group, members) do { if (0) { (void)(group); (void)(members); } } while (0)
+#define PROBE_FAN_OUT_END(group, delivered) do { if (0) { (void)(group); (void)(delivered); } } while (0)
+#define PROBE_TRANSFER_CHUNK(fd, size, total, sending) do { if (0) { (void)(fd); (void)(size); (void)(total); (void)(sending); } } while (0)
+#define PROBE_PEER_SEND(trace_id, command, size) do { if (0) { (void)(trace_id); (void)(command); (void)(size); } } while (0)
+#define PROBE_PEER_ACK(trace_id, lag_ns) do { if (0) { (void)(trace_id); (void)(lag_ns); } } while (0)
+#define PROBE_PEER_APPLY(trace_id, command, duration_ns) do { if (0) { (void)(trace_id); (void)(command); (void)(duration_ns); } } while (0)
+
+#endif // ENABLE_SDT_PROBES
+
+#endif // PROBES_H
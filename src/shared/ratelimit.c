@@ -0,0 +1,106 @@
+/**
+ * @file ratelimit.c
+ * @brief Implementation of the token buckets.
+ */
+
+#include <time.h>
+#include "ratelimit.h"
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t ratelimit_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bucket_init(struct token_bucket *bucket, double rate, double burst_seconds)
+{
+    bucket->rate = rate;
+    bucket->capacity = rate * burst_seconds;
+    if (bucket->capacity < 1)
+    {
+        bucket->capacity = 1;
+    }
+    bucket->tokens = bucket->capacity;
+    bucket->last_ns = ratelimit_now_ns();
+}
+
+/**
+ * @brief Adds the tokens earned since the last refill.
+ */
+static void bucket_refill(struct token_bucket *bucket, uint64_t now_ns)
+{
+    if (now_ns > bucket->last_ns)
+    {
+        bucket->tokens += bucket->rate * (now_ns - bucket->last_ns) / 1e9;
+        if (bucket->tokens > bucket->capacity)
+        {
+            bucket->tokens = bucket->capacity;
+        }
+        bucket->last_ns = now_ns;
+    }
+}
+
+/**
+ * @brief Returns how long to wait until a bucket holds `amount` tokens.
+ *
+ * An amount larger than the capacity only needs a full bucket, so that frames bigger
+ * than the burst are slowed down rather than blocked forever.
+ */
+static uint64_t bucket_wait_ns(struct token_bucket *bucket, double amount, uint64_t now_ns)
+{
+    if (bucket->rate <= 0)
+    {
+        return 0;
+    }
+    bucket_refill(bucket, now_ns);
+    if (amount > bucket->capacity)
+    {
+        amount = bucket->capacity;
+    }
+    if (bucket->tokens >= amount)
+    {
+        return 0;
+    }
+    return (uint64_t)((amount - bucket->tokens) / bucket->rate * 1e9) + 1;
+}
+
+/**
+ * @brief Initialises a limiter with the given rates.
+ */
+void ratelimit_init(struct rate_limiter *limiter, double messages_per_sec, double bytes_per_sec, double burst_seconds)
+{
+    bucket_init(&limiter->messages, messages_per_sec, burst_seconds);
+    bucket_init(&limiter->bytes, bytes_per_sec, burst_seconds);
+}
+
+/**
+ * @brief Computes how long a frame must wait before a limiter lets it through.
+ */
+uint64_t ratelimit_wait_ns(struct rate_limiter *limiter, size_t bytes, uint64_t now_ns)
+{
+    uint64_t wait_messages = bucket_wait_ns(&limiter->messages, 1, now_ns);
+    uint64_t wait_bytes = bucket_wait_ns(&limiter->bytes, bytes, now_ns);
+    return wait_messages > wait_bytes ? wait_messages : wait_bytes;
+}
+
+/**
+ * @brief Consumes the tokens of a frame.
+ *
+ * The byte bucket may go negative for frames larger than its capacity; the debt is
+ * paid back before the next frame is let through.
+ */
+void ratelimit_consume(struct rate_limiter *limiter, size_t bytes)
+{
+    if (limiter->messages.rate > 0)
+    {
+        limiter->messages.tokens -= 1;
+    }
+    if (limiter->bytes.rate > 0)
+    {
+        limiter->bytes.tokens -= bytes;
+    }
+}
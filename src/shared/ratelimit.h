@@ -0,0 +1,75 @@
+/**
+ * @file ratelimit.h
+ * @brief Token-bucket rate limiting of client frames.
+ *
+ * Each connection and each logged-in user owns two buckets, one counting frames and
+ * one counting bytes. A frame is dispatched only when every bucket that applies to it
+ * holds enough tokens.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @struct token_bucket
+ * @brief Tokens refilled continuously at a fixed rate, up to a capacity.
+ */
+struct token_bucket
+{
+    double rate;      /**< Tokens added per second (0 disables the bucket) */
+    double capacity;  /**< Maximum number of tokens */
+    double tokens;    /**< Tokens currently available */
+    uint64_t last_ns; /**< Time of the last refill */
+};
+
+/**
+ * @struct rate_limiter
+ * @brief Frame and byte buckets of one connection or user.
+ */
+struct rate_limiter
+{
+    struct token_bucket messages;
+    struct token_bucket bytes;
+};
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t ratelimit_now_ns(void);
+
+/**
+ * @brief Initialises a limiter with the given rates.
+ *
+ * Buckets start full, with a capacity of `burst_seconds` worth of rate.
+ *
+ * @param limiter The limiter.
+ * @param messages_per_sec Frames allowed per second (0 disables).
+ * @param bytes_per_sec Bytes allowed per second (0 disables).
+ * @param burst_seconds Capacity of the buckets, in seconds worth of rate.
+ */
+void ratelimit_init(struct rate_limiter *limiter, double messages_per_sec, double bytes_per_sec, double burst_seconds);
+
+/**
+ * @brief Computes how long a frame must wait before a limiter lets it through.
+ *
+ * Does not consume tokens.
+ *
+ * @param limiter The limiter.
+ * @param bytes The size of the frame.
+ * @param now_ns The current time.
+ * @return 0 if the frame may go now, otherwise the wait in nanoseconds.
+ */
+uint64_t ratelimit_wait_ns(struct rate_limiter *limiter, size_t bytes, uint64_t now_ns);
+
+/**
+ * @brief Consumes the tokens of a frame.
+ *
+ * @param limiter The limiter.
+ * @param bytes The size of the frame.
+ */
+void ratelimit_consume(struct rate_limiter *limiter, size_t bytes);
+
+#endif // RATELIMIT_H
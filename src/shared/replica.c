@@ -0,0 +1,541 @@
+/**
+ * @file replica.c
+ * @brief Streaming of uploaded files to the peers and assembly of the files they stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include "replica.h"
+#include "file_cache.h"
+#include "file_index.h"
+#include "socket_utils.h"
+#include "metrics.h"
+#include "log.h"
+#include "pool.h"
+
+/**
+ * @struct incoming_file
+ * @brief A file being received from a peer.
+ */
+struct incoming_file
+{
+    int active;                       /**< Whether a file is being received */
+    int fd;                           /**< The hidden file being written */
+    char temp_path[REPLICA_PATH_SIZE]; /**< Where the data is written */
+    char path[REPLICA_PATH_SIZE];     /**< Where the file goes once complete */
+    char group[64];                   /**< Group of the file */
+    struct file_index_entry entry;    /**< Index entry of the file, completed once it is checked */
+    uint64_t size;                    /**< Size announced */
+    uint64_t received;                /**< Bytes written so far */
+    uint64_t start;                   /**< When the first frame arrived */
+    struct checksum checksum;         /**< Checksum of the bytes written */
+};
+
+static struct incoming_file incoming[MAX_PEERS];
+
+/**
+ * @struct replica_policy
+ * @brief The replication mode chosen for a group.
+ */
+struct replica_policy
+{
+    char group[64];
+    enum replica_mode mode;
+};
+
+enum replica_mode replica_default_mode = REPLICA_EAGER;
+static struct replica_policy policies[REPLICA_MAX_POLICIES];
+static int policy_count = 0;
+
+/**
+ * @brief Sets the replication mode of a group.
+ */
+int replica_set_policy(const char *group, enum replica_mode mode)
+{
+    for (int i = 0; i < policy_count; i++)
+    {
+        if (strcmp(policies[i].group, group) == 0)
+        {
+            policies[i].mode = mode;
+            return 0;
+        }
+    }
+    if (policy_count == REPLICA_MAX_POLICIES)
+    {
+        return -1;
+    }
+    snprintf(policies[policy_count].group, sizeof(policies[policy_count].group), "%s", group);
+    policies[policy_count++].mode = mode;
+    return 0;
+}
+
+/**
+ * @brief Returns the replication mode of a group.
+ */
+enum replica_mode replica_policy(struct str_view group)
+{
+    for (int i = 0; i < policy_count; i++)
+    {
+        if (view_equals(group, policies[i].group))
+        {
+            return policies[i].mode;
+        }
+    }
+    return replica_default_mode;
+}
+
+/**
+ * @brief Sends a frame to the peers of a stream, dropping those whose link fails.
+ */
+static void send_to_targets(struct replica_stream *stream, struct iovec *parts, int count)
+{
+    for (int i = 0; i < stream->target_count;)
+    {
+        struct peer *peer = &peers[stream->targets[i]];
+        if (peer->state != PEER_CONNECTED || send_message_parts(peer->fd, parts, count) < 0)
+        {
+            log_warn("Stopped streaming a file to node %d", peer->id);
+            stream->targets[i] = stream->targets[--stream->target_count];
+            continue;
+        }
+        i++;
+    }
+}
+
+/**
+ * @brief Announces an upload to every linked peer.
+ */
+void replica_stream_begin(struct replica_stream *stream, struct str_view group, struct str_view file, uint64_t size,
+                          uint32_t version, const char *uploader)
+{
+    stream->target_count = 0;
+    checksum_init(&stream->checksum);
+    stream->mode = replica_policy(group);
+    stream->size = size;
+    snprintf(stream->meta, sizeof(stream->meta), "%.*s %.*s %lu", (int)group.len, group.ptr, (int)file.len, file.ptr,
+             size);
+    snprintf(stream->origin, sizeof(stream->origin), "%u %s", version, uploader);
+    if (stream->mode == REPLICA_LAZY)
+    {
+        return;
+    }
+
+    for (int i = 0; i < peer_count; i++)
+    {
+        if (peers[i].state == PEER_CONNECTED)
+        {
+            stream->targets[stream->target_count++] = i;
+        }
+    }
+
+    char header[REPLICA_PATH_SIZE + 96];
+    int length = snprintf(header, sizeof(header), "file_begin %s %s", stream->meta, stream->origin);
+    struct iovec parts[1] = {{header, length}};
+    send_to_targets(stream, parts, 1);
+}
+
+/**
+ * @brief Sends a piece of the upload to the peers.
+ */
+void replica_stream_chunk(struct replica_stream *stream, const char *data, size_t length)
+{
+    checksum_update(&stream->checksum, data, length);
+    if (stream->target_count == 0)
+    {
+        return;
+    }
+
+    char header[32];
+    struct iovec parts[2] = {
+        {header, snprintf(header, sizeof(header), "file_chunk %zu ", length)},
+        {(char *)data, length},
+    };
+    send_to_targets(stream, parts, 2);
+    metrics_add(METRIC_REPLICATION_BYTES_SENT, length * stream->target_count);
+}
+
+/**
+ * @brief Ends the stream with the checksum of the data, or abandons it if the upload is incomplete.
+ *
+ * An abandoned stream ends with an empty checksum, which no peer accepts.
+ */
+void replica_stream_end(struct replica_stream *stream, int complete)
+{
+    if (stream->mode == REPLICA_LAZY)
+    {
+        if (complete)
+        {
+            char meta[REPLICA_PATH_SIZE + 128];
+            int length = snprintf(meta, sizeof(meta), "file_meta %s %016llx %s", stream->meta,
+                                  (unsigned long long)checksum_final(&stream->checksum), stream->origin);
+            struct iovec parts[1] = {{meta, length}};
+            metrics_add(METRIC_REPLICATION_BYTES_DEFERRED, stream->size * peer_broadcast(parts, 1));
+        }
+        return;
+    }
+
+    char trailer[64];
+    int length = complete ? snprintf(trailer, sizeof(trailer), "file_end %016llx",
+                                     (unsigned long long)checksum_final(&stream->checksum))
+                          : snprintf(trailer, sizeof(trailer), "file_end -");
+    struct iovec parts[1] = {{trailer, length}};
+    send_to_targets(stream, parts, 1);
+}
+
+/**
+ * @brief Closes the file being received from a peer and removes it.
+ */
+static void discard(struct incoming_file *file)
+{
+    if (file->active)
+    {
+        close(file->fd);
+        unlink(file->temp_path);
+        file->active = 0;
+    }
+}
+
+/**
+ * @brief Reads the `<version> <uploader>` of a replicated file into its index entry.
+ */
+static void parse_origin(struct str_view text, struct file_index_entry *entry)
+{
+    char copy[96];
+    long version = 0;
+    view_copy(copy, sizeof(copy), text);
+    if (sscanf(copy, "%ld %49s", &version, entry->uploader) != 2)
+    {
+        strcpy(entry->uploader, "-");
+    }
+    entry->version = version > 0 ? version : 1;
+}
+
+/**
+ * @brief Starts receiving a file from a peer, dropping any file it left unfinished.
+ */
+void replica_receive_begin(int peer_index, struct str_view group, struct str_view file, long size,
+                           struct str_view origin)
+{
+    struct incoming_file *target = &incoming[peer_index];
+    if (target->active)
+    {
+        log_warn("Node %d started a file before finishing %s", peers[peer_index].id, target->path);
+        discard(target);
+    }
+    if (size < 0 || memchr(file.ptr, '/', file.len) != NULL || file.len == 0 || file.ptr[0] == '.' ||
+        file.len >= FILE_INDEX_NAME_SIZE || group.len >= sizeof(target->group))
+    {
+        log_warn("Node %d sent an invalid file_begin", peers[peer_index].id);
+        return;
+    }
+
+    snprintf(target->path, sizeof(target->path), "./drive/%.*s/%.*s", (int)group.len, group.ptr, (int)file.len,
+             file.ptr);
+    snprintf(target->temp_path, sizeof(target->temp_path), "./drive/%.*s/.%.*s.part", (int)group.len, group.ptr,
+             (int)file.len, file.ptr);
+    view_copy(target->group, sizeof(target->group), group);
+    view_copy(target->entry.name, sizeof(target->entry.name), file);
+    parse_origin(origin, &target->entry);
+    target->entry.size = size;
+    target->entry.node = 0;
+    target->fd = open(target->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (target->fd < 0)
+    {
+        log_errno(target->temp_path);
+        return;
+    }
+    target->active = 1;
+    target->size = size;
+    target->received = 0;
+    target->start = metrics_now_ns();
+    checksum_init(&target->checksum);
+}
+
+/**
+ * @brief Writes a piece of the file being received from a peer.
+ */
+void replica_receive_chunk(int peer_index, const char *data, size_t length)
+{
+    struct incoming_file *target = &incoming[peer_index];
+    if (!target->active)
+    {
+        return;
+    }
+    if (target->received + length > target->size)
+    {
+        log_warn("Node %d sent more than the %lu bytes of %s", peers[peer_index].id, target->size, target->path);
+        discard(target);
+        return;
+    }
+
+    for (size_t written = 0; written < length;)
+    {
+        ssize_t count = write(target->fd, data + written, length - written);
+        if (count <= 0)
+        {
+            log_errno(target->temp_path);
+            discard(target);
+            return;
+        }
+        written += count;
+    }
+    checksum_update(&target->checksum, data, length);
+    target->received += length;
+    metrics_add(METRIC_REPLICATION_BYTES_RECEIVED, length);
+}
+
+/**
+ * @brief Checks the file received from a peer against its checksum and moves it into place.
+ */
+void replica_receive_end(int peer_index, struct str_view checksum)
+{
+    struct incoming_file *target = &incoming[peer_index];
+    if (!target->active)
+    {
+        return;
+    }
+
+    char expected[32];
+    snprintf(expected, sizeof(expected), "%016llx", (unsigned long long)checksum_final(&target->checksum));
+    if (target->received != target->size || checksum.len != 16 || memcmp(checksum.ptr, expected, 16) != 0)
+    {
+        log_warn("Dropped %s from node %d: %lu of %lu bytes, checksum %.*s, expected %s", target->path,
+                 peers[peer_index].id, target->received, target->size, (int)checksum.len, checksum.ptr, expected);
+        discard(target);
+        return;
+    }
+
+    close(target->fd);
+    target->active = 0;
+    if (rename(target->temp_path, target->path) < 0)
+    {
+        log_errno(target->path);
+        unlink(target->temp_path);
+        return;
+    }
+    struct str_view group = view_from_cstr(target->group);
+    target->entry.hash = checksum_final(&target->checksum);
+    target->entry.mtime = time(NULL);
+    file_index_put(group, &target->entry);
+    file_cache_invalidate(group, view_from_cstr(target->entry.name));
+    log_info("File replicated from node %d: %s (%lu bytes, %.1f ms)", peers[peer_index].id, target->path,
+             target->size, (metrics_now_ns() - target->start) / 1e6);
+}
+
+/**
+ * @brief Drops the file being received from a peer whose link was lost.
+ */
+void replica_forget(int peer_index)
+{
+    if (incoming[peer_index].active)
+    {
+        log_warn("Link to node %d lost while receiving %s", peers[peer_index].id, incoming[peer_index].path);
+        discard(&incoming[peer_index]);
+    }
+}
+
+/**
+ * @brief Records a file announced by a peer, replacing any older copy.
+ *
+ * The index entry names the node the file came from, and a copy of an older version of
+ * the file is removed so that the next download pulls the new one. A copy with the same
+ * contents is kept, and nothing needs to be fetched.
+ */
+void replica_receive_meta(int peer_index, struct str_view group, struct str_view file, long size,
+                          struct str_view details)
+{
+    unsigned long long hash;
+    if (size < 0 || details.len < 17 || details.ptr[16] != ' ' || sscanf(details.ptr, "%16llx", &hash) != 1 ||
+        memchr(file.ptr, '/', file.len) != NULL || file.len == 0 || file.ptr[0] == '.' ||
+        file.len >= FILE_INDEX_NAME_SIZE || group.len + file.len + 32 > REPLICA_PATH_SIZE)
+    {
+        log_warn("Node %d sent an invalid file_meta", peers[peer_index].id);
+        return;
+    }
+
+    struct file_index_entry entry = {.size = size, .mtime = time(NULL), .hash = hash, .node = peers[peer_index].id};
+    view_copy(entry.name, sizeof(entry.name), file);
+    parse_origin((struct str_view){details.ptr + 17, details.len - 17}, &entry);
+
+    const struct file_index_entry *current = file_index_find(group, file);
+    if (current != NULL && current->node == 0 && current->size == entry.size && current->hash == entry.hash)
+    {
+        entry.node = 0;
+        entry.mtime = current->mtime;
+        file_index_put(group, &entry);
+        metrics_add(METRIC_REPLICATION_SKIPPED, 1);
+        log_debug("Kept %.*s/%.*s: same contents as on node %d", (int)group.len, group.ptr, (int)file.len, file.ptr,
+                  peers[peer_index].id);
+        return;
+    }
+
+    char path[REPLICA_PATH_SIZE];
+    snprintf(path, sizeof(path), "./drive/%.*s/%.*s", (int)group.len, group.ptr, (int)file.len, file.ptr);
+    unlink(path);
+    file_cache_invalidate(group, file);
+    file_index_put(group, &entry);
+    log_debug("Recorded %.*s/%.*s from node %d (%ld bytes, not fetched)", (int)group.len, group.ptr, (int)file.len,
+              file.ptr, peers[peer_index].id, size);
+}
+
+/**
+ * @brief Opens a client connection to a peer, with reads and writes bounded by `peer_timeout_ms`.
+ *
+ * @return The socket, or -1.
+ */
+static int connect_to_peer(const struct peer *peer)
+{
+    char port[16];
+    snprintf(port, sizeof(port), "%d", peer->port);
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *address;
+    if (getaddrinfo(peer->host, port, &hints, &address) != 0)
+    {
+        return -1;
+    }
+
+    int fd = socket(address->ai_family, address->ai_socktype, 0);
+    if (fd >= 0)
+    {
+        struct timeval timeout = {peer_timeout_ms / 1000, (peer_timeout_ms % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, address->ai_addr, address->ai_addrlen) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(address);
+    return fd;
+}
+
+/**
+ * @brief Fetches a file from the server that announced it and caches it in place.
+ *
+ * The whole file is asked for as one range. Each piece is written to a hidden file and
+ * passed on to the client, and the copy replaces the stub once the checksum sent by the
+ * origin and the one of the stub both match the data.
+ */
+uint64_t replica_pull(struct str_view group, struct str_view file, const struct file_index_entry *remote,
+                      int client_fd)
+{
+    static char buffer[256 * 1024];
+    struct peer *origin = NULL;
+    for (int i = 0; i < peer_count; i++)
+    {
+        if (peers[i].id == remote->node)
+        {
+            origin = &peers[i];
+        }
+    }
+    int fd = origin != NULL ? connect_to_peer(origin) : -1;
+    if (fd < 0)
+    {
+        log_warn("Cannot pull %.*s/%.*s from node %d", (int)group.len, group.ptr, (int)file.len, file.ptr,
+                 remote->node);
+        return 0;
+    }
+
+    char request[REPLICA_PATH_SIZE + 64];
+    int request_length = snprintf(request, sizeof(request), "download_range %.*s %.*s 0 %lu", (int)group.len,
+                                  group.ptr, (int)file.len, file.ptr, remote->size);
+    send_message(fd, request, request_length, 0);
+
+    size_t frame_length;
+    unsigned long offset, length, size;
+    char *header = receive_frame(fd, 256, &frame_length);
+    if (header == NULL || sscanf(header, "RANGE %lu %lu %lu", &offset, &length, &size) != 3 ||
+        length != remote->size || size != remote->size)
+    {
+        log_warn("Node %d cannot send %.*s/%.*s: %s", remote->node, (int)group.len, group.ptr, (int)file.len,
+                 file.ptr, header != NULL ? header : "connection closed");
+        pool_free(header);
+        close(fd);
+        return 0;
+    }
+    pool_free(header);
+
+    char path[REPLICA_PATH_SIZE], temp_path[REPLICA_PATH_SIZE];
+    snprintf(path, sizeof(path), "./drive/%.*s/%.*s", (int)group.len, group.ptr, (int)file.len, file.ptr);
+    snprintf(temp_path, sizeof(temp_path), "./drive/%.*s/.%.*s.part", (int)group.len, group.ptr, (int)file.len,
+             file.ptr);
+    int cache = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (cache < 0)
+    {
+        log_errno(temp_path);
+    }
+
+    // Pass every piece on to the client as it arrives, caching it on the way
+    uint64_t start = metrics_now_ns();
+    struct checksum checksum;
+    checksum_init(&checksum);
+    uint64_t received = 0;
+    while (received < remote->size)
+    {
+        size_t wanted = remote->size - received < sizeof(buffer) ? remote->size - received : sizeof(buffer);
+        ssize_t count = recv(fd, buffer, wanted, 0);
+        if (count <= 0)
+        {
+            break;
+        }
+        checksum_update(&checksum, buffer, count);
+        if (cache >= 0 && write(cache, buffer, count) != count)
+        {
+            log_errno(temp_path);
+            close(cache);
+            unlink(temp_path);
+            cache = -1;
+        }
+        if (client_fd >= 0 && send(client_fd, buffer, count, MSG_NOSIGNAL) != count)
+        {
+            client_fd = -1; // The client left; the file is still cached for the next one
+        }
+        received += count;
+    }
+
+    uint64_t hash = checksum_final(&checksum);
+    char expected[32];
+    snprintf(expected, sizeof(expected), "RANGE_END %016llx\n", (unsigned long long)hash);
+    char *trailer = received == remote->size ? receive_frame(fd, 256, &frame_length) : NULL;
+    int verified = trailer != NULL && strcmp(trailer, expected) == 0 && hash == remote->hash;
+    pool_free(trailer);
+    close(fd);
+
+    metrics_add(METRIC_PULLS, 1);
+    metrics_add(METRIC_PULL_BYTES, received);
+    if (cache < 0)
+    {
+        return received;
+    }
+    close(cache);
+    if (!verified)
+    {
+        log_warn("Pull of %s from node %d failed: %lu of %lu bytes", path, remote->node, received, remote->size);
+        unlink(temp_path);
+        return received;
+    }
+    if (rename(temp_path, path) < 0)
+    {
+        log_errno(path);
+        unlink(temp_path);
+        return received;
+    }
+    struct file_index_entry entry = *remote;
+    entry.node = 0;
+    entry.mtime = time(NULL);
+    file_index_put(group, &entry);
+    log_info("File pulled from node %d: %s (%lu bytes, %.1f ms)", remote->node, path, received,
+             (metrics_now_ns() - start) / 1e6);
+    return received;
+}
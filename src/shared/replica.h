@@ -0,0 +1,156 @@
+/**
+ * @file replica.h
+ * @brief Copies of uploaded files streamed to the peer servers while they are received.
+ *
+ * Each piece of an upload read from the client is written locally and sent at once to
+ * every linked peer, on the link that carries the replicated commands:
+ *
+ *     file_begin <group> <file> <size> <version> <uploader>
+ *     file_chunk <length> <data>
+ *     ...
+ *     file_end <checksum, XXH64 in hex>
+ *
+ * The frames are not kept in the replication log: a file is megabytes where the log is
+ * sized for commands. A peer writes the data to a hidden file next to the target and
+ * renames it into place once the size and checksum match, so the file appears complete
+ * or not at all, within moments of the upload finishing. A stream cut by a lost link is
+ * discarded. The peer handles the frames in its event loop like any other, so it keeps
+ * serving its own clients during the transfer.
+ *
+ * Groups can instead be replicated lazily (`replication_group <group> lazy` in
+ * server.conf, the same on every server). Only the metadata of an upload is replicated,
+ * as a logged command that survives a lost link:
+ *
+ *     file_meta <group> <file> <size> <checksum> <version> <uploader>
+ *
+ * A peer records it in the file index of the group, naming the origin server, unless
+ * its own copy already has the same checksum (msgapp_replication_skipped_total). The first
+ * download of the file on that peer pulls it from the origin with `download_range`,
+ * streaming it to the client while caching it in place, and the cached copy is checked
+ * against the checksum before the index points to it. Files never downloaded in a region
+ * never cross to it; msgapp_replication_saved_bytes counts them.
+ */
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "checksum.h"
+#include "command.h"
+#include "peer.h"
+#include "file_index.h"
+
+#define REPLICA_PATH_SIZE 512    /**< Room for the path of a file of a group */
+#define REPLICA_MAX_POLICIES 64 /**< Groups with their own replication mode */
+
+/**
+ * @enum replica_mode
+ * @brief When the files of a group are copied to the other servers.
+ */
+enum replica_mode
+{
+    REPLICA_EAGER = 0, /**< Streamed to every peer during the upload */
+    REPLICA_LAZY       /**< Only announced; pulled by a peer on its first download */
+};
+
+extern enum replica_mode replica_default_mode; /**< Mode of the groups without a policy of their own */
+
+/**
+ * @struct replica_stream
+ * @brief An upload being streamed to the peers.
+ */
+struct replica_stream
+{
+    int targets[MAX_PEERS];       /**< Indexes of the peers the file is sent to */
+    int target_count;             /**< Number of entries in `targets` */
+    struct checksum checksum;     /**< Checksum of the data sent so far */
+    enum replica_mode mode;       /**< Policy of the group of the file */
+    char meta[REPLICA_PATH_SIZE]; /**< `<group> <file> <size>`, for the announcement of a lazy upload */
+    char origin[64];              /**< `<version> <uploader>` of the upload */
+    uint64_t size;                /**< Size announced by the client */
+};
+
+/**
+ * @brief Sets the replication mode of a group.
+ *
+ * @return 0 on success, -1 if REPLICA_MAX_POLICIES groups already have one.
+ */
+int replica_set_policy(const char *group, enum replica_mode mode);
+
+/**
+ * @brief Returns the replication mode of a group.
+ */
+enum replica_mode replica_policy(struct str_view group);
+
+/**
+ * @brief Starts replicating an upload: announces it to every linked peer if its group is eager.
+ *
+ * @param stream The stream, initialised by the call.
+ * @param group The group of the file.
+ * @param file The name of the file.
+ * @param size The size announced by the client.
+ * @param version The version of the file the upload creates.
+ * @param uploader The user uploading the file.
+ */
+void replica_stream_begin(struct replica_stream *stream, struct str_view group, struct str_view file, uint64_t size,
+                          uint32_t version, const char *uploader);
+
+/**
+ * @brief Sends a piece of the upload to the peers; a peer whose link fails is dropped from the stream.
+ */
+void replica_stream_chunk(struct replica_stream *stream, const char *data, size_t length);
+
+/**
+ * @brief Ends the stream with the checksum of the data, or abandons it if the upload is incomplete.
+ *
+ * A complete lazy upload is announced to the peers with `file_meta`.
+ */
+void replica_stream_end(struct replica_stream *stream, int complete);
+
+/**
+ * @brief Starts receiving a file from a peer, dropping any file it left unfinished.
+ *
+ * @param origin The `<version> <uploader>` of the upload.
+ */
+void replica_receive_begin(int peer_index, struct str_view group, struct str_view file, long size,
+                           struct str_view origin);
+
+/**
+ * @brief Writes a piece of the file being received from a peer.
+ */
+void replica_receive_chunk(int peer_index, const char *data, size_t length);
+
+/**
+ * @brief Checks the file received from a peer against its checksum, moves it into place and indexes it.
+ */
+void replica_receive_end(int peer_index, struct str_view checksum);
+
+/**
+ * @brief Drops the file being received from a peer whose link was lost.
+ */
+void replica_forget(int peer_index);
+
+/**
+ * @brief Records a file announced by a peer, replacing any older copy.
+ *
+ * @param details The `<checksum> <version> <uploader>` of the upload.
+ */
+void replica_receive_meta(int peer_index, struct str_view group, struct str_view file, long size,
+                          struct str_view details);
+
+/**
+ * @brief Fetches a file from the server that announced it and caches it in place.
+ *
+ * The event loop waits for the transfer, at most `peer_timeout_ms` between two pieces.
+ *
+ * @param group The group of the file.
+ * @param file The name of the file.
+ * @param remote Its index entry, naming the node holding it; not an entry of the index itself, which the pull changes.
+ * @param client_fd A socket every piece is also sent to as it arrives, or -1.
+ * @return The number of bytes fetched, which is the size of the file unless the pull failed.
+ */
+uint64_t replica_pull(struct str_view group, struct str_view file, const struct file_index_entry *remote,
+                      int client_fd);
+
+#endif // REPLICA_H
@@ -0,0 +1,238 @@
+/**
+ * @file routing.c
+ * @brief Consistent hash ring of the group owners and interest sets of the peers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "routing.h"
+#include "database.h"
+#include "config.h"
+#include "socket_utils.h"
+#include "metrics.h"
+#include "log.h"
+
+/**
+ * @struct ring_point
+ * @brief One of the points of a node on the hash ring.
+ */
+struct ring_point
+{
+    uint64_t hash;
+    int node;
+};
+
+static struct ring_point ring[(MAX_PEERS + 1) * ROUTING_VNODES];
+static int ring_size = 0;
+
+static int local_sessions[MAX_GROUPS]; /**< Sessions logged in here per group, counted per member */
+static uint32_t peer_interest[MAX_GROUPS]; /**< Bit i set if peers[i] has sessions in the group */
+
+static int compare_points(const void *a, const void *b)
+{
+    const struct ring_point *x = a, *y = b;
+    if (x->hash != y->hash)
+    {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->node - y->node;
+}
+
+static void add_node(int node)
+{
+    for (int v = 0; v < ROUTING_VNODES; v++)
+    {
+        char key[32];
+        int length = snprintf(key, sizeof(key), "node-%d-%d", node, v);
+        ring[ring_size].hash = view_hash((struct str_view){key, length});
+        ring[ring_size].node = node;
+        ring_size++;
+    }
+}
+
+/**
+ * @brief Builds the hash ring from this node and its configured peers.
+ */
+void routing_init(void)
+{
+    ring_size = 0;
+    if (peer_count == 0)
+    {
+        return;
+    }
+    add_node(node_id);
+    for (int i = 0; i < peer_count; i++)
+    {
+        add_node(peers[i].id);
+    }
+    qsort(ring, ring_size, sizeof(ring[0]), compare_points);
+}
+
+/**
+ * @brief Returns the node id owning a group.
+ */
+int routing_owner(struct str_view group)
+{
+    if (ring_size == 0)
+    {
+        return node_id;
+    }
+
+    // First point at or after the hash of the name, wrapping around the ring
+    uint64_t hash = view_hash(group);
+    int low = 0, high = ring_size;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (ring[middle].hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return ring[low == ring_size ? 0 : low].node;
+}
+
+/**
+ * @brief Returns the link to the owner of a group, when membership changes must go there.
+ */
+struct peer *routing_owner_link(struct str_view group)
+{
+    int owner = routing_owner(group);
+    if (owner == node_id)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < peer_count; i++)
+    {
+        if (peers[i].id == owner)
+        {
+            if (peers[i].state == PEER_CONNECTED)
+            {
+                return &peers[i];
+            }
+            break;
+        }
+    }
+    log_sampled(LOG_LEVEL_WARN, "Node %d owning group %.*s is not linked, applying the change here", owner,
+                (int)group.len, group.ptr);
+    return NULL;
+}
+
+static int find_group(struct str_view group)
+{
+    for (int i = 0; i < group_count; i++)
+    {
+        if (view_equals(group, groups[i].group_name))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void send_interest(int fd, int group_index, int interested)
+{
+    char frame[96];
+    int length = snprintf(frame, sizeof(frame), "interest %s %d", groups[group_index].group_name, interested);
+    send_message(fd, frame, length, 0);
+}
+
+/**
+ * @brief Records a change in the sessions logged in here that belong to a group.
+ */
+void routing_local_sessions(int group_index, int delta)
+{
+    int before = local_sessions[group_index];
+    local_sessions[group_index] += delta;
+    if ((before > 0) == (local_sessions[group_index] > 0))
+    {
+        return;
+    }
+    for (int i = 0; i < peer_count; i++)
+    {
+        if (peers[i].state != PEER_DISCONNECTED)
+        {
+            send_interest(peers[i].fd, group_index, local_sessions[group_index] > 0);
+        }
+    }
+}
+
+/**
+ * @brief Records the interest of a peer in a group, as announced by the peer.
+ */
+void routing_set_interest(const struct peer *peer, struct str_view group, int interested)
+{
+    int group_index = find_group(group);
+    if (group_index < 0)
+    {
+        return;
+    }
+    uint32_t bit = 1u << (peer - peers);
+    if (interested)
+    {
+        peer_interest[group_index] |= bit;
+    }
+    else
+    {
+        peer_interest[group_index] &= ~bit;
+    }
+}
+
+/**
+ * @brief Sends the whole interest set of this server to a newly linked peer.
+ */
+void routing_announce(const struct peer *peer)
+{
+    for (int i = 0; i < group_count; i++)
+    {
+        if (local_sessions[i] > 0)
+        {
+            send_interest(peer->fd, i, 1);
+        }
+    }
+}
+
+/**
+ * @brief Forgets the interest set of a peer, before it announces it again on linking.
+ */
+void routing_forget(const struct peer *peer)
+{
+    uint32_t bit = 1u << (peer - peers);
+    for (int i = 0; i < group_count; i++)
+    {
+        peer_interest[i] &= ~bit;
+    }
+}
+
+/**
+ * @brief Sends a chat frame to the peers with members of its group logged in, and to its owner.
+ */
+int routing_send_interested(struct str_view group, const struct iovec *parts, int count)
+{
+    int group_index = find_group(group);
+    if (group_index < 0)
+    {
+        return 0;
+    }
+
+    // Interest is kept while a link is down, so the peer catches up on the chat it missed
+    int owner = server_config.message_archive ? routing_owner(group) : node_id;
+    int sent = 0;
+    for (int i = 0; i < peer_count; i++)
+    {
+        if ((peer_interest[group_index] & (1u << i)) || peers[i].id == owner)
+        {
+            sent += peer_send(&peers[i], parts, count);
+        }
+        else if (peers[i].rx_epoch != 0)
+        {
+            metrics_add(METRIC_PEER_FORWARDS_SKIPPED, 1);
+        }
+    }
+    return sent;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file routing.h
+ * @brief Group ownership and interest-based routing between the servers of a cluster.
+ *
+ * Every group has an owner node, picked by consistent hashing of the group name over
+ * the nodes of the configuration: all the servers agree on it without talking, and a
+ * node joining the cluster only takes over a share of the groups. Membership changes
+ * (join_group and leaving a group) are applied by the owner first and replicated by
+ * it, so every server sees the changes of a group in the same order.
+ *
+ * Each server also tells its peers which groups have members logged in on it, its
+ * interest set, with `interest <group> <0|1>`. Chat messages are only sent to the
+ * peers interested in their group, and to its owner, which archives them (archive.h).
+ */
+
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include <sys/uio.h>
+#include "command.h"
+#include "peer.h"
+
+#define ROUTING_VNODES 64 /**< Points of each node on the hash ring */
+
+/**
+ * @brief Builds the hash ring from this node and its configured peers.
+ */
+void routing_init(void);
+
+/**
+ * @brief Returns the node id owning a group.
+ *
+ * @param group The group name.
+ * @return The owner, this node if the ring is empty.
+ */
+int routing_owner(struct str_view group);
+
+/**
+ * @brief Returns the link to the owner of a group, when membership changes must go there.
+ *
+ * @param group The group name.
+ * @return The owner, or NULL if this node owns the group or the owner is not linked,
+ *         in which case the change is applied here.
+ */
+struct peer *routing_owner_link(struct str_view group);
+
+/**
+ * @brief Records a change in the sessions logged in here that belong to a group.
+ *
+ * When the group gains its first session or loses its last one, the peers are told.
+ *
+ * @param group_index The index of the group in `groups`.
+ * @param delta The number of sessions added, negative when removed.
+ */
+void routing_local_sessions(int group_index, int delta);
+
+/**
+ * @brief Records the interest of a peer in a group, as announced by the peer.
+ *
+ * @param peer The peer.
+ * @param group The group name.
+ * @param interested Non-zero if the peer has members of the group logged in.
+ */
+void routing_set_interest(const struct peer *peer, struct str_view group, int interested);
+
+/**
+ * @brief Sends the whole interest set of this server to a newly linked peer.
+ */
+void routing_announce(const struct peer *peer);
+
+/**
+ * @brief Forgets the interest set of a peer, before it announces it again on linking.
+ */
+void routing_forget(const struct peer *peer);
+
+/**
+ * @brief Sends a chat frame to the peers with members of its group logged in, and to its owner.
+ *
+ * The owner gets every message of its groups while `message_archive` is on. A peer
+ * whose link is down gets the frame in its replication log.
+ *
+ * @param group The group name.
+ * @param parts The parts of the frame payload, as for send_message_parts().
+ * @param count The number of parts.
+ * @return The number of peers the frame was sent or logged for.
+ */
+int routing_send_interested(struct str_view group, const struct iovec *parts, int count);
+
+#endif // ROUTING_H
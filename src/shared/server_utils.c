@@ -8,20 +8,375 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <poll.h>
-#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include "database.h"
 #include "server_utils.h"
 #include "socket_utils.h"
+#include "connection.h"
+#include "pool.h"
+#include "command.h"
+#include "config.h"
+#include "ratelimit.h"
+#include "metrics.h"
+#include "log.h"
+#include "trace.h"
+#include "probes.h"
+#include "peer.h"
+#include "routing.h"
+#include "presence.h"
+#include "checksum.h"
+#include "replica.h"
+#include "file_cache.h"
+#include "file_index.h"
+#include "mailbox.h"
+#include "archive.h"
 
-#define MAX_CLIENTS 100
+#define MAX_CLIENTS 4096
 #define BUFFER_SIZE 8192
+#define TRANSFER_BUFFER_SIZE (256 * 1024) /**< Bytes of a file read, received or sent at a time */
+#define MAX_PENDING_REQUESTS 1024          /**< Requests forwarded to group owners and not answered yet */
+#define SEARCH_NONE "No messages found\n"  /**< Answer of a search that found nothing, as the archive words it */
 
-#define OTHER_SERVER_FD 4
+#define PRINT_DATA_INTERVAL_NS 1000000000ull /**< Minimum time between two state dumps at debug level */
+
+static struct rate_limiter user_limits[MAX_USERS]; /**< Buckets shared by all connections of a user */
+static char user_limits_ready[MAX_USERS];         /**< Non-zero once the buckets of a user are set up */
+
+/**
+ * @brief Tells whether a socket is the link to another server of the cluster.
+ */
+static int is_peer(int fd)
+{
+    struct connection *conn = connection_get(fd);
+    return conn != NULL && conn->peer_index >= 0;
+}
+
+/** Session of the client on the requesting server of the peer_request being applied, or -1 */
+static long request_origin = -1;
+
+/** `@<id> ` tag of the request being applied, empty if the client did not tag it */
+static struct str_view request_tag;
+
+/** Non-zero once the request being applied was answered */
+static int replied = 0;
+
+/** File data on its way between a socket and the disk */
+static char transfer_buffer[TRANSFER_BUFFER_SIZE];
+
+/**
+ * @struct pending_request
+ * @brief A membership change or a search forwarded to the owner of its group, waiting for its answer.
+ */
+struct pending_request
+{
+    uint64_t session;      /**< Session of the client, which the `peer_reply` of the owner names */
+    int client_fd;         /**< Socket of the client, or -1 once it is closed */
+    int peer_index;        /**< Link the request was sent on */
+    char tag[24];          /**< `@<id> ` tag of the request, empty if it had none */
+    size_t tag_length;
+    char *command;         /**< The membership change, applied here if the link goes down, or NULL for a search */
+    size_t command_length;
+};
+
+/** Forwarded requests in the order they were sent; the answers come back in that order on each link */
+static struct pending_request pending_requests[MAX_PENDING_REQUESTS];
+static int pending_request_count = 0;
+
+/**
+ * @brief Splits the `@<id> ` tag off a request.
+ *
+ * A client pipelining requests starts each one with a tag, which the server puts in front
+ * of the answer so the client can match them; frames without a tag are pushed events.
+ *
+ * @return The tag, trailing space included, or an empty view.
+ */
+static struct str_view strip_request_tag(char **frame, size_t *length)
+{
+    struct str_view tag = {NULL, 0};
+    if (*length < 3 || (*frame)[0] != '@')
+    {
+        return tag;
+    }
+    size_t i = 1;
+    while (i < *length && i <= 20 && (*frame)[i] >= '0' && (*frame)[i] <= '9')
+    {
+        i++;
+    }
+    if (i == 1 || i == *length || (*frame)[i] != ' ')
+    {
+        return tag;
+    }
+    tag.ptr = *frame;
+    tag.len = i + 1;
+    *frame += tag.len;
+    *length -= tag.len;
+    return tag;
+}
+
+/**
+ * @brief Answers a client, behind the tag of its request if it had one.
+ *
+ * Commands replicated by another server are applied silently, except the changes
+ * forwarded to this server as the owner of a group: their answer goes back to the
+ * requesting server with `peer_reply <session> <text>`.
+ */
+static void reply(int fd, char *text, int length)
+{
+    char header[32];
+    struct iovec parts[3] = {
+        {header, 0},
+        {(char *)request_tag.ptr, request_tag.len},
+        {text, length},
+    };
+    replied = 1;
+    if (fd < 0)
+    {
+        // The client of a change applied after its link was lost is gone
+        return;
+    }
+    if (!is_peer(fd))
+    {
+        send_message_parts(fd, parts, 3);
+    }
+    else if (request_origin >= 0)
+    {
+        parts[0].iov_len = snprintf(header, sizeof(header), "peer_reply %ld ", request_origin);
+        send_message_parts(fd, parts, 3);
+    }
+}
+
+/**
+ * @brief Tells whether a command changes the members of a group: join_group or leaving.
+ */
+static int is_membership_change(const struct command *cmd)
+{
+    return cmd->id == COMMAND_JOIN_GROUP || (cmd->id == COMMAND_MESSAGE && view_equals(command_arg(cmd, 2), "0"));
+}
+
+/**
+ * @brief Sends a request to the owner of its group, and remembers it until the owner answers.
+ *
+ * @param owner The link to the owner.
+ * @param conn The connection of the client.
+ * @param parts The `peer_request <session> ` frame.
+ * @param count The number of parts.
+ * @param command The membership change, kept to be applied here if the link goes down, or NULL for a search.
+ * @param length Its length.
+ * @return 0 if the request went out, -1 if it must be handled here.
+ */
+static int forward_request(struct peer *owner, struct connection *conn, const struct iovec *parts, int count,
+                           const char *command, size_t length)
+{
+    if (pending_request_count == MAX_PENDING_REQUESTS || request_tag.len > sizeof(pending_requests[0].tag))
+    {
+        return -1;
+    }
+    char *copy = NULL;
+    if (command != NULL && (copy = malloc(length)) == NULL)
+    {
+        return -1;
+    }
+    if (send_message_parts(owner->fd, parts, count) < 0)
+    {
+        // Part of the frame may have gone out, which leaves the link out of step
+        log_warn("Cannot write to node %d, dropping the link", owner->id);
+        shutdown(owner->fd, SHUT_RDWR);
+        owner->state = PEER_SYNCING;
+        free(copy);
+        return -1;
+    }
+
+    struct pending_request *request = &pending_requests[pending_request_count++];
+    request->session = conn->session;
+    request->client_fd = conn->fd;
+    request->peer_index = owner - peers;
+    request->tag_length = request_tag.len;
+    memcpy(request->tag, request_tag.ptr, request_tag.len);
+    request->command = copy;
+    request->command_length = length;
+    if (copy != NULL)
+    {
+        memcpy(copy, command, length);
+    }
+    return 0;
+}
+
+/**
+ * @brief Forgets the oldest request of a session sent on a link, which the owner answered.
+ *
+ * @return The socket of the client to pass the answer to, or -1 if it is gone or the request unknown.
+ */
+static int settle_request(int peer_index, long session)
+{
+    for (int i = 0; i < pending_request_count; i++)
+    {
+        struct pending_request *request = &pending_requests[i];
+        if (request->peer_index == peer_index && (long)request->session == session)
+        {
+            int client_fd = request->client_fd;
+            free(request->command);
+            memmove(request, request + 1, (pending_request_count - i - 1) * sizeof(*request));
+            pending_request_count--;
+            return client_fd;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Applies here a membership change whose owner cannot be reached, and replicates it.
+ *
+ * The peers get it through their replication logs, the owner once its link is back.
+ */
+static void apply_membership(const struct pending_request *request)
+{
+    struct command cmd;
+    if (command_parse(request->command, request->command_length, &cmd) < 0 || !is_membership_change(&cmd))
+    {
+        return;
+    }
+    struct iovec part = {request->command, request->command_length};
+    metrics_add(METRIC_PEER_FORWARDS, peer_broadcast(&part, 1));
+
+    request_tag = (struct str_view){request->tag, request->tag_length};
+    replied = 0;
+    if (cmd.id == COMMAND_JOIN_GROUP)
+    {
+        handle_join_group(request->client_fd, command_arg(&cmd, 0), command_arg(&cmd, 1));
+    }
+    else
+    {
+        handle_message(request->client_fd, command_arg(&cmd, 0), command_arg(&cmd, 1), command_tail(&cmd, 3), 0);
+    }
+    if (request->tag_length > 0 && !replied)
+    {
+        reply(request->client_fd, "", 0);
+    }
+    request_tag.len = 0;
+}
+
+/**
+ * @brief Settles the pending requests of a closed client or lost link.
+ *
+ * The membership changes sent on a lost link are applied here, and its searches answered
+ * as finding nothing, since the archive is out of reach. The searches of a closed client
+ * are dropped; its membership changes are kept, only without a client to answer.
+ *
+ * @param client_fd The closed client, or -1.
+ * @param peer_index The lost link, or -1.
+ */
+static void abandon_requests(int client_fd, int peer_index)
+{
+    int kept = 0;
+    for (int i = 0; i < pending_request_count; i++)
+    {
+        struct pending_request *request = &pending_requests[i];
+        if (request->peer_index == peer_index)
+        {
+            if (request->command != NULL)
+            {
+                apply_membership(request);
+                free(request->command);
+            }
+            else if (request->client_fd >= 0)
+            {
+                struct iovec parts[2] = {
+                    {request->tag, request->tag_length},
+                    {SEARCH_NONE, sizeof(SEARCH_NONE) - 1},
+                };
+                send_message_parts(request->client_fd, parts, 2);
+            }
+            continue;
+        }
+        if (client_fd >= 0 && request->client_fd == client_fd)
+        {
+            if (request->command == NULL)
+            {
+                continue;
+            }
+            request->client_fd = -1;
+        }
+        pending_requests[kept++] = *request;
+    }
+    pending_request_count = kept;
+}
+
+/**
+ * @brief Tells whether the user logged in on a connection is a member of a group.
+ */
+static int is_group_member(int client_fd, struct str_view group_name)
+{
+    struct connection *conn = connection_get(client_fd);
+    if (conn == NULL || conn->user_index < 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < group_count; i++)
+    {
+        if (view_equals(group_name, groups[i].group_name))
+        {
+            for (int j = 0; j < groups[i].member_count; j++)
+            {
+                if (strcmp(users[conn->user_index].username, groups[i].members[j]) == 0)
+                {
+                    return 1;
+                }
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the number of sessions of a user logged in on this server.
+ */
+static int local_session_count(const char *username)
+{
+    int count = 0;
+    for (int i = 0; i < client_count; i++)
+    {
+        if (strcmp(clients[i].username, username) == 0)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief Adds sessions of a user to every group it is a member of, for interest routing.
+ */
+static void count_sessions(const char *username, int delta)
+{
+    for (int i = 0; i < group_count; i++)
+    {
+        for (int j = 0; j < groups[i].member_count; j++)
+        {
+            if (strcmp(groups[i].members[j], username) == 0)
+            {
+                routing_local_sessions(i, delta);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Returns the group a join_group or message command is about.
+ */
+static struct str_view command_group(const struct command *cmd)
+{
+    return command_arg(cmd, cmd->id == COMMAND_JOIN_GROUP ? 1 : 0);
+}
 
 /**
  * @brief Adds a new client to the server.
@@ -38,13 +393,16 @@ void add_client(const char *username, int fd)
 {
     if (client_count < MAX_CLIENTS)
     {
-        strncpy(clients[client_count].username, username, sizeof(clients[client_count].username) - 1);
+        view_copy(clients[client_count].username, sizeof(clients[client_count].username), view_from_cstr(username));
         clients[client_count].fd = fd;
         client_count++;
+        metrics_gauge_add(METRIC_USERS_ONLINE, 1);
+        count_sessions(username, 1);
+        presence_login(username, fd);
     }
     else
     {
-        printf("Max clients reached, cannot add more clients.\n");
+        log_warn("Max clients reached, cannot add %s", username);
     }
 }
 
@@ -52,7 +410,9 @@ void add_client(const char *username, int fd)
  * @brief Removes a client from the server.
  *
  * This function removes the client with the specified file descriptor (fd)
- * from the list of active clients.
+ * from the list of active clients. The user stays a member of its groups: once
+ * its last session in the cluster has ended, the messages sent to it are kept
+ * in its mailbox until it logs in again.
  *
  * @param fd The file descriptor of the client to be removed.
  */
@@ -62,8 +422,22 @@ void remove_client(int fd)
     {
         if (clients[i].fd == fd)
         {
+            char username[sizeof(clients[i].username)];
+            memcpy(username, clients[i].username, sizeof(username));
+            count_sessions(username, -1);
             clients[i] = clients[client_count - 1];
             client_count--;
+            metrics_gauge_add(METRIC_USERS_ONLINE, -1);
+
+            int remaining_fd = -1;
+            for (int j = 0; j < client_count && remaining_fd < 0; j++)
+            {
+                if (strcmp(clients[j].username, username) == 0)
+                {
+                    remaining_fd = clients[j].fd;
+                }
+            }
+            presence_logout(username, fd, remaining_fd);
             break;
         }
     }
@@ -80,20 +454,58 @@ void remove_client(int fd)
  * @param username The username provided by the client.
  * @param password The password provided by the client.
  */
-void handle_login(int client_fd, char *username, char *password)
+void handle_login(int client_fd, struct str_view username, struct str_view password)
 {
     for (int i = 0; i < user_count; i++)
     {
-        if (strcmp(users[i].username, username) == 0 && strcmp(users[i].password, password) == 0)
+        if (view_equals(username, users[i].username) && view_equals(password, users[i].password))
         {
 
-            send_message(client_fd, "Login successful\n", 17, 0);
-            add_client(username, client_fd);
+            add_client(users[i].username, client_fd);
+            mailbox_deliver(users[i].username, client_fd);
+            reply(client_fd, "Login successful\n", 17);
+
+            struct connection *conn = connection_get(client_fd);
+            if (conn != NULL)
+            {
+                conn->user_index = i;
+            }
+            if (!user_limits_ready[i])
+            {
+                ratelimit_init(&user_limits[i], server_config.user_messages_per_sec,
+                               server_config.user_bytes_per_sec, server_config.burst_seconds);
+                user_limits_ready[i] = 1;
+            }
             return;
         }
     }
 
-    send_message(client_fd, "Login failed\n", 13, 0);
+    reply(client_fd, "Login failed\n", 13);
+}
+
+/**
+ * @brief Negotiates the largest frame a client may send.
+ *
+ * The limit granted is the requested size capped to FRAME_MAX_SIZE. It is stored in the
+ * frame reader of the connection and echoed back to the client.
+ *
+ * @param client_fd The file descriptor of the client.
+ * @param requested The frame size requested by the client, in bytes.
+ */
+void handle_max_frame(int client_fd, long requested)
+{
+    struct connection *conn = connection_get(client_fd);
+    if (conn == NULL || requested <= 0)
+    {
+        reply(client_fd, "Invalid command format\n", 23);
+        return;
+    }
+
+    conn->rx.max_size = requested < FRAME_MAX_SIZE ? (size_t)requested : FRAME_MAX_SIZE;
+
+    char response[64];
+    int length = snprintf(response, sizeof(response), "max_frame %zu\n", conn->rx.max_size);
+    reply(client_fd, response, length);
 }
 
 /**
@@ -109,27 +521,33 @@ void handle_login(int client_fd, char *username, char *password)
  * @param age The age of the new user.
  * @param password The password for the new account.
  */
-void handle_create_user(int client_fd, char *username, char *gender, int age, char *password)
+void handle_create_user(int client_fd, struct str_view username, struct str_view gender, int age, struct str_view password)
 {
     for (int i = 0; i < user_count; i++)
     {
-        if (strcmp(users[i].username, username) == 0)
+        if (view_equals(username, users[i].username))
         {
 
-            send_message(client_fd, "Username already exists\n", 24, 0);
+            reply(client_fd, "Username already exists\n", 24);
             return;
         }
     }
-    add_user(username, gender[0], age, password);
 
-    send_message(client_fd, "User created successfully\n", 26, 0);
+    // The user table keeps its own NUL-terminated copies
+    char name[50], pass[50];
+    view_copy(name, sizeof(name), username);
+    view_copy(pass, sizeof(pass), password);
+    add_user(name, gender.len > 0 ? gender.ptr[0] : '?', age, pass);
+
+    reply(client_fd, "User created successfully\n", 26);
 }
 
 /**
  * @brief Handles the file upload process for a client.
  *
  * Receives a file from the client and stores it in the server's group-specific directory.
- * It verifies the group existence, receives the file size, and writes the data to disk.
+ * It verifies the group existence, receives the file size, and writes the data to a hidden
+ * temporary file that replaces the previous version only once it is complete.
  *
  * @param client_fd The file descriptor of the client.
  * @param group_name The name of the group the file belongs to.
@@ -137,15 +555,16 @@ void handle_create_user(int client_fd, char *username, char *gender, int age, ch
  *
  * @note If the group does not exist or any error occurs, the client is notified.
  */
-void handle_upload_file(int client_fd, const char *group_name, const char *file_name)
+void handle_upload_file(int client_fd, struct str_view group_name, struct str_view file_name)
 {
-    printf("uploading file... \n");
+    log_debug("Receiving %.*s/%.*s from fd %d", (int)group_name.len, group_name.ptr, (int)file_name.len, file_name.ptr,
+              client_fd);
 
     // Find the group
     int group_index = -1;
     for (int i = 0; i < group_count; i++)
     {
-        if (strcmp(groups[i].group_name, group_name) == 0)
+        if (view_equals(group_name, groups[i].group_name))
         {
             group_index = i;
             break;
@@ -158,63 +577,150 @@ void handle_upload_file(int client_fd, const char *group_name, const char *file_
         return;
     }
 
-    // Create the file path
-    char file_path[BUFFER_SIZE];
-    snprintf(file_path, sizeof(file_path), "./drive/%s/%s", group_name, file_name);
+    // Hidden names are kept for the files of the server (index, partial replicas)
+    if (file_name.len == 0 || file_name.len >= FILE_INDEX_NAME_SIZE || file_name.ptr[0] == '.' ||
+        memchr(file_name.ptr, '/', file_name.len) != NULL)
+    {
+        send(client_fd, "Invalid file name\n", 18, 0);
+        return;
+    }
+
+    // Create the file path, and the one of the upload until it is complete
+    char file_path[BUFFER_SIZE], temp_path[BUFFER_SIZE];
+    snprintf(file_path, sizeof(file_path), "./drive/%.*s/%.*s",
+             (int)group_name.len, group_name.ptr, (int)file_name.len, file_name.ptr);
+    snprintf(temp_path, sizeof(temp_path), "./drive/%.*s/.%.*s.upload",
+             (int)group_name.len, group_name.ptr, (int)file_name.len, file_name.ptr);
 
-    // Open the file for writing
-    FILE *file = fopen(file_path, "wb");
+    // Open the file for writing, after the index of the group is loaded so the version follows the last upload
+    uint32_t version = file_index_next_version(group_name, file_name);
+    FILE *file = fopen(temp_path, "wb");
     if (file == NULL)
     {
-        perror("fopen");
+        log_errno(temp_path);
         send(client_fd, "Error opening file\n", 19, 0);
         return;
     }
 
     // Notify the client that the server is ready
     send(client_fd, "SERVER_READY", 12, 0);
-    printf("Server ready to receive file\n");
 
     // Receive the file size from the client
     uint64_t file_size;
     if (recv(client_fd, &file_size, sizeof(file_size), 0) <= 0)
     {
-        perror("recv (file size)");
+        log_errno("recv (file size)");
         fclose(file);
+        unlink(temp_path);
         return;
     }
-    printf("File size received: %lu\n", file_size);
+    log_debug("File size received: %lu", file_size);
 
     // Notify the client that the file size is received and OK
     send(client_fd, "SIZE_OK", 7, 0);
 
-    // Receive the file data from the client
-    char buffer[BUFFER_SIZE];
+    struct file_index_entry entry = {.size = file_size, .version = version};
+    view_copy(entry.name, sizeof(entry.name), file_name);
+    struct connection *conn = connection_get(client_fd);
+    snprintf(entry.uploader, sizeof(entry.uploader), "%s",
+             conn != NULL && conn->user_index >= 0 ? users[conn->user_index].username : "-");
+
+    // Receive the file data from the client, streaming each piece to the peers as it is written
+    uint64_t start = metrics_now_ns();
+    struct replica_stream stream;
+    replica_stream_begin(&stream, group_name, file_name, file_size, entry.version, entry.uploader);
     ssize_t bytes_received;
     uint64_t total_bytes_received = 0;
-    while (total_bytes_received < file_size && (bytes_received = recv(client_fd, buffer, sizeof(buffer), 0)) > 0)
+    int write_failed = 0;
+    while (total_bytes_received < file_size)
     {
-        fwrite(buffer, 1, bytes_received, file);
+        size_t wanted = file_size - total_bytes_received < TRANSFER_BUFFER_SIZE ? file_size - total_bytes_received
+                                                                                : TRANSFER_BUFFER_SIZE;
+        if ((bytes_received = recv(client_fd, transfer_buffer, wanted, 0)) <= 0)
+        {
+            break;
+        }
+        // The rest is still read so that the connection stays in step with the client
+        if (!write_failed && fwrite(transfer_buffer, 1, bytes_received, file) != (size_t)bytes_received)
+        {
+            log_errno(temp_path);
+            write_failed = 1;
+        }
+        replica_stream_chunk(&stream, transfer_buffer, bytes_received);
         total_bytes_received += bytes_received;
+        PROBE_TRANSFER_CHUNK(client_fd, bytes_received, total_bytes_received, 0);
+    }
+    if (fclose(file) != 0)
+    {
+        write_failed = 1;
+    }
+    int complete = total_bytes_received == file_size && !write_failed;
+    if (complete && rename(temp_path, file_path) < 0)
+    {
+        log_errno(file_path);
+        complete = 0;
     }
+    replica_stream_end(&stream, complete);
 
-    if (total_bytes_received == file_size)
+    // The checksum computed for the peers while streaming is the one of the index
+    if (complete)
     {
-        printf("File received successfully: %s\n", file_path);
+        file_cache_invalidate(group_name, file_name);
+        entry.hash = checksum_final(&stream.checksum);
+        entry.mtime = time(NULL);
+        file_index_put(group_name, &entry);
+        log_info("File received: %s (%lu bytes, version %u)", file_path, file_size, entry.version);
     }
     else
     {
-        printf("File receive incomplete. Received %lu of %lu bytes.\n", total_bytes_received, file_size);
+        // The previous version, if any, stays in place with its index entry
+        unlink(temp_path);
+        log_warn("File receive incomplete: %s, %lu of %lu bytes", file_path, total_bytes_received, file_size);
     }
 
-    fclose(file);
+    metrics_add(METRIC_UPLOADS, 1);
+    metrics_add(METRIC_UPLOAD_BYTES, total_bytes_received);
+    metrics_observe(METRIC_UPLOAD_DURATION, metrics_now_ns() - start);
+}
+
+/**
+ * @brief Waits for a step of the download handshake from the client.
+ *
+ * @param client_fd The file descriptor of the client.
+ * @param expected The word the client must send.
+ * @param file_path The file being downloaded, for the logs.
+ * @return 0 if the client sent the word, -1 otherwise.
+ */
+static int await_client(int client_fd, const char *expected, const char *file_path)
+{
+    char answer[BUFFER_SIZE];
+    int nbytes = recv(client_fd, answer, sizeof(answer) - 1, 0);
+    if (nbytes > 0)
+    {
+        answer[nbytes] = '\0';
+        if (strncmp(answer, expected, strlen(expected)) != 0)
+        {
+            log_warn("fd %d did not send %s for %s, aborting", client_fd, expected, file_path);
+            return -1;
+        }
+        return 0;
+    }
+    else if (nbytes == 0)
+    {
+        log_error("fd %d closed the connection during a download", client_fd);
+        exit(EXIT_FAILURE);
+    }
+    log_errno("recv");
+    return -1;
 }
 
 /**
- * @brief Handles the file download process for a client.
+ * @brief Handles a client's request to download a file.
  *
- * Sends a requested file to the client. The file must be located in the group-specific
- * directory on the server.
+ * Sends a requested file to the client by reading it from the group's
+ * directory on the server. Small files are kept in the file cache and sent from
+ * memory on the next downloads. A file of a lazy group that only has a stub here is
+ * pulled from the server holding it and passed on to the client as it arrives.
  *
  * @param client_fd The file descriptor of the client.
  * @param group_name The name of the group the file belongs to.
@@ -222,139 +728,326 @@ void handle_upload_file(int client_fd, const char *group_name, const char *file_
  *
  * @note If the file cannot be opened, the client is notified.
  */
-void handle_download_file(int client_fd, const char *group_name, const char *file_name)
+void handle_download_file(int client_fd, struct str_view group_name, struct str_view file_name)
 {
     // Create the file path
     char file_path[BUFFER_SIZE];
-    snprintf(file_path, sizeof(file_path), "./drive/%s/%s", group_name, file_name);
+    snprintf(file_path, sizeof(file_path), "./drive/%.*s/%.*s",
+             (int)group_name.len, group_name.ptr, (int)file_name.len, file_name.ptr);
 
-    // Open the file for reading
-    FILE *file = fopen(file_path, "rb");
-    if (file == NULL)
+    // The index gives the size and where the file is; the drive is only read for its data
+    const struct file_index_entry *indexed = file_index_find(group_name, file_name);
+    if (indexed == NULL)
+    {
+        log_warn("%s is not in the file index", file_path);
+        send(client_fd, "Error opening file\n", 19, 0);
+        return;
+    }
+    struct file_index_entry meta = *indexed; // A pull changes the index
+    const struct file_cache_entry *cached = meta.node == 0 ? file_cache_get(group_name, file_name) : NULL;
+    FILE *file = meta.node == 0 && cached == NULL ? fopen(file_path, "rb") : NULL;
+    if (meta.node == 0 && cached == NULL && file == NULL)
     {
-        perror("fopen");
+        log_errno(file_path);
         send(client_fd, "Error opening file\n", 19, 0);
         return;
     }
 
-    char server_ready[BUFFER_SIZE];
-    int nbytes = recv(client_fd, server_ready, sizeof(server_ready) - 1, 0);
-    if (nbytes > 0)
+    if (await_client(client_fd, "SERVER_READY", file_path) < 0)
     {
-        server_ready[nbytes] = '\0';
-        if (strncmp(server_ready, "SERVER_READY", 12) != 0)
+        if (file != NULL)
         {
-            printf("Server is not ready for file upload. Aborting upload.\n");
             fclose(file);
-            return;
         }
+        return;
     }
-    else if (nbytes == 0)
-    {
-        printf("Server closed the connection\n");
-        fclose(file);
-        exit(EXIT_FAILURE);
-    }
-    else
+
+    size_t file_size = meta.size;
+    if (file != NULL && (cached = file_cache_load(group_name, file_name, fileno(file), file_size)) != NULL)
     {
-        perror("recv");
         fclose(file);
-        return;
+        file = NULL;
     }
 
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    if (send(client_fd, &file_size, sizeof(file_size), 0) == -1)
+    if (send(client_fd, &file_size, sizeof(file_size), 0) == -1 ||
+        await_client(client_fd, "SIZE_OK", file_path) < 0)
     {
-        perror("send");
-        fclose(file);
+        if (file != NULL)
+        {
+            fclose(file);
+        }
         return;
     }
 
-    char size_ok[BUFFER_SIZE];
-    nbytes = recv(client_fd, size_ok, sizeof(size_ok) - 1, 0);
-    if (nbytes > 0)
+    // Send the file data to the client
+    uint64_t start = metrics_now_ns();
+    uint64_t total_bytes_sent = 0;
+    if (cached != NULL)
     {
-        size_ok[nbytes] = '\0';
-        if (strncmp(size_ok, "SIZE_OK", 7) != 0)
+        while (total_bytes_sent < file_size)
         {
-            printf("Server did not acknowledge file size. Aborting upload.\n");
-            fclose(file);
-            return;
+            ssize_t sent = send(client_fd, cached->data + total_bytes_sent, file_size - total_bytes_sent, 0);
+            if (sent <= 0)
+            {
+                log_errno("send (file data)");
+                break;
+            }
+            total_bytes_sent += sent;
+            PROBE_TRANSFER_CHUNK(client_fd, sent, total_bytes_sent, 1);
         }
     }
-    else if (nbytes == 0)
+    else if (file == NULL)
     {
-        printf("Server closed the connection\n");
-        fclose(file);
-        exit(EXIT_FAILURE);
+        total_bytes_sent = replica_pull(group_name, file_name, &meta, client_fd);
     }
     else
     {
-        perror("recv");
+        char buffer[BUFFER_SIZE];
+        size_t bytes_read;
+        while (total_bytes_sent < file_size &&
+               (bytes_read = fread(buffer, 1, file_size - total_bytes_sent < sizeof(buffer) ? file_size - total_bytes_sent
+                                                                                          : sizeof(buffer),
+                                   file)) > 0)
+        {
+            if (send(client_fd, buffer, bytes_read, 0) == -1)
+            {
+                log_errno("send (file data)");
+                break;
+            }
+            total_bytes_sent += bytes_read;
+            PROBE_TRANSFER_CHUNK(client_fd, bytes_read, total_bytes_sent, 1);
+        }
         fclose(file);
-        return;
     }
-
-    // Send the file data to the client
-    char buffer[BUFFER_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    if (total_bytes_sent < file_size)
     {
-        if (send(client_fd, buffer, bytes_read, 0) == -1)
-        {
-            perror("send (file data)");
-            break;
-        }
+        // The client is waiting for bytes that will not come
+        shutdown(client_fd, SHUT_RDWR);
     }
 
-    fclose(file);
-    printf("File sent successfully\n");
+    metrics_add(METRIC_DOWNLOADS, 1);
+    metrics_add(METRIC_DOWNLOAD_BYTES, total_bytes_sent);
+    metrics_observe(METRIC_DOWNLOAD_DURATION, metrics_now_ns() - start);
+    log_info("File sent: %s (%lu bytes)", file_path, total_bytes_sent);
 }
 
 /**
- * @brief Lists all files in a group's directory for a client.
+ * @brief Sends a range of a file, for clients downloading a file over several connections.
  *
- * Sends a list of files present in the group's directory to the requesting client.
+ * The range is framed by two frames: `RANGE <offset> <length> <file size>` before the
+ * raw data and `RANGE_END <checksum>` after it, the XXH64 of the data in hexadecimal so
+ * the client can verify it. The length is cut at the end of the file, and a length of 0
+ * only asks for the size. A client can fetch the ranges of a file from any server holding
+ * a copy, in any order. Each range is a bounded piece of work, so a large download no
+ * longer holds up the other clients for its whole duration. A file of a lazy group known
+ * only from its stub is pulled in whole before the first range is served.
  *
  * @param client_fd The file descriptor of the client.
- * @param group_name The name of the group whose files are to be listed.
- *
- * @note If the group folder cannot be opened, the client is notified.
+ * @param group_name The name of the group the file belongs to.
+ * @param file_name The name of the file.
+ * @param offset The first byte of the range.
+ * @param length The number of bytes wanted.
+ */
+void handle_download_range(int client_fd, struct str_view group_name, struct str_view file_name, long offset, long length)
+{
+    char file_path[BUFFER_SIZE];
+    snprintf(file_path, sizeof(file_path), "./drive/%.*s/%.*s",
+             (int)group_name.len, group_name.ptr, (int)file_name.len, file_name.ptr);
+
+    const struct file_index_entry *indexed = file_index_find(group_name, file_name);
+    struct file_index_entry meta;
+    if (indexed != NULL && indexed->node != 0)
+    {
+        // Ranges are served from a whole copy, fetched first from the server that has it
+        meta = *indexed;
+        if (replica_pull(group_name, file_name, &meta, -1) < meta.size)
+        {
+            reply(client_fd, "Error opening file\n", 19);
+            return;
+        }
+        indexed = file_index_find(group_name, file_name);
+    }
+    if (indexed == NULL)
+    {
+        log_warn("%s is not in the file index", file_path);
+        reply(client_fd, "Error opening file\n", 19);
+        return;
+    }
+
+    int fd = -1;
+    long file_size = indexed->size;
+    const struct file_cache_entry *cached = file_cache_get(group_name, file_name);
+    if (cached == NULL)
+    {
+        fd = open(file_path, O_RDONLY);
+        if (fd < 0)
+        {
+            log_errno(file_path);
+            reply(client_fd, "Error opening file\n", 19);
+            return;
+        }
+        if ((cached = file_cache_load(group_name, file_name, fd, file_size)) != NULL)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (offset < 0 || length < 0 || offset > file_size)
+    {
+        reply(client_fd, "Invalid range\n", 14);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+    if (length > file_size - offset)
+    {
+        length = file_size - offset;
+    }
+
+    char header[96];
+    int header_length = snprintf(header, sizeof(header), "RANGE %ld %ld %ld\n", offset, length, file_size);
+    reply(client_fd, header, header_length);
+
+    // Read, checksum and send the data one buffer at a time, straight from the cache if the file is in it
+    uint64_t start = metrics_now_ns();
+    const char *buffer = transfer_buffer;
+    struct checksum checksum;
+    checksum_init(&checksum);
+    long total_bytes_sent = 0;
+    while (total_bytes_sent < length)
+    {
+        size_t wanted = length - total_bytes_sent < TRANSFER_BUFFER_SIZE ? length - total_bytes_sent : TRANSFER_BUFFER_SIZE;
+        ssize_t bytes_read = wanted;
+        if (cached != NULL)
+        {
+            buffer = cached->data + offset + total_bytes_sent;
+        }
+        else if ((bytes_read = pread(fd, transfer_buffer, wanted, offset + total_bytes_sent)) <= 0)
+        {
+            break;
+        }
+        checksum_update(&checksum, buffer, bytes_read);
+
+        ssize_t sent = 0;
+        while (sent < bytes_read)
+        {
+            ssize_t count = send(client_fd, buffer + sent, bytes_read - sent, 0);
+            if (count <= 0)
+            {
+                break;
+            }
+            sent += count;
+        }
+        total_bytes_sent += sent;
+        PROBE_TRANSFER_CHUNK(client_fd, sent, total_bytes_sent, 1);
+        if (sent < bytes_read)
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    metrics_add(METRIC_DOWNLOAD_RANGES, 1);
+    metrics_add(METRIC_DOWNLOAD_BYTES, total_bytes_sent);
+    metrics_observe(METRIC_DOWNLOAD_DURATION, metrics_now_ns() - start);
+    if (total_bytes_sent < length)
+    {
+        // The client is waiting for bytes that will not come: end the connection so it tries elsewhere
+        log_warn("Range %ld+%ld of %s cut short after %ld bytes", offset, length, file_path, total_bytes_sent);
+        shutdown(client_fd, SHUT_RDWR);
+        return;
+    }
+
+    header_length = snprintf(header, sizeof(header), "RANGE_END %016llx\n",
+                             (unsigned long long)checksum_final(&checksum));
+    reply(client_fd, header, header_length);
+    log_debug("Range %ld+%ld of %s sent to fd %d", offset, length, file_path, client_fd);
+}
+
+/**
+ * @brief Appends a line to a BUFFER_SIZE reply buffer.
+ *
+ * @param buffer The reply being built.
+ * @param length The current length of the reply, updated by the call.
+ * @param line The text to append, followed by a newline.
+ * @return 0 on success, -1 if the line does not fit (the reply is left unchanged).
  */
-void handle_list_files(int client_fd, const char *group_name)
+static int append_line(char *buffer, size_t *length, const char *line)
 {
-    char folder_path[BUFFER_SIZE];
-    snprintf(folder_path, sizeof(folder_path), "./drive/%s", group_name);
+    size_t line_length = strlen(line);
+    if (*length + line_length + 2 > BUFFER_SIZE)
+    {
+        return -1;
+    }
+    memcpy(buffer + *length, line, line_length);
+    *length += line_length;
+    buffer[(*length)++] = '\n';
+    buffer[*length] = '\0';
+    return 0;
+}
 
-    DIR *dir = opendir(folder_path);
-    if (dir == NULL)
+/**
+ * @brief Lists all files in a group's directory for a client.
+ *
+ * Sends the names of the files in the index of the group, in alphabetical order, to
+ * the requesting client.
+ *
+ * @param client_fd The file descriptor of the client.
+ * @param group_name The name of the group whose files are to be listed.
+ *
+ * @note If the group folder cannot be opened, the client is notified.
+ */
+void handle_list_files(int client_fd, struct str_view group_name)
+{
+    int count;
+    const struct file_index_entry *files = file_index_list(group_name, &count);
+    if (files == NULL)
     {
-        perror("opendir");
-        send_message(client_fd, "Error opening group folder\n", 27, 0);
+        log_warn("No folder for group %.*s", (int)group_name.len, group_name.ptr);
+        reply(client_fd, "Error opening group folder\n", 27);
         return;
     }
 
-    struct dirent *entry;
+    // The index lists the files stored here and those of lazy groups stored on another server
     char buffer[BUFFER_SIZE] = "Files:\n";
-    while ((entry = readdir(dir)) != NULL)
+    size_t length = 7;
+    for (int i = 0; i < count; i++)
     {
-        if (entry->d_name[0] != '.')
+        if (append_line(buffer, &length, files[i].name) < 0)
         {
-            strcat(buffer, entry->d_name);
-            strcat(buffer, "\n");
+            break;
         }
     }
-    closedir(dir);
+    reply(client_fd, buffer, length);
+}
 
-    // Send the list of files to the client
-    // if (send_message(client_fd, buffer, strlen(buffer), 0) == -1)
-    // {
-    //     perror("send");
-    // }
-    send_message(client_fd, buffer, strlen(buffer), 0);
+/**
+ * @brief Answers the most recent archived messages of a group holding every term of a query.
+ *
+ * Only the members of the group may search it. Only the owner of the group holds its
+ * archive: a search is forwarded there when the owner is another server, and answered
+ * as finding nothing if the link to the owner is lost first.
+ *
+ * @param client_fd The file descriptor of the client.
+ * @param group_name The group.
+ * @param query The terms.
+ */
+void handle_search(int client_fd, struct str_view group_name, struct str_view query)
+{
+    // A search forwarded by another server was checked there
+    if (!is_peer(client_fd) && !is_group_member(client_fd, group_name))
+    {
+        reply(client_fd, "Not a member of the group\n", 26);
+        return;
+    }
+    char buffer[BUFFER_SIZE];
+    size_t length = archive_search(group_name, query, buffer, sizeof(buffer));
+    reply(client_fd, buffer, length);
 }
 
 /**
@@ -367,12 +1060,15 @@ void handle_list_files(int client_fd, const char *group_name)
 void handle_list_groups(int client_fd)
 {
     char buffer[BUFFER_SIZE] = "Groups:\n";
+    size_t length = 8;
     for (int i = 0; i < group_count; i++)
     {
-        strcat(buffer, groups[i].group_name);
-        strcat(buffer, "\n");
+        if (append_line(buffer, &length, groups[i].group_name) < 0)
+        {
+            break;
+        }
     }
-    send_message(client_fd, buffer, strlen(buffer), 0);
+    reply(client_fd, buffer, length);
 }
 
 /**
@@ -387,34 +1083,35 @@ void handle_list_groups(int client_fd)
  *
  * @note If the group does not exist, the client is notified.
  */
-void handle_join_group(int client_fd, char *username, char *group_name)
+void handle_join_group(int client_fd, struct str_view username, struct str_view group_name)
 {
     for (int i = 0; i < group_count; i++)
     {
-        if (strcmp(groups[i].group_name, group_name) == 0)
+        if (view_equals(group_name, groups[i].group_name))
         {
             for (int j = 0; j < groups[i].member_count; j++)
             {
-                if (strcmp(groups[i].members[j], username) == 0)
+                if (view_equals(username, groups[i].members[j]))
                 {
-                    send_message(client_fd, "Already in the group\n", 21, 0);
+                    reply(client_fd, "Already in the group\n", 21);
                     return;
                 }
             }
             if (groups[i].member_count < MAX_GROUP_MEMBERS)
             {
-                strcpy(groups[i].members[groups[i].member_count], username);
+                view_copy(groups[i].members[groups[i].member_count], sizeof(groups[i].members[0]), username);
+                routing_local_sessions(i, local_session_count(groups[i].members[groups[i].member_count]));
                 groups[i].member_count++;
-                send_message(client_fd, "Joined group successfully\n", 26, 0);
+                reply(client_fd, "Joined group successfully\n", 26);
             }
             else
             {
-                send_message(client_fd, "Group is full\n", 14, 0);
+                reply(client_fd, "Group is full\n", 14);
             }
             return;
         }
     }
-    send_message(client_fd, "Group not found\n", 16, 0);
+    reply(client_fd, "Group not found\n", 16);
 }
 
 /**
@@ -428,41 +1125,26 @@ void handle_join_group(int client_fd, char *username, char *group_name)
  */
 int get_client_fd_by_username(const char *username)
 {
-    for (int i = 0; i < client_count; i++)
-    {
-        if (strcmp(clients[i].username, username) == 0)
-        {
-            return clients[i].fd;
-        }
-    }
-    return -1;
+    return presence_local_fd(view_from_cstr(username));
 }
 
-void remove_client_from_all_groups(int client_fd)
+/**
+ * @brief Tells whether a user has logged out of every server of the cluster.
+ *
+ * A session forgotten with the link to its server is not over: that server catches up
+ * on the chat it missed when the link comes back.
+ */
+static int is_offline(const char *username)
 {
-    for (int i = 0; i < group_count; i++)
-    {
-        for (int j = 0; j < groups[i].member_count; j++)
-        {
-            if (clients[get_client_fd_by_username(groups[i].members[j])].fd == client_fd)
-            {
-                // Shift members to remove the client
-                for (int k = j; k < groups[i].member_count - 1; k++)
-                {
-                    strcpy(groups[i].members[k], groups[i].members[k + 1]);
-                }
-                groups[i].member_count--;
-                j--; // Adjust index after removal
-            }
-        }
-    }
+    return presence_offline(view_from_cstr(username));
 }
 
 /**
  * @brief Handles messages sent within a group.
  *
  * Depending on the message type, this function either removes a user from a group or sends
- * a message to all group members, excluding the sender.
+ * a message to all group members, excluding the sender. Members logged in nowhere get
+ * it in their mailbox, delivered when they log in.
  *
  * @param client_fd The file descriptor of the client.
  * @param group The name of the group.
@@ -472,24 +1154,25 @@ void remove_client_from_all_groups(int client_fd)
  *
  * @note If the client is not part of the group, an error message is sent.
  */
-void handle_message(int client_fd, char *group, char *user, char *message, int type)
+void handle_message(int client_fd, struct str_view group, struct str_view user, struct str_view message, int type)
 {
 
     if (type == 0)
     {
         for (int i = 0; i < group_count; i++)
         {
+            if (!view_equals(group, groups[i].group_name))
+                continue;
             for (int j = 0; j < groups[i].member_count; j++)
             {
-                if (strcmp(groups[i].members[j], user) == 0)
+                if (view_equals(user, groups[i].members[j]))
                 {
+                    routing_local_sessions(i, -local_session_count(groups[i].members[j]));
                     for (int k = j; k < groups[i].member_count - 1; k++)
                     {
                         strcpy(groups[i].members[k], groups[i].members[k + 1]);
                     }
                     groups[i].member_count--;
-                    if (client_fd == OTHER_SERVER_FD)
-                        send_message(client_fd, "Left group successfully\n", 24, 0);
                     return;
                 }
             }
@@ -499,177 +1182,578 @@ void handle_message(int client_fd, char *group, char *user, char *message, int t
     {
         for (int i = 0; i < group_count; i++)
         {
+            if (!view_equals(group, groups[i].group_name))
+                continue;
             for (int j = 0; j < groups[i].member_count; j++)
             {
-                if (strcmp(groups[i].members[j], user) == 0)
+                if (view_equals(user, groups[i].members[j]))
                 {
+                    // "<user>: <message>", sent straight from the receive buffer
+                    struct iovec message_to_send[3] = {
+                        {(char *)user.ptr, user.len},
+                        {": ", 2},
+                        {(char *)message.ptr, message.len},
+                    };
+
+                    int delivered = 0;
+                    int from_peer = is_peer(client_fd);
+                    PROBE_FAN_OUT_START(groups[i].group_name, groups[i].member_count);
                     for (int k = 0; k < groups[i].member_count; k++)
                     {
-                        if (strcmp(groups[i].members[k], user) != 0)
+                        if (k != j)
                         {
                             int member_fd = get_client_fd_by_username(groups[i].members[k]);
                             if (member_fd != -1)
                             {
-                                printf("Sending message to %s\n fd : %d", groups[i].members[k], member_fd);
-                                char message_to_send[BUFFER_SIZE];
-                                snprintf(message_to_send, sizeof(message_to_send), "%s: %s", user, message);
-                                send_message(member_fd, message_to_send, strlen(message_to_send), 0);
+                                log_sampled(LOG_LEVEL_DEBUG, "Sending message to %s fd %d", groups[i].members[k], member_fd);
+                                connection_send_chat(member_fd, message_to_send, 3);
+                                delivered++;
+                            }
+                            else if (!from_peer && is_offline(groups[i].members[k]))
+                            {
+                                // Kept by the server the message was posted on only
+                                mailbox_append(groups[i].members[k], message_to_send, 3);
                             }
                         }
                     }
-                    if (client_fd == OTHER_SERVER_FD)
-                        send_message(client_fd, "Message sent successfully\n", 26, 0);
+                    PROBE_FAN_OUT_END(groups[i].group_name, delivered);
+
+                    // Archived once delivered, by the owner of the group only
+                    if (routing_owner(group) == node_id)
+                    {
+                        archive_post(group, message_to_send, 3);
+                    }
                     return;
                 }
             }
         }
-        send_message(client_fd, "Invalid command format\n", 23, 0);
+        reply(client_fd, "Invalid command format\n", 23);
     }
     else
     {
-        send_message(client_fd, "Invalid command format\n", 23, 0);
+        reply(client_fd, "Invalid command format\n", 23);
     }
 }
 
 /**
- * @brief Handles commands from a client.
- *
- * This function processes incoming client commands, such as login, user creation,
- * file upload/download, group joining, and messaging. Some commands may be forwarded
- * to a secondary server for processing.
+ * @brief Decides whether a received frame may be dispatched now.
  *
- * @param client_fd The file descriptor of the client.
- * @param second_server_fd The file descriptor for the connection to the secondary server.
+ * The frame must fit in the buckets of its connection and, once logged in, of its
+ * user. When it does not, the frame is either rejected or held in the connection until
+ * enough tokens have accumulated, depending on the configured mode. While a frame is
+ * held the event loop stops reading the socket, which pushes back on the client.
  *
- * @note If a client disconnects, it is removed from the active client list.
+ * @param conn The connection the frame was received on.
+ * @param length The size of the frame.
+ * @return Non-zero if the frame can be dispatched.
  */
-
-void handle_client(int client_fd)
+static int admit_frame(struct connection *conn, size_t length)
 {
-    char buffer[BUFFER_SIZE];
-    printf("\n\nAwaiting for recv ...\n\n");
+    uint64_t now = ratelimit_now_ns();
+    struct rate_limiter *user = conn->user_index >= 0 ? &user_limits[conn->user_index] : NULL;
 
-    receive_message(client_fd, buffer, sizeof(buffer), 0);
-
-    if (strlen(buffer) == 0)
+    uint64_t wait = ratelimit_wait_ns(&conn->limit, length, now);
+    if (user != NULL)
     {
-        remove_client_from_all_groups(client_fd);
-        remove_client(client_fd);
-        printf("Client or server disconnected : %d\n", client_fd);
+        uint64_t user_wait = ratelimit_wait_ns(user, length, now);
+        if (user_wait > wait)
+        {
+            wait = user_wait;
+        }
+    }
 
-        if (client_fd != OTHER_SERVER_FD)
+    if (wait == 0)
+    {
+        ratelimit_consume(&conn->limit, length);
+        if (user != NULL)
         {
-            char remove_command[BUFFER_SIZE];
-            snprintf(remove_command, sizeof(remove_command), "remove_client %d\n", client_fd);
-            send_message(OTHER_SERVER_FD, remove_command, strlen(remove_command), 0);
+            ratelimit_consume(user, length);
         }
-        close(client_fd);
-        return;
+        conn->throttled_until = 0;
+        return 1;
     }
 
-    if (client_fd == OTHER_SERVER_FD)
+    if (server_config.ratelimit_mode == RATELIMIT_REJECT)
     {
-        printf("Received message from server: %s\n", buffer);
+        metrics_add(METRIC_FRAMES_REJECTED, 1);
+        frame_reader_release(&conn->rx);
+        reply(conn->fd, "Rate limit exceeded\n", 20);
+        return 0;
     }
-    else
+
+    if (conn->throttled_until == 0)
     {
-        printf("Received message from client %d: %s\n", client_fd, buffer);
+        metrics_add(METRIC_FRAMES_DELAYED, 1);
     }
+    conn->throttled_until = now + wait;
+    return 0;
+}
+
+/**
+ * @brief Runs the handler of a command.
+ *
+ * @param client_fd The file descriptor the command was received on.
+ * @param conn The connection of that socket.
+ * @param cmd The parsed command.
+ */
+static void dispatch_command(int client_fd, struct connection *conn, struct command *cmd)
+{
+    int from_peer = conn->peer_index >= 0;
+    struct str_view arg1 = command_arg(cmd, 0);
+    struct str_view arg2 = command_arg(cmd, 1);
+    long number = 0;
 
-    if (client_fd != OTHER_SERVER_FD &&
-        (strncmp(buffer, "join_group", 10) == 0 ||
-         strncmp(buffer, "message", 7) == 0 ||
-         strncmp(buffer, "create_user", 11) == 0))
+    switch (cmd->id)
     {
-        // Forward the command to the second server
-        printf("sending command to server\n");
-        send_message(OTHER_SERVER_FD, buffer, strlen(buffer), 0);
+    case COMMAND_MAX_FRAME:
+        view_to_long(arg1, &number);
+        handle_max_frame(client_fd, number);
+        break;
+
+    case COMMAND_LOGIN:
+        handle_login(client_fd, arg1, arg2);
+        break;
+
+    case COMMAND_CREATE_USER:
+        view_to_long(command_arg(cmd, 2), &number);
+        handle_create_user(client_fd, arg1, arg2, number, command_tail(cmd, 3));
+        break;
+
+    case COMMAND_LIST_GROUPS:
+        handle_list_groups(client_fd);
+        break;
+
+    case COMMAND_JOIN_GROUP:
+        handle_join_group(client_fd, arg1, arg2);
+        break;
+
+    case COMMAND_MESSAGE:
+        if (view_to_long(command_arg(cmd, 2), &number) < 0)
+        {
+            number = -1;
+        }
+        handle_message(client_fd, arg1, arg2, command_tail(cmd, 3), number);
+        break;
+
+    case COMMAND_UPLOAD_FILE:
+        handle_upload_file(client_fd, arg1, arg2);
+        log_debug("Done uploading file from client %d", client_fd);
+        break;
 
-        // Receive response from the second server
-        char response[BUFFER_SIZE];
-        printf("\n\nAwaiting for recv ...\n\n");
+    case COMMAND_LIST_FILES:
+        handle_list_files(client_fd, arg1); // arg1 is group name
+        break;
 
-        receive_message(OTHER_SERVER_FD, response, sizeof(response), 0);
+    case COMMAND_SEARCH:
+        handle_search(client_fd, arg1, command_tail(cmd, 1));
+        break;
+
+    case COMMAND_DOWNLOAD_FILE:
+        handle_download_file(client_fd, arg1, arg2);
+        break;
+
+    case COMMAND_DOWNLOAD_RANGE:
+    {
+        long offset = -1, length = -1;
+        view_to_long(command_arg(cmd, 2), &offset);
+        view_to_long(command_arg(cmd, 3), &length);
+        handle_download_range(client_fd, arg1, arg2, offset, length);
+        break;
     }
 
-    char command[50], arg1[50], arg2[50];
-    char arg3[BUFFER_SIZE];
-    int arg4;
+    case COMMAND_FILE_BEGIN:
+        view_to_long(command_arg(cmd, 2), &number);
+        replica_receive_begin(conn->peer_index, arg1, arg2, number, command_tail(cmd, 3));
+        break;
+
+    case COMMAND_FILE_CHUNK:
+        // The data is the end of the frame, binary and possibly starting with spaces
+        if (view_to_long(arg1, &number) == 0 && number >= 0 && number <= cmd->end - arg1.ptr - (long)arg1.len - 1)
+        {
+            replica_receive_chunk(conn->peer_index, cmd->end - number, number);
+        }
+        break;
 
-    if (sscanf(buffer, "%49s %49s %49s %d %[^\n]", command, arg1, arg2, &arg4, arg3) >= 1)
+    case COMMAND_FILE_END:
+        replica_receive_end(conn->peer_index, arg1);
+        break;
+
+    case COMMAND_FILE_META:
+        view_to_long(command_arg(cmd, 2), &number);
+        replica_receive_meta(conn->peer_index, arg1, arg2, number, command_tail(cmd, 3));
+        break;
+
+    case COMMAND_PRESENCE:
+        presence_apply(command_tail(cmd, 0), mailbox_forward);
+        break;
+
+    case COMMAND_MAILBOX:
     {
+        // The lines follow the line of the user name, and their length prefixes are binary
+        const char *lines = arg1.ptr + arg1.len + 1;
+        if (arg1.len > 0 && lines <= cmd->end && lines[-1] == '\n')
+        {
+            mailbox_receive(client_fd, arg1, (struct str_view){lines, cmd->end - lines});
+        }
+        break;
+    }
+
+    case COMMAND_MAILBOX_ACK:
+        mailbox_acknowledge(conn->peer_index, arg1);
+        break;
 
-        if (strcmp(command, "login") == 0)
+    case COMMAND_PEER_HELLO:
+    {
+        if (from_peer || view_to_long(arg1, &number) < 0 || number <= 0 || number > INT_MAX)
         {
-            handle_login(client_fd, arg1, arg2);
+            break;
         }
-        else if (strcmp(command, "create_user") == 0)
+        struct peer *peer = peer_accept(client_fd, number, arg2.ptr, arg2.len);
+        if (peer == NULL)
         {
-            handle_create_user(client_fd, arg1, arg2, arg4, arg3);
+            // The event loop closes the connection once it reads the shutdown
+            shutdown(client_fd, SHUT_RDWR);
+            break;
         }
-        else if (strcmp(command, "list_groups") == 0)
+        routing_announce(peer);
+        presence_announce(peer);
+        break;
+    }
+
+    case COMMAND_PEER_REPLY:
+    {
+        // The answer of the owner of a group to a request forwarded for a client of this server
+        struct str_view text = command_tail(cmd, 1);
+        struct iovec parts[2] = {
+            {(char *)text.ptr, text.len},
+            {"\n", 1},
+        };
+        int fd = view_to_long(arg1, &number) == 0 ? settle_request(conn->peer_index, number) : -1;
+        if (fd >= 0)
         {
-            handle_list_groups(client_fd);
+            send_message_parts(fd, parts, 2);
         }
-        else if (strcmp(command, "join_group") == 0)
+        break;
+    }
+
+    case COMMAND_PEER_SYNC:
+    {
+        unsigned long long epoch, seen_epoch, seen_seq;
+        struct str_view tail = command_tail(cmd, 0);
+        char text[96];
+        view_copy(text, sizeof(text), tail);
+        if (sscanf(text, "%llx %llx %llu", &epoch, &seen_epoch, &seen_seq) != 3)
         {
-            handle_join_group(client_fd, arg1, arg2);
+            log_warn("Invalid peer_sync from node %d", peers[conn->peer_index].id);
+            break;
         }
-        else if (strcmp(command, "message") == 0)
+        routing_forget(&peers[conn->peer_index]);
+        peer_sync(&peers[conn->peer_index], epoch, seen_epoch, seen_seq);
+        break;
+    }
+
+    case COMMAND_PEER_ACK:
+    {
+        unsigned long long seq;
+        char text[32];
+        view_copy(text, sizeof(text), arg1);
+        if (sscanf(text, "%llu", &seq) == 1)
         {
-            handle_message(client_fd, arg1, arg2, arg3, arg4);
+            peer_acknowledge(&peers[conn->peer_index], seq);
         }
-        else if (strcmp(command, "upload_file") == 0)
+        break;
+    }
+
+    case COMMAND_INTEREST:
+        routing_set_interest(&peers[conn->peer_index], arg1, view_equals(arg2, "1"));
+        break;
+
+    default:
+        if (!from_peer)
+            reply(client_fd, "Unknown command\n", 16);
+        break;
+    }
+
+}
+
+/**
+ * @brief Handles commands from a client.
+ *
+ * This function processes incoming client commands, such as login, user creation,
+ * file upload/download, group joining, and messaging. Commands changing the shared
+ * state are replicated to every other server of the cluster, without waiting for them.
+ *
+ * @param client_fd The file descriptor of the client, or of a link to another server.
+ *
+ * @note If a client disconnects, it is removed from the active client list.
+ */
+
+void handle_client(int client_fd)
+{
+    struct connection *conn = connection_get(client_fd);
+    if (conn == NULL && (conn = connection_open(client_fd)) == NULL)
+    {
+        close(client_fd);
+        return;
+    }
+
+    int from_peer = conn->peer_index >= 0;
+
+    // A frame held by the rate limiter is dispatched before reading anything new
+    int held = frame_reader_ready(&conn->rx);
+    int status = held ? FRAME_READY : frame_reader_poll(client_fd, &conn->rx);
+    if (status == FRAME_PENDING)
+    {
+        return;
+    }
+    if (status == FRAME_TOO_LARGE)
+    {
+        if (!from_peer)
+            send_message(client_fd, "Frame too large\n", 16, 0);
+        return;
+    }
+    if (status != FRAME_READY)
+    {
+        if (from_peer)
+        {
+            presence_forget_node(peers[conn->peer_index].id);
+            replica_forget(conn->peer_index);
+            mailbox_forget(conn->peer_index);
+            peer_detach(client_fd);
+            // Once detached, so that the changes applied here are logged for the peer
+            abandon_requests(-1, conn->peer_index);
+        }
+        else
         {
+            abandon_requests(client_fd, -1);
+        }
+        remove_client(client_fd);
+        connection_close(client_fd);
+        log_sampled(LOG_LEVEL_INFO, "Client or server disconnected: %d", client_fd);
+        close(client_fd);
+        return;
+    }
 
-            handle_upload_file(client_fd, arg1, arg2);
-            printf("done uploading file from client\n");
-            if (client_fd != OTHER_SERVER_FD)
-            {
-                printf("tranferring file to other server\n");
-                char transfer_command[BUFFER_SIZE];
-                snprintf(transfer_command, sizeof(transfer_command), "transfer_file %s %s\n", arg1, arg2);
-                send_message(OTHER_SERVER_FD, transfer_command, strlen(transfer_command), 0);
+    if (!held)
+    {
+        PROBE_FRAME_RECEIVE(client_fd, conn->rx.size);
+        if (trace_enabled)
+        {
+            conn->received_at = metrics_now_ns();
+        }
+    }
 
-                handle_download_file(OTHER_SERVER_FD, arg1, arg2);
-            }
+    char *buffer = conn->rx.data;
+    size_t length = conn->rx.size;
+    if (length == 0)
+    {
+        frame_reader_release(&conn->rx);
+        return;
+    }
+
+    // Commands forwarded by another server carry the correlation id of the request
+    uint64_t trace_id = 0;
+    request_tag.len = 0;
+    replied = 0;
+    if (from_peer)
+    {
+        if (peer_receive(&peers[conn->peer_index], &buffer, &length) < 0)
+        {
+            frame_reader_release(&conn->rx);
+            return;
+        }
+        trace_id = trace_strip_prefix(&buffer, &length);
+    }
+    else
+    {
+        request_tag = strip_request_tag(&buffer, &length);
+        if (trace_enabled)
+        {
+            trace_id = trace_new_id();
         }
-        else if (strcmp(command, "list_files") == 0)
+    }
+
+    if (!from_peer && !admit_frame(conn, length))
+    {
+        return;
+    }
+    uint64_t dispatch_start = metrics_now_ns();
+
+    struct command cmd;
+    if (command_parse(buffer, length, &cmd) < 0)
+    {
+        log_sampled(LOG_LEVEL_DEBUG, "Invalid command of %zu bytes from fd %d", length, client_fd);
+        if (!from_peer)
+            reply(client_fd, "Invalid command format\n", 23);
+        frame_reader_release(&conn->rx);
+        return;
+    }
+
+    // A membership change or a search forwarded to this server as the owner of its group
+    if (from_peer && cmd.id == COMMAND_PEER_REQUEST)
+    {
+        long origin;
+        struct str_view inner = command_tail(&cmd, 1);
+        buffer = (char *)inner.ptr;
+        length = inner.len;
+        request_tag = strip_request_tag(&buffer, &length);
+        if (view_to_long(command_arg(&cmd, 0), &origin) < 0 || command_parse(buffer, length, &cmd) < 0 ||
+            !(is_membership_change(&cmd) || cmd.id == COMMAND_SEARCH))
         {
-            handle_list_files(client_fd, arg1); // arg1 is group name
+            log_sampled(LOG_LEVEL_WARN, "Invalid peer_request from fd %d", client_fd);
+            frame_reader_release(&conn->rx);
+            return;
         }
-        else if (strcmp(command, "download_file") == 0)
+        request_origin = origin;
+    }
+
+    // Only the command name is logged: login and create_user carry passwords
+    log_sampled(LOG_LEVEL_DEBUG, "%s from %s %d (%zu bytes)", command_id_name(cmd.id),
+                from_peer ? "server" : "client", client_fd, length);
+
+    PROBE_COMMAND_DISPATCH(client_fd, cmd.id, trace_id);
+
+    if (cmd.id == COMMAND_MESSAGE && !view_is_printable_utf8(command_tail(&cmd, 3)))
+    {
+        if (!from_peer)
+            reply(client_fd, "Invalid message encoding\n", 25);
+        frame_reader_release(&conn->rx);
+        return;
+    }
+
+    uint64_t forward_start = 0;
+    uint64_t forward_end = 0;
+    struct peer *owner = NULL;
+    if ((!from_peer || request_origin >= 0) &&
+        (cmd.id == COMMAND_JOIN_GROUP ||
+         cmd.id == COMMAND_MESSAGE ||
+         cmd.id == COMMAND_CREATE_USER))
+    {
+        // Replicate the command to the other servers; the links are ordered, so no answer is awaited
+        forward_start = metrics_now_ns();
+        PROBE_PEER_SEND(trace_id, cmd.id, length);
+        char prefix[TRACE_PREFIX_SIZE + 1];
+        char request[32];
+        struct iovec parts[4] = {
+            {prefix, 0},
+            {request, 0},
+            {(char *)request_tag.ptr, 0},
+            {buffer, length},
+        };
+        if (trace_id != 0)
         {
-            handle_download_file(client_fd, arg1, arg2);
+            parts[0].iov_len = trace_format_prefix(prefix, trace_id);
         }
-        else if (client_fd == OTHER_SERVER_FD && strcmp(command, "transfer_file") == 0)
+
+        int membership = is_membership_change(&cmd);
+        int forwarded = 0;
+        if (membership && request_origin < 0 && (owner = routing_owner_link(command_group(&cmd))) != NULL)
         {
-            handle_upload_file(OTHER_SERVER_FD, arg1, arg2);
-            printf("done uploading file from other server\n");
+            // The owner applies the change, replicates it to every server and answers the client
+            parts[1].iov_len = snprintf(request, sizeof(request), "peer_request %llu ", (unsigned long long)conn->session);
+            parts[2].iov_len = request_tag.len;
+            if (forward_request(owner, conn, parts, 4, buffer, length) == 0)
+            {
+                forwarded = 1;
+            }
+            else
+            {
+                // Applied here instead, as when the owner is not linked
+                owner = NULL;
+                parts[1].iov_len = 0;
+                parts[2].iov_len = 0;
+            }
         }
-        else if (client_fd == OTHER_SERVER_FD && strcmp(command, "remove_client") == 0)
+        if (owner == NULL && cmd.id == COMMAND_MESSAGE && !membership)
         {
-            int fd_to_remove;
-            sscanf(arg1, "%d", &fd_to_remove);
-            remove_client_from_all_groups(fd_to_remove);
-            remove_client(fd_to_remove);
-            printf("Client removed by other server: %d\n", fd_to_remove);
+            forwarded = routing_send_interested(command_group(&cmd), parts, 4);
         }
-        else
+        else if (owner == NULL)
         {
-            if (client_fd != OTHER_SERVER_FD)
+            forwarded = peer_broadcast(parts, 4);
+        }
+        forward_end = metrics_now_ns();
+        PROBE_PEER_ACK(trace_id, forward_end - forward_start);
+        metrics_add(METRIC_PEER_FORWARDS, forwarded);
+    }
 
-                send_message(client_fd, "Unknown command\n", 16, 0);
+    // A search of a member is answered by the owner of the group, which holds its archive
+    if (!from_peer && cmd.id == COMMAND_SEARCH && server_config.message_archive &&
+        is_group_member(client_fd, command_arg(&cmd, 0)) && (owner = routing_owner_link(command_arg(&cmd, 0))) != NULL)
+    {
+        char request[32];
+        struct iovec parts[3] = {
+            {request, snprintf(request, sizeof(request), "peer_request %llu ", (unsigned long long)conn->session)},
+            {(char *)request_tag.ptr, request_tag.len},
+            {buffer, length},
+        };
+        if (forward_request(owner, conn, parts, 3, NULL, 0) < 0)
+        {
+            reply(client_fd, SEARCH_NONE, sizeof(SEARCH_NONE) - 1);
         }
     }
-    else
+
+    // Replication commands are only accepted from other servers; peer_hello, which makes
+    // a connection one, is checked against the secret of the cluster by peer_accept()
+    if (!from_peer &&
+        (cmd.id == COMMAND_FILE_BEGIN ||
+         cmd.id == COMMAND_FILE_CHUNK ||
+         cmd.id == COMMAND_FILE_END ||
+         cmd.id == COMMAND_FILE_META ||
+         cmd.id == COMMAND_PEER_REQUEST ||
+         cmd.id == COMMAND_PEER_REPLY ||
+         cmd.id == COMMAND_INTEREST ||
+         cmd.id == COMMAND_PRESENCE ||
+         cmd.id == COMMAND_MAILBOX ||
+         cmd.id == COMMAND_MAILBOX_ACK ||
+         cmd.id == COMMAND_PEER_SYNC ||
+         cmd.id == COMMAND_PEER_ACK))
     {
-        if (client_fd != OTHER_SERVER_FD)
+        cmd.id = COMMAND_UNKNOWN;
+    }
 
-            send_message(client_fd, "Invalid command format\n", 23, 0);
+    if (owner == NULL)
+    {
+        dispatch_command(client_fd, conn, &cmd);
+
+        // A tagged request always gets an answer, empty when the command has none
+        if (request_tag.len > 0 && !replied)
+        {
+            reply(client_fd, "", 0);
+        }
     }
+    request_origin = -1;
+    request_tag.len = 0;
 
-    memset(buffer, 0, sizeof(buffer));
+    uint64_t done = metrics_now_ns();
+    if (!from_peer)
+    {
+        metrics_observe_command(cmd.id, done - dispatch_start);
+        PROBE_COMMAND_DONE(client_fd, cmd.id, done - dispatch_start);
+    }
+    else
+    {
+        PROBE_PEER_APPLY(trace_id, cmd.id, done - dispatch_start);
+        metrics_observe(METRIC_REPLICATION_LAG, done - dispatch_start);
+    }
+    if (trace_enabled && trace_id != 0)
+    {
+        if (from_peer)
+        {
+            trace_record(TRACE_PEER_APPLY, trace_id, cmd.id, dispatch_start, done);
+        }
+        else
+        {
+            trace_record(TRACE_REQUEST, trace_id, cmd.id, conn->received_at, done);
+            trace_record(TRACE_QUEUED, trace_id, cmd.id, conn->received_at, dispatch_start);
+            if (forward_end != 0)
+            {
+                trace_record(TRACE_PEER_FORWARD, trace_id, cmd.id, forward_start, forward_end);
+            }
+            trace_record(TRACE_FAN_OUT, trace_id, cmd.id, forward_end != 0 ? forward_end : dispatch_start, done);
+        }
+    }
+    frame_reader_release(&conn->rx);
 }
 
 /**
@@ -677,16 +1761,18 @@ void handle_client(int client_fd)
  *
  * This function displays the list of users, groups, and active clients on the server.
  *
- * @note This is primarily for debugging and monitoring purposes.
+ * @note This is primarily for debugging and monitoring purposes. Passwords are not
+ * printed.
  */
 void print_data()
 {
+    // Keep the dump in one piece next to the lines written by the log thread
+    flockfile(stdout);
     printf("\n\nServer state\n----------------------------------------------\n");
     printf("Users:\n");
     for (int i = 0; i < user_count; i++)
     {
-        printf("Username: %s, Gender: %c, Age: %d, Password: %s\n",
-               users[i].username, (int)users[i].gender, users[i].age, users[i].password);
+        printf("Username: %s, Gender: %c, Age: %d\n", users[i].username, (int)users[i].gender, users[i].age);
     }
 
     printf("\nGroups:\n");
@@ -705,5 +1791,180 @@ void print_data()
     {
         printf("Username: %s, FD: %d\n", clients[i].username, clients[i].fd);
     }
+
+    printf("\nConnections: %d\n", connection_count());
+    printf("Throttled frames: %llu delayed, %llu rejected\n",
+           (unsigned long long)metrics_total(METRIC_FRAMES_DELAYED),
+           (unsigned long long)metrics_total(METRIC_FRAMES_REJECTED));
+    pool_print_stats(stdout);
     printf("---------------------------------------------------\n");
-}
\ No newline at end of file
+    fflush(stdout);
+    funlockfile(stdout);
+}
+
+/**
+ * @brief Raises the open file limit so that MAX_CLIENTS sockets can be accepted.
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < MAX_CONNECTIONS)
+    {
+        limit.rlim_cur = limit.rlim_max < MAX_CONNECTIONS ? limit.rlim_max : MAX_CONNECTIONS;
+        if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+        {
+            log_errno("setrlimit");
+        }
+    }
+}
+
+/**
+ * @brief Runs the event loop of a server.
+ *
+ * Accepts new clients on the listening socket and dispatches every readable socket to
+ * handle_client(). Sockets holding a rate-limited frame are left out of the poll set
+ * until their frame is due, and the poll timeout is shortened so that it is dispatched
+ * on time. The links to the peers this server dials are opened, and opened again when
+ * they drop, between two polls. At the debug log level the server state is also
+ * printed once per second.
+ *
+ * @param server_fd The listening socket.
+ */
+void server_loop(int server_fd)
+{
+    raise_fd_limit();
+
+    // A peer going away must not take this server down with it
+    signal(SIGPIPE, SIG_IGN);
+    routing_init();
+
+    if (server_config.tracing)
+    {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        getsockname(server_fd, (struct sockaddr *)&address, &addrlen);
+        trace_start(ntohs(address.sin_port));
+        metrics_route("/trace", "application/json", trace_dump);
+    }
+    if (server_config.metrics_port > 0)
+    {
+        metrics_serve(server_config.metrics_port);
+    }
+    archive_start();
+
+    int sockets[MAX_CLIENTS];
+    int socket_count = 0;
+    struct pollfd fds[MAX_CLIENTS + 1];
+    uint64_t next_dump = 0;
+
+    while (1)
+    {
+        uint64_t now = ratelimit_now_ns();
+        int timeout = -1;
+        int nfds = 1;
+
+        int dialed[MAX_PEERS];
+        int dial_count = peer_maintain(now, dialed, MAX_PEERS);
+        peer_heartbeat(now);
+        for (int i = 0; i < dial_count && socket_count < MAX_CLIENTS; i++)
+        {
+            routing_announce(peer_by_fd(dialed[i]));
+            presence_announce(peer_by_fd(dialed[i]));
+            sockets[socket_count++] = dialed[i];
+        }
+        uint64_t next_attempt = peer_next_attempt();
+        if (next_attempt != UINT64_MAX)
+        {
+            timeout = next_attempt > now ? (next_attempt - now + 999999) / 1000000 : 0;
+        }
+
+        fds[0].fd = server_fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < socket_count; i++)
+        {
+            struct connection *conn = connection_get(sockets[i]);
+            if (conn != NULL && conn->throttled_until > now)
+            {
+                int wait_ms = (conn->throttled_until - now + 999999) / 1000000;
+                if (timeout < 0 || wait_ms < timeout)
+                {
+                    timeout = wait_ms;
+                }
+                continue;
+            }
+            fds[nfds].fd = sockets[i];
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+
+        int activity = poll(fds, nfds, timeout);
+        if (activity < 0)
+        {
+            log_errno("poll");
+            break;
+        }
+
+        // Sockets whose held frame is now due
+        now = ratelimit_now_ns();
+        for (int i = 0; i < socket_count; i++)
+        {
+            struct connection *conn = connection_get(sockets[i]);
+            if (conn != NULL && conn->throttled_until != 0 && conn->throttled_until <= now)
+            {
+                handle_client(sockets[i]);
+            }
+        }
+
+        for (int j = 1; j < nfds; j++)
+        {
+            if (fds[j].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                handle_client(fds[j].fd);
+            }
+        }
+
+        // The logins and logouts of this turn reach the peers as one frame
+        presence_flush();
+        connection_flush_chat();
+
+        // The state dump is a debugging aid, printed at most once per second
+        if (LOG_ENABLED(LOG_LEVEL_DEBUG) && now >= next_dump)
+        {
+            print_data();
+            next_dump = now + PRINT_DATA_INTERVAL_NS;
+        }
+
+        // Forget the sockets closed by handle_client()
+        for (int i = 0; i < socket_count; i++)
+        {
+            if (connection_get(sockets[i]) == NULL)
+            {
+                sockets[i--] = sockets[--socket_count];
+            }
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            struct sockaddr_in address;
+            socklen_t addrlen = sizeof(address);
+            int new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
+            if (new_socket < 0)
+            {
+                log_errno("accept");
+                continue;
+            }
+
+            log_sampled(LOG_LEVEL_INFO, "New connection, socket fd is %d, ip is %s, port %d",
+                        new_socket, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
+
+            if (socket_count == MAX_CLIENTS || connection_open(new_socket) == NULL)
+            {
+                log_warn("Max clients reached, cannot accept more connections");
+                close(new_socket);
+                continue;
+            }
+            sockets[socket_count++] = new_socket;
+        }
+    }
+}
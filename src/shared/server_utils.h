@@ -18,24 +18,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "database.h"
+#include "command.h"
 
-#define MAX_CLIENTS 100
+#define MAX_CLIENTS 4096
 #define BUFFER_SIZE 8192
 
-#define OTHER_SERVER_FD 4
-
 void add_client(const char *username, int fd);
 void remove_client(int fd);
-void handle_login(int client_fd, char *username, char *password);
-void handle_create_user(int client_fd, char *username, char *gender, int age, char *password);
-void handle_upload_file(int client_fd, const char *group_name, const char *file_name);
-void handle_download_file(int client_fd, const char *group_name, const char *file_name);
-void handle_list_files(int client_fd, const char *group_name);
+void handle_login(int client_fd, struct str_view username, struct str_view password);
+void handle_max_frame(int client_fd, long requested);
+void handle_create_user(int client_fd, struct str_view username, struct str_view gender, int age, struct str_view password);
+void handle_upload_file(int client_fd, struct str_view group_name, struct str_view file_name);
+void handle_download_file(int client_fd, struct str_view group_name, struct str_view file_name);
+void handle_download_range(int client_fd, struct str_view group_name, struct str_view file_name, long offset, long length);
+void handle_list_files(int client_fd, struct str_view group_name);
 void handle_list_groups(int client_fd);
-void handle_join_group(int client_fd, char *username, char *group_name);
+void handle_search(int client_fd, struct str_view group_name, struct str_view query);
+void handle_join_group(int client_fd, struct str_view username, struct str_view group_name);
 int get_client_fd_by_username(const char *username);
-void handle_message(int client_fd, char *group, char *user, char *message, int type);
+void handle_message(int client_fd, struct str_view group, struct str_view user, struct str_view message, int type);
 void handle_client(int client_fd);
 void print_data();
+void server_loop(int server_fd);
 
 #endif // SERVER_UTILS_H
\ No newline at end of file
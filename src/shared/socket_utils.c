@@ -6,7 +6,12 @@
  * and integers over a socket, along with error handling.
  */
 
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
 #include "socket_utils.h"
+#include "pool.h"
+#include "metrics.h"
 
 /**
  * @brief Prints an error message if the result is negative.
@@ -146,9 +151,65 @@ void write_int_as_message(int fd, int val)
  */
 void send_message(int fd, char *message, int size, int flag)
 {
-    write_int_as_message(fd, size);
-    // printf("Message size: %d\n", size);
-    write_on_socket(fd, message);
+    struct iovec part = {message, size};
+    send_message_parts(fd, &part, 1);
+}
+
+
+/**
+ * @brief Sends a message assembled from several parts as a single frame.
+ *
+ * The length prefix and the parts are handed to the kernel with a single `writev`;
+ * partial writes are resumed until the whole frame has been sent.
+ *
+ * @param fd The socket file descriptor.
+ * @param parts The parts of the message payload.
+ * @param count The number of parts.
+ * @return 0 on success, -1 if the frame could not be written completely.
+ */
+int send_message_parts(int fd, const struct iovec *parts, int count)
+{
+    struct iovec iov[FRAME_MAX_PARTS + 1];
+    int32_t size = 0;
+
+    if (count > FRAME_MAX_PARTS)
+    {
+        fprintf(stderr, "send_message_parts: too many parts\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        iov[i + 1] = parts[i];
+        size += parts[i].iov_len;
+    }
+    iov[0].iov_base = &size;
+    iov[0].iov_len = sizeof(size);
+
+    struct iovec *pending = iov;
+    int pending_count = count + 1;
+    while (pending_count > 0)
+    {
+        ssize_t written = writev(fd, pending, pending_count);
+        if (written < 0)
+        {
+            print_error(written, "writev");
+            return -1;
+        }
+        while (pending_count > 0 && (size_t)written >= pending->iov_len)
+        {
+            written -= pending->iov_len;
+            pending++;
+            pending_count--;
+        }
+        if (pending_count > 0)
+        {
+            pending->iov_base = (char *)pending->iov_base + written;
+            pending->iov_len -= written;
+        }
+    }
+    metrics_add(METRIC_FRAMES_SENT, 1);
+    metrics_add(METRIC_BYTES_SENT, sizeof(size) + size);
+    return 0;
 }
 
 
@@ -156,11 +217,12 @@ void send_message(int fd, char *message, int size, int flag)
  * @brief Receives a message from a socket.
  *
  * This function receives a message from a socket by first reading the size of the message,
- * then reading the message content into the provided buffer.
+ * then reading the message content into the provided buffer. Whatever does not fit in
+ * the buffer is read and discarded so that the stream stays in sync.
  *
  * @param fd The socket file descriptor.
  * @param buffer The buffer to store the received message.
- * @param size The expected size of the message.
+ * @param size The size of the buffer, including room for the terminating NUL.
  * @param flag A flag (currently unused) for message receiving options.
  */
 void receive_message(int fd, char *buffer, int size, int flag)
@@ -168,11 +230,244 @@ void receive_message(int fd, char *buffer, int size, int flag)
     int message_size = read_int_from_socket(fd);
     // printf("Message size: %d\n", message_size);
 
-    int read_status = read_message_from_socket(fd, buffer, message_size);
-    if (read_status <= 0)
+    buffer[0] = '\0';
+    if (message_size < 0)
+    {
+        printf("Invalid message size received: %d\n", message_size);
+        return;
+    }
+
+    int kept = message_size < size ? message_size : size - 1;
+    int read_status = read_message_from_socket(fd, buffer, kept);
+    if (kept > 0 && read_status <= 0)
     {
         printf("Server disconnected or error occurred.\n");
         // exit(EXIT_FAILURE);
+        buffer[0] = '\0';
+        return;
     }
-    buffer[message_size] = '\0';
-}
\ No newline at end of file
+    buffer[kept] = '\0';
+
+    char scratch[1024];
+    int remaining = message_size - kept;
+    while (remaining > 0)
+    {
+        int chunk = remaining < (int)sizeof(scratch) ? remaining : (int)sizeof(scratch);
+        if (read_message_from_socket(fd, scratch, chunk) <= 0)
+        {
+            break;
+        }
+        remaining -= chunk;
+    }
+    if (message_size > kept)
+    {
+        printf("Message truncated from %d to %d bytes.\n", message_size, kept);
+    }
+}
+
+
+/**
+ * @brief Receives a whole frame into a pooled buffer of the right size class.
+ *
+ * @param fd The socket file descriptor.
+ * @param max_size The largest payload accepted.
+ * @param length Set to the payload length on success.
+ * @return The NUL-terminated payload to release with pool_free(), or NULL if the
+ *         connection closed or the frame was too large.
+ */
+char *receive_frame(int fd, size_t max_size, size_t *length)
+{
+    struct frame_reader reader;
+    frame_reader_init(&reader, max_size);
+
+    int status;
+    while ((status = frame_reader_poll(fd, &reader)) == FRAME_PENDING)
+    {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        poll(&pfd, 1, -1);
+    }
+    if (status != FRAME_READY)
+    {
+        frame_reader_release(&reader);
+        return NULL;
+    }
+
+    *length = reader.size;
+    return reader.data;
+}
+
+
+/**
+ * @brief Returns the next chat line of a `batch` frame.
+ *
+ * @param cursor The line to read, just after the header or the previous line; moved past the line.
+ * @param end One past the last byte of the frame.
+ * @param length Receives the length of the line.
+ * @return The line, or NULL at the end of the frame or if a length runs past it.
+ */
+const char *batch_next_line(const char **cursor, const char *end, size_t *length)
+{
+    int32_t size;
+    if (end - *cursor < FRAME_HEADER_SIZE)
+    {
+        return NULL;
+    }
+    memcpy(&size, *cursor, sizeof(size));
+    const char *line = *cursor + FRAME_HEADER_SIZE;
+    if (size < 0 || size > end - line)
+    {
+        return NULL;
+    }
+    *cursor = line + size;
+    *length = size;
+    return line;
+}
+
+/**
+ * @brief Initialises a frame reader.
+ *
+ * @param reader The reader.
+ * @param max_size The largest payload accepted.
+ */
+void frame_reader_init(struct frame_reader *reader, size_t max_size)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->max_size = max_size;
+}
+
+
+/**
+ * @brief Reads what is available on a socket without blocking.
+ *
+ * @return The number of bytes read, 0 if nothing is available yet, or -1 if the
+ *         connection is closed or failed.
+ */
+static ssize_t read_available(int fd, void *buffer, size_t size)
+{
+    ssize_t n = recv(fd, buffer, size, MSG_DONTWAIT);
+    if (n > 0)
+    {
+        return n;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        return 0;
+    }
+    print_error(n, "read_frame");
+    return -1;
+}
+
+
+/**
+ * @brief Reads from a socket into a frame reader.
+ *
+ * The length prefix and the payload are read separately so that no byte past the end
+ * of the frame is consumed; the raw file transfer protocol relies on this. The payload
+ * buffer is taken from the pools once the length is known. Oversized payloads are
+ * drained in small chunks and reported once fully skipped.
+ *
+ * @param fd The socket file descriptor.
+ * @param reader The reader.
+ * @return A frame_status value.
+ */
+int frame_reader_poll(int fd, struct frame_reader *reader)
+{
+    if (reader->header_read < FRAME_HEADER_SIZE)
+    {
+        ssize_t n = read_available(fd, reader->header + reader->header_read, FRAME_HEADER_SIZE - reader->header_read);
+        if (n < 0)
+        {
+            return FRAME_CLOSED;
+        }
+        reader->header_read += n;
+        if (reader->header_read < FRAME_HEADER_SIZE)
+        {
+            return FRAME_PENDING;
+        }
+
+        int32_t announced;
+        memcpy(&announced, reader->header, sizeof(announced));
+        if (announced < 0)
+        {
+            metrics_add(METRIC_FRAMES_INVALID, 1);
+            return FRAME_INVALID;
+        }
+        reader->size = announced;
+        reader->received = 0;
+        reader->skipping = reader->size > reader->max_size;
+        if (!reader->skipping)
+        {
+            reader->data = pool_alloc(reader->size + 1);
+            if (reader->data == NULL)
+            {
+                return FRAME_CLOSED;
+            }
+        }
+    }
+
+    while (reader->received < reader->size)
+    {
+        char scratch[4096];
+        size_t wanted = reader->size - reader->received;
+        char *target = reader->data + reader->received;
+        if (reader->skipping)
+        {
+            target = scratch;
+            if (wanted > sizeof(scratch))
+            {
+                wanted = sizeof(scratch);
+            }
+        }
+
+        ssize_t n = read_available(fd, target, wanted);
+        if (n < 0)
+        {
+            return FRAME_CLOSED;
+        }
+        if (n == 0)
+        {
+            return FRAME_PENDING;
+        }
+        reader->received += n;
+    }
+
+    if (reader->skipping)
+    {
+        printf("Frame of %zu bytes exceeds the limit of %zu bytes, skipped.\n", reader->size, reader->max_size);
+        frame_reader_release(reader);
+        metrics_add(METRIC_FRAMES_TOO_LARGE, 1);
+        return FRAME_TOO_LARGE;
+    }
+    reader->data[reader->size] = '\0';
+    metrics_add(METRIC_FRAMES_RECEIVED, 1);
+    metrics_add(METRIC_BYTES_RECEIVED, FRAME_HEADER_SIZE + reader->size);
+    return FRAME_READY;
+}
+
+
+/**
+ * @brief Tells whether a complete frame is waiting in a reader.
+ *
+ * @param reader The reader.
+ * @return Non-zero if the reader holds a frame not released yet.
+ */
+int frame_reader_ready(const struct frame_reader *reader)
+{
+    return reader->data != NULL && reader->header_read == FRAME_HEADER_SIZE && reader->received == reader->size;
+}
+
+
+/**
+ * @brief Releases the current frame and prepares the reader for the next one.
+ *
+ * @param reader The reader.
+ */
+void frame_reader_release(struct frame_reader *reader)
+{
+    pool_free(reader->data);
+    reader->data = NULL;
+    reader->header_read = 0;
+    reader->size = 0;
+    reader->received = 0;
+    reader->skipping = 0;
+}
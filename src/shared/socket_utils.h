@@ -18,6 +18,45 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/uio.h>
+
+#define FRAME_HEADER_SIZE 4                        /**< Size of the length prefix of a frame */
+#define FRAME_DEFAULT_MAX_SIZE (64 * 1024)         /**< Largest frame accepted before negotiation */
+#define FRAME_MAX_SIZE (16 * 1024 * 1024)          /**< Largest frame size that can be negotiated */
+#define FRAME_MAX_PARTS 16                         /**< Largest number of parts in send_message_parts() */
+#define FRAME_BATCH_HEADER "batch\n"                /**< First line of a pushed frame carrying several chat lines, see batch_next_line() */
+
+/**
+ * @enum frame_status
+ * @brief Result of feeding a socket to a frame reader.
+ */
+enum frame_status
+{
+    FRAME_PENDING = 0,    /**< The frame is not complete yet, call again when readable */
+    FRAME_READY = 1,      /**< A complete frame is available in the reader */
+    FRAME_CLOSED = -1,    /**< The peer closed the connection or a read error occurred */
+    FRAME_TOO_LARGE = -2, /**< An oversized frame was skipped, the stream is still in sync */
+    FRAME_INVALID = -3    /**< The length prefix is corrupt, the stream cannot be resynchronised */
+};
+
+/**
+ * @struct frame_reader
+ * @brief Incremental reader assembling one length-prefixed frame at a time.
+ *
+ * The payload is read directly into a pooled buffer of the size class matching the
+ * announced length, so frames up to the negotiated maximum are received without
+ * intermediate copies. The buffer always has room for a terminating NUL byte.
+ */
+struct frame_reader
+{
+    char header[FRAME_HEADER_SIZE]; /**< Length prefix being assembled */
+    int header_read;                /**< Bytes of the length prefix received so far */
+    char *data;                     /**< Pooled payload buffer, NUL-terminated once ready */
+    size_t size;                    /**< Announced payload length */
+    size_t received;                /**< Payload bytes received (or skipped) so far */
+    size_t max_size;                /**< Largest payload accepted on this stream */
+    int skipping;                   /**< Non-zero while an oversized payload is discarded */
+};
 
 /**
  * @brief Prints an error message if the result is negative.
@@ -90,17 +129,92 @@ void write_int_as_message(int fd, int val);
  */
 void send_message(int fd, char *message, int size, int flag);
 
+/**
+ * @brief Sends a message assembled from several parts as a single frame.
+ *
+ * The length prefix and all parts are written with one vectored write, so composite
+ * messages do not have to be copied into an intermediate buffer.
+ *
+ * @param fd The socket file descriptor.
+ * @param parts The parts of the message payload.
+ * @param count The number of parts.
+ * @return 0 on success, -1 if the frame could not be written completely.
+ */
+int send_message_parts(int fd, const struct iovec *parts, int count);
+
 /**
  * @brief Receives a message from a socket.
  *
  * Receives a message by first reading the message size, then reading the message content
- * into the provided buffer. The buffer will be null-terminated after reading.
+ * into the provided buffer. The buffer will be null-terminated after reading. Messages
+ * that do not fit are truncated and the rest of the frame is discarded.
  *
  * @param fd The socket file descriptor.
  * @param buffer The buffer to store the received message.
- * @param size The expected size of the message.
+ * @param size The size of the buffer, including room for the terminating NUL.
  * @param flag A flag (currently unused) for message receiving options.
  */
 void receive_message(int fd, char *buffer, int size, int flag);
 
+/**
+ * @brief Receives a whole frame into a pooled buffer of the right size class.
+ *
+ * Blocks until the frame is complete. The returned buffer is NUL-terminated and must
+ * be released with pool_free().
+ *
+ * @param fd The socket file descriptor.
+ * @param max_size The largest payload accepted.
+ * @param length Set to the payload length on success.
+ * @return The payload, or NULL if the connection closed or the frame was too large.
+ */
+char *receive_frame(int fd, size_t max_size, size_t *length);
+
+/**
+ * @brief Returns the next chat line of a `batch` frame.
+ *
+ * After FRAME_BATCH_HEADER, each line is carried like a frame of its own, behind a
+ * FRAME_HEADER_SIZE length prefix, so a message holding newlines stays one line.
+ *
+ * @param cursor The line to read, just after the header or the previous line; moved past the line.
+ * @param end One past the last byte of the frame.
+ * @param length Receives the length of the line.
+ * @return The line, or NULL at the end of the frame or if a length runs past it.
+ */
+const char *batch_next_line(const char **cursor, const char *end, size_t *length);
+
+/**
+ * @brief Initialises a frame reader.
+ *
+ * @param reader The reader.
+ * @param max_size The largest payload accepted.
+ */
+void frame_reader_init(struct frame_reader *reader, size_t max_size);
+
+/**
+ * @brief Reads from a socket into a frame reader.
+ *
+ * Only reads what is already available on the socket, so it never blocks. Call it
+ * again when poll() reports the socket as readable.
+ *
+ * @param fd The socket file descriptor.
+ * @param reader The reader.
+ * @return A frame_status value.
+ */
+int frame_reader_poll(int fd, struct frame_reader *reader);
+
+/**
+ * @brief Tells whether a complete frame is waiting in a reader.
+ *
+ * @param reader The reader.
+ * @return Non-zero if the reader holds a frame not released yet.
+ */
+int frame_reader_ready(const struct frame_reader *reader);
+
+/**
+ * @brief Releases the current frame and prepares the reader for the next one.
+ *
+ * @param reader The reader.
+ */
+void frame_reader_release(struct frame_reader *reader);
+
 #endif
@@ -0,0 +1,160 @@
+/**
+ * @file trace.c
+ * @brief Span ring and Chrome trace JSON export.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+/**
+ * @struct trace_event
+ * @brief One recorded span.
+ */
+struct trace_event
+{
+    uint64_t id;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint16_t span;
+    uint16_t command;
+};
+
+static const char *span_names[TRACE_SPAN_COUNT] = {
+    [TRACE_REQUEST] = "request",
+    [TRACE_QUEUED] = "queued",
+    [TRACE_PEER_FORWARD] = "peer_forward",
+    [TRACE_FAN_OUT] = "fan_out",
+    [TRACE_PEER_APPLY] = "peer_apply",
+};
+
+int trace_enabled = 0;
+
+static struct trace_event *events = NULL;
+static uint64_t head = 0; /**< Number of spans ever recorded */
+static int trace_node = 0;
+static uint64_t next_id = 0;
+
+/**
+ * @brief Turns tracing on for this server.
+ */
+void trace_start(int node)
+{
+    if (events == NULL)
+    {
+        events = calloc(TRACE_EVENTS, sizeof(struct trace_event));
+        if (events == NULL)
+        {
+            return;
+        }
+    }
+    trace_node = node;
+    trace_enabled = 1;
+}
+
+/**
+ * @brief Returns a new correlation id, unique across the servers.
+ *
+ * The node number fills the high bits so that ids created by different servers never
+ * collide.
+ */
+uint64_t trace_new_id(void)
+{
+    return ((uint64_t)trace_node << 40) | ++next_id;
+}
+
+/**
+ * @brief Records a span of a request.
+ */
+void trace_record(enum trace_span span, uint64_t id, enum command_id command, uint64_t start_ns, uint64_t end_ns)
+{
+    if (!trace_enabled)
+    {
+        return;
+    }
+    struct trace_event *event = &events[head & (TRACE_EVENTS - 1)];
+    event->id = id;
+    event->start_ns = start_ns;
+    event->duration_ns = end_ns - start_ns;
+    event->span = span;
+    event->command = command;
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Writes the prefix carrying a correlation id over the peer link.
+ */
+int trace_format_prefix(char *buffer, uint64_t id)
+{
+    return snprintf(buffer, TRACE_PREFIX_SIZE + 1, "#%016llx ", (unsigned long long)id);
+}
+
+/**
+ * @brief Removes the correlation id prefix from a frame received over the peer link.
+ */
+uint64_t trace_strip_prefix(char **frame, size_t *length)
+{
+    if (*length <= TRACE_PREFIX_SIZE || (*frame)[0] != '#' || (*frame)[TRACE_PREFIX_SIZE - 1] != ' ')
+    {
+        return 0;
+    }
+    uint64_t id = strtoull(*frame + 1, NULL, 16);
+    *frame += TRACE_PREFIX_SIZE;
+    *length -= TRACE_PREFIX_SIZE;
+    return id;
+}
+
+static void print_event(FILE *out, const struct trace_event *event, const char *separator)
+{
+    double start_us = event->start_ns / 1000.0;
+    const char *command = command_id_name(event->command);
+
+    fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                 "\"args\":{\"id\":\"%016llx\",\"command\":\"%s\"}}",
+            separator, span_names[event->span], command, start_us, event->duration_ns / 1000.0, trace_node,
+            event->span == TRACE_REQUEST ? 0 : 1, (unsigned long long)event->id, command);
+
+    // Flow arrows join the forward on one server to the apply on the other
+    if (event->span == TRACE_PEER_FORWARD || event->span == TRACE_PEER_APPLY)
+    {
+        fprintf(out, ",\n{\"name\":\"replicate\",\"cat\":\"flow\",\"ph\":\"%s\",\"bp\":\"e\",\"id\":\"%016llx\","
+                     "\"ts\":%.3f,\"pid\":%d,\"tid\":1}",
+                event->span == TRACE_PEER_FORWARD ? "s" : "f", (unsigned long long)event->id,
+                start_us, trace_node);
+    }
+}
+
+/**
+ * @brief Writes the recorded spans as Chrome trace JSON.
+ */
+void trace_dump(FILE *out)
+{
+    fprintf(out, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                 "\"args\":{\"name\":\"server %d\"}}",
+            trace_node, trace_node);
+
+    uint64_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    if (events != NULL && end > 0)
+    {
+        uint64_t start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+        size_t count = end - start;
+        struct trace_event *copy = malloc(count * sizeof(struct trace_event));
+        if (copy != NULL)
+        {
+            for (uint64_t i = start; i < end; i++)
+            {
+                copy[i - start] = events[i & (TRACE_EVENTS - 1)];
+            }
+
+            // Slots reused by the event loop during the copy may be torn, skip them
+            uint64_t now = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+            uint64_t first_valid = now >= TRACE_EVENTS ? now - TRACE_EVENTS + 1 : 0;
+            for (uint64_t i = start > first_valid ? start : first_valid; i < end; i++)
+            {
+                print_event(out, &copy[i - start], ",\n");
+            }
+            free(copy);
+        }
+    }
+    fprintf(out, "\n]}\n");
+}
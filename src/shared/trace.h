@@ -0,0 +1,92 @@
+/**
+ * @file trace.h
+ * @brief Request tracing across the servers, exported as Chrome trace JSON.
+ *
+ * Every client command gets a correlation id. When the command is replicated to the
+ * peer servers the id travels in front of the frame as `#<16 hex digits> `, so that
+ * the spans recorded on every server can be matched. Timestamps come from the
+ * monotonic clock, which both servers share when they run on the same machine.
+ *
+ * Spans are kept in a ring of the last TRACE_EVENTS events, written by the event loop
+ * only. The dump can be loaded in chrome://tracing or https://ui.perfetto.dev.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "command.h"
+
+#define TRACE_EVENTS 65536      /**< Spans kept in memory, a power of two */
+#define TRACE_PREFIX_SIZE 18    /**< Length of "#<16 hex digits> " */
+
+/**
+ * @enum trace_span
+ * @brief Step of a request covered by a span.
+ */
+enum trace_span
+{
+    TRACE_REQUEST,      /**< From the frame being received to the end of its handling */
+    TRACE_QUEUED,       /**< From the frame being received to its dispatch (rate limiter delays) */
+    TRACE_PEER_FORWARD, /**< Writing the command to every peer server */
+    TRACE_FAN_OUT,      /**< Local handling, up to the last recipient being sent the message */
+    TRACE_PEER_APPLY,   /**< On a peer server, applying the replicated command */
+    TRACE_SPAN_COUNT
+};
+
+extern int trace_enabled; /**< Non-zero if spans are recorded */
+
+/**
+ * @brief Turns tracing on for this server.
+ *
+ * @param node Number shown as the process id in the dump, such as the listening port.
+ */
+void trace_start(int node);
+
+/**
+ * @brief Returns a new correlation id, unique across the servers.
+ */
+uint64_t trace_new_id(void);
+
+/**
+ * @brief Records a span of a request.
+ *
+ * @param span The step covered.
+ * @param id The correlation id of the request.
+ * @param command The command of the request.
+ * @param start_ns Start of the span (metrics_now_ns()).
+ * @param end_ns End of the span.
+ */
+void trace_record(enum trace_span span, uint64_t id, enum command_id command, uint64_t start_ns, uint64_t end_ns);
+
+/**
+ * @brief Writes the prefix carrying a correlation id over the peer link.
+ *
+ * @param buffer Room for TRACE_PREFIX_SIZE + 1 bytes.
+ * @param id The correlation id.
+ * @return TRACE_PREFIX_SIZE.
+ */
+int trace_format_prefix(char *buffer, uint64_t id);
+
+/**
+ * @brief Removes the correlation id prefix from a frame received over the peer link.
+ *
+ * @param frame The frame, advanced past the prefix if there is one.
+ * @param length The length of the frame, updated accordingly.
+ * @return The correlation id, or 0 if the frame has no prefix.
+ */
+uint64_t trace_strip_prefix(char **frame, size_t *length);
+
+/**
+ * @brief Writes the recorded spans as Chrome trace JSON.
+ *
+ * Safe to call from another thread than the event loop: spans overwritten while the
+ * dump is taken are left out.
+ *
+ * @param out The stream to write to.
+ */
+void trace_dump(FILE *out);
+
+#endif // TRACE_H